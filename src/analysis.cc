@@ -0,0 +1,220 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <utility>
+
+#include "./analysis.h"
+
+AnalysisEngine::AnalysisEngine()
+    : trees_(Options["num_search_trees"].get_int()),
+      closed_(false),
+      os_(nullptr) {
+  trees_[0].SetGPUAndMemory(trees_.size());
+  for (size_t i = 1; i < trees_.size(); ++i)
+    trees_[i].ShareEvaluator(&trees_[0]);
+}
+
+void AnalysisEngine::Run(std::istream& is, std::ostream& os) {
+  os_ = &os;
+  closed_ = false;
+
+  std::vector<std::thread> ths;
+  for (auto& tree : trees_)
+    ths.emplace_back(&AnalysisEngine::Worker, this, &tree);
+
+  const size_t max_queue = kQueuePerTree * trees_.size();
+  std::string line;
+  while (std::getline(is, line)) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+    JsonValue json;
+    Query q;
+    std::string error;
+    if (!JsonValue::Parse(line, &json, &error) ||
+        !ParseQuery(json, &q, &error)) {
+      JsonValue result = JsonValue::Object();
+      result.Set("id", json["id"].get_string());
+      result.Set("error", error);
+      Write(result);
+      continue;
+    }
+
+    // Waits for a free space so that a large input is not read at once.
+    std::unique_lock<std::mutex> lock(mx_);
+    cv_.wait(lock, [&] { return queue_.size() < max_queue; });
+    queue_.push_back(std::move(q));
+    cv_.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mx_);
+    closed_ = true;
+  }
+  cv_.notify_all();
+  for (auto& th : ths) th.join();
+}
+
+bool AnalysisEngine::ParseQuery(const JsonValue& json, Query* q,
+                                std::string* error) {
+  if (json.type() != JsonValue::kObject) {
+    *error = "query is not an object";
+    return false;
+  }
+
+  q->id = json["id"].get_string();
+  if (q->id.empty()) {
+    *error = "missing id";
+    return false;
+  }
+
+  const JsonValue& moves = json["moves"];
+  if (moves.type() != JsonValue::kArray) {
+    *error = "missing moves";
+    return false;
+  }
+
+  // Replays the moves to reject illegal ones before searching.
+  Board b;
+  q->moves.clear();
+  for (size_t i = 0; i < moves.size(); ++i) {
+    Vertex v = str2v(moves[i].get_string());
+    if (v == kVtNull || !b.IsLegal(v) || b.game_ply() >= kMaxPly - 1) {
+      *error = "illegal move " + moves[i].get_string() + " at " +
+               std::to_string(i + 1);
+      return false;
+    }
+    b.MakeMove<kOneWay>(v);
+    q->moves.push_back(v);
+  }
+
+  if (!json["rule"].is_null() &&
+      json["rule"].get_int(-1) != Options["rule"].get_int()) {
+    *error = "rule differs from --rule";
+    return false;
+  }
+
+  int search_limit = Options["search_limit"].get_int();
+  q->komi = json["komi"].get_double(Options["komi"].get_double());
+  q->max_visits = json["max_visits"].get_int(
+      search_limit > 0 ? search_limit : 800);
+  q->max_time = json["max_time"].get_double(3600.0);
+  q->num_symmetries = json["symmetries"].get_int(1);
+  q->include_ownership = json["include_ownership"].get_bool(false);
+  q->max_candidates = json["max_candidates"].get_int(10);
+  q->pv_length = json["pv_length"].get_int(10);
+
+  if (q->max_visits <= 0 || q->max_time <= 0) {
+    *error = "max_visits and max_time must be positive";
+    return false;
+  }
+
+  return true;
+}
+
+JsonValue AnalysisEngine::Analyze(SearchTree* tree, const Query& q) {
+  Board b;
+  for (Vertex v : q.moves) b.MakeMove<kOneWay>(v);
+
+  tree->set_komi(q.komi);
+  tree->set_search_limit(q.max_visits);
+  tree->set_root_symmetries(q.num_symmetries);
+  tree->InitRoot();
+
+  double winning_rate = 0.5;
+  tree->Search(b, q.max_time, &winning_rate, false, false);
+
+  Node* nd = tree->root_node();
+  JsonValue result = JsonValue::Object();
+  result.Set("id", q.id);
+  result.Set("turn", b.game_ply());
+  result.Set("visits", nd->num_total_values());
+
+  JsonValue moves = JsonValue::Array();
+  std::vector<ChildNode*> candidates = tree->SortChildren(*nd);
+  if (!candidates.empty())
+    result.Set("winrate", tree->WinningRate(*candidates[0]));
+
+  for (int i = 0;
+       i < std::min(q.max_candidates, static_cast<int>(candidates.size()));
+       ++i) {
+    const ChildNode* child = candidates[i];
+    if (i > 0 && child->num_values() == 0) break;
+
+    JsonValue pv = JsonValue::Array();
+    pv.Push(tree->v2str(child->move()));
+    for (const ChildNode* pc = child;
+         pc->has_next() && static_cast<int>(pv.size()) < q.pv_length;) {
+      std::vector<ChildNode*> next = tree->SortChildren(*pc->next_ptr());
+      if (next.empty() || next[0]->num_values() == 0) break;
+      pc = next[0];
+      pv.Push(tree->v2str(pc->move()));
+    }
+
+    JsonValue move = JsonValue::Object();
+    move.Set("move", tree->v2str(child->move()));
+    move.Set("visits", child->num_values());
+    move.Set("winrate", tree->WinningRate(*child));
+    move.Set("prior", static_cast<double>(child->prob()));
+    move.Set("pv", std::move(pv));
+    moves.Push(std::move(move));
+  }
+  result.Set("moves", std::move(moves));
+
+  if (q.include_ownership) {
+    const int num_playouts = 256;
+    Board::OwnerMap owner = {0};
+    tree->FinalScore(b, kVtNull, -1, num_playouts, &owner);
+
+    JsonValue ownership = JsonValue::Array();
+    for (int y = kBSize; y >= 1; --y) {
+      for (int x = 1; x <= kBSize; ++x) {
+        Vertex v = xy2v(x, y);
+        ownership.Push((owner[kBlack][v] - owner[kWhite][v]) / num_playouts);
+      }
+    }
+    result.Set("ownership", std::move(ownership));
+  }
+
+  return result;
+}
+
+void AnalysisEngine::Worker(SearchTree* tree) {
+  for (;;) {
+    Query q;
+    {
+      std::unique_lock<std::mutex> lock(mx_);
+      cv_.wait(lock, [&] { return closed_ || !queue_.empty(); });
+      if (queue_.empty()) return;
+      q = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    cv_.notify_all();
+
+    Write(Analyze(tree, q));
+  }
+}
+
+void AnalysisEngine::Write(const JsonValue& result) {
+  std::string line = result.Dump();
+  std::lock_guard<std::mutex> lock(out_mx_);
+  *os_ << line << std::endl;
+}
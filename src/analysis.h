@@ -0,0 +1,106 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANALYSIS_H_
+#define ANALYSIS_H_
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "./json.h"
+#include "./search.h"
+
+/**
+ * @class AnalysisEngine
+ * AnalysisEngine class reads JSON queries from a stream, one per line, and
+ * writes a JSON result for each query as soon as it is analyzed, so results
+ * may be out of order.
+ * Queries are searched concurrently by num_search_trees trees which share
+ * one EvalWorker and EvalCache, so that batches are filled across queries.
+ *
+ * Query ("id" and "moves" are required, and moves alternate from black):
+ *  {"id": "q1", "moves": ["D4", "Q16", "pass"], "komi": 7.5, "rule": 0,
+ *   "max_visits": 800, "max_time": 60.0, "symmetries": 8,
+ *   "include_ownership": true, "max_candidates": 10, "pv_length": 10}
+ *
+ * Result:
+ *  {"id": "q1", "turn": 3, "visits": 812, "winrate": 0.48,
+ *   "moves": [{"move": "R4", "visits": 420, "winrate": 0.49,
+ *              "prior": 0.21, "pv": ["R4", "D16"]}, ...],
+ *   "ownership": [0.98, ...]}
+ * Winning rates are of the side to move. "symmetries" is the number of
+ * symmetries averaged in the evaluation of the root node. "ownership" is
+ * the probability of black minus that of white from A19 to T1 row by row.
+ * A query that cannot be analyzed is answered with {"id": ..., "error": ...}.
+ */
+class AnalysisEngine {
+ public:
+  AnalysisEngine();
+
+  /**
+   * Analyzes all queries in is until the end of the stream.
+   */
+  void Run(std::istream& is, std::ostream& os);
+
+  struct Query {
+    std::string id;
+    std::vector<Vertex> moves;
+    double komi;
+    int max_visits;
+    double max_time;
+    int num_symmetries;
+    bool include_ownership;
+    int max_candidates;
+    int pv_length;
+  };
+
+  /**
+   * Parses json into q. Returns false with a message if the query cannot be
+   * analyzed.
+   */
+  static bool ParseQuery(const JsonValue& json, Query* q, std::string* error);
+
+ private:
+  // Maximum number of parsed queries waiting for a tree per tree.
+  static constexpr int kQueuePerTree = 4;
+
+  std::vector<SearchTree> trees_;
+  std::deque<Query> queue_;
+  bool closed_;
+  std::mutex mx_;
+  std::condition_variable cv_;
+
+  std::ostream* os_;
+  std::mutex out_mx_;
+
+  JsonValue Analyze(SearchTree* tree, const Query& q);
+
+  /**
+   * Analyzes queries from queue_ with tree until it is closed.
+   */
+  void Worker(SearchTree* tree);
+
+  void Write(const JsonValue& result);
+};
+
+#endif  // ANALYSIS_H_
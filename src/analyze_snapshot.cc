@@ -0,0 +1,285 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./analyze_snapshot.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+namespace {
+
+bool ParseInt(const std::string& str, int* val) {
+  if (str.empty()) return false;
+  char* end = nullptr;
+  long l = std::strtol(str.c_str(), &end, 10);
+  if (*end != '\0') return false;
+  *val = static_cast<int>(l);
+  return true;
+}
+
+bool ParseColor(std::string str, Color* c) {
+  for (auto& ch : str) ch = std::tolower(static_cast<unsigned char>(ch));
+  if (str == "b" || str == "black") {
+    *c = kBlack;
+    return true;
+  } else if (str == "w" || str == "white") {
+    *c = kWhite;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Returns true if lhs is visited more than rhs, or has a higher prior with
+ * the same visits. This is the order of SearchTree::SortChildren().
+ */
+bool Precedes(const ChildNode& lhs, const ChildNode& rhs) {
+  int lhs_values = lhs.num_values();
+  int rhs_values = rhs.num_values();
+  if (lhs_values == rhs_values) return lhs.prob() > rhs.prob();
+  return lhs_values > rhs_values;
+}
+
+}  // namespace
+
+bool AnalyzeOptions::Parse(const std::vector<std::string>& args, bool kata,
+                           AnalyzeOptions* options, std::string* error) {
+  AnalyzeOptions o;
+  o.kata = kata;
+  size_t i = 0;
+  int centisec;
+  Color c;
+
+  // The color is ignored because the side to move is always analyzed.
+  if (i < args.size() && ParseColor(args[i], &c)) ++i;
+  if (i < args.size() && ParseInt(args[i], &centisec)) {
+    o.interval = centisec * 10;
+    ++i;
+  }
+
+  while (i < args.size()) {
+    const std::string& key = args[i++];
+    int val;
+    if (key == "interval" && i < args.size() && ParseInt(args[i], &val)) {
+      o.interval = val * 10;
+      ++i;
+    } else if (key == "minmoves" && i < args.size() &&
+               ParseInt(args[i], &val)) {
+      o.min_moves = val;
+      ++i;
+    } else if (key == "ownership" && i < args.size()) {
+      o.ownership = args[i++] == "true";
+    } else if ((key == "avoid" || key == "allow") && i + 2 < args.size() &&
+               ParseColor(args[i], &c) && ParseInt(args[i + 2], &val)) {
+      std::stringstream ss(args[i + 1]);
+      std::string vertex;
+      while (std::getline(ss, vertex, ',')) {
+        if (vertex.empty()) continue;
+        Vertex v = str2v(vertex);
+        if (v == kVtNull) {
+          *error = "invalid vertex " + vertex;
+          return false;
+        }
+        if (key == "avoid") {
+          o.avoid_until[c][v] = std::max(o.avoid_until[c][v], val);
+        } else {
+          o.allowed[c][v] = true;
+        }
+      }
+      if (key == "allow") o.allow_until[c] = std::max(o.allow_until[c], val);
+      o.has_filter = true;
+      i += 3;
+    } else {
+      *error = "invalid argument " + key;
+      return false;
+    }
+  }
+
+  if (o.interval <= 0) o.interval = 100;
+  *options = o;
+  return true;
+}
+
+void AnalyzeSnapshot::Write(const Node& root, const Board& b, double lambda,
+                            std::ostream& os) {
+  if (root.num_children() == 0) return;
+  if (key_ != b.key()) {
+    key_ = b.key();
+    ClearCache();
+  }
+
+  // 1. Sorts the candidates at the root.
+  candidates_.clear();
+  for (const auto& child : root.children) {
+    if (options_.Filters(b.side_to_move(), child.move(), 0)) continue;
+    candidates_.push_back({child.num_values(), child.prob(), &child});
+  }
+  std::stable_sort(candidates_.begin(), candidates_.end(),
+                   [](const Candidate& lhs, const Candidate& rhs) {
+                     if (lhs.num_values == rhs.num_values)
+                       return lhs.prob > rhs.prob;
+                     return lhs.num_values > rhs.num_values;
+                   });
+
+  // 2. Formats the candidates.
+  buf_.clear();
+  int cutoff = 0;
+  for (int i = 0, imax = candidates_.size(); i < imax; ++i) {
+    const ChildNode* child = candidates_[i].child;
+    int num_games = candidates_[i].num_values;
+    if (!cutoff) cutoff = static_cast<int>(std::sqrt(num_games));
+    if (i >= options_.min_moves &&
+        ((i != 0 && num_games == 0) || num_games < cutoff))
+      break;
+
+    double rollout_rate = (child->rollout_rate() + 1) / 2;
+    double value_rate = (child->value_rate() + 1) / 2;
+    double rate = (1 - lambda) * rollout_rate + lambda * value_rate;
+
+    if (i > 0) buf_ += ' ';
+    buf_ += "info move ";
+    AppendVertex(child->move());
+    buf_ += " visits ";
+    AppendInt(num_games);
+    buf_ += " winrate ";
+    if (options_.kata) {
+      AppendDouble(rate, 6);
+      double score_lead = ScoreLead(b, child->move());
+      buf_ += " scoreMean ";
+      AppendDouble(score_lead, 2);
+      buf_ += " scoreLead ";
+      AppendDouble(score_lead, 2);
+      buf_ += " prior ";
+      AppendDouble(candidates_[i].prob, 6);
+    } else {
+      AppendInt(static_cast<int>(rate * 10000));
+      buf_ += " prior ";
+      AppendInt(static_cast<int>(candidates_[i].prob * 10000));
+    }
+    buf_ += " order ";
+    AppendInt(i);
+    buf_ += " pv ";
+    AppendVertex(child->move());
+    AppendPV(*child);
+  }
+
+  // 3. Appends ownership from the side to move.
+  if (options_.kata && options_.ownership) {
+    UpdateOwnership(b);
+    buf_ += " ownership";
+    for (float o : ownership_) {
+      buf_ += ' ';
+      AppendDouble(o, 3);
+    }
+  }
+
+  buf_ += '\n';
+  os.write(buf_.data(), buf_.size());
+  os.flush();
+}
+
+double AnalyzeSnapshot::ScoreLead(const Board& b, Vertex v) {
+  if (!has_score_lead_[v]) {
+    auto scores =
+        b.RolloutScores(kNumScorePlayouts, v, 0.0, false, false, nullptr);
+    double sum = 0.0;
+    int n = 0;
+    for (const auto& s : scores) {
+      sum += s.first * s.second;
+      n += s.second;
+    }
+    double mean = n == 0 ? 0.0 : sum / n;
+    score_lead_[v] = b.side_to_move() == kBlack ? mean : -mean;
+    has_score_lead_[v] = true;
+  }
+  return score_lead_[v];
+}
+
+void AnalyzeSnapshot::UpdateOwnership(const Board& b) {
+  if (!ownership_.empty()) return;
+
+  Board::OwnerMap owner = {0};
+  b.RolloutScores(kNumOwnerPlayouts, kVtNull, 0.0, false, false, &owner);
+
+  Color us = b.side_to_move();
+  ownership_.reserve(kNumRvts);
+  for (int y = kBSize; y >= 1; --y) {
+    for (int x = 1; x <= kBSize; ++x) {
+      Vertex v = xy2v(x, y);
+      ownership_.push_back((owner[us][v] - owner[~us][v]) / kNumOwnerPlayouts);
+    }
+  }
+}
+
+void AnalyzeSnapshot::AppendPV(const ChildNode& child) {
+  Vertex prev_move = child.move();
+  const ChildNode* pc = &child;
+
+  for (int depth = 1; depth < kMaxPVLength && pc->has_next(); ++depth) {
+    const Node* nd = pc->next_ptr();
+    if (nd->num_children() <= 1) break;
+
+    // Finds the most visited child without sorting.
+    const ChildNode* best = &nd->children[0];
+    for (const auto& ch : nd->children)
+      if (Precedes(ch, *best)) best = &ch;
+    if (best->num_values() == 0) break;
+
+    buf_ += ' ';
+    AppendVertex(best->move());
+    if (prev_move == kPass && best->move() == kPass) break;
+
+    prev_move = best->move();
+    pc = best;
+  }
+}
+
+void AnalyzeSnapshot::AppendVertex(Vertex v) {
+  if (v == kPass) {
+    buf_ += "PASS";
+  } else if (v > kPass) {
+    buf_ += "NULL";
+  } else {
+    buf_ += "ABCDEFGHJKLMNOPQRST"[x_of(v) - 1];
+    AppendInt(y_of(v));
+  }
+}
+
+void AnalyzeSnapshot::AppendInt(int64_t val) {
+  char tmp[24];
+  int len = 0;
+  bool negative = val < 0;
+  uint64_t u = negative ? -static_cast<uint64_t>(val) : val;
+  do {
+    tmp[len++] = '0' + u % 10;
+    u /= 10;
+  } while (u > 0);
+  if (negative) buf_ += '-';
+  while (len > 0) buf_ += tmp[--len];
+}
+
+void AnalyzeSnapshot::AppendDouble(double val, int precision) {
+  char tmp[32];
+  int len = snprintf(tmp, sizeof(tmp), "%.*f", precision, val);
+  if (len > 0) buf_.append(tmp, std::min<int>(len, sizeof(tmp) - 1));
+}
@@ -0,0 +1,155 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANALYZE_SNAPSHOT_H_
+#define ANALYZE_SNAPSHOT_H_
+
+#include <array>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "./board.h"
+#include "./node.h"
+
+/**
+ * @struct AnalyzeOptions
+ * Arguments of lz-analyze and kata-analyze.
+ *  e.g. "lz-analyze b 10 avoid b q16,d4 1 minmoves 5"
+ *       "kata-analyze 50 ownership true allow w d16 2"
+ */
+struct AnalyzeOptions {
+  bool kata = false;        // Outputs in the format of kata-analyze.
+  int interval = 100;       // msec
+  int min_moves = 0;        // Minimum number of candidates to output.
+  bool ownership = false;   // Only for kata-analyze.
+  bool has_filter = false;  // Whether the search is restricted.
+
+  // Moves of each color are avoided while the number of moves from the root
+  // is less than or equal to avoid_until.
+  std::array<std::array<int, kNumVtsPlus1>, kNumPlayers> avoid_until;
+  // Only allowed moves can be played until allow_until moves.
+  std::array<int, kNumPlayers> allow_until;
+  std::array<std::array<bool, kNumVtsPlus1>, kNumPlayers> allowed;
+
+  AnalyzeOptions() {
+    for (Color c = kColorZero; c < kNumPlayers; ++c) {
+      avoid_until[c].fill(0);
+      allow_until[c] = 0;
+      allowed[c].fill(false);
+    }
+  }
+
+  /**
+   * Returns whether or not move v of color c at depth from the root is
+   * excluded from the search, where depth is 0 for moves at the root.
+   */
+  bool Filters(Color c, Vertex v, int depth) const {
+    return has_filter && (depth < avoid_until[c][v] ||
+                          (depth < allow_until[c] && !allowed[c][v]));
+  }
+
+  /**
+   * Parses GTP arguments. Returns false with a message if they are invalid.
+   */
+  static bool Parse(const std::vector<std::string>& args, bool kata,
+                    AnalyzeOptions* options, std::string* error);
+};
+
+/**
+ * @class AnalyzeSnapshot
+ * AnalyzeSnapshot class formats a line of lz-analyze or kata-analyze output
+ * from the root node at each interval while the search threads run.
+ *
+ * Each principal variation is traced by scanning children for the most
+ * visited one without sorting or allocation, and the line is formatted into
+ * a buffer which is reserved once. Score leads and ownership for
+ * kata-analyze are estimated by rollouts, which are run only once for each
+ * position and candidate and are cached.
+ */
+class AnalyzeSnapshot {
+ public:
+  AnalyzeSnapshot() : key_(0) {
+    buf_.reserve(1 << 16);
+    ClearCache();
+  }
+
+  const AnalyzeOptions& options() const { return options_; }
+
+  void set_options(const AnalyzeOptions& options) {
+    options_ = options;
+    ClearCache();
+  }
+
+  /**
+   * Writes information on candidate moves of root on b.
+   */
+  void Write(const Node& root, const Board& b, double lambda,
+             std::ostream& os);
+
+ private:
+  static constexpr int kMaxPVLength = 128;
+  static constexpr int kNumScorePlayouts = 64;
+  static constexpr int kNumOwnerPlayouts = 128;
+
+  /**
+   * Statistics of a root child copied once, so that the candidates are
+   * sorted and cut off consistently while search threads update them.
+   */
+  struct Candidate {
+    int num_values;
+    float prob;
+    const ChildNode* child;
+  };
+
+  AnalyzeOptions options_;
+  std::string buf_;
+  std::vector<Candidate> candidates_;
+
+  // Caches of rollouts for the position with key_.
+  Key key_;
+  std::array<double, kNumVtsPlus1> score_lead_;
+  std::array<bool, kNumVtsPlus1> has_score_lead_;
+  std::vector<float> ownership_;
+
+  void ClearCache() {
+    has_score_lead_.fill(false);
+    ownership_.clear();
+  }
+
+  /**
+   * Returns the mean score of rollouts after v from the side to move of b.
+   */
+  double ScoreLead(const Board& b, Vertex v);
+
+  void UpdateOwnership(const Board& b);
+
+  /**
+   * Appends moves of the principal variation after child.
+   */
+  void AppendPV(const ChildNode& child);
+
+  void AppendVertex(Vertex v);
+
+  void AppendInt(int64_t val);
+
+  void AppendDouble(double val, int precision);
+};
+
+#endif  // ANALYZE_SNAPSHOT_H_
@@ -0,0 +1,507 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./bench.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "./eval_cache.h"
+#include "./infer_engine.h"
+#include "./node.h"
+#include "./option.h"
+#include "./search.h"
+#include "./sgf.h"
+
+namespace {
+
+// Move numbers of the positions in each game.
+constexpr int kPositionPlies[] = {40, 100, 160, 220};
+
+// Moves played from each position in a repetition of board cases.
+constexpr int kNumNextMoves = 16;
+
+// Cache probes of each thread in a repetition.
+constexpr int kNumProbesPerThread = 16384;
+
+// Playouts of a search from each position.
+constexpr int kNumSearchPlayouts = 64;
+
+int64_t NowNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double Round(double val) { return std::round(val * 10) / 10; }
+
+/**
+ * Returns the q-quantile of sorted samples by the nearest rank.
+ */
+double Percentile(const std::vector<double>& sorted, double q) {
+  if (sorted.empty()) return 0.0;
+  size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+bool ReadJsonFile(const std::string& path, JsonValue* val,
+                  std::string* error) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  std::stringstream ss;
+  ss << ifs.rdbuf();
+  if (!JsonValue::Parse(ss.str(), val, error)) {
+    *error = path + ": " + *error;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Copies the positions to boards before each repetition.
+ */
+void CopyBoards(const std::vector<MicroBench::Position>& positions,
+                std::vector<Board>* boards) {
+  boards->resize(positions.size());
+  for (size_t i = 0; i < positions.size(); ++i) (*boards)[i] = positions[i].b;
+}
+
+template <AdvanceType Type>
+MicroBench::Case MakeMoveCase(const std::string& name,
+                              const std::vector<MicroBench::Position>* ps) {
+  auto boards = std::make_shared<std::vector<Board>>();
+  return {name, [ps, boards]() { CopyBoards(*ps, boards.get()); },
+          [ps, boards]() {
+            int64_t n = 0;
+            for (size_t i = 0; i < ps->size(); ++i) {
+              Board& b = (*boards)[i];
+              for (Vertex v : (*ps)[i].next_moves) b.MakeMove<Type>(v);
+              n += (*ps)[i].next_moves.size();
+            }
+            return n;
+          }};
+}
+
+template <AdvanceType Type>
+MicroBench::Case UnmakeMoveCase(const std::string& name,
+                                const std::vector<MicroBench::Position>* ps) {
+  auto boards = std::make_shared<std::vector<Board>>();
+  return {name,
+          [ps, boards]() {
+            CopyBoards(*ps, boards.get());
+            for (size_t i = 0; i < ps->size(); ++i)
+              for (Vertex v : (*ps)[i].next_moves)
+                (*boards)[i].MakeMove<Type>(v);
+          },
+          [ps, boards]() {
+            int64_t n = 0;
+            for (size_t i = 0; i < ps->size(); ++i) {
+              Board& b = (*boards)[i];
+              for (size_t j = 0; j < (*ps)[i].next_moves.size(); ++j)
+                b.UnmakeMove<Type>();
+              n += (*ps)[i].next_moves.size();
+            }
+            return n;
+          }};
+}
+
+/**
+ * Adds cases of Board, Feature and Node.
+ */
+void AddBoardCases(MicroBench* bench) {
+  const std::vector<MicroBench::Position>* ps = &bench->positions();
+
+  bench->Add(MakeMoveCase<kOneWay>("make_move/one_way", ps));
+  bench->Add(MakeMoveCase<kReversible>("make_move/reversible", ps));
+  bench->Add(MakeMoveCase<kQuick>("make_move/quick", ps));
+  bench->Add(MakeMoveCase<kRollout>("make_move/rollout", ps));
+  bench->Add(UnmakeMoveCase<kReversible>("unmake_move/reversible", ps));
+  bench->Add(UnmakeMoveCase<kQuick>("unmake_move/quick", ps));
+
+  auto boards = std::make_shared<std::vector<Board>>();
+  bench->Add({"ladder_escapes",
+              [ps, boards]() { CopyBoards(*ps, boards.get()); },
+              [boards]() {
+                constexpr int num_escapes = kBSize == 9 ? 3 : 4;
+                int64_t n = 0;
+                for (auto& b : *boards) {
+                  b.LadderEscapes(num_escapes);
+                  ++n;
+                }
+                return n;
+              }});
+
+  auto features = std::make_shared<std::vector<Feature>>();
+  bench->Add({"feature/update",
+              [ps, features]() {
+                features->clear();
+                for (const auto& p : *ps)
+                  features->push_back(p.b.get_feature());
+              },
+              [ps, features]() {
+                for (size_t i = 0; i < ps->size(); ++i)
+                  (*features)[i].Update((*ps)[i].b);
+                return static_cast<int64_t>(ps->size());
+              }});
+
+  // Copies features computed in advance, and writes them directly from
+  // boards as EvalWorker does.
+  auto inputs = std::make_shared<std::vector<float>>(kInputFeatures * kNumRvts);
+  bench->Add({"feature/copy",
+              [ps, features]() {
+                if (features->size() == ps->size()) return;
+                features->clear();
+                for (const auto& p : *ps)
+                  features->push_back(p.b.get_feature());
+              },
+              [features, inputs]() {
+                int64_t n = 0;
+                for (const auto& ft : *features) {
+                  for (int sym = 0; sym < kNumSymmetry; ++sym) {
+                    ft.Copy(inputs->data(), true, sym);
+                    ++n;
+                  }
+                }
+                return n;
+              }});
+  bench->Add({"feature/write", []() {},
+              [ps, inputs]() {
+                int64_t n = 0;
+                for (const auto& p : *ps) {
+                  for (int sym = 0; sym < kNumSymmetry; ++sym) {
+                    p.b.WriteFeature(inputs->data(), true, sym);
+                    ++n;
+                  }
+                }
+                return n;
+              }});
+
+  // Expands nodes with a fixed policy as in SearchTree::SearchBranch().
+  auto tree = std::make_shared<SearchTree>();
+  auto vp = std::make_shared<ValueAndProb>();
+  std::mt19937 mt(0);
+  std::normal_distribution<float> normal(0.0f, 3.0f);
+  float sum = 0.0f;
+  for (auto& p : vp->prob) sum += (p = std::exp(normal(mt)));
+  for (auto& p : vp->prob) p /= sum;
+  bench->Add({"node/expand", []() {},
+              [ps, tree, vp]() {
+                for (const auto& p : *ps) {
+                  Node nd(p.b);
+                  tree->UpdateNodeVP(&nd, *vp);
+                }
+                return static_cast<int64_t>(ps->size());
+              }});
+}
+
+/**
+ * Adds cases of EvalCache and SearchTree.
+ */
+void AddSearchCases(MicroBench* bench) {
+  const std::vector<MicroBench::Position>* ps = &bench->positions();
+  const int num_threads = Options["num_threads"].get_int();
+
+  // Probes keys of a skewed distribution over 4x more positions than the
+  // cache can hold, and inserts missed ones, from all threads.
+  auto cache = std::make_shared<EvalCache>();
+  auto seed = std::make_shared<std::atomic<int>>(0);
+  bench->Add(
+      {"eval_cache/probe_insert",
+       [cache]() {
+         if (cache->num_slots() > 0) return;
+         cache->Resize(Options["eval_cache_mb"].get_int(),
+                       Options["eval_cache_format"].get_string(),
+                       Options["eval_cache_topk"].get_int());
+       },
+       [cache, seed, num_threads]() {
+         const double working_set = 4.0 * cache->num_slots();
+         std::vector<std::thread> threads;
+         for (int t = 0; t < num_threads; ++t) {
+           threads.emplace_back([&]() {
+             std::mt19937_64 mt(seed->fetch_add(1) + 1);
+             std::uniform_real_distribution<double> uniform(0.0, 1.0);
+             ValueAndProb vp;
+             for (int i = 0; i < kNumProbesPerThread; ++i) {
+               double u = uniform(mt);
+               uint64_t idx = static_cast<uint64_t>(working_set * u * u * u);
+               // splitmix64 of idx as a Zobrist-like key.
+               Key key = idx + 0x9e3779b97f4a7c15ULL;
+               key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+               key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+               key ^= key >> 31;
+               if (!cache->Probe(key, &vp)) cache->Insert(key, vp);
+             }
+           });
+         }
+         for (auto& th : threads) th.join();
+         return static_cast<int64_t>(num_threads) * kNumProbesPerThread;
+       }});
+
+  // Rollout playouts from root nodes evaluated by the stub engine, as in
+  // SearchTree::RolloutWorker().
+  auto trees = std::make_shared<std::vector<std::unique_ptr<SearchTree>>>();
+  bench->Add({"search/rollout_branch",
+              [ps, trees]() {
+                if (!trees->empty()) return;
+                StubEngine engine(1);
+                engine.Init();
+                for (const auto& p : *ps) {
+                  trees->emplace_back(new SearchTree);
+                  trees->back()->Resize(Options["node_size"].get_int());
+                  trees->back()->UpdateRoot(p.b, &engine);
+                }
+              },
+              [ps, trees]() {
+                int64_t n = 0;
+                for (size_t i = 0; i < ps->size(); ++i) {
+                  SearchTree* tree = (*trees)[i].get();
+                  for (int j = 0; j < kNumNextMoves; ++j) {
+                    Board b = (*ps)[i].b;
+                    SearchRoute route;
+                    tree->SearchBranch<false>(tree->root_node(), &b, &route);
+                    ++n;
+                  }
+                }
+                return n;
+              }});
+
+  // Searches from scratch with all threads and the stub engine.
+  auto search_tree = std::make_shared<SearchTree>();
+  bench->Add({"search/stub_eval",
+              [search_tree]() {
+                if (!search_tree->has_eval_worker())
+                  search_tree->SetGPUAndMemory();
+                search_tree->InitEvalCache();
+              },
+              [ps, search_tree]() {
+                int64_t n = 0;
+                double winning_rate;
+                for (const auto& p : *ps) {
+                  search_tree->InitRoot();
+                  search_tree->set_search_limit(kNumSearchPlayouts);
+                  search_tree->Search(p.b, 60.0, &winning_rate, false, false);
+                  n += search_tree->root_node()->num_total_values() - 1;
+                }
+                return n;
+              }});
+}
+
+}  // namespace
+
+bool MicroBench::LoadPositions(const std::string& dir, int num_next_moves,
+                               std::string* error) {
+  std::vector<std::string> files;
+  SgfData::GetSgfFiles(dir, &files);
+  std::sort(files.begin(), files.end());
+
+  positions_.clear();
+  for (auto file_path : files) {
+    std::string file_name = file_path;
+    if (file_path.find_first_of("/\\") == std::string::npos)
+      file_path = JoinPath(dir, file_path);
+    else
+      file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
+
+    SgfData sgf;
+    sgf.Read(file_path);
+    for (int ply : kPositionPlies) {
+      if (ply + num_next_moves > sgf.game_ply()) continue;
+      Position p;
+      p.name = file_name + ":" + std::to_string(ply);
+      if (!sgf.ReconstructBoard(&p.b, ply)) continue;
+      for (int i = 0; i < num_next_moves; ++i)
+        p.next_moves.push_back(sgf.move_at(ply + i));
+      positions_.push_back(std::move(p));
+    }
+  }
+
+  if (positions_.empty()) {
+    *error = "no position is found in " + dir;
+    return false;
+  }
+  return true;
+}
+
+JsonValue MicroBench::Run(const std::string& filter) const {
+  JsonValue cases = JsonValue::Array();
+  for (const auto& c : cases_) {
+    if (c.name.find(filter) == std::string::npos) continue;
+
+    std::vector<double> samples;
+    int64_t num_ops = 0;
+    for (int i = 0; i < num_warmups_ + num_reps_; ++i) {
+      c.setup();
+      int64_t t0 = NowNanoseconds();
+      num_ops = c.run();
+      int64_t elapsed = NowNanoseconds() - t0;
+      if (i >= num_warmups_ && num_ops > 0)
+        samples.push_back(static_cast<double>(elapsed) / num_ops);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (double s : samples) sum += s;
+    JsonValue result = JsonValue::Object();
+    result.Set("name", c.name);
+    result.Set("ops", num_ops);
+    result.Set("reps", static_cast<int>(samples.size()));
+    result.Set("mean_ns", Round(samples.empty() ? 0 : sum / samples.size()));
+    result.Set("min_ns", Round(samples.empty() ? 0 : samples.front()));
+    result.Set("p50_ns", Round(Percentile(samples, 0.5)));
+    result.Set("p90_ns", Round(Percentile(samples, 0.9)));
+    result.Set("p99_ns", Round(Percentile(samples, 0.99)));
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s: %.1f [ns/op]", c.name.c_str(),
+             result["p50_ns"].get_double());
+    std::cerr << buf << std::endl;
+    cases.Push(std::move(result));
+  }
+
+  JsonValue json = JsonValue::Object();
+  json.Set("positions", static_cast<int>(positions_.size()));
+  json.Set("filter", filter);
+  json.Set("cases", std::move(cases));
+  return json;
+}
+
+bool MicroBench::Compare(const JsonValue& baseline, const JsonValue& result,
+                         double threshold, std::ostream& os) {
+  const JsonValue& base_cases = baseline["cases"];
+  const JsonValue& cases = result["cases"];
+  bool ok = true;
+  char buf[128];
+
+  snprintf(buf, sizeof(buf), "%-26s %12s %12s %8s\n", "case", "base[ns]",
+           "new[ns]", "diff");
+  os << buf;
+  for (size_t i = 0; i < cases.size(); ++i) {
+    std::string name = cases[i]["name"].get_string();
+    double p50 = cases[i]["p50_ns"].get_double();
+    const JsonValue* base = nullptr;
+    for (size_t j = 0; j < base_cases.size() && base == nullptr; ++j)
+      if (base_cases[j]["name"].get_string() == name) base = &base_cases[j];
+
+    if (base == nullptr || (*base)["p50_ns"].get_double() <= 0) {
+      snprintf(buf, sizeof(buf), "%-26s %12s %12.1f %8s\n", name.c_str(), "-",
+               p50, "new");
+      os << buf;
+      continue;
+    }
+
+    double base_p50 = (*base)["p50_ns"].get_double();
+    double diff = p50 / base_p50 - 1.0;
+    bool regressed = diff > threshold;
+    ok &= !regressed;
+    snprintf(buf, sizeof(buf), "%-26s %12.1f %12.1f %+7.1f%%%s\n", name.c_str(),
+             base_p50, p50, 100 * diff, regressed ? "  REGRESSION" : "");
+    os << buf;
+  }
+
+  // Baseline cases which were not run fail the comparison unless the filter
+  // of the result excludes them.
+  std::string filter = result["filter"].get_string();
+  for (size_t i = 0; i < base_cases.size(); ++i) {
+    std::string name = base_cases[i]["name"].get_string();
+    bool found = false;
+    for (size_t j = 0; j < cases.size() && !found; ++j)
+      found = cases[j]["name"].get_string() == name;
+    if (found) continue;
+
+    bool filtered = name.find(filter) == std::string::npos;
+    ok &= filtered;
+    snprintf(buf, sizeof(buf), "%-26s %12.1f %12s %8s%s\n", name.c_str(),
+             base_cases[i]["p50_ns"].get_double(), "-",
+             filtered ? "filtered" : "missing",
+             filtered ? "" : "  REGRESSION");
+    os << buf;
+  }
+
+  return ok;
+}
+
+bool MicroBenchmark() {
+  // Searches use the stub engine, so that they are measured without a model.
+  Options["model_path"] = "stub";
+
+  std::string dir = Options["bench_sgf_dir"];
+  if (dir.empty()) dir = JoinPath(Options["working_dir"], "bench");
+
+  MicroBench bench(Options["bench_warmup"].get_int(),
+                   Options["bench_reps"].get_int());
+  std::string error;
+  if (!bench.LoadPositions(dir, kNumNextMoves, &error)) {
+    std::cerr << error << std::endl;
+    return false;
+  }
+  std::cerr << "*** Micro Benchmark ***" << std::endl;
+  std::cerr << bench.positions().size() << " positions in " << dir
+            << std::endl;
+
+  AddBoardCases(&bench);
+  AddSearchCases(&bench);
+  JsonValue result = bench.Run(Options["bench_filter"]);
+
+  std::string output = Options["bench_output"];
+  if (output.empty()) {
+    std::cout << result.Dump() << std::endl;
+  } else {
+    std::ofstream ofs(output);
+    ofs << result.Dump() << std::endl;
+    if (!ofs) {
+      std::cerr << "failed to write " << output << std::endl;
+      return false;
+    }
+  }
+
+  std::string baseline_path = Options["bench_baseline"];
+  if (baseline_path.empty()) return true;
+  JsonValue baseline;
+  if (!ReadJsonFile(baseline_path, &baseline, &error)) {
+    std::cerr << error << std::endl;
+    return false;
+  }
+  return MicroBench::Compare(baseline, result,
+                             Options["bench_threshold"].get_double(),
+                             std::cerr);
+}
+
+bool CompareBenchmarks() {
+  JsonValue baseline, result;
+  std::string error;
+  if (!ReadJsonFile(Options["bench_baseline"], &baseline, &error) ||
+      !ReadJsonFile(Options["bench_output"], &result, &error)) {
+    std::cerr << error << std::endl;
+    return false;
+  }
+  return MicroBench::Compare(baseline, result,
+                             Options["bench_threshold"].get_double(),
+                             std::cout);
+}
@@ -0,0 +1,121 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./board.h"
+#include "./json.h"
+
+/**
+ * @class MicroBench
+ * MicroBench class runs named benchmark cases on fixed positions and reports
+ * the time per operation in JSON.
+ *
+ * Each case is run bench_warmup times without measurement, and then
+ * bench_reps times. A repetition performs a number of operations after an
+ * untimed setup, and its time divided by the number of operations is a
+ * sample. The percentiles are those of the samples.
+ *
+ * @code
+ *  MicroBench bench;
+ *  bench.LoadPositions("bench", &error);
+ *  bench.Add({"make_move/one_way", setup, run});
+ *  JsonValue result = bench.Run("make_move");
+ *  MicroBench::Compare(baseline, result, 0.05, std::cerr);
+ * @endcode
+ */
+class MicroBench {
+ public:
+  /**
+   * A position and the moves played after it in the game.
+   */
+  struct Position {
+    std::string name;  // e.g. "game1.sgf:100"
+    Board b;
+    std::vector<Vertex> next_moves;
+  };
+
+  /**
+   * A benchmark case. setup is called before each repetition without
+   * measurement, and run returns the number of operations it performed.
+   */
+  struct Case {
+    std::string name;
+    std::function<void()> setup;
+    std::function<int64_t()> run;
+  };
+
+  MicroBench(int num_warmups, int num_reps)
+      : num_warmups_(num_warmups), num_reps_(num_reps) {}
+
+  const std::vector<Position>& positions() const { return positions_; }
+
+  /**
+   * Loads positions at fixed move numbers of the SGF files in dir, with
+   * num_next_moves moves of the game after each of them.
+   */
+  bool LoadPositions(const std::string& dir, int num_next_moves,
+                     std::string* error);
+
+  void Add(Case c) { cases_.push_back(std::move(c)); }
+
+  /**
+   * Runs cases whose names contain filter and returns their results.
+   *  e.g. {"positions":16,"filter":"","cases":[{"name":"make_move/one_way",
+   *        "ops":256,"reps":30,"mean_ns":310.2,"min_ns":301.5,
+   *        "p50_ns":308.8,"p90_ns":322.4,"p99_ns":340.1},...]}
+   */
+  JsonValue Run(const std::string& filter) const;
+
+  /**
+   * Writes the ratio of p50 of each case in result to that in baseline, and
+   * returns false if any of them is slower by more than threshold, or if a
+   * case in baseline is missing from result but not excluded by its filter.
+   */
+  static bool Compare(const JsonValue& baseline, const JsonValue& result,
+                      double threshold, std::ostream& os);
+
+ private:
+  int num_warmups_;
+  int num_reps_;
+  std::vector<Position> positions_;
+  std::vector<Case> cases_;
+};
+
+/**
+ * Runs the benchmark cases of board, feature, node, cache and search
+ * operations on positions in bench_sgf_dir. Returns false if a case is
+ * slower than the result in bench_baseline.
+ */
+bool MicroBenchmark();
+
+/**
+ * Compares the results in bench_output with those in bench_baseline.
+ * Returns false if a case has regressed.
+ */
+bool CompareBenchmarks();
+
+#endif  // BENCH_H_
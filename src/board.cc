@@ -601,7 +601,7 @@ RepetitionState Board::CheckRepetition(Vertex v) const {
   if (v == kPass || !ptn_[v].atari()) return kRepetitionNone;
 
   RepetitionRule rule = RepetitionRule(Options["repetition_rule"].get_int());
-  Key key_next = hash_key_;
+  Key key_next = key();
   key_next ^= kCoordTable.zobrist_table[0][us_][v];
   key_next ^= 1;
   if (ko_ != kVtNull) key_next ^= kCoordTable.zobrist_table[0][3][ko_];
@@ -228,41 +228,35 @@ class Board {
   /**
    * Returns hash key of current board.
    */
-  Key key() const { return hash_key_; }
+  Key key() const { return sym_hash_keys_[0]; }
 
   /**
-   * Returns hash key of current board with symmetric operation.
+   * Returns hash key of current board with symmetric operation, i.e. the key
+   * of the board whose vertex v has the color of v2sym(v, symmetry_idx).
    */
   Key key(int symmetry_idx) const {
-    Key sym_hash_key = 0;
+    return sym_keys_stale_ && symmetry_idx != 0 ? SymmetricKey(symmetry_idx)
+                                                : sym_hash_keys_[symmetry_idx];
+  }
 
-    if (symmetry_idx == 0) {
-      sym_hash_key = hash_key_;
-    } else {
-      for (int rv = 0; rv < kNumRvts; ++rv) {
-        Vertex v = rv2v((RawVertex)rv);
-        Vertex v_sym = rv2v((RawVertex)rv2sym(rv, symmetry_idx));
-        if (color_[v_sym] == kBlack)
-          sym_hash_key ^= kCoordTable.zobrist_table[0][kBlack][v];
-        else if (color_[v_sym] == kWhite)
-          sym_hash_key ^= kCoordTable.zobrist_table[0][kWhite][v];
-      }
-      if (ko_ != kVtNull) {
-        int rv = v2rv(ko_);
-        Vertex v_sym = ko_;
-        for (int i = 0; i < 8; ++i) {
-          int rv_sym = rv2sym(rv, i);
-          if (rv2sym(rv_sym, symmetry_idx) == rv) {
-            v_sym = rv2v((RawVertex)rv_sym);
-            break;
-          }
-        }
-        sym_hash_key ^= kCoordTable.zobrist_table[0][3][v_sym];
+  /**
+   * Returns the minimum hash key over the 8 symmetric operations, which is
+   * shared by all symmetric boards. symmetry_idx is set to the index i with
+   * key(i) == canonical_key(), i.e. the board is canonical after the symmetric
+   * operation of the index.
+   */
+  Key canonical_key(int* symmetry_idx = nullptr) const {
+    Key min_key = sym_hash_keys_[0];
+    int min_idx = 0;
+    for (int i = 1; i < 8; ++i) {
+      Key sym_key = key(i);
+      if (sym_key < min_key) {
+        min_key = sym_key;
+        min_idx = i;
       }
-      if (us_ == kWhite) sym_hash_key ^= 1;
     }
-
-    return sym_hash_key;
+    if (symmetry_idx) *symmetry_idx = min_idx;
+    return min_key;
   }
 
   Feature get_feature() const {
@@ -271,6 +265,15 @@ class Board {
     return std::move(ft);
   }
 
+  /**
+   * Writes the input planes of get_feature() to oi without copying Feature,
+   * for num_symmetries symmetries from symmetry_idx.
+   */
+  float* WriteFeature(float* oi, bool use_full = true, int symmetry_idx = 0,
+                      int num_symmetries = 1) const {
+    return feature_.Write(*this, oi, use_full, symmetry_idx, num_symmetries);
+  }
+
   /**
    * Returns whether v is a sensible move.
    */
@@ -625,8 +628,13 @@ class Board {
   // Probability of previous response pattern.
   double prev_rsp_prob_;
 
-  // Hash key of current board.
-  Key hash_key_;
+  // Hash keys of current board with each symmetric operation, which are
+  // updated incrementally. [0] is the key of the board itself.
+  Key sym_hash_keys_[8];
+
+  // Whether sym_hash_keys_[1-7] are not updated after a move of kRollout,
+  // which is not looked up in caches.
+  bool sym_keys_stale_;
 
   // History of hash keys.
   Key key_history_[8];
@@ -751,6 +759,41 @@ class Board {
 
   void UpdateResponseMove(const std::vector<int>& atari_ids);
 
+  /**
+   * Toggles the zobrist hash of v with the color index in the hash keys of
+   * all symmetric boards. A stone on v is on v2sym_inv(v, i) in the i-th
+   * symmetric board. Only the key of the board itself is updated in kRollout.
+   */
+  template <AdvanceType Type>
+  void FlipHashKeys(Vertex v, int color_idx) {
+    constexpr int num_keys = Type == kRollout ? 1 : 8;
+    for (int i = 0; i < num_keys; ++i)
+      sym_hash_keys_[i] ^=
+          kCoordTable.zobrist_table[0][color_idx][v2sym_inv(v, i)];
+  }
+
+  template <AdvanceType Type>
+  void FlipTurnHashKeys() {
+    constexpr int num_keys = Type == kRollout ? 1 : 8;
+    for (int i = 0; i < num_keys; ++i) sym_hash_keys_[i] ^= 1;
+  }
+
+  /**
+   * Computes the hash key of the i-th symmetric board from the stones, which
+   * is used while sym_hash_keys_ are stale.
+   */
+  Key SymmetricKey(int symmetry_idx) const {
+    Key sym_key = us_ == kWhite ? 1 : 0;
+    const auto& zobrist = kCoordTable.zobrist_table[0];
+    for (int rv = 0; rv < kNumRvts; ++rv) {
+      Vertex v = rv2v(static_cast<RawVertex>(rv));
+      if (color_[v] == kBlack || color_[v] == kWhite)
+        sym_key ^= zobrist[color_[v]][v2sym_inv(v, symmetry_idx)];
+    }
+    if (ko_ != kVtNull) sym_key ^= zobrist[3][v2sym_inv(ko_, symmetry_idx)];
+    return sym_key;
+  }
+
   /**
    * Adds v to the list of updated patterns.
    */
@@ -1005,9 +1048,10 @@ inline Board::Board(const Board& rhs)
       prev_ko_(rhs.prev_ko_),
       removed_stones_(rhs.removed_stones_),
       prev_rsp_prob_(rhs.prev_rsp_prob_),
-      hash_key_(rhs.hash_key_),
       feature_(rhs.feature_) {
   std::memcpy(color_, rhs.color_, sizeof(color_));
+  std::memcpy(sym_hash_keys_, rhs.sym_hash_keys_, sizeof(sym_hash_keys_));
+  sym_keys_stale_ = rhs.sym_keys_stale_;
   std::memcpy(empty_, rhs.empty_, sizeof(empty_));
   std::memcpy(empty_id_, rhs.empty_id_, sizeof(empty_id_));
   std::memcpy(num_stones_, rhs.num_stones_, sizeof(num_stones_));
@@ -1056,7 +1100,8 @@ inline Board& Board::operator=(const Board& rhs) {
   updated_ptns_ = rhs.updated_ptns_;
   std::memcpy(sum_prob_rank_, rhs.sum_prob_rank_, sizeof(sum_prob_rank_));
   std::memcpy(num_passes_, rhs.num_passes_, sizeof(num_passes_));
-  hash_key_ = rhs.hash_key_;
+  std::memcpy(sym_hash_keys_, rhs.sym_hash_keys_, sizeof(sym_hash_keys_));
+  sym_keys_stale_ = rhs.sym_keys_stale_;
   std::memcpy(key_history_, rhs.key_history_, sizeof(key_history_));
   diffs_.clear();  // Resets diffs_
   feature_ = rhs.feature_;
@@ -1125,7 +1170,8 @@ inline void Board::Init() {
   prev_ptn_[kBlack].SetNull();
 
   prev_rsp_prob_ = 0.0;
-  hash_key_ = 0;
+  for (auto& k : sym_hash_keys_) k = 0;
+  sym_keys_stale_ = false;
   for (auto& k : key_history_) k = UINT64_MAX;
 
   diffs_.clear();
@@ -1377,6 +1423,7 @@ inline void Board::MakeMove(Vertex v) {
   bool reversible = (Type == kReversible);
   bool use_prob = (Type != kQuick);
   bool use_feature = (Type == kOneWay || Type == kReversible);
+  if (Type == kRollout) sym_keys_stale_ = true;
 
   if (use_diff) {
     diffs_.emplace_back(Diff());
@@ -1450,16 +1497,15 @@ inline void Board::MakeMove(Vertex v) {
       prev_rsp_prob_ = 0;
 
       for (int i = 7; i > 0; --i) key_history_[i] = key_history_[i - 1];
-      key_history_[0] = hash_key_;
+      key_history_[0] = key();
     }
 
     // Exchange turn.
     us_ = ~us_;
     opp_ = ~opp_;
 
-    hash_key_ ^= 1;
-    if (prev_ko_ != kVtNull)
-      hash_key_ ^= kCoordTable.zobrist_table[0][3][prev_ko_];
+    FlipTurnHashKeys<Type>();
+    if (prev_ko_ != kVtNull) FlipHashKeys<Type>(prev_ko_, 3);
 
     return;
   }
@@ -1567,19 +1613,17 @@ inline void Board::MakeMove(Vertex v) {
     if (reversible) diffs_.back().key = key_history_[7];
 
     for (int i = 7; i > 0; --i) key_history_[i] = key_history_[i - 1];
-    key_history_[0] = hash_key_;
+    key_history_[0] = key();
   }
 
   // 16. Updates current hash key.
-  hash_key_ ^= kCoordTable.zobrist_table[0][us_][v];
-  hash_key_ ^= 1;
+  FlipHashKeys<Type>(v, us_);
+  FlipTurnHashKeys<Type>();
 
-  for (auto& rs : removed_stones_.Vertices())
-    hash_key_ ^= kCoordTable.zobrist_table[0][opp_][rs];
+  for (auto& rs : removed_stones_.Vertices()) FlipHashKeys<Type>(rs, opp_);
 
-  if (prev_ko_ != kVtNull)
-    hash_key_ ^= kCoordTable.zobrist_table[0][3][prev_ko_];
-  if (ko_ != kVtNull) hash_key_ ^= kCoordTable.zobrist_table[0][3][ko_];
+  if (prev_ko_ != kVtNull) FlipHashKeys<Type>(prev_ko_, 3);
+  if (ko_ != kVtNull) FlipHashKeys<Type>(ko_, 3);
 
   // 17. Flips turn.
   prev_move_[us_] = v;
@@ -1638,15 +1682,13 @@ inline void Board::UnmakeMove() {
   }
 
   // Updates hash key.
-  if (v != kPass) hash_key_ ^= kCoordTable.zobrist_table[0][opp_][v];
-  hash_key_ ^= 1;
+  if (v != kPass) FlipHashKeys<Type>(v, opp_);
+  FlipTurnHashKeys<Type>();
 
-  for (auto rs : removed_stones_.Vertices())
-    hash_key_ ^= kCoordTable.zobrist_table[0][us_][rs];
+  for (auto rs : removed_stones_.Vertices()) FlipHashKeys<Type>(rs, us_);
 
-  if (prev_ko_ != kVtNull)
-    hash_key_ ^= kCoordTable.zobrist_table[0][3][prev_ko_];
-  if (ko_ != kVtNull) hash_key_ ^= kCoordTable.zobrist_table[0][3][ko_];
+  if (prev_ko_ != kVtNull) FlipHashKeys<Type>(prev_ko_, 3);
+  if (ko_ != kVtNull) FlipHashKeys<Type>(ko_, 3);
 
   // Recovers Ko.
   ko_ = prev_ko_;
@@ -0,0 +1,579 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./cpu_gemm.h"
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define USE_AVX2_KERNEL
+#if defined(__GNUC__) && !defined(__clang__)
+#define USE_DOT_KERNEL  // Kernels with target attributes and runtime dispatch.
+#endif
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+constexpr int kDepthBlock = 256;  // Blocking size of the inner dimension.
+
+inline int RoundUp(int x, int unit) { return (x + unit - 1) / unit * unit; }
+
+inline int32_t Load32(const void* p) {
+  int32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+inline float Bf16ToFloat(uint16_t h) {
+  uint32_t bits = static_cast<uint32_t>(h) << 16;
+  float f;
+  std::memcpy(&f, &bits, 4);
+  return f;
+}
+
+/**
+ * Writes im2col of src where G consecutive rows are interleaved.
+ *   col[((kk / G) * n + j) * G + kk % G] = convert(src[c][iy][ix])
+ * Rows from s.k() to RoundUp(s.k(), G) are filled with zeros.
+ */
+template <int G, typename T, typename F>
+void Im2ColGroup(const float* src, T* col, const ConvShape& s, F convert) {
+  const int n = s.out_hw();
+  const int k = s.k();
+  const int k_pad = RoundUp(k, G);
+
+  for (int kk = 0; kk < k_pad; ++kk) {
+    T* dst = col + static_cast<size_t>(kk / G) * n * G + kk % G;
+    if (kk >= k) {
+      for (int j = 0; j < n; ++j) dst[j * G] = T(0);
+      continue;
+    }
+
+    int c = kk / (s.kh * s.kw);
+    int ky = (kk / s.kw) % s.kh;
+    int kx = kk % s.kw;
+    const float* plane = src + c * s.h * s.w;
+    // Columns [ox_begin, ox_end) are inside the input for every row.
+    int ox_begin = (s.pad_w - kx + s.stride_w - 1) / s.stride_w;
+    int ox_end = (s.w + s.pad_w - kx + s.stride_w - 1) / s.stride_w;
+    ox_begin = std::min(s.out_w, std::max(0, ox_begin));
+    ox_end = std::max(ox_begin, std::min(s.out_w, ox_end));
+    for (int oy = 0; oy < s.out_h; ++oy) {
+      int iy = oy * s.stride_h - s.pad_h + ky;
+      if (iy < 0 || iy >= s.h) {
+        for (int ox = 0; ox < s.out_w; ++ox, dst += G) *dst = T(0);
+        continue;
+      }
+      const float* row = plane + iy * s.w - s.pad_w + kx;
+      int ox = 0;
+      for (; ox < ox_begin; ++ox, dst += G) *dst = T(0);
+      for (; ox < ox_end; ++ox, dst += G) *dst = convert(row[ox * s.stride_w]);
+      for (; ox < s.out_w; ++ox, dst += G) *dst = T(0);
+    }
+  }
+}
+
+#ifdef USE_AVX2_KERNEL
+/**
+ * Computes a (4 x 8*NV) block of C. When NV == 1, only the first cols
+ * columns are loaded and stored.
+ */
+template <int NV>
+inline void Kernel(const float* a, const float* b, int ldb, int kc, float* c,
+                   int ldc, int rows, int cols, bool first, bool last,
+                   const float* bias, const float* res, bool relu) {
+  const __m256i mask = _mm256_cmpgt_epi32(
+      _mm256_set1_epi32(cols), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  auto load = [&mask](const float* p) {
+    return NV == 1 ? _mm256_maskload_ps(p, mask) : _mm256_loadu_ps(p);
+  };
+
+  __m256 acc[4][NV];
+  for (int r = 0; r < 4; ++r)
+    for (int v = 0; v < NV; ++v)
+      acc[r][v] = (first || r >= rows) ? _mm256_setzero_ps()
+                                       : load(c + r * ldc + 8 * v);
+
+  for (int p = 0; p < kc; ++p) {
+    __m256 bv[NV];
+    for (int v = 0; v < NV; ++v) bv[v] = load(b + p * ldb + 8 * v);
+    for (int r = 0; r < 4; ++r) {
+      __m256 av = _mm256_broadcast_ss(a + p * 4 + r);
+      for (int v = 0; v < NV; ++v)
+        acc[r][v] = _mm256_fmadd_ps(av, bv[v], acc[r][v]);
+    }
+  }
+
+  for (int r = 0; r < rows; ++r) {
+    for (int v = 0; v < NV; ++v) {
+      __m256 x = acc[r][v];
+      if (last) {
+        x = _mm256_add_ps(x, _mm256_set1_ps(bias[r]));
+        if (res) x = _mm256_add_ps(x, load(res + r * ldc + 8 * v));
+        if (relu) x = _mm256_max_ps(x, _mm256_setzero_ps());
+      }
+      if (NV == 1)
+        _mm256_maskstore_ps(c + r * ldc, mask, x);
+      else
+        _mm256_storeu_ps(c + r * ldc + 8 * v, x);
+    }
+  }
+}
+
+inline __m256i ColumnMask(int cols) {
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(cols),
+                            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+/**
+ * Applies scales, bias, residual and Relu to a (4 x 16) block of int32 sums
+ * and stores it.
+ */
+inline void StoreBlockS32(const __m256i (*acc)[2], int rows, int cols,
+                          float* c, int ldc, const float* scales,
+                          const float* bias, const float* res, bool relu) {
+  const __m256i mask[2] = {ColumnMask(cols), ColumnMask(cols - 8)};
+  for (int r = 0; r < rows; ++r) {
+    for (int v = 0; v < 2; ++v) {
+      __m256 x = _mm256_fmadd_ps(_mm256_cvtepi32_ps(acc[r][v]),
+                                 _mm256_set1_ps(scales[r]),
+                                 _mm256_set1_ps(bias[r]));
+      if (res)
+        x = _mm256_add_ps(x,
+                          _mm256_maskload_ps(res + r * ldc + 8 * v, mask[v]));
+      if (relu) x = _mm256_max_ps(x, _mm256_setzero_ps());
+      _mm256_maskstore_ps(c + r * ldc + 8 * v, mask[v], x);
+    }
+  }
+}
+
+void GemmU8S8Avx2(const int8_t* a_packed, int m, int n, int k_pad,
+                  int m_begin, int m_end, const uint8_t* b, float* c,
+                  const float* scales, const float* bias, const float* res,
+                  bool relu) {
+  const int num_groups = k_pad / 4;
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  for (int j = 0; j < n; j += 16) {
+    int cols = std::min(16, n - j);
+    const __m256i mask0 = ColumnMask(cols);
+    const __m256i mask1 = ColumnMask(cols - 8);
+
+    for (int i = m_begin; i < m_end; i += 4) {
+      const int8_t* a = a_packed + static_cast<size_t>(i / 4) * num_groups * 16;
+      __m256i acc[4][2];
+      for (int r = 0; r < 4; ++r)
+        acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+
+      for (int g = 0; g < num_groups; ++g) {
+        const int* bg = reinterpret_cast<const int*>(
+            b + (static_cast<size_t>(g) * n + j) * 4);
+        __m256i b0 = _mm256_maskload_epi32(bg, mask0);
+        __m256i b1 = _mm256_maskload_epi32(bg + 8, mask1);
+        for (int r = 0; r < 4; ++r) {
+          __m256i av = _mm256_set1_epi32(Load32(a + (g * 4 + r) * 4));
+          acc[r][0] = _mm256_add_epi32(
+              acc[r][0], _mm256_madd_epi16(_mm256_maddubs_epi16(b0, av), ones));
+          acc[r][1] = _mm256_add_epi32(
+              acc[r][1], _mm256_madd_epi16(_mm256_maddubs_epi16(b1, av), ones));
+        }
+      }
+
+      StoreBlockS32(acc, std::min(4, m - i), cols, c + i * n + j, n,
+                    scales + i, bias + i, res ? res + i * n + j : nullptr,
+                    relu);
+    }
+  }
+}
+
+void GemmBf16Avx2(const uint16_t* a_packed, int m, int n, int k_pad,
+                  int m_begin, int m_end, const uint16_t* b, float* c,
+                  const float* bias, const float* res, bool relu) {
+  const int num_pairs = k_pad / 2;
+  const __m256i hi_mask = _mm256_set1_epi32(0xffff0000);
+
+  for (int j = 0; j < n; j += 8) {
+    int cols = std::min(8, n - j);
+    const __m256i mask = ColumnMask(cols);
+
+    for (int i = m_begin; i < m_end; i += 4) {
+      const uint16_t* a = a_packed + static_cast<size_t>(i / 4) * num_pairs * 8;
+      __m256 acc[4];
+      for (int r = 0; r < 4; ++r) acc[r] = _mm256_setzero_ps();
+
+      for (int q = 0; q < num_pairs; ++q) {
+        const int* bq = reinterpret_cast<const int*>(
+            b + (static_cast<size_t>(q) * n + j) * 2);
+        __m256i bv = _mm256_maskload_epi32(bq, mask);
+        __m256 b_lo = _mm256_castsi256_ps(_mm256_slli_epi32(bv, 16));
+        __m256 b_hi = _mm256_castsi256_ps(_mm256_and_si256(bv, hi_mask));
+        for (int r = 0; r < 4; ++r) {
+          const uint16_t* ap = a + (q * 4 + r) * 2;
+          acc[r] = _mm256_fmadd_ps(_mm256_set1_ps(Bf16ToFloat(ap[0])), b_lo,
+                                   acc[r]);
+          acc[r] = _mm256_fmadd_ps(_mm256_set1_ps(Bf16ToFloat(ap[1])), b_hi,
+                                   acc[r]);
+        }
+      }
+
+      for (int r = 0, rows = std::min(4, m - i); r < rows; ++r) {
+        __m256 x = _mm256_add_ps(acc[r], _mm256_set1_ps(bias[i + r]));
+        if (res)
+          x = _mm256_add_ps(
+              x, _mm256_maskload_ps(res + (i + r) * n + j, mask));
+        if (relu) x = _mm256_max_ps(x, _mm256_setzero_ps());
+        _mm256_maskstore_ps(c + (i + r) * n + j, mask, x);
+      }
+    }
+  }
+}
+#endif  // USE_AVX2_KERNEL
+
+#ifdef USE_DOT_KERNEL
+__attribute__((target("avx2,fma,avxvnni"))) void GemmU8S8Vnni(
+    const int8_t* a_packed, int m, int n, int k_pad, int m_begin, int m_end,
+    const uint8_t* b, float* c, const float* scales, const float* bias,
+    const float* res, bool relu) {
+  const int num_groups = k_pad / 4;
+
+  for (int j = 0; j < n; j += 16) {
+    int cols = std::min(16, n - j);
+    const __m256i mask0 = ColumnMask(cols);
+    const __m256i mask1 = ColumnMask(cols - 8);
+
+    for (int i = m_begin; i < m_end; i += 4) {
+      const int8_t* a = a_packed + static_cast<size_t>(i / 4) * num_groups * 16;
+      __m256i acc[4][2];
+      for (int r = 0; r < 4; ++r)
+        acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+
+      for (int g = 0; g < num_groups; ++g) {
+        const int* bg = reinterpret_cast<const int*>(
+            b + (static_cast<size_t>(g) * n + j) * 4);
+        __m256i b0 = _mm256_maskload_epi32(bg, mask0);
+        __m256i b1 = _mm256_maskload_epi32(bg + 8, mask1);
+        for (int r = 0; r < 4; ++r) {
+          __m256i av = _mm256_set1_epi32(Load32(a + (g * 4 + r) * 4));
+          acc[r][0] = _mm256_dpbusd_avx_epi32(acc[r][0], b0, av);
+          acc[r][1] = _mm256_dpbusd_avx_epi32(acc[r][1], b1, av);
+        }
+      }
+
+      StoreBlockS32(acc, std::min(4, m - i), cols, c + i * n + j, n,
+                    scales + i, bias + i, res ? res + i * n + j : nullptr,
+                    relu);
+    }
+  }
+}
+
+__attribute__((target("avx512f,avx512bf16"))) void GemmBf16Avx512(
+    const uint16_t* a_packed, int m, int n, int k_pad, int m_begin, int m_end,
+    const uint16_t* b, float* c, const float* bias, const float* res,
+    bool relu) {
+  const int num_pairs = k_pad / 2;
+
+  for (int j = 0; j < n; j += 32) {
+    int cols = std::min(32, n - j);
+    const __mmask16 mask[2] = {
+        static_cast<__mmask16>(cols >= 16 ? 0xffff : (1u << cols) - 1),
+        static_cast<__mmask16>(
+            cols >= 32 ? 0xffff : cols > 16 ? (1u << (cols - 16)) - 1 : 0)};
+
+    for (int i = m_begin; i < m_end; i += 4) {
+      const uint16_t* a = a_packed + static_cast<size_t>(i / 4) * num_pairs * 8;
+      __m512 acc[4][2];
+      for (int r = 0; r < 4; ++r) acc[r][0] = acc[r][1] = _mm512_setzero_ps();
+
+      for (int q = 0; q < num_pairs; ++q) {
+        const uint16_t* bq = b + (static_cast<size_t>(q) * n + j) * 2;
+        __m512i b0 = _mm512_maskz_loadu_epi32(mask[0], bq);
+        __m512i b1 = _mm512_maskz_loadu_epi32(mask[1], bq + 32);
+        for (int r = 0; r < 4; ++r) {
+          __m512i av = _mm512_set1_epi32(Load32(a + (q * 4 + r) * 2));
+          acc[r][0] = _mm512_dpbf16_ps(acc[r][0], (__m512bh)av, (__m512bh)b0);
+          acc[r][1] = _mm512_dpbf16_ps(acc[r][1], (__m512bh)av, (__m512bh)b1);
+        }
+      }
+
+      for (int r = 0, rows = std::min(4, m - i); r < rows; ++r) {
+        for (int v = 0; v < 2; ++v) {
+          int offset = (i + r) * n + j + 16 * v;
+          __m512 x = _mm512_add_ps(acc[r][v], _mm512_set1_ps(bias[i + r]));
+          if (res)
+            x = _mm512_add_ps(x, _mm512_maskz_loadu_ps(mask[v], res + offset));
+          if (relu) x = _mm512_max_ps(x, _mm512_setzero_ps());
+          _mm512_mask_storeu_ps(c + offset, mask[v], x);
+        }
+      }
+    }
+  }
+}
+#endif  // USE_DOT_KERNEL
+
+}  // namespace
+
+std::vector<float> PackPanels(const std::vector<float>& w, int m, int k) {
+  int num_panels = (m + 3) / 4;
+  std::vector<float> packed(static_cast<size_t>(num_panels) * k * 4, 0.0f);
+  for (int i = 0; i < m; ++i)
+    for (int p = 0; p < k; ++p)
+      packed[(static_cast<size_t>(i / 4) * k + p) * 4 + i % 4] = w[i * k + p];
+  return packed;
+}
+
+std::vector<float> UnpackPanels(const std::vector<float>& packed, int m,
+                                int k) {
+  std::vector<float> w(static_cast<size_t>(m) * k);
+  for (int i = 0; i < m; ++i)
+    for (int p = 0; p < k; ++p)
+      w[i * k + p] = packed[(static_cast<size_t>(i / 4) * k + p) * 4 + i % 4];
+  return w;
+}
+
+void Im2Col(const float* src, float* col, const ConvShape& s) {
+  for (int c = 0; c < s.cin; ++c) {
+    const float* plane = src + c * s.h * s.w;
+    for (int ky = 0; ky < s.kh; ++ky) {
+      for (int kx = 0; kx < s.kw; ++kx) {
+        for (int oy = 0; oy < s.out_h; ++oy) {
+          int iy = oy * s.stride_h - s.pad_h + ky;
+          if (iy < 0 || iy >= s.h) {
+            std::fill_n(col, s.out_w, 0.0f);
+            col += s.out_w;
+            continue;
+          }
+          const float* row = plane + iy * s.w;
+          for (int ox = 0; ox < s.out_w; ++ox) {
+            int ix = ox * s.stride_w - s.pad_w + kx;
+            *col++ = (ix < 0 || ix >= s.w) ? 0.0f : row[ix];
+          }
+        }
+      }
+    }
+  }
+}
+
+void Sgemm(const float* a_packed, int m, int n, int k, int m_begin, int m_end,
+           const float* b, int ldb, float* c, int ldc, const float* bias,
+           const float* res, bool relu) {
+  m_end = std::min(m_end, m);
+
+#ifdef USE_AVX2_KERNEL
+  for (int k0 = 0; k0 < k; k0 += kDepthBlock) {
+    int kc = std::min(kDepthBlock, k - k0);
+    bool first = k0 == 0;
+    bool last = k0 + kc >= k;
+    const float* b_k = b + static_cast<size_t>(k0) * ldb;
+
+    for (int j = 0; j < n;) {
+      int width = n - j >= 24 ? 24 : std::min(8, n - j);
+      for (int i = m_begin; i < m_end; i += 4) {
+        const float* a = a_packed + (static_cast<size_t>(i / 4) * k + k0) * 4;
+        const float* r = res ? res + i * ldc + j : nullptr;
+        int rows = std::min(4, m - i);
+        if (width == 24)
+          Kernel<3>(a, b_k + j, ldb, kc, c + i * ldc + j, ldc, rows, 24, first,
+                    last, bias + i, r, relu);
+        else
+          Kernel<1>(a, b_k + j, ldb, kc, c + i * ldc + j, ldc, rows, width,
+                    first, last, bias + i, r, relu);
+      }
+      j += width;
+    }
+  }
+#else
+  for (int i = m_begin; i < m_end; ++i) {
+    const float* a = a_packed + static_cast<size_t>(i / 4) * k * 4 + i % 4;
+    float* ci = c + i * ldc;
+    std::fill_n(ci, n, bias[i]);
+    for (int p = 0; p < k; ++p) {
+      float ap = a[p * 4];
+      const float* bp = b + static_cast<size_t>(p) * ldb;
+      for (int j = 0; j < n; ++j) ci[j] += ap * bp[j];
+    }
+    for (int j = 0; j < n; ++j) {
+      if (res) ci[j] += res[i * ldc + j];
+      if (relu) ci[j] = std::max(ci[j], 0.0f);
+    }
+  }
+#endif  // USE_AVX2_KERNEL
+}
+
+float Dot(const float* x, const float* y, int n) {
+  int i = 0;
+  float sum = 0.0f;
+#ifdef USE_AVX2_KERNEL
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8)
+    acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc);
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc),
+                        _mm256_extractf128_ps(acc, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  sum = _mm_cvtss_f32(s);
+#endif
+  for (; i < n; ++i) sum += x[i] * y[i];
+  return sum;
+}
+
+uint16_t FloatToBf16(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, 4);
+  if ((bits & 0x7fffffff) > 0x7f800000) return (bits >> 16) | 0x40;  // NaN
+  bits += 0x7fff + ((bits >> 16) & 1);  // Rounds to nearest even.
+  return static_cast<uint16_t>(bits >> 16);
+}
+
+std::vector<uint16_t> PackPanelsBf16(const std::vector<float>& w, int m,
+                                     int k) {
+  int num_panels = (m + 3) / 4;
+  int num_pairs = RoundUp(k, 2) / 2;
+  std::vector<uint16_t> packed(static_cast<size_t>(num_panels) * num_pairs * 8,
+                               0);
+  for (int i = 0; i < m; ++i)
+    for (int p = 0; p < k; ++p) {
+      size_t idx =
+          (static_cast<size_t>(i / 4) * num_pairs + p / 2) * 4 + i % 4;
+      packed[idx * 2 + p % 2] = FloatToBf16(w[i * k + p]);
+    }
+  return packed;
+}
+
+void Im2ColBf16(const float* src, uint16_t* col, const ConvShape& s) {
+  Im2ColGroup<2>(src, col, s, FloatToBf16);
+}
+
+void GemmBf16(const uint16_t* a_packed, int m, int n, int k, int m_begin,
+              int m_end, const uint16_t* b, float* c, const float* bias,
+              const float* res, bool relu) {
+  m_end = std::min(m_end, m);
+  const int k_pad = RoundUp(k, 2);
+
+#ifdef USE_DOT_KERNEL
+  if (CpuHasBf16Dot()) {
+    GemmBf16Avx512(a_packed, m, n, k_pad, m_begin, m_end, b, c, bias, res,
+                   relu);
+    return;
+  }
+#endif
+#ifdef USE_AVX2_KERNEL
+  GemmBf16Avx2(a_packed, m, n, k_pad, m_begin, m_end, b, c, bias, res, relu);
+#else
+  const int num_pairs = k_pad / 2;
+  for (int i = m_begin; i < m_end; ++i) {
+    const uint16_t* a = a_packed + static_cast<size_t>(i / 4) * num_pairs * 8;
+    for (int j = 0; j < n; ++j) {
+      float sum = bias[i];
+      for (int p = 0; p < k_pad; ++p)
+        sum += Bf16ToFloat(a[((p / 2) * 4 + i % 4) * 2 + p % 2]) *
+               Bf16ToFloat(b[(static_cast<size_t>(p / 2) * n + j) * 2 + p % 2]);
+      if (res) sum += res[i * n + j];
+      c[i * n + j] = relu ? std::max(sum, 0.0f) : sum;
+    }
+  }
+#endif
+}
+
+std::vector<int8_t> PackPanelsS8(const std::vector<float>& w, int m, int k,
+                                 std::vector<float>* scales) {
+  int num_panels = (m + 3) / 4;
+  int num_groups = RoundUp(k, 4) / 4;
+  std::vector<int8_t> packed(
+      static_cast<size_t>(num_panels) * num_groups * 16, 0);
+  scales->assign(m, 1.0f);
+
+  for (int i = 0; i < m; ++i) {
+    float max_abs = 0.0f;
+    for (int p = 0; p < k; ++p)
+      max_abs = std::max(max_abs, std::abs(w[i * k + p]));
+    if (max_abs > 0.0f) (*scales)[i] = max_abs / 127.0f;
+
+    for (int p = 0; p < k; ++p) {
+      float q = std::round(w[i * k + p] / (*scales)[i]);
+      size_t idx =
+          (static_cast<size_t>(i / 4) * num_groups + p / 4) * 4 + i % 4;
+      packed[idx * 4 + p % 4] =
+          static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, q)));
+    }
+  }
+  return packed;
+}
+
+void Im2ColU8(const float* src, uint8_t* col, const ConvShape& s,
+              float inv_scale) {
+  Im2ColGroup<4>(src, col, s, [inv_scale](float x) {
+    // Rounds half up, which is cheaper than std::round for non-negative x.
+    float q = std::max(0.0f, std::min(127.0f, x * inv_scale));
+    return static_cast<uint8_t>(q + 0.5f);
+  });
+}
+
+void GemmU8S8(const int8_t* a_packed, int m, int n, int k, int m_begin,
+              int m_end, const uint8_t* b, float* c, const float* scales,
+              const float* bias, const float* res, bool relu) {
+  m_end = std::min(m_end, m);
+  const int k_pad = RoundUp(k, 4);
+
+#ifdef USE_DOT_KERNEL
+  if (CpuHasInt8Dot()) {
+    GemmU8S8Vnni(a_packed, m, n, k_pad, m_begin, m_end, b, c, scales, bias,
+                 res, relu);
+    return;
+  }
+#endif
+#ifdef USE_AVX2_KERNEL
+  GemmU8S8Avx2(a_packed, m, n, k_pad, m_begin, m_end, b, c, scales, bias, res,
+               relu);
+#else
+  const int num_groups = k_pad / 4;
+  for (int i = m_begin; i < m_end; ++i) {
+    const int8_t* a = a_packed + static_cast<size_t>(i / 4) * num_groups * 16;
+    for (int j = 0; j < n; ++j) {
+      int32_t sum = 0;
+      for (int p = 0; p < k_pad; ++p)
+        sum += a[((p / 4) * 4 + i % 4) * 4 + p % 4] *
+               b[(static_cast<size_t>(p / 4) * n + j) * 4 + p % 4];
+      float x = sum * scales[i] + bias[i];
+      if (res) x += res[i * n + j];
+      c[i * n + j] = relu ? std::max(x, 0.0f) : x;
+    }
+  }
+#endif
+}
+
+bool CpuHasBf16Dot() {
+#ifdef USE_DOT_KERNEL
+  static const bool supported = __builtin_cpu_supports("avx512bf16");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+bool CpuHasInt8Dot() {
+#ifdef USE_DOT_KERNEL
+  static const bool supported = __builtin_cpu_supports("avxvnni");
+  return supported;
+#else
+  return false;
+#endif
+}
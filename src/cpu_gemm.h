@@ -0,0 +1,98 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPU_GEMM_H_
+#define CPU_GEMM_H_
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * @struct ConvShape
+ * Geometry of a 2D convolution for a single sample.
+ */
+struct ConvShape {
+  int cin = 0, h = 1, w = 1, kh = 1, kw = 1;
+  int stride_h = 1, stride_w = 1, pad_h = 0, pad_w = 0;
+  int out_h = 1, out_w = 1;
+
+  int k() const { return cin * kh * kw; }
+  int out_hw() const { return out_h * out_w; }
+
+  /**
+   * Returns true if the input planes can be used as the im2col matrix.
+   */
+  bool is_pointwise() const {
+    return kh == 1 && kw == 1 && stride_h == 1 && stride_w == 1 &&
+           pad_h == 0 && pad_w == 0 && out_h == h && out_w == w;
+  }
+};
+
+/**
+ * Kernels of matrix products for CpuEngine.
+ *
+ * A (weights) is packed into panels of 4 rows, and B (im2col of activations)
+ * is a [k][n] matrix. The reduced precision kernels interleave 2 (bf16) or 4
+ * (int8) consecutive k in B, so that a single 32-bit lane holds the operands
+ * of a dot product instruction, and k is padded with zeros.
+ *
+ * All kernels compute rows [m_begin, m_end) of
+ *   C = act(A * B + bias + res)
+ * where res (optional) has the same layout as C and act is Relu if relu is
+ * true.
+ */
+
+// fp32
+std::vector<float> PackPanels(const std::vector<float>& w, int m, int k);
+std::vector<float> UnpackPanels(const std::vector<float>& packed, int m,
+                                int k);
+void Im2Col(const float* src, float* col, const ConvShape& s);
+void Sgemm(const float* a_packed, int m, int n, int k, int m_begin, int m_end,
+           const float* b, int ldb, float* c, int ldc, const float* bias,
+           const float* res, bool relu);
+float Dot(const float* x, const float* y, int n);
+
+// bf16 weights and activations with fp32 accumulation.
+uint16_t FloatToBf16(float f);
+std::vector<uint16_t> PackPanelsBf16(const std::vector<float>& w, int m,
+                                     int k);
+void Im2ColBf16(const float* src, uint16_t* col, const ConvShape& s);
+void GemmBf16(const uint16_t* a_packed, int m, int n, int k, int m_begin,
+              int m_end, const uint16_t* b, float* c, const float* bias,
+              const float* res, bool relu);
+
+// Signed int8 weights with per-row scales and unsigned 7-bit activations.
+// Activations are limited to [0, 127] so that the pairwise sums of
+// vpmaddubsw don't saturate.
+std::vector<int8_t> PackPanelsS8(const std::vector<float>& w, int m, int k,
+                                 std::vector<float>* scales);
+void Im2ColU8(const float* src, uint8_t* col, const ConvShape& s,
+              float inv_scale);
+void GemmU8S8(const int8_t* a_packed, int m, int n, int k, int m_begin,
+              int m_end, const uint8_t* b, float* c, const float* scales,
+              const float* bias, const float* res, bool relu);
+
+/**
+ * Returns true if the CPU has dot product instructions of bf16 (AVX512_BF16)
+ * or int8 (AVX-VNNI), which are used by GemmBf16 and GemmU8S8.
+ */
+bool CpuHasBf16Dot();
+bool CpuHasInt8Dot();
+
+#endif  // CPU_GEMM_H_
@@ -0,0 +1,1166 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./cpu_network.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "./sgf.h"
+
+namespace {
+
+constexpr int kRowBlock = 32;   // Output channels per task of convolution.
+constexpr int kGemmBlock = 64;  // Output units per task of Gemm.
+constexpr int kNumCalibrationPositions = 256;
+
+int64_t Product(const std::vector<int64_t>& dims, size_t begin, size_t end) {
+  int64_t n = 1;
+  for (size_t i = begin; i < end && i < dims.size(); ++i) n *= dims[i];
+  return n;
+}
+
+int NormalizeAxis(int64_t axis, size_t rank) {
+  return static_cast<int>(axis < 0 ? axis + rank : axis);
+}
+
+/**
+ * Resolves 0 and -1 in the target shape of Reshape.
+ */
+bool ReshapeDims(const std::vector<int64_t>& in,
+                 const std::vector<int64_t>& target,
+                 std::vector<int64_t>* out) {
+  *out = target;
+  int64_t known = 1;
+  int infer_idx = -1;
+  for (size_t i = 0; i < out->size(); ++i) {
+    if ((*out)[i] == 0 && i < in.size()) (*out)[i] = in[i];
+    if ((*out)[i] == -1) {
+      if (infer_idx >= 0) return false;
+      infer_idx = i;
+    } else {
+      known *= (*out)[i];
+    }
+  }
+  int64_t total = Product(in, 0, in.size());
+  if (infer_idx >= 0) {
+    if (known == 0) return false;
+    (*out)[infer_idx] = total / known;
+  }
+  return Product(*out, 0, out->size()) == total;
+}
+
+std::vector<int64_t> SqueezeDims(const std::vector<int64_t>& in,
+                                 const std::vector<int64_t>& axes) {
+  std::vector<int64_t> out;
+  for (size_t i = 0; i < in.size(); ++i) {
+    bool squeeze = false;
+    if (axes.empty()) {
+      squeeze = i > 0 && in[i] == 1;
+    } else {
+      for (auto a : axes)
+        if (NormalizeAxis(a, in.size()) == static_cast<int>(i)) squeeze = true;
+    }
+    if (!squeeze) out.push_back(in[i]);
+  }
+  return out;
+}
+
+std::vector<int64_t> UnsqueezeDims(const std::vector<int64_t>& in,
+                                   const std::vector<int64_t>& axes) {
+  size_t rank = in.size() + axes.size();
+  std::vector<bool> inserted(rank, false);
+  for (auto a : axes) inserted[NormalizeAxis(a, rank)] = true;
+
+  std::vector<int64_t> out;
+  auto itr = in.begin();
+  for (size_t i = 0; i < rank; ++i) {
+    if (inserted[i])
+      out.push_back(1);
+    else if (itr != in.end())
+      out.push_back(*itr++);
+  }
+  return out;
+}
+
+/**
+ * Returns the shape of the numpy-style broadcast of a and b.
+ */
+bool BroadcastDims(std::vector<int64_t> a, std::vector<int64_t> b,
+                   std::vector<int64_t>* out) {
+  size_t rank = std::max(a.size(), b.size());
+  a.insert(a.begin(), rank - a.size(), 1);
+  b.insert(b.begin(), rank - b.size(), 1);
+  out->resize(rank);
+  for (size_t i = 0; i < rank; ++i) {
+    if (a[i] != b[i] && a[i] != 1 && b[i] != 1) return false;
+    (*out)[i] = std::max(a[i], b[i]);
+  }
+  return true;
+}
+
+/**
+ * Returns strides of a tensor broadcast to the out shape.
+ */
+std::vector<int64_t> BroadcastStrides(std::vector<int64_t> dims,
+                                      const std::vector<int64_t>& out) {
+  dims.insert(dims.begin(), out.size() - dims.size(), 1);
+  std::vector<int64_t> strides(out.size(), 0);
+  int64_t s = 1;
+  for (int i = static_cast<int>(out.size()) - 1; i >= 0; --i) {
+    strides[i] = dims[i] == 1 ? 0 : s;
+    s *= dims[i];
+  }
+  return strides;
+}
+
+template <typename T, typename F>
+void BinaryOp(const T* a, const std::vector<int64_t>& a_dims, const T* b,
+              const std::vector<int64_t>& b_dims, T* y,
+              const std::vector<int64_t>& y_dims, F f) {
+  int64_t total = Product(y_dims, 0, y_dims.size());
+  if (a_dims == y_dims && b_dims == y_dims) {
+    for (int64_t i = 0; i < total; ++i) y[i] = f(a[i], b[i]);
+    return;
+  }
+  if (a_dims == y_dims && Product(b_dims, 0, b_dims.size()) == 1) {
+    for (int64_t i = 0; i < total; ++i) y[i] = f(a[i], b[0]);
+    return;
+  }
+
+  auto a_strides = BroadcastStrides(a_dims, y_dims);
+  auto b_strides = BroadcastStrides(b_dims, y_dims);
+  std::vector<int64_t> idx(y_dims.size(), 0);
+  int64_t a_pos = 0, b_pos = 0;
+  for (int64_t i = 0; i < total; ++i) {
+    y[i] = f(a[a_pos], b[b_pos]);
+    for (int d = static_cast<int>(y_dims.size()) - 1; d >= 0; --d) {
+      a_pos += a_strides[d];
+      b_pos += b_strides[d];
+      if (++idx[d] < y_dims[d]) break;
+      a_pos -= a_strides[d] * y_dims[d];
+      b_pos -= b_strides[d] * y_dims[d];
+      idx[d] = 0;
+    }
+  }
+}
+
+}  // namespace
+
+std::string CpuEngine::OnnxPath(std::string model_path) {
+  std::string base_path = model_path;
+  if (base_path.find(".engine") != std::string::npos) {
+    base_path = base_path.substr(0, base_path.size() - 7);
+  } else if (base_path.find(".onnx") != std::string::npos) {
+    base_path = base_path.substr(0, base_path.size() - 5);
+  } else if (base_path.find(".uff") != std::string::npos) {
+    base_path = base_path.substr(0, base_path.size() - 4);
+  }
+  return base_path + ".onnx";
+}
+
+void CpuEngine::Init(std::string model_path, bool use_full_features,
+                     bool value_from_black) {
+  SetFeatureMode(use_full_features, value_from_black);
+
+  int num_threads = Options["num_cpu_threads"].get_int();
+  if (num_threads <= 0)
+    num_threads =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  pool_.reset(new CpuThreadPool(num_threads));
+
+  std::string onnx_path = OnnxPath(DefaultModelPath(model_path));
+  OnnxModel model;
+  if (!model.Load(onnx_path)) {
+    std::cerr << "[ERROR] File not found: " << onnx_path << std::endl;
+    std::cerr << "Use '--model_path' option to specify a non-default ONNX file."
+              << std::endl;
+    exit(1);
+  }
+
+  if (!Compile(model)) {
+    std::cerr << "[ERROR] Unsupported ONNX model: " << onnx_path << std::endl;
+    exit(1);
+  }
+
+  std::string precision = precision_;
+  if (precision.empty()) precision = Options["cpu_precision"].get_string();
+  if (precision == "int8") {
+    Calibrate(SampleFeatures(kNumCalibrationPositions));
+    Quantize(kInt8);
+  } else if (precision == "bf16") {
+    Quantize(kBf16);
+  } else if (precision != "fp32") {
+    std::cerr << "unknown cpu precision: " << precision << std::endl;
+  }
+}
+
+std::vector<Feature> CpuEngine::SampleFeatures(int num) {
+  std::vector<Feature> features;
+  Board b;
+
+  std::string sgf_dir = Options["sgf_dir"];
+  std::vector<std::string> files;
+  if (!sgf_dir.empty()) SgfData::GetSgfFiles(sgf_dir, &files);
+
+  for (int i = 0; i < 10 * num && !files.empty() &&
+                  static_cast<int>(features.size()) < num;
+       ++i) {
+    std::string file_path = files[RandDouble() * files.size()];
+    if (file_path.find_first_of("/\\") == std::string::npos)
+      file_path = JoinPath(sgf_dir, file_path);
+
+    SgfData sgf;
+    sgf.Read(file_path);
+    if (sgf.game_ply() == 0) continue;
+    if (!sgf.ReconstructBoard(&b, RandDouble() * sgf.game_ply())) continue;
+    features.push_back(b.get_feature());
+  }
+
+  // Falls back to random games.
+  while (static_cast<int>(features.size()) < num) {
+    b.Init();
+    int num_moves = RandDouble() * 200;
+    for (int j = 0; j < num_moves && !b.double_pass(); ++j)
+      b.MakeMove<kOneWay>(b.SelectMoveRandom());
+    features.push_back(b.get_feature());
+  }
+
+  return features;
+}
+
+void CpuEngine::Calibrate(const std::vector<Feature>& features) {
+  input_ranges_.assign(ops_.size(), {0.0f, 0.0f});
+  calibrating_ = true;
+
+  std::vector<std::shared_ptr<SyncedEntry>> entries;
+  for (size_t i = 0; i < features.size(); ++i) {
+    entries.emplace_back(std::make_shared<SyncedEntry>(features[i]));
+    if (static_cast<int>(entries.size()) == max_batch_size_ ||
+        i + 1 == features.size()) {
+      Infer(&entries, kNumSymmetry);
+      entries.clear();
+    }
+  }
+
+  calibrating_ = false;
+}
+
+void CpuEngine::Quantize(Precision precision) {
+  const int num_convs =
+      std::count_if(ops_.begin(), ops_.end(),
+                    [](const Op& op) { return op.type == kOpConv; });
+  int num_quantized = 0;
+  size_t col_size = 0;
+
+  for (size_t i = 0; i < ops_.size(); ++i) {
+    Op& op = ops_[i];
+    if (op.type != kOpConv) continue;
+
+    const int k = op.conv.k();
+    std::vector<float> weights = UnpackPanels(op.weights, op.cout, k);
+    if (precision == kInt8) {
+      // Activations are quantized to [0, 127].
+      float min_x = input_ranges_[i].first;
+      float max_x = input_ranges_[i].second;
+      if (min_x < 0.0f || max_x <= 0.0f) continue;
+
+      float act_scale = max_x / 127.0f;
+      op.inv_act_scale = 1.0f / act_scale;
+      op.weights_s8 = PackPanelsS8(weights, op.cout, k, &op.scales);
+      for (auto& scale : op.scales) scale *= act_scale;
+    } else {
+      op.weights_bf16 = PackPanelsBf16(weights, op.cout, k);
+    }
+
+    op.precision = precision;
+    op.weights.clear();
+    col_size = std::max(col_size, static_cast<size_t>(max_batch_size_) *
+                                      ((k + 3) / 4 * 4) * op.conv.out_hw());
+    ++num_quantized;
+  }
+
+  if (precision == kInt8)
+    col_u8_.assign(col_size, 0);
+  else
+    col_bf16_.assign(col_size, 0);
+
+  std::cerr << "cpu precision: " << (precision == kInt8 ? "int8" : "bf16")
+            << " (" << num_quantized << "/" << num_convs << " convolutions";
+  if (precision == kInt8 ? CpuHasInt8Dot() : CpuHasBf16Dot())
+    std::cerr << ", dot product instructions";
+  std::cerr << ")" << std::endl;
+}
+
+bool CpuEngine::FoldConstant(const OnnxNode& node,
+                             std::unordered_map<std::string, int>* ids) {
+  auto input = [&](size_t i) -> const Value* {
+    if (i >= node.inputs.size() || node.inputs[i] == "") return nullptr;
+    return &values_[ids->at(node.inputs[i])];
+  };
+  auto axes_of = [&]() {
+    if (node.has("axes")) return node.get_ints("axes");
+    const Value* axes = input(1);
+    return axes ? axes->ints : std::vector<int64_t>();
+  };
+
+  const std::string& type = node.op_type;
+  Value out;
+
+  if (type == "Constant") {
+    if (node.has("value")) {
+      const OnnxTensor& t = node.attributes.at("value").t;
+      out.shape = t.dims;
+      out.is_int = !t.is_float();
+      out.floats = t.floats;
+      out.ints = t.ints;
+    } else if (node.has("value_float")) {
+      out.floats = {node.get_float("value_float", 0.0f)};
+    } else if (node.has("value_floats")) {
+      out.floats = node.attributes.at("value_floats").floats;
+      out.shape = {static_cast<int64_t>(out.floats.size())};
+    } else if (node.has("value_int")) {
+      out.is_int = true;
+      out.ints = {node.get_int("value_int", 0)};
+    } else if (node.has("value_ints")) {
+      out.is_int = true;
+      out.ints = node.get_ints("value_ints");
+      out.shape = {static_cast<int64_t>(out.ints.size())};
+    } else {
+      return false;
+    }
+  } else if (type == "Shape") {
+    out.is_int = true;
+    out.ints = input(0)->shape;
+    out.shape = {static_cast<int64_t>(out.ints.size())};
+  } else if (type == "Identity" || type == "Dropout") {
+    out = *input(0);
+  } else if (type == "Cast") {
+    out = *input(0);
+    int to = node.get_int("to", 1);
+    bool to_float = to == 1 || to == 10 || to == 11;
+    if (to_float && out.is_int) {
+      out.floats.assign(out.ints.begin(), out.ints.end());
+      out.ints.clear();
+    } else if (!to_float && !out.is_int) {
+      for (auto f : out.floats) out.ints.push_back(static_cast<int64_t>(f));
+      out.floats.clear();
+    }
+    out.is_int = !to_float;
+  } else if (type == "Gather") {
+    const Value* data = input(0);
+    const Value* indices = input(1);
+    if (node.get_int("axis", 0) != 0 || data->shape.empty() || !indices->is_int)
+      return false;
+    int64_t rows = data->shape[0];
+    int64_t row_size = Product(data->shape, 1, data->shape.size());
+    out.is_int = data->is_int;
+    out.shape = indices->shape;
+    out.shape.insert(out.shape.end(), data->shape.begin() + 1,
+                     data->shape.end());
+    for (auto idx : indices->ints) {
+      if (idx < 0) idx += rows;
+      if (idx < 0 || idx >= rows) return false;
+      if (data->is_int)
+        out.ints.insert(out.ints.end(), data->ints.begin() + idx * row_size,
+                        data->ints.begin() + (idx + 1) * row_size);
+      else
+        out.floats.insert(out.floats.end(),
+                          data->floats.begin() + idx * row_size,
+                          data->floats.begin() + (idx + 1) * row_size);
+    }
+  } else if (type == "Unsqueeze") {
+    out = *input(0);
+    out.shape = UnsqueezeDims(out.shape, axes_of());
+  } else if (type == "Squeeze") {
+    out = *input(0);
+    auto axes = axes_of();
+    if (axes.empty()) {  // Squeezes all dims including the first one.
+      std::vector<int64_t> dims;
+      for (auto d : out.shape)
+        if (d != 1) dims.push_back(d);
+      out.shape = dims;
+    } else {
+      out.shape = SqueezeDims(out.shape, axes);
+    }
+  } else if (type == "Reshape") {
+    out = *input(0);
+    if (!ReshapeDims(input(0)->shape, input(1)->ints, &out.shape)) return false;
+  } else if (type == "Flatten") {
+    out = *input(0);
+    int axis = NormalizeAxis(node.get_int("axis", 1), out.shape.size());
+    out.shape = {Product(out.shape, 0, axis),
+                 Product(out.shape, axis, out.shape.size())};
+  } else if (type == "Concat") {
+    out.is_int = input(0)->is_int;
+    int64_t total = 0;
+    for (size_t i = 0; i < node.inputs.size(); ++i) {
+      const Value* v = input(i);
+      if (v->shape.size() > 1) return false;
+      out.ints.insert(out.ints.end(), v->ints.begin(), v->ints.end());
+      out.floats.insert(out.floats.end(), v->floats.begin(), v->floats.end());
+      total += v->is_int ? v->ints.size() : v->floats.size();
+    }
+    out.shape = {total};
+  } else if (type == "Slice") {
+    const Value* data = input(0);
+    if (data->shape.size() != 1) return false;
+    std::vector<int64_t> starts, ends, steps;
+    if (node.has("starts")) {
+      starts = node.get_ints("starts");
+      ends = node.get_ints("ends");
+    } else {
+      starts = input(1)->ints;
+      ends = input(2)->ints;
+      if (input(4)) steps = input(4)->ints;
+    }
+    if (starts.size() != 1 || (!steps.empty() && steps[0] != 1)) return false;
+    int64_t dim = data->shape[0];
+    int64_t s = starts[0] < 0 ? starts[0] + dim : std::min(starts[0], dim);
+    int64_t e = ends[0] < 0 ? ends[0] + dim : std::min(ends[0], dim);
+    s = std::max<int64_t>(s, 0);
+    e = std::max(e, s);
+    out.is_int = data->is_int;
+    out.shape = {e - s};
+    if (data->is_int)
+      out.ints.assign(data->ints.begin() + s, data->ints.begin() + e);
+    else
+      out.floats.assign(data->floats.begin() + s, data->floats.begin() + e);
+  } else if (type == "Add" || type == "Sub" || type == "Mul" ||
+             type == "Div") {
+    const Value* a = input(0);
+    const Value* b = input(1);
+    if (a->is_int != b->is_int) return false;
+    if (!BroadcastDims(a->shape, b->shape, &out.shape)) return false;
+    out.is_int = a->is_int;
+    char c = type[0];
+    if (out.is_int) {
+      out.ints.resize(Product(out.shape, 0, out.shape.size()));
+      BinaryOp(a->ints.data(), a->shape, b->ints.data(), b->shape,
+               out.ints.data(), out.shape, [c](int64_t x, int64_t y) {
+                 return c == 'A' ? x + y
+                                 : c == 'S' ? x - y
+                                            : c == 'M' ? x * y : x / y;
+               });
+    } else {
+      out.floats.resize(Product(out.shape, 0, out.shape.size()));
+      BinaryOp(a->floats.data(), a->shape, b->floats.data(), b->shape,
+               out.floats.data(), out.shape, [c](float x, float y) {
+                 return c == 'A' ? x + y
+                                 : c == 'S' ? x - y
+                                            : c == 'M' ? x * y : x / y;
+               });
+    }
+  } else {
+    return false;
+  }
+
+  out.is_const = true;
+  int id = values_.size();
+  values_.push_back(out);
+  (*ids)[node.outputs[0]] = id;
+
+  return true;
+}
+
+bool CpuEngine::Compile(const OnnxModel& model) {
+  values_.clear();
+  ops_.clear();
+  buffers_.clear();
+  input_id_ = policy_id_ = value_id_ = -1;
+
+  const int64_t n = max_batch_size_;
+  const auto& nodes = model.nodes();
+  std::unordered_map<std::string, int> ids;
+
+  auto add_value = [&](const std::string& name,
+                       const std::vector<int64_t>& shape) {
+    int id = values_.size();
+    values_.emplace_back();
+    values_.back().shape = shape;
+    ids[name] = id;
+    return id;
+  };
+  auto id_of = [&](const std::string& name) {
+    auto itr = ids.find(name);
+    return itr == ids.end() ? -1 : itr->second;
+  };
+  auto unsupported = [](const OnnxNode& node) {
+    std::cerr << "unsupported operator: " << node.op_type << " (" << node.name
+              << ")" << std::endl;
+    return false;
+  };
+
+  // 1. Registers weights and the input.
+  for (const auto& t : model.initializers()) {
+    int id = add_value(t.name, t.dims);
+    values_[id].is_const = true;
+    values_[id].is_int = !t.is_float();
+    values_[id].floats = t.floats;
+    values_[id].ints = t.ints;
+  }
+
+  for (const auto& info : model.inputs()) {
+    if (ids.count(info.name)) continue;
+    std::vector<int64_t> shape = info.dims;
+    bool valid = shape.size() >= 2;
+    for (size_t i = 1; i < shape.size(); ++i) valid &= shape[i] > 0;
+    if (!valid) shape = {n, feature_size_, kNumRvts};
+    shape[0] = n;
+    input_id_ = add_value(info.name, shape);
+    break;
+  }
+  if (input_id_ < 0 ||
+      values_[input_id_].sample_size() != feature_size_ * kNumRvts) {
+    std::cerr << "input size of the model does not match the features."
+              << std::endl;
+    return false;
+  }
+
+  // 2. Counts consumers of each tensor for fusion.
+  std::unordered_map<std::string, int> num_consumers;
+  std::unordered_map<std::string, int> consumer;
+  for (int i = 0, imax = nodes.size(); i < imax; ++i) {
+    for (const auto& name : nodes[i].inputs) {
+      ++num_consumers[name];
+      consumer[name] = i;
+    }
+  }
+  for (const auto& info : model.outputs()) num_consumers[info.name] += 2;
+
+  auto sole_consumer = [&](const std::string& name) {
+    return num_consumers[name] == 1 ? consumer[name] : -1;
+  };
+
+  // 3. Converts nodes to operators.
+  std::vector<bool> skipped(nodes.size(), false);
+  size_t col_size = 0;
+
+  for (int idx = 0, imax = nodes.size(); idx < imax; ++idx) {
+    if (skipped[idx]) continue;
+    const OnnxNode& node = nodes[idx];
+    const std::string& type = node.op_type;
+
+    bool all_const = true;
+    for (const auto& name : node.inputs) {
+      if (name == "") continue;
+      int id = id_of(name);
+      if (id < 0) {
+        std::cerr << "unknown tensor: " << name << std::endl;
+        return false;
+      }
+      if (!values_[id].is_const) all_const = false;
+    }
+
+    if (type == "Constant" || type == "Shape" || all_const) {
+      if (!FoldConstant(node, &ids)) return unsupported(node);
+      continue;
+    }
+
+    int x_id = id_of(node.inputs[0]);
+    std::vector<int64_t> x_shape = values_[x_id].shape;
+    Op op;
+    op.inputs = {x_id};
+    std::vector<int64_t> y_shape;
+    std::string y_name = node.outputs[0];
+
+    if (type == "Conv") {
+      int w_id = id_of(node.inputs[1]);
+      const Value& w = values_[w_id];
+      if (x_shape.size() != 4 || !w.is_const || w.shape.size() != 4 ||
+          node.get_int("group", 1) != 1)
+        return unsupported(node);
+      for (auto d : node.get_ints("dilations"))
+        if (d != 1) return unsupported(node);
+
+      op.type = kOpConv;
+      op.cout = w.shape[0];
+      op.cin = w.shape[1];
+      ConvShape& cs = op.conv;
+      cs.cin = op.cin;
+      cs.kh = w.shape[2];
+      cs.kw = w.shape[3];
+      cs.h = x_shape[2];
+      cs.w = x_shape[3];
+      auto strides = node.get_ints("strides");
+      if (strides.size() == 2) {
+        cs.stride_h = strides[0];
+        cs.stride_w = strides[1];
+      }
+
+      int pad_t = 0, pad_l = 0, pad_b = 0, pad_r = 0;
+      auto pads = node.get_ints("pads");
+      std::string auto_pad =
+          node.has("auto_pad") ? node.attributes.at("auto_pad").s : "";
+      if (pads.size() == 4) {
+        pad_t = pads[0];
+        pad_l = pads[1];
+        pad_b = pads[2];
+        pad_r = pads[3];
+      } else if (auto_pad == "SAME_UPPER" || auto_pad == "SAME_LOWER") {
+        int out_h = (cs.h + cs.stride_h - 1) / cs.stride_h;
+        int out_w = (cs.w + cs.stride_w - 1) / cs.stride_w;
+        int total_h = std::max(0, (out_h - 1) * cs.stride_h + cs.kh - cs.h);
+        int total_w = std::max(0, (out_w - 1) * cs.stride_w + cs.kw - cs.w);
+        bool upper = auto_pad == "SAME_UPPER";
+        pad_t = upper ? total_h / 2 : (total_h + 1) / 2;
+        pad_l = upper ? total_w / 2 : (total_w + 1) / 2;
+        pad_b = total_h - pad_t;
+        pad_r = total_w - pad_l;
+      }
+      cs.pad_h = pad_t;
+      cs.pad_w = pad_l;
+      cs.out_h = (cs.h + pad_t + pad_b - cs.kh) / cs.stride_h + 1;
+      cs.out_w = (cs.w + pad_l + pad_r - cs.kw) / cs.stride_w + 1;
+      y_shape = {n, op.cout, cs.out_h, cs.out_w};
+
+      int k = cs.k();
+      std::vector<float> weights = w.floats;
+      op.bias.assign(op.cout, 0.0f);
+      if (node.inputs.size() > 2 && node.inputs[2] != "")
+        op.bias = values_[id_of(node.inputs[2])].floats;
+      if (static_cast<int>(weights.size()) != op.cout * k ||
+          static_cast<int>(op.bias.size()) != op.cout)
+        return unsupported(node);
+
+      // Fuses BatchNormalization, residual Add and Relu.
+      while (true) {
+        int c = sole_consumer(y_name);
+        if (c < 0) break;
+        const OnnxNode& next = nodes[c];
+
+        if (next.op_type == "BatchNormalization" && op.residual < 0 &&
+            !op.relu && next.inputs.size() >= 5) {
+          int ids_bn[4];
+          bool const_bn = true;
+          for (int i = 0; i < 4; ++i) {
+            ids_bn[i] = id_of(next.inputs[i + 1]);
+            const_bn &= ids_bn[i] >= 0 && values_[ids_bn[i]].is_const;
+          }
+          if (!const_bn) break;
+          const auto& gamma = values_[ids_bn[0]].floats;
+          const auto& beta = values_[ids_bn[1]].floats;
+          const auto& mean = values_[ids_bn[2]].floats;
+          const auto& var = values_[ids_bn[3]].floats;
+          float eps = next.get_float("epsilon", 1e-5f);
+          for (int o = 0; o < op.cout; ++o) {
+            float s = gamma[o] / std::sqrt(var[o] + eps);
+            for (int p = 0; p < k; ++p) weights[o * k + p] *= s;
+            op.bias[o] = (op.bias[o] - mean[o]) * s + beta[o];
+          }
+        } else if ((next.op_type == "Add" || next.op_type == "Sum") &&
+                   next.inputs.size() == 2 && op.residual < 0 && !op.relu) {
+          const std::string& other =
+              next.inputs[0] == y_name ? next.inputs[1] : next.inputs[0];
+          int other_id = id_of(other);
+          if (other_id < 0 || values_[other_id].is_const ||
+              values_[other_id].shape != y_shape)
+            break;
+          op.residual = other_id;
+        } else if (next.op_type == "Relu" && !op.relu) {
+          op.relu = true;
+        } else {
+          break;
+        }
+
+        skipped[c] = true;
+        y_name = next.outputs[0];
+      }
+
+      op.weights = PackPanels(weights, op.cout, k);
+      if (op.residual >= 0) op.inputs.push_back(op.residual);
+      if (!cs.is_pointwise())
+        col_size =
+            std::max(col_size, static_cast<size_t>(n) * k * cs.out_hw());
+    } else if (type == "Gemm" || type == "MatMul") {
+      int w_id = id_of(node.inputs[1]);
+      const Value& w = values_[w_id];
+      if (!w.is_const || w.shape.size() != 2 ||
+          node.get_int("transA", 0) != 0 ||
+          (type == "MatMul" && x_shape.size() != 2))
+        return unsupported(node);
+
+      bool trans_b = node.get_int("transB", 0) != 0;
+      float alpha = node.get_float("alpha", 1.0f);
+      float beta = node.get_float("beta", 1.0f);
+      op.type = kOpGemm;
+      op.cin = trans_b ? w.shape[1] : w.shape[0];
+      op.cout = trans_b ? w.shape[0] : w.shape[1];
+      if (values_[x_id].sample_size() != op.cin) return unsupported(node);
+
+      op.weights.resize(op.cout * op.cin);
+      for (int o = 0; o < op.cout; ++o)
+        for (int i = 0; i < op.cin; ++i)
+          op.weights[o * op.cin + i] =
+              alpha * (trans_b ? w.floats[o * op.cin + i]
+                               : w.floats[i * op.cout + o]);
+
+      op.bias.assign(op.cout, 0.0f);
+      auto add_bias = [&op](const std::vector<float>& b, float scale) {
+        if (b.size() != 1 && static_cast<int>(b.size()) != op.cout)
+          return false;
+        for (int o = 0; o < op.cout; ++o)
+          op.bias[o] += scale * (b.size() == 1 ? b[0] : b[o]);
+        return true;
+      };
+      if (type == "Gemm" && node.inputs.size() > 2 && node.inputs[2] != "") {
+        if (!add_bias(values_[id_of(node.inputs[2])].floats, beta))
+          return unsupported(node);
+      }
+      y_shape = {n, op.cout};
+
+      // Fuses bias Add and Relu.
+      while (true) {
+        int c = sole_consumer(y_name);
+        if (c < 0) break;
+        const OnnxNode& next = nodes[c];
+
+        if (next.op_type == "Add" && next.inputs.size() == 2 && !op.relu) {
+          const std::string& other =
+              next.inputs[0] == y_name ? next.inputs[1] : next.inputs[0];
+          int other_id = id_of(other);
+          if (other_id < 0 || !values_[other_id].is_const ||
+              !add_bias(values_[other_id].floats, 1.0f))
+            break;
+        } else if (next.op_type == "Relu" && !op.relu) {
+          op.relu = true;
+        } else {
+          break;
+        }
+
+        skipped[c] = true;
+        y_name = next.outputs[0];
+      }
+    } else if (type == "BatchNormalization") {
+      if (x_shape.size() < 2 || node.inputs.size() < 5)
+        return unsupported(node);
+      op.type = kOpBatchNorm;
+      op.cout = x_shape[1];
+      const auto& gamma = values_[id_of(node.inputs[1])].floats;
+      const auto& beta = values_[id_of(node.inputs[2])].floats;
+      const auto& mean = values_[id_of(node.inputs[3])].floats;
+      const auto& var = values_[id_of(node.inputs[4])].floats;
+      float eps = node.get_float("epsilon", 1e-5f);
+      for (int c = 0; c < op.cout; ++c) {
+        float s = gamma[c] / std::sqrt(var[c] + eps);
+        op.weights.push_back(s);
+        op.bias.push_back(beta[c] - mean[c] * s);
+      }
+      y_shape = x_shape;
+    } else if (type == "Relu" || type == "Tanh" || type == "Sigmoid") {
+      op.type =
+          type == "Relu" ? kOpRelu : type == "Tanh" ? kOpTanh : kOpSigmoid;
+      y_shape = x_shape;
+    } else if (type == "Add" || type == "Sum" || type == "Mul") {
+      if (node.inputs.size() != 2) return unsupported(node);
+      op.type = type == "Mul" ? kOpMul : kOpAdd;
+      int b_id = id_of(node.inputs[1]);
+      op.inputs.push_back(b_id);
+      if (!BroadcastDims(x_shape, values_[b_id].shape, &y_shape) ||
+          y_shape.empty() || y_shape[0] != n)
+        return unsupported(node);
+    } else if (type == "Softmax") {
+      op.type = kOpSoftmax;
+      op.coerce = model.opset_version() < 13;
+      op.axis = NormalizeAxis(node.get_int("axis", op.coerce ? 1 : -1),
+                              x_shape.size());
+      if (op.axis < 1) return unsupported(node);
+      y_shape = x_shape;
+    } else if (type == "Transpose") {
+      op.type = kOpTranspose;
+      auto perm = node.get_ints("perm");
+      if (perm.empty())
+        for (int i = x_shape.size() - 1; i >= 0; --i) perm.push_back(i);
+      if (perm.size() != x_shape.size() || perm[0] != 0)
+        return unsupported(node);
+      for (auto p : perm) {
+        op.perm.push_back(p);
+        y_shape.push_back(x_shape[p]);
+      }
+    } else if (type == "Concat") {
+      op.type = kOpConcat;
+      op.axis = NormalizeAxis(node.get_int("axis", 0), x_shape.size());
+      if (op.axis < 1) return unsupported(node);
+      y_shape = x_shape;
+      y_shape[op.axis] = 0;
+      op.inputs.clear();
+      for (const auto& name : node.inputs) {
+        int id = id_of(name);
+        if (values_[id].is_const ||
+            values_[id].shape.size() != x_shape.size())
+          return unsupported(node);
+        op.inputs.push_back(id);
+        y_shape[op.axis] += values_[id].shape[op.axis];
+      }
+    } else if (type == "GlobalAveragePool") {
+      if (x_shape.size() != 4) return unsupported(node);
+      op.type = kOpGlobalAveragePool;
+      y_shape = {n, x_shape[1], 1, 1};
+    } else if (type == "Reshape" || type == "Flatten" || type == "Squeeze" ||
+               type == "Unsqueeze" || type == "Identity" ||
+               type == "Dropout") {
+      // These operators only change the shape and share the buffer.
+      std::vector<int64_t> axes = node.get_ints("axes");
+      if (!node.has("axes") && node.inputs.size() > 1 &&
+          (type == "Squeeze" || type == "Unsqueeze"))
+        axes = values_[id_of(node.inputs[1])].ints;
+
+      if (type == "Reshape") {
+        const Value& target = values_[id_of(node.inputs[1])];
+        if (!target.is_const || !ReshapeDims(x_shape, target.ints, &y_shape))
+          return unsupported(node);
+      } else if (type == "Flatten") {
+        if (node.get_int("axis", 1) != 1) return unsupported(node);
+        y_shape = {n, values_[x_id].sample_size()};
+      } else if (type == "Squeeze") {
+        y_shape = SqueezeDims(x_shape, axes);
+      } else if (type == "Unsqueeze") {
+        y_shape = UnsqueezeDims(x_shape, axes);
+      } else {
+        y_shape = x_shape;
+      }
+      if (y_shape.empty() || y_shape[0] != n) return unsupported(node);
+
+      int y_id = add_value(y_name, y_shape);
+      values_[y_id].alias = x_id;
+      continue;
+    } else {
+      return unsupported(node);
+    }
+
+    op.output = add_value(y_name, y_shape);
+    ops_.push_back(op);
+  }
+
+  // 4. Finds the policy and value outputs.
+  std::vector<int> outputs;
+  for (const auto& info : model.outputs()) {
+    int id = id_of(info.name);
+    if (id < 0 || values_[id].is_const) return false;
+    outputs.push_back(id);
+    bool is_value = info.name.find("value") != std::string::npos ||
+                    values_[id].sample_size() == 1;
+    if (is_value && value_id_ < 0)
+      value_id_ = id;
+    else if (policy_id_ < 0)
+      policy_id_ = id;
+  }
+  if (policy_id_ < 0 || value_id_ < 0 ||
+      values_[policy_id_].sample_size() < kNumRvts) {
+    std::cerr << "policy and value outputs are not found." << std::endl;
+    return false;
+  }
+
+  col_buf_.assign(col_size, 0.0f);
+  AllocateBuffers(outputs);
+
+  return true;
+}
+
+void CpuEngine::AllocateBuffers(const std::vector<int>& outputs) {
+  const int num_ops = ops_.size();
+  std::vector<int> last_use(values_.size(), -1);
+  for (int i = 0; i < num_ops; ++i)
+    for (auto id : ops_[i].inputs)
+      last_use[Root(id)] = std::max(last_use[Root(id)], i);
+  for (auto id : outputs) last_use[Root(id)] = num_ops;
+
+  std::vector<size_t> capacity;
+  std::vector<int> free_buffers;
+
+  auto release = [&](int root) {
+    if (values_[root].buffer >= 0 && last_use[root] < num_ops) {
+      free_buffers.push_back(values_[root].buffer);
+      last_use[root] = num_ops;  // Prevents releasing twice.
+    }
+  };
+
+  for (int i = 0; i < num_ops; ++i) {
+    int y = ops_[i].output;
+    size_t need = values_[y].size();
+
+    // Picks the smallest free buffer that is large enough, otherwise the
+    // largest one, which is extended.
+    int best = -1;
+    for (int j = 0, jmax = free_buffers.size(); j < jmax; ++j) {
+      if (best < 0) {
+        best = j;
+        continue;
+      }
+      size_t cap = capacity[free_buffers[j]];
+      size_t best_cap = capacity[free_buffers[best]];
+      if (best_cap >= need ? (cap >= need && cap < best_cap) : cap > best_cap)
+        best = j;
+    }
+
+    int buffer;
+    if (best >= 0) {
+      buffer = free_buffers[best];
+      free_buffers.erase(free_buffers.begin() + best);
+      capacity[buffer] = std::max(capacity[buffer], need);
+    } else {
+      buffer = capacity.size();
+      capacity.push_back(need);
+    }
+    values_[y].buffer = buffer;
+
+    for (auto id : ops_[i].inputs)
+      if (last_use[Root(id)] == i) release(Root(id));
+    if (last_use[y] <= i) release(y);
+  }
+
+  buffers_.resize(capacity.size());
+  for (size_t b = 0; b < capacity.size(); ++b)
+    buffers_[b].assign(capacity[b], 0.0f);
+}
+
+bool CpuEngine::Forward(const float* inputs, int batch_size, float* policy,
+                        float* value) {
+  if (batch_size <= 0 || batch_size > max_batch_size_ || policy_id_ < 0)
+    return false;
+
+  inputs_ = inputs;
+  for (size_t i = 0; i < ops_.size(); ++i) {
+    const Op& op = ops_[i];
+    if (calibrating_ && op.type == kOpConv) {
+      const float* x = Data(op.inputs[0]);
+      int64_t size = batch_size * values_[op.inputs[0]].sample_size();
+      auto& range = input_ranges_[i];
+      for (int64_t j = 0; j < size; ++j) {
+        range.first = std::min(range.first, x[j]);
+        range.second = std::max(range.second, x[j]);
+      }
+    }
+    RunOp(op, batch_size);
+  }
+
+  const float* p = Data(policy_id_);
+  const float* v = Data(value_id_);
+  int64_t policy_size = values_[policy_id_].sample_size();
+  int64_t value_size = values_[value_id_].sample_size();
+  for (int i = 0; i < batch_size; ++i) {
+    std::copy_n(p + i * policy_size, kNumRvts, policy + i * kNumRvts);
+    value[i] = v[i * value_size];
+  }
+
+  return true;
+}
+
+void CpuEngine::RunConv(const Op& op, int batch_size) {
+  const float* x = Data(op.inputs[0]);
+  float* y = MutableData(op.output);
+  const float* res = op.residual >= 0 ? Data(op.residual) : nullptr;
+
+  const ConvShape& cs = op.conv;
+  const int in_size = cs.cin * cs.h * cs.w;
+  const int out_hw = cs.out_hw();
+  const int out_size = op.cout * out_hw;
+  const int k = cs.k();
+  const int num_blocks = (op.cout + kRowBlock - 1) / kRowBlock;
+
+  if (op.precision != kFp32) {
+    // Converts inputs to the interleaved im2col layout of the kernels.
+    const size_t col_stride = static_cast<size_t>((k + 3) / 4 * 4) * out_hw;
+    pool_->ParallelFor(batch_size, [&](int i) {
+      if (op.precision == kBf16)
+        Im2ColBf16(x + i * in_size, col_bf16_.data() + i * col_stride, cs);
+      else
+        Im2ColU8(x + i * in_size, col_u8_.data() + i * col_stride, cs,
+                 op.inv_act_scale);
+    });
+
+    pool_->ParallelFor(batch_size * num_blocks, [&](int t) {
+      int i = t / num_blocks;
+      int m_begin = (t % num_blocks) * kRowBlock;
+      int m_end = m_begin + kRowBlock;
+      float* yi = y + i * out_size;
+      const float* ri = res ? res + i * out_size : nullptr;
+      if (op.precision == kBf16)
+        GemmBf16(op.weights_bf16.data(), op.cout, out_hw, k, m_begin, m_end,
+                 col_bf16_.data() + i * col_stride, yi, op.bias.data(), ri,
+                 op.relu);
+      else
+        GemmU8S8(op.weights_s8.data(), op.cout, out_hw, k, m_begin, m_end,
+                 col_u8_.data() + i * col_stride, yi, op.scales.data(),
+                 op.bias.data(), ri, op.relu);
+    });
+    return;
+  }
+
+  const bool direct = cs.is_pointwise();
+  if (!direct) {
+    pool_->ParallelFor(batch_size, [&](int i) {
+      float* col = col_buf_.data() + static_cast<size_t>(i) * k * out_hw;
+      Im2Col(x + i * in_size, col, cs);
+    });
+  }
+
+  pool_->ParallelFor(batch_size * num_blocks, [&](int t) {
+    int i = t / num_blocks;
+    int m_begin = (t % num_blocks) * kRowBlock;
+    const float* b =
+        direct ? x + i * in_size
+               : col_buf_.data() + static_cast<size_t>(i) * k * out_hw;
+    Sgemm(op.weights.data(), op.cout, out_hw, k, m_begin, m_begin + kRowBlock,
+          b, out_hw, y + i * out_size, out_hw, op.bias.data(),
+          res ? res + i * out_size : nullptr, op.relu);
+  });
+}
+
+void CpuEngine::RunGemm(const Op& op, int batch_size) {
+  const float* x = Data(op.inputs[0]);
+  float* y = MutableData(op.output);
+
+  const int num_blocks = (op.cout + kGemmBlock - 1) / kGemmBlock;
+  pool_->ParallelFor(batch_size * num_blocks, [&](int t) {
+    int i = t / num_blocks;
+    int o_begin = (t % num_blocks) * kGemmBlock;
+    int o_end = std::min(op.cout, o_begin + kGemmBlock);
+    const float* xi = x + i * op.cin;
+    for (int o = o_begin; o < o_end; ++o) {
+      float s = Dot(xi, op.weights.data() + o * op.cin, op.cin) + op.bias[o];
+      y[i * op.cout + o] = op.relu ? std::max(s, 0.0f) : s;
+    }
+  });
+}
+
+void CpuEngine::RunOp(const Op& op, int batch_size) {
+  auto runtime_shape = [&](int id) {
+    std::vector<int64_t> shape = values_[id].shape;
+    if (!values_[id].is_const && !shape.empty()) shape[0] = batch_size;
+    return shape;
+  };
+
+  if (op.type == kOpConv) {
+    RunConv(op, batch_size);
+    return;
+  } else if (op.type == kOpGemm) {
+    RunGemm(op, batch_size);
+    return;
+  }
+
+  const float* x = Data(op.inputs[0]);
+  float* y = MutableData(op.output);
+  std::vector<int64_t> y_shape = runtime_shape(op.output);
+  const int64_t total = Product(y_shape, 0, y_shape.size());
+
+  switch (op.type) {
+    case kOpBatchNorm: {
+      int64_t inner = total / (batch_size * op.cout);
+      for (int64_t i = 0; i < total; ++i) {
+        int c = (i / inner) % op.cout;
+        y[i] = x[i] * op.weights[c] + op.bias[c];
+      }
+      break;
+    }
+    case kOpRelu:
+      for (int64_t i = 0; i < total; ++i) y[i] = std::max(x[i], 0.0f);
+      break;
+    case kOpTanh:
+      for (int64_t i = 0; i < total; ++i) y[i] = std::tanh(x[i]);
+      break;
+    case kOpSigmoid:
+      for (int64_t i = 0; i < total; ++i)
+        y[i] = 1.0f / (1.0f + std::exp(-x[i]));
+      break;
+    case kOpAdd:
+    case kOpMul: {
+      const float* b = Data(op.inputs[1]);
+      if (op.type == kOpAdd)
+        BinaryOp(x, runtime_shape(op.inputs[0]), b, runtime_shape(op.inputs[1]),
+                 y, y_shape, [](float p, float q) { return p + q; });
+      else
+        BinaryOp(x, runtime_shape(op.inputs[0]), b, runtime_shape(op.inputs[1]),
+                 y, y_shape, [](float p, float q) { return p * q; });
+      break;
+    }
+    case kOpSoftmax: {
+      int64_t outer = Product(y_shape, 0, op.axis);
+      int64_t dim = op.coerce ? Product(y_shape, op.axis, y_shape.size())
+                              : y_shape[op.axis];
+      int64_t inner =
+          op.coerce ? 1 : Product(y_shape, op.axis + 1, y_shape.size());
+      for (int64_t o = 0; o < outer; ++o) {
+        for (int64_t j = 0; j < inner; ++j) {
+          const float* xo = x + o * dim * inner + j;
+          float* yo = y + o * dim * inner + j;
+          float max_x = xo[0];
+          for (int64_t d = 1; d < dim; ++d)
+            max_x = std::max(max_x, xo[d * inner]);
+          float sum = 0.0f;
+          for (int64_t d = 0; d < dim; ++d) {
+            yo[d * inner] = std::exp(xo[d * inner] - max_x);
+            sum += yo[d * inner];
+          }
+          for (int64_t d = 0; d < dim; ++d) yo[d * inner] /= sum;
+        }
+      }
+      break;
+    }
+    case kOpTranspose: {
+      std::vector<int64_t> x_shape = runtime_shape(op.inputs[0]);
+      int rank = x_shape.size();
+      std::vector<int64_t> x_strides(rank, 1);
+      for (int d = rank - 2; d >= 0; --d)
+        x_strides[d] = x_strides[d + 1] * x_shape[d + 1];
+      std::vector<int64_t> idx(rank, 0);
+      int64_t pos = 0;
+      for (int64_t i = 0; i < total; ++i) {
+        y[i] = x[pos];
+        for (int d = rank - 1; d >= 0; --d) {
+          int64_t stride = x_strides[op.perm[d]];
+          pos += stride;
+          if (++idx[d] < y_shape[d]) break;
+          pos -= stride * y_shape[d];
+          idx[d] = 0;
+        }
+      }
+      break;
+    }
+    case kOpConcat: {
+      int64_t outer = Product(y_shape, 0, op.axis);
+      int64_t y_chunk = Product(y_shape, op.axis, y_shape.size());
+      int64_t offset = 0;
+      for (auto id : op.inputs) {
+        const float* xi = Data(id);
+        const auto& x_shape = values_[id].shape;
+        int64_t chunk = Product(x_shape, op.axis, x_shape.size());
+        for (int64_t o = 0; o < outer; ++o)
+          std::copy_n(xi + o * chunk, chunk, y + o * y_chunk + offset);
+        offset += chunk;
+      }
+      break;
+    }
+    case kOpGlobalAveragePool: {
+      std::vector<int64_t> x_shape = runtime_shape(op.inputs[0]);
+      int64_t planes = x_shape[0] * x_shape[1];
+      int64_t hw = x_shape[2] * x_shape[3];
+      for (int64_t p = 0; p < planes; ++p) {
+        float sum = 0.0f;
+        for (int64_t j = 0; j < hw; ++j) sum += x[p * hw + j];
+        y[p] = sum / hw;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
@@ -0,0 +1,307 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPU_NETWORK_H_
+#define CPU_NETWORK_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "./cpu_gemm.h"
+#include "./infer_engine.h"
+#include "./onnx.h"
+
+/**
+ * @class CpuThreadPool
+ * Persistent worker threads for data-parallel loops of CpuEngine.
+ * The calling thread also processes tasks, so a pool with one thread has no
+ * worker and runs everything in place.
+ */
+class CpuThreadPool {
+ public:
+  explicit CpuThreadPool(int num_threads)
+      : running_(true), generation_(0), num_tasks_(0), num_pending_(0) {
+    for (int i = 1; i < num_threads; ++i)
+      workers_.emplace_back(&CpuThreadPool::WorkerLoop, this);
+  }
+
+  ~CpuThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(mx_);
+      running_ = false;
+    }
+    cv_.notify_all();
+    for (auto& th : workers_) th.join();
+  }
+
+  int num_threads() const { return workers_.size() + 1; }
+
+  /**
+   * Calls fn(0), ..., fn(num_tasks - 1) in parallel and waits for all of them.
+   */
+  void ParallelFor(int num_tasks, const std::function<void(int)>& fn) {
+    if (num_tasks <= 0) return;
+    if (workers_.empty() || num_tasks == 1) {
+      for (int i = 0; i < num_tasks; ++i) fn(i);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(mx_);
+      fn_ = &fn;
+      num_tasks_ = num_tasks;
+      next_task_.store(0);
+      num_pending_ = workers_.size();
+      ++generation_;
+    }
+    cv_.notify_all();
+
+    RunTasks(fn, num_tasks);
+
+    std::unique_lock<std::mutex> lk(mx_);
+    done_cv_.wait(lk, [this]() { return num_pending_ == 0; });
+    fn_ = nullptr;
+  }
+
+ private:
+  std::mutex mx_;
+  std::condition_variable cv_;
+  std::condition_variable done_cv_;
+  std::vector<std::thread> workers_;
+  bool running_;
+  uint64_t generation_;
+  const std::function<void(int)>* fn_ = nullptr;
+  int num_tasks_;
+  int num_pending_;
+  std::atomic<int> next_task_;
+
+  void RunTasks(const std::function<void(int)>& fn, int num_tasks) {
+    while (true) {
+      int i = next_task_.fetch_add(1);
+      if (i >= num_tasks) break;
+      fn(i);
+    }
+  }
+
+  void WorkerLoop() {
+    uint64_t generation = 0;
+    while (true) {
+      const std::function<void(int)>* fn;
+      int num_tasks;
+      {
+        std::unique_lock<std::mutex> lk(mx_);
+        cv_.wait(lk, [&]() { return !running_ || generation_ != generation; });
+        if (!running_) return;
+        generation = generation_;
+        fn = fn_;
+        num_tasks = num_tasks_;
+      }
+
+      RunTasks(*fn, num_tasks);
+
+      {
+        std::lock_guard<std::mutex> lk(mx_);
+        --num_pending_;
+      }
+      done_cv_.notify_one();
+    }
+  }
+};
+
+/**
+ * @class CpuEngine
+ * CpuEngine evaluates the ONNX model used by TensorEngine::BuildFromOnnx on
+ * CPU, so that AQ can run on hosts without GPU.
+ *
+ * The graph is compiled once in Init(): constant subgraphs such as Shape and
+ * Gather are folded, BatchNormalization, residual Add and Relu are fused into
+ * the preceding convolution, and activation buffers are shared between
+ * tensors whose lifetimes don't overlap. Convolutions are computed by im2col
+ * and a GEMM kernel with AVX2/FMA, parallelized over samples and output
+ * channels.
+ *
+ * With the 'cpu_precision' option, convolutions run in bf16 or int8. Weights
+ * of int8 layers are quantized per output channel, and activation scales are
+ * calibrated on positions sampled from SGF files in 'sgf_dir'. Layers whose
+ * inputs can be negative stay in fp32, since activations are unsigned.
+ */
+class CpuEngine : public InferEngine {
+ public:
+  explicit CpuEngine(int batch_size)
+      : InferEngine(batch_size),
+        input_id_(-1),
+        policy_id_(-1),
+        value_id_(-1),
+        inputs_(nullptr),
+        calibrating_(false) {}
+
+  void Init(std::string model_path = "", bool use_full_features = true,
+            bool value_from_black = false) override;
+
+  /**
+   * Returns the ONNX path of a model. The extension of model_path is
+   * replaced with '.onnx'.
+   */
+  static std::string OnnxPath(std::string model_path);
+
+  /**
+   * Sets the precision of convolutions, 'fp32', 'bf16' or 'int8'.
+   * Options["cpu_precision"] is used if it is empty. Call before Init().
+   */
+  void set_precision(std::string precision) { precision_ = precision; }
+
+  /**
+   * Returns features of num positions sampled from SGF files in
+   * Options["sgf_dir"], or from random games if no SGF file is found.
+   */
+  static std::vector<Feature> SampleFeatures(int num);
+
+ protected:
+  bool Forward(const float* inputs, int batch_size, float* policy,
+               float* value) override;
+
+ private:
+  enum OpType {
+    kOpConv,
+    kOpGemm,
+    kOpBatchNorm,
+    kOpRelu,
+    kOpTanh,
+    kOpSigmoid,
+    kOpAdd,
+    kOpMul,
+    kOpSoftmax,
+    kOpTranspose,
+    kOpConcat,
+    kOpGlobalAveragePool,
+  };
+
+  enum Precision {
+    kFp32,
+    kBf16,
+    kInt8,
+  };
+
+  /**
+   * Tensor in the compiled graph. Shapes are computed with max_batch_size_
+   * and the first dimension is replaced with the actual batch size in
+   * Forward().
+   */
+  struct Value {
+    std::vector<int64_t> shape;
+    bool is_const = false;
+    bool is_int = false;
+    std::vector<float> floats;
+    std::vector<int64_t> ints;
+    int alias = -1;  // Index of the value which owns the buffer.
+    int buffer = -1;
+
+    int64_t sample_size() const {
+      int64_t n = 1;
+      for (size_t i = 1; i < shape.size(); ++i) n *= shape[i];
+      return n;
+    }
+
+    int64_t size() const {
+      int64_t n = 1;
+      for (auto d : shape) n *= d;
+      return n;
+    }
+  };
+
+  struct Op {
+    OpType type;
+    std::vector<int> inputs;
+    int output = -1;
+
+    // Convolution and fully connected layers.
+    int cin = 0, cout = 0;
+    ConvShape conv;
+    std::vector<float> weights;  // Packed for conv, [cout][cin] for gemm.
+    std::vector<float> bias;
+    int residual = -1;
+    bool relu = false;
+
+    // Reduced precision convolution.
+    Precision precision = kFp32;
+    std::vector<uint16_t> weights_bf16;
+    std::vector<int8_t> weights_s8;
+    std::vector<float> scales;  // Weight scale times activation scale.
+    float inv_act_scale = 1.0f;
+
+    // Other operators.
+    int axis = 1;
+    bool coerce = false;  // Softmax before opset 13 flattens dims from axis.
+    std::vector<int> perm;
+  };
+
+  std::vector<Value> values_;
+  std::vector<Op> ops_;
+  std::vector<std::vector<float>> buffers_;
+  std::vector<float> col_buf_;
+  std::vector<uint16_t> col_bf16_;
+  std::vector<uint8_t> col_u8_;
+  std::unique_ptr<CpuThreadPool> pool_;
+  int input_id_;
+  int policy_id_;
+  int value_id_;
+  const float* inputs_;
+  std::string precision_;
+
+  // Ranges of the inputs of each operator observed in calibration.
+  bool calibrating_;
+  std::vector<std::pair<float, float>> input_ranges_;
+
+  bool Compile(const OnnxModel& model);
+  bool FoldConstant(const OnnxNode& node,
+                    std::unordered_map<std::string, int>* ids);
+  void AllocateBuffers(const std::vector<int>& outputs);
+  void Calibrate(const std::vector<Feature>& features);
+  void Quantize(Precision precision);
+
+  int Root(int id) const {
+    while (values_[id].alias >= 0) id = values_[id].alias;
+    return id;
+  }
+
+  const float* Data(int id) const {
+    const Value& v = values_[id];
+    if (v.is_const) return v.floats.data();
+    int root = Root(id);
+    if (root == input_id_) return inputs_;
+    return buffers_[values_[root].buffer].data();
+  }
+
+  float* MutableData(int id) {
+    return buffers_[values_[Root(id)].buffer].data();
+  }
+
+  void RunConv(const Op& op, int batch_size);
+  void RunGemm(const Op& op, int batch_size);
+  void RunOp(const Op& op, int batch_size);
+};
+
+#endif  // CPU_NETWORK_H_
@@ -0,0 +1,192 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./eval_cache.h"
+
+#include <cstdio>
+#include <fstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr size_t EvalStore::kHeaderSize;
+
+namespace {
+
+constexpr char kStoreMagic[8] = {'A', 'Q', 'E', 'V', 'A', 'L', 'S', 'T'};
+constexpr uint32_t kStoreVersion = 1;
+
+struct StoreHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_rvts;
+  uint32_t record_size;
+  uint32_t reserved;
+  uint64_t num_slots;
+  uint64_t num_entries;
+};
+
+static_assert(sizeof(StoreHeader) <= EvalStore::kHeaderSize,
+              "header of EvalStore is too large");
+
+}  // namespace
+
+bool EvalStore::Open(std::string path) {
+  Close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER file_size;
+  GetFileSizeEx(file, &file_size);
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void* addr = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)
+                       : nullptr;
+  if (addr == nullptr) {
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  file_handle_ = file;
+  map_handle_ = mapping;
+  size_ = file_size.QuadPart;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);  // The mapping remains valid.
+  if (addr == MAP_FAILED) return false;
+  size_ = st.st_size;
+#endif
+  data_ = static_cast<const uint8_t*>(addr);
+
+  const StoreHeader* header = reinterpret_cast<const StoreHeader*>(data_);
+  bool valid = size_ >= kHeaderSize &&
+               std::equal(kStoreMagic, kStoreMagic + 8, header->magic) &&
+               header->version == kStoreVersion &&
+               header->num_rvts == kNumRvts &&
+               header->record_size == sizeof(EvalStoreRecord) &&
+               header->num_slots > 0 &&
+               (header->num_slots & (header->num_slots - 1)) == 0 &&
+               size_ >= kHeaderSize +
+                            header->num_slots * sizeof(EvalStoreRecord);
+  if (!valid) {
+    std::cerr << "invalid eval store: " << path << std::endl;
+    Close();
+    return false;
+  }
+
+  num_slots_ = header->num_slots;
+  num_entries_ = header->num_entries;
+  return true;
+}
+
+void EvalStore::Close() {
+  if (data_ != nullptr) {
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(map_handle_);
+    CloseHandle(file_handle_);
+#else
+    munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+  }
+  data_ = nullptr;
+  size_ = num_slots_ = num_entries_ = 0;
+}
+
+bool EvalStoreBuilder::Add(const Board& b, const ValueAndProb& vp) {
+  if (b.game_ply() > max_ply_) return false;
+
+  int symmetry_idx;
+  EvalStoreRecord r;
+  r.key = b.canonical_key(&symmetry_idx);
+  if (r.key == 0) return false;
+  r.value = vp.value;
+  for (int j = 0; j < kNumRvts; ++j)
+    r.prob[j] = EncodeLogProb(vp.prob[rv2sym(j, symmetry_idx)]);
+
+  std::lock_guard<std::mutex> lk(mx_);
+  return records_.emplace(r.key, r).second;
+}
+
+void EvalStoreBuilder::Merge(const EvalStore& store) {
+  if (!store.is_open()) return;
+  std::lock_guard<std::mutex> lk(mx_);
+  for (size_t i = 0; i < store.num_slots_; ++i) {
+    const EvalStoreRecord& r = store.records()[i];
+    if (r.key != 0) records_.emplace(r.key, r);
+  }
+}
+
+bool EvalStoreBuilder::Write(std::string path) const {
+  std::lock_guard<std::mutex> lk(mx_);
+
+  // Keeps the load factor at most 0.5.
+  size_t num_slots = 1;
+  while (num_slots < 2 * records_.size()) num_slots *= 2;
+
+  std::vector<EvalStoreRecord> slots(num_slots);
+  for (auto& r : slots) std::memset(&r, 0, sizeof(r));
+  for (const auto& kv : records_) {
+    size_t idx = kv.first & (num_slots - 1);
+    while (slots[idx].key != 0) idx = (idx + 1) & (num_slots - 1);
+    slots[idx] = kv.second;
+  }
+
+  std::vector<char> header(EvalStore::kHeaderSize, 0);
+  StoreHeader h;
+  std::memset(&h, 0, sizeof(h));
+  std::copy(kStoreMagic, kStoreMagic + 8, h.magic);
+  h.version = kStoreVersion;
+  h.num_rvts = kNumRvts;
+  h.record_size = sizeof(EvalStoreRecord);
+  h.num_slots = num_slots;
+  h.num_entries = records_.size();
+  std::memcpy(header.data(), &h, sizeof(h));
+
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!ofs) return false;
+    ofs.write(header.data(), header.size());
+    ofs.write(reinterpret_cast<const char*>(slots.data()),
+              slots.size() * sizeof(EvalStoreRecord));
+    if (!ofs) return false;
+  }
+
+#ifdef _WIN32
+  std::remove(path.c_str());  // rename() fails if path exists.
+#endif
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
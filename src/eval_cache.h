@@ -21,15 +21,23 @@
 #define EVAL_CACHE_H_
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <condition_variable>
-#include <deque>
+#include <cstring>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "./node.h"
 
+// Generation of an evaluation whose inference failed, which is not cached.
+constexpr int kFailedGeneration = -1;
+
 /**
  * @struct ValueAndProb
  * Structure that holds value and policy.
@@ -37,15 +45,18 @@
 struct ValueAndProb {
   double value;
   std::array<float, kNumRvts> prob;  // Doesn't include kPass.
+  int generation;                    // Generation of the evaluating model.
 
   // Constructor
-  ValueAndProb() : value(0.0), prob{0.0} {}
+  ValueAndProb() : value(0.0), prob{0.0}, generation(0) {}
 
-  ValueAndProb(const ValueAndProb& rhs) : value(rhs.value), prob(rhs.prob) {}
+  ValueAndProb(const ValueAndProb& rhs)
+      : value(rhs.value), prob(rhs.prob), generation(rhs.generation) {}
 
   ValueAndProb& operator=(const ValueAndProb& rhs) {
     value = rhs.value;
     prob = rhs.prob;
+    generation = rhs.generation;
     return *this;
   }
 };
@@ -64,101 +75,536 @@ struct SyncedEntry {
   explicit SyncedEntry(const Feature& ft_) : ft(ft_) {}
 };
 
+// Steps per e of log-probabilities in 8 bits.
+constexpr float kLogProbStep = 16.0f;
+
+/**
+ * Quantizes a probability to round(-log(p) * kLogProbStep). 255 means 0.
+ */
+inline uint8_t EncodeLogProb(float p) {
+  float q = p > 0.0f ? -std::log(p) * kLogProbStep + 0.5f : 255.0f;
+  return static_cast<uint8_t>(std::min(q, 255.0f));
+}
+
+inline float DecodeLogProb(uint8_t q) {
+  static const std::array<float, 256> table = []() {
+    std::array<float, 256> t;
+    for (int i = 0; i < 255; ++i) t[i] = std::exp(-i / kLogProbStep);
+    t[255] = 0.0f;
+    return t;
+  }();
+  return table[q];
+}
+
+/**
+ * @struct EvalStoreRecord
+ * An evaluation in EvalStore files. The policy is stored in the canonical
+ * orientation of the board (see Board::canonical_key()).
+ */
+struct EvalStoreRecord {
+  Key key;  // 0 means an empty slot.
+  float value;
+  uint8_t prob[kNumRvts];  // EncodeLogProb()
+};
+
+/**
+ * @class EvalStore
+ * EvalStore class gives read-only access to a persistent table of
+ * evaluations, such as those of opening positions. The file is mapped into
+ * memory, so that engine processes on the same host share its pages.
+ *
+ * File layout: a 64-byte header followed by a power-of-two number of
+ * EvalStoreRecord slots with linear probing on the canonical key.
+ */
+class EvalStore {
+ public:
+  static constexpr size_t kHeaderSize = 64;
+
+  EvalStore() : data_(nullptr), size_(0), num_slots_(0), num_entries_(0) {}
+
+  EvalStore(const EvalStore&) = delete;
+  EvalStore& operator=(const EvalStore&) = delete;
+
+  ~EvalStore() { Close(); }
+
+  /**
+   * Maps the file. Returns false if it is not found or not a valid store.
+   */
+  bool Open(std::string path);
+
+  void Close();
+
+  bool is_open() const { return data_ != nullptr; }
+
+  size_t num_entries() const { return num_entries_; }
+
+  bool Probe(const Board& b, ValueAndProb* vp) const {
+    if (!is_open()) return false;
+    int symmetry_idx;
+    const EvalStoreRecord* r = Find(b.canonical_key(&symmetry_idx));
+    if (r == nullptr) return false;
+
+    vp->value = r->value;
+    for (int j = 0; j < kNumRvts; ++j)
+      vp->prob[rv2sym(j, symmetry_idx)] = DecodeLogProb(r->prob[j]);
+    return true;
+  }
+
+ private:
+  friend class EvalStoreBuilder;
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t num_slots_;
+  size_t num_entries_;
+#ifdef _WIN32
+  void* file_handle_ = nullptr;
+  void* map_handle_ = nullptr;
+#endif
+
+  const EvalStoreRecord* records() const {
+    return reinterpret_cast<const EvalStoreRecord*>(data_ + kHeaderSize);
+  }
+
+  const EvalStoreRecord* Find(Key key) const {
+    if (key == 0) return nullptr;
+    for (size_t i = 0, idx = key & (num_slots_ - 1); i < num_slots_;
+         ++i, idx = (idx + 1) & (num_slots_ - 1)) {
+      const EvalStoreRecord* r = &records()[idx];
+      if (r->key == key) return r;
+      if (r->key == 0) break;
+    }
+    return nullptr;
+  }
+};
+
+/**
+ * @class EvalStoreBuilder
+ * EvalStoreBuilder class collects evaluations of positions up to max_ply and
+ * writes them as an EvalStore file. Add() is thread-safe.
+ */
+class EvalStoreBuilder {
+ public:
+  explicit EvalStoreBuilder(int max_ply = kMaxPly) : max_ply_(max_ply) {}
+
+  bool Contains(const Board& b) const {
+    std::lock_guard<std::mutex> lk(mx_);
+    return records_.count(b.canonical_key()) > 0;
+  }
+
+  /**
+   * Adds the evaluation of b. Returns false if b is deeper than max_ply or
+   * already added.
+   */
+  bool Add(const Board& b, const ValueAndProb& vp);
+
+  /**
+   * Adds all entries of the store which are not added yet.
+   */
+  void Merge(const EvalStore& store);
+
+  /**
+   * Writes the store to a temporary file and renames it to path, so that
+   * processes mapping the old file are not affected.
+   */
+  bool Write(std::string path) const;
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lk(mx_);
+    return records_.size();
+  }
+
+  int max_ply() const { return max_ply_; }
+
+ private:
+  int max_ply_;
+  mutable std::mutex mx_;
+  std::unordered_map<Key, EvalStoreRecord> records_;
+};
+
 /**
  * @class EvalCache
- * EvalCache class exclusively manages caches of ValueAndProb.
+ * EvalCache class holds ValueAndProb of evaluated boards in a preallocated
+ * table shared by search threads without locks.
+ *
+ * The table consists of buckets of kBucketSize slots. Each slot is guarded by
+ * a version counter (seqlock): a writer makes it odd while copying the entry,
+ * and a reader discards the copy if the version has changed. A writer that
+ * fails to acquire a slot just gives up, since a cache may lose entries.
+ * Victims are selected by the clock algorithm in the bucket.
+ *
+ * Boards are stored under Board::canonical_key() with the policy rotated to
+ * the canonical orientation, so that one entry serves all 8 symmetric boards
+ * and a probe is a single lookup at any move number.
+ *
+ * Each entry is tagged with the model generation of ValueAndProb. Once an
+ * evaluation of a newer model is inserted, entries of older models are no
+ * longer served, nor is the persistent store, which is built with the first
+ * model.
+ *
+ * Policies are stored in one of the following formats, which trade accuracy
+ * for the number of entries in the same memory.
+ *   fp32: 1444 bytes, exact.
+ *   fp16: 722 bytes, relative error < 0.05%.
+ *   u8:   361 bytes, log-probabilities in steps of 1/16 (error < 3.2%).
+ *   topk: 4 * top_k bytes, the top_k moves in fp16, and the rest of the
+ *         probability is distributed uniformly to the other moves.
  *
  * @code
  *  ValueAndProb vp;
  *  bool found = eval_cache.Probe(b, &vp);
  *  if(!found) {
  *    engine.Infer(b.get_feature(), &vp);
- *    eval_cache.Insert(b.key(), vp);
+ *    eval_cache.Insert(b, vp);
  *  }
  * @endcode
  */
 class EvalCache {
  public:
+  static constexpr int kBucketSize = 4;
+
   // Constructor
-  explicit EvalCache(int size = 10000) { max_size_ = size; }
+  explicit EvalCache(size_t size_mb = 16)
+      : format_(kFormatFp32),
+        top_k_(0),
+        store_(nullptr),
+        recorder_(nullptr),
+        generation_(0) {
+    Resize(size_mb);
+  }
 
-  void Resize(int size) {
-    max_size_ = size;
-    while (order_.size() > max_size_) {
-      vp_map_.erase(order_.front());
-      order_.pop_front();
-    }
+  /**
+   * Sets a persistent store which is looked up when the cache misses.
+   */
+  void set_store(const EvalStore* store) { store_ = store; }
+
+  /**
+   * Sets a builder to which evaluations inserted with boards are added.
+   */
+  void set_recorder(EvalStoreBuilder* recorder) { recorder_ = recorder; }
+
+  /**
+   * Reallocates the table with size_mb megabytes and the policy format,
+   * 'fp32', 'fp16', 'u8' or 'topk'. All entries are cleared.
+   * Must not be called during search.
+   */
+  void Resize(size_t size_mb, std::string format = "fp32", int top_k = 32) {
+    format_ = format == "fp16"
+                  ? kFormatFp16
+                  : format == "u8" ? kFormatLogU8
+                                   : format == "topk" ? kFormatTopK
+                                                      : kFormatFp32;
+    top_k_ = std::max(1, std::min(top_k, kNumRvts - 1));
+
+    const size_t n = kNumRvts;
+    size_t payload_size = format_ == kFormatFp32
+                              ? n * sizeof(float)
+                              : format_ == kFormatFp16
+                                    ? n * sizeof(uint16_t)
+                                    : format_ == kFormatLogU8
+                                          ? n
+                                          : top_k_ * 2 * sizeof(uint16_t);
+    // Keeps slots 8-byte aligned.
+    stride_ = (sizeof(SlotHeader) + payload_size + 7) / 8 * 8;
+    num_buckets_ =
+        std::max<size_t>(1, (size_mb << 20) / (stride_ * kBucketSize));
+
+    storage_.reset(new uint64_t[num_slots() * stride_ / 8]);
+    hands_.reset(new std::atomic<uint8_t>[num_buckets_]);
+    for (size_t i = 0; i < num_slots(); ++i) new (Slot(i)) SlotHeader();
+    Init();
   }
 
   void Init() {
-    vp_map_.clear();
-    order_.clear();
+    for (size_t i = 0; i < num_slots(); ++i) {
+      SlotHeader* slot = Slot(i);
+      slot->version.store(0, std::memory_order_relaxed);
+      slot->referenced.store(false, std::memory_order_relaxed);
+      slot->key.store(kEmptyKey, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < num_buckets_; ++i)
+      hands_[i].store(0, std::memory_order_relaxed);
+    for (auto& c : counters_) {
+      c.num_probes.store(0, std::memory_order_relaxed);
+      c.num_hits.store(0, std::memory_order_relaxed);
+    }
   }
 
-  bool Probe(const Board& b, ValueAndProb* vp, bool check_sym = true) {
-    Key key = b.key();
-    bool found = false;
+  /**
+   * Looks up the entry of b, which is shared by the 8 symmetric boards of b.
+   */
+  bool Probe(const Board& b, ValueAndProb* vp) {
+    int symmetry_idx;
+    Key key = b.canonical_key(&symmetry_idx);
+    if (Find(key, symmetry_idx, vp)) {
+      Count(key, true);
+      return true;
+    }
 
-    std::lock_guard<std::mutex> lk(mx_);
+    bool found =
+        store_ != nullptr && generation() == 0 && store_->Probe(b, vp);
+    if (found) {
+      vp->generation = 0;
+      Insert(key, symmetry_idx, *vp);
+    }
+    Count(key, found);
+    return found;
+  }
 
-    if (check_sym && b.game_ply() < kNumRvts / 12) {
-      for (int i = 0; i < 8; ++i) {
-        Key sym_hash = b.key(i);
-        auto itr = vp_map_.find(sym_hash);
-        found = (itr != vp_map_.end());
-        if (found) {
-          if (i == 0) {
-            *vp = *itr->second;
-          } else {
-            vp->value = itr->second->value;
-            for (int j = 0; j < kNumRvts; ++j)
-              vp->prob[rv2sym(j, i)] = itr->second->prob[j];
-
-            AddCache(key, *vp);
-          }
-          return true;
-        }
+  bool Probe(Key key, ValueAndProb* vp) {
+    bool found = Find(key, 0, vp);
+    Count(key, found);
+    return found;
+  }
+
+  /**
+   * Inserts the evaluation of b in the canonical orientation.
+   */
+  void Insert(const Board& b, const ValueAndProb& vp) {
+    if (vp.generation == kFailedGeneration) return;
+    int symmetry_idx;
+    Key key = b.canonical_key(&symmetry_idx);
+    Insert(key, symmetry_idx, vp);
+    if (recorder_ != nullptr) recorder_->Add(b, vp);
+  }
+
+  void Insert(Key key, const ValueAndProb& vp) { Insert(key, 0, vp); }
+
+  /**
+   * Returns the newest model generation of inserted evaluations.
+   */
+  int generation() const {
+    return generation_.load(std::memory_order_relaxed);
+  }
+
+  size_t size_bytes() const { return num_slots() * stride_; }
+
+  size_t num_slots() const { return num_buckets_ * kBucketSize; }
+
+  size_t slot_bytes() const { return stride_; }
+
+  uint64_t num_probes() const {
+    uint64_t n = 0;
+    for (auto& c : counters_)
+      n += c.num_probes.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  uint64_t num_hits() const {
+    uint64_t n = 0;
+    for (auto& c : counters_)
+      n += c.num_hits.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  double hit_rate() const {
+    uint64_t probes = num_probes();
+    return probes == 0 ? 0.0 : static_cast<double>(num_hits()) / probes;
+  }
+
+ private:
+  enum Format {
+    kFormatFp32,
+    kFormatFp16,
+    kFormatLogU8,
+    kFormatTopK,
+  };
+
+  static constexpr Key kEmptyKey = 0;
+  static constexpr int kNumCounters = 16;
+
+  // Policy of the format follows the header.
+  struct SlotHeader {
+    std::atomic<uint32_t> version;  // Odd while the entry is being written.
+    std::atomic<bool> referenced;
+    std::atomic<Key> key;
+    float value;
+    int generation;
+  };
+
+  // Counters are striped by key to avoid contention on a single cache line,
+  // and padded to keep stripes on separate lines.
+  struct Counter {
+    std::atomic<uint64_t> num_probes{0};
+    std::atomic<uint64_t> num_hits{0};
+    char padding[64];
+  };
+
+  Format format_;
+  int top_k_;
+  size_t stride_;
+  size_t num_buckets_;
+  std::unique_ptr<uint64_t[]> storage_;
+  std::unique_ptr<std::atomic<uint8_t>[]> hands_;
+  std::array<Counter, kNumCounters> counters_;
+  const EvalStore* store_;
+  EvalStoreBuilder* recorder_;
+  std::atomic<int> generation_;
+
+  SlotHeader* Slot(size_t i) const {
+    return reinterpret_cast<SlotHeader*>(
+        reinterpret_cast<uint8_t*>(storage_.get()) + i * stride_);
+  }
+
+  // Maps the upper 32 bits of key to [0, num_buckets_) without division.
+  size_t BucketIndex(Key key) const {
+    return ((key >> 32) * num_buckets_) >> 32;
+  }
+
+  /**
+   * Stores vp of the board whose canonical_key() is key. The policy is
+   * converted to the canonical orientation with symmetry_idx.
+   */
+  void Insert(Key key, int symmetry_idx, const ValueAndProb& vp) {
+    if (key == kEmptyKey || vp.generation == kFailedGeneration) return;
+
+    // Advances the generation, or drops the evaluation of an old model.
+    int generation = generation_.load(std::memory_order_relaxed);
+    while (vp.generation > generation &&
+           !generation_.compare_exchange_weak(generation, vp.generation,
+                                              std::memory_order_relaxed)) {
+    }
+    if (vp.generation < generation) return;
+
+    size_t bucket = BucketIndex(key) * kBucketSize;
+    int idx = -1;
+    for (int i = 0; i < kBucketSize; ++i) {
+      if (Slot(bucket + i)->key.load(std::memory_order_relaxed) == key) {
+        if (Slot(bucket + i)->generation == vp.generation) return;
+        idx = i;  // Overwrites the entry of an old model.
       }
+    }
 
-      return false;
-    } else {
-      auto itr = vp_map_.find(key);
-      if (itr == vp_map_.end()) return false;
-      *vp = *itr->second;
+    if (idx < 0) {
+      // Clock: clears reference bits until finding an unreferenced slot.
+      std::atomic<uint8_t>& hand = hands_[BucketIndex(key)];
+      idx = hand.load(std::memory_order_relaxed) % kBucketSize;
+      for (int i = 0; i < kBucketSize; ++i) {
+        if (!Slot(bucket + idx)->referenced.exchange(
+                false, std::memory_order_relaxed))
+          break;
+        idx = (idx + 1) % kBucketSize;
+      }
+      hand.store((idx + 1) % kBucketSize, std::memory_order_relaxed);
     }
 
-    return true;
+    SlotHeader* slot = Slot(bucket + idx);
+    uint32_t version = slot->version.load(std::memory_order_relaxed);
+    if ((version & 1) ||
+        !slot->version.compare_exchange_strong(version, version + 1,
+                                               std::memory_order_acquire))
+      return;  // Another thread is writing this slot.
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->key.store(key, std::memory_order_relaxed);
+    slot->value = vp.value;
+    slot->generation = vp.generation;
+    Encode(vp, symmetry_idx, reinterpret_cast<uint8_t*>(slot + 1));
+    slot->version.store(version + 2, std::memory_order_release);
   }
 
-  bool Probe(Key key, ValueAndProb* vp) {
-    std::lock_guard<std::mutex> lk(mx_);
-    auto itr = vp_map_.find(key);
-    if (itr == vp_map_.end()) return false;
-    *vp = *itr->second;
-    return true;
+  /**
+   * Copies the entry of key to vp, converting the policy from the canonical
+   * orientation with symmetry_idx.
+   */
+  bool Find(Key key, int symmetry_idx, ValueAndProb* vp) const {
+    if (key == kEmptyKey) return false;
+    int generation = generation_.load(std::memory_order_relaxed);
+    size_t bucket = BucketIndex(key) * kBucketSize;
+    for (int i = 0; i < kBucketSize; ++i) {
+      SlotHeader* slot = Slot(bucket + i);
+      uint32_t version = slot->version.load(std::memory_order_acquire);
+      if ((version & 1) || slot->key.load(std::memory_order_relaxed) != key ||
+          slot->generation != generation)
+        continue;
+
+      vp->value = slot->value;
+      vp->generation = generation;
+      Decode(reinterpret_cast<const uint8_t*>(slot + 1), symmetry_idx, vp);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->version.load(std::memory_order_relaxed) != version) continue;
+
+      slot->referenced.store(true, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
   }
 
-  void Insert(Key key, const ValueAndProb& vp) {
-    std::lock_guard<std::mutex> lk(mx_);
-    if (vp_map_.find(key) == vp_map_.end()) AddCache(key, vp);
+  // The j-th stored probability is that of rv2sym(j, symmetry_idx) in vp.
+  void Encode(const ValueAndProb& vp, int symmetry_idx,
+              uint8_t* payload) const {
+    const int* sym = kCoordTable.rv2sym_table[symmetry_idx];
+    switch (format_) {
+      case kFormatFp32: {
+        float* f = reinterpret_cast<float*>(payload);
+        for (int i = 0; i < kNumRvts; ++i) f[i] = vp.prob[sym[i]];
+        break;
+      }
+      case kFormatFp16: {
+        uint16_t h[kNumRvts];
+        for (int i = 0; i < kNumRvts; ++i) h[i] = FloatToHalf(vp.prob[sym[i]]);
+        std::memcpy(payload, h, sizeof(h));
+        break;
+      }
+      case kFormatLogU8:
+        for (int i = 0; i < kNumRvts; ++i)
+          payload[i] = EncodeLogProb(vp.prob[sym[i]]);
+        break;
+      case kFormatTopK: {
+        std::array<int, kNumRvts> order;
+        for (int i = 0; i < kNumRvts; ++i) order[i] = i;
+        std::partial_sort(
+            order.begin(), order.begin() + top_k_, order.end(),
+            [&](int i, int j) { return vp.prob[sym[i]] > vp.prob[sym[j]]; });
+        uint16_t h[2 * kNumRvts];
+        for (int i = 0; i < top_k_; ++i) {
+          h[2 * i] = order[i];
+          h[2 * i + 1] = FloatToHalf(vp.prob[sym[order[i]]]);
+        }
+        std::memcpy(payload, h, top_k_ * 2 * sizeof(uint16_t));
+        break;
+      }
+    }
   }
 
- private:
-  std::mutex mx_;
-  size_t max_size_;
-  std::unordered_map<Key, std::unique_ptr<const ValueAndProb>> vp_map_;
-  std::deque<Key> order_;
-
-  void AddCache(Key key, const ValueAndProb& vp) {
-    vp_map_.emplace(key,
-                    std::unique_ptr<const ValueAndProb>(new ValueAndProb(vp)));
-    order_.push_back(key);
-
-    if (order_.size() > max_size_) {
-      vp_map_.erase(order_.front());
-      order_.pop_front();
+  void Decode(const uint8_t* payload, int symmetry_idx,
+              ValueAndProb* vp) const {
+    const int* sym = kCoordTable.rv2sym_table[symmetry_idx];
+    switch (format_) {
+      case kFormatFp32: {
+        const float* f = reinterpret_cast<const float*>(payload);
+        for (int i = 0; i < kNumRvts; ++i) vp->prob[sym[i]] = f[i];
+        break;
+      }
+      case kFormatFp16: {
+        uint16_t h[kNumRvts];
+        std::memcpy(h, payload, sizeof(h));
+        for (int i = 0; i < kNumRvts; ++i)
+          vp->prob[sym[i]] = HalfToFloat(h[i]);
+        break;
+      }
+      case kFormatLogU8:
+        for (int i = 0; i < kNumRvts; ++i)
+          vp->prob[sym[i]] = DecodeLogProb(payload[i]);
+        break;
+      case kFormatTopK: {
+        uint16_t h[2 * kNumRvts];
+        std::memcpy(h, payload, top_k_ * 2 * sizeof(uint16_t));
+        float sum = 0.0f;
+        for (int i = 0; i < top_k_; ++i) sum += HalfToFloat(h[2 * i + 1]);
+        vp->prob.fill(std::max(0.0f, 1.0f - sum) / (kNumRvts - top_k_));
+        for (int i = 0; i < top_k_; ++i)
+          vp->prob[sym[h[2 * i] % kNumRvts]] = HalfToFloat(h[2 * i + 1]);
+        break;
+      }
     }
   }
+
+  void Count(Key key, bool hit) {
+    Counter& c = counters_[(key >> 59) % kNumCounters];
+    c.num_probes.fetch_add(1, std::memory_order_relaxed);
+    if (hit) c.num_hits.fetch_add(1, std::memory_order_relaxed);
+  }
 };
 
 #endif  // EVAL_CACHE_H_
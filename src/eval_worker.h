@@ -20,21 +20,74 @@
 #ifndef EVAL_WORKER_H_
 #define EVAL_WORKER_H_
 
-#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-#include "./network.h"
+#include "./infer_engine.h"
 #include "./option.h"
+#include "./request_ring.h"
+#include "./search_stats.h"
+#include "./stats.h"
+#include "./trace.h"
+
+/**
+ * @enum EvalPriority
+ * Priority class of an evaluation request.
+ */
+enum EvalPriority {
+  kHighPriority,    // Latency-critical, e.g. the root node.
+  kNormalPriority,  // Leaf nodes of the search.
+  kNumPriorities,
+};
 
 /**
  * @class EvalWorker
  * The EvalWorker class waits for features to be evaluated, and when the queue
  * piles up, it performs inference asynchronously on the GPU for each batch
  * size.
+ * When the CPU backend is used, a single worker evaluates all batches since
+ * the engine itself runs on multiple threads.
+ *
+ * Requests are passed through a RequestRing of preallocated slots, so a
+ * search thread writes its feature in place and sleeps on the slot until the
+ * result is written, without allocations or locks.
+ *
+ * A partial batch is dispatched by a deadline scheduler. Each request should
+ * be answered within batch_latency_ms, which includes the inference time of
+ * the backend. A worker waits for more requests while the batch is smaller
+ * than batch_min_fill * batch_size, and otherwise dispatches it as soon as
+ * the next request, expected from the average arrival interval, would come
+ * after the deadline. A full batch is dispatched immediately, and the oldest
+ * request never waits beyond the deadline.
+ *
+ * Low latency (e.g. for play with few threads) and high throughput (e.g. for
+ * analysis) are thus selected by the two options.
+ *
+ * Requests of high priority, such as the root node at the start of a search,
+ * have their own ring and are dispatched first without waiting for a full
+ * batch. A normal batch is still dispatched after kMaxPreemptions high
+ * batches in a row, so it never starves.
+ *
+ * Identical boards requested at the same time, e.g. by transpositions, are
+ * evaluated once. Later requesters of a pending board follow the first one
+ * and receive a copy of its result.
+ *
+ * With eval_symmetries > 1, each request is written in that many symmetries
+ * to consecutive rows, which are evaluated in the same batch and averaged.
+ *
+ * ReplaceModel() loads a new model in the background while the current one
+ * keeps evaluating. Each worker switches to its new engine between batches
+ * and destroys the old one, and results are tagged with the generation of
+ * the model so that EvalCache stops serving old evaluations. A batch whose
+ * inference fails is answered with a neutral evaluation, which is not cached.
  *
  * This class is implemented with reference to OpenCLScheduler of LeelaZero.
  * https://github.com/leela-zero/leela-zero/blob/next/src/OpenCLScheduler.cpp
@@ -43,22 +96,30 @@
 class EvalWorker {
  public:
   ~EvalWorker() {
-    {
-      std::unique_lock<std::mutex> lk(mx_);
-      running_ = false;
-    }
-    cv_.notify_all();
+    if (loader_.joinable()) loader_.join();
+    running_ = false;
+    rings_[kNormalPriority].WakeConsumers();
     if (workers_.size() > 0)
       for (auto& th : workers_) th.join();
   }
 
-  EvalWorker() {
+  /**
+   * Creates rings for num_producers search threads, e.g. those of all trees
+   * sharing this worker, or for num_threads if it is 0.
+   */
+  explicit EvalWorker(int num_producers = 0)
+      : rings_{{RingCapacity(num_producers), RowSize()},
+               {RingCapacity(num_producers), RowSize()}},
+        batch_size_hist_(Histogram::Linear(Options["batch_size"].get_int())),
+        queue_wait_hist_(Histogram::Exponential(1000000)) {
     running_ = true;
-    wait_time_millisec_ = 10;
-    in_single_eval_.store(false);
+    num_deduplicated_ = 0;
+    generation_ = 0;
     batch_size_ = Options["batch_size"].get_int();
     use_full_features_ = Options["use_full_features"].get_bool();
     value_from_black_ = Options["value_from_black"].get_bool();
+    num_symmetries_ = Options["eval_symmetries"].get_int();
+    InitScheduler();
   }
 
   void Init(std::vector<int> gpu_ids, std::string model_path = "") {
@@ -67,130 +128,420 @@ class EvalWorker {
       int num_gpus = Options["num_gpus"].get_int();
       for (int i = 0; i < num_gpus; ++i) gpu_ids.push_back(i);
     }
+    if (UseCpuEngine()) {
+      num_threads = 1;
+      gpu_ids = {0};
+    }
 
     for (auto gpu_id : gpu_ids) {
       for (int i = 0; i < num_threads; ++i) {
-        auto th =
-            std::thread(&EvalWorker::BatchWorker, this, gpu_id, model_path);
+        slots_.emplace_back(new EngineSlot(gpu_id));
+        auto th = std::thread(&EvalWorker::BatchWorker, this,
+                              slots_.back().get(), model_path);
         workers_.push_back(std::move(th));
         std::this_thread::sleep_for(std::chrono::milliseconds(50));  // 50 msec
       }
     }
   }
 
-  void ReplaceModel(std::vector<int> gpu_ids, std::string model_path = "") {
-    running_ = false;
-    cv_.notify_all();
-    for (auto& th : workers_) th.join();
-    workers_.clear();
-
-    running_ = true;
-    wait_time_millisec_ = 10;
-    in_single_eval_.store(false);
+  /**
+   * Loads the model of model_path in the background for the same backends.
+   * Search continues with the current model until the new one is ready.
+   * A request while loading waits for the previous one.
+   */
+  void ReplaceModel(std::string model_path = "") {
+    if (loader_.joinable()) loader_.join();
+    loader_ = std::thread(&EvalWorker::LoadModel, this, model_path);
+  }
 
-    int num_threads = 2;
-    for (auto gpu_id : gpu_ids) {
-      for (int i = 0; i < num_threads; ++i) {
-        auto th =
-            std::thread(&EvalWorker::BatchWorker, this, gpu_id, model_path);
-        workers_.push_back(std::move(th));
-      }
+  /**
+   * Returns the generation of the latest loaded model, starting from 0.
+   */
+  int generation() const { return generation_.load(); }
+
+  /**
+   * Evaluates b, writing its input planes directly to the staging buffer.
+   * If the same board is already being evaluated, waits for its result
+   * instead. A request of high priority does not follow one of normal
+   * priority, which may wait for a batch, and is evaluated by itself.
+   */
+  void Evaluate(const Board& b, ValueAndProb* vp,
+                EvalPriority priority = kNormalPriority) {
+    Key key = b.key();
+    InFlightStripe& stripe = in_flight_[(key >> 8) % kNumStripes];
+    InFlightEval self;
+    self.priority = priority;
+    InFlightEval* leader;
+    {
+      std::lock_guard<std::mutex> lock(stripe.mx);
+      leader = stripe.evals.emplace(key, &self).first->second;
+      if (leader != &self && leader->priority != priority &&
+          priority == kHighPriority)
+        leader = nullptr;
+      else if (leader != &self)
+        leader->num_followers.fetch_add(1, std::memory_order_relaxed);
     }
-  }
 
-  void Evaluate(const Feature& ft, ValueAndProb* vp) {
-    auto entry = std::make_shared<SyncedEntry>(ft);
+    if (leader != &self && leader != nullptr) {
+      while (leader->done.load(std::memory_order_acquire) == 0)
+        FutexWait(&leader->done, 0);
+      *vp = leader->vp;
+      leader->num_followers.fetch_sub(1, std::memory_order_release);
+      num_deduplicated_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
 
-    std::unique_lock<std::mutex> lk(entry->mx);
+    EvalRequest* r = rings_[priority].Acquire();
+    r->symmetry_idx = RandSymmetry();
+    r->next_side = b.side_to_move();
+    b.WriteFeature(r->inputs, use_full_features_, r->symmetry_idx,
+                   num_symmetries_);
+    Submit(r, priority, vp);
+    if (leader == nullptr) return;  // Not registered.
 
     {
-      std::lock_guard<std::mutex> lk(mx_);
-      synced_queue_.push_back(entry);
-
-      if (in_single_eval_.load() && wait_time_millisec_ < 15)
-        wait_time_millisec_ += 2;
+      std::lock_guard<std::mutex> lock(stripe.mx);
+      stripe.evals.erase(key);
     }
+    // No one can follow after erasing, so the result is copied only when
+    // there are followers, which must read it before self is destroyed.
+    if (self.num_followers.load(std::memory_order_acquire) > 0) {
+      self.vp = *vp;
+      self.done.store(1, std::memory_order_release);
+      FutexWakeAll(&self.done);
+      while (self.num_followers.load(std::memory_order_acquire) > 0)
+        std::this_thread::yield();
+    }
+  }
 
-    cv_.notify_one();
-    entry->cv.wait(lk);
-
-    *vp = entry->vp;
+  /**
+   * Evaluates ft with symmetry_idx, or a random symmetry if it is
+   * kNumSymmetry.
+   */
+  void Evaluate(const Feature& ft, ValueAndProb* vp,
+                EvalPriority priority = kNormalPriority,
+                int symmetry_idx = kNumSymmetry) {
+    EvalRequest* r = rings_[priority].Acquire();
+    r->symmetry_idx =
+        symmetry_idx == kNumSymmetry ? RandSymmetry() : symmetry_idx;
+    r->next_side = ft.next_side();
+    float* inputs = r->inputs;
+    for (int i = 0; i < num_symmetries_; ++i)
+      inputs = ft.Copy(inputs, use_full_features_,
+                       (r->symmetry_idx + i) % kNumSymmetry);
+    Submit(r, priority, vp);
   }
 
   std::mutex* get_mutex() { return &mx_; }
 
+  /**
+   * Returns the expected requests per second.
+   */
+  double arrival_rate() const {
+    return 1.0 / std::max(arrival_interval_.load(), 1e-6);
+  }
+
+  /**
+   * Returns the number of requests answered by a pending evaluation of the
+   * same board.
+   */
+  uint64_t num_deduplicated() const {
+    return num_deduplicated_.load(std::memory_order_relaxed);
+  }
+
+  const Histogram& batch_size_histogram() const { return batch_size_hist_; }
+
+  // Wait of each request in the queue in microseconds.
+  const Histogram& queue_wait_histogram() const { return queue_wait_hist_; }
+
  private:
+  // Weight of the latest sample in moving averages.
+  static constexpr double kArrivalDecay = 1.0 / 16;
+  static constexpr double kInferDecay = 1.0 / 8;
+  static constexpr double kMaxInterval = 0.1;  // 100 msec
+  static constexpr int kNumStripes = 64;
+  static constexpr int kMaxPreemptions = 4;
+
+  /**
+   * Result of a pending evaluation shared with its followers.
+   */
+  struct InFlightEval {
+    std::atomic<uint32_t> done;
+    std::atomic<int> num_followers;
+    EvalPriority priority;
+    ValueAndProb vp;
+
+    InFlightEval() : done(0), num_followers(0), priority(kNormalPriority) {}
+  };
+
+  // Padded to keep stripes on separate cache lines.
+  struct InFlightStripe {
+    std::mutex mx;
+    std::unordered_map<Key, InFlightEval*> evals;
+    char padding[64];
+  };
+
+  /**
+   * Engine of the next model handed to a worker.
+   */
+  struct EngineSlot {
+    int gpu_id;
+    std::mutex mx;
+    std::unique_ptr<InferEngine> next;
+    int generation;
+
+    explicit EngineSlot(int id) : gpu_id(id), generation(0) {}
+  };
+
   std::atomic<bool> running_;
   std::mutex mx_;
-  std::condition_variable cv_;
   bool use_full_features_;
   bool value_from_black_;
-  int wait_time_millisec_;
-  std::atomic<bool> in_single_eval_;
   int batch_size_;
-  std::deque<std::shared_ptr<SyncedEntry>> synced_queue_;
+  int num_symmetries_;
+  // Workers sleep on the arrivals of the normal ring, which is also bumped
+  // by high priority requests.
+  RequestRing rings_[kNumPriorities];
   std::vector<std::thread> workers_;
+  std::vector<std::unique_ptr<EngineSlot>> slots_;
+  std::thread loader_;
+  std::atomic<int> generation_;
+
+  // Scheduler parameters and states.
+  int64_t target_latency_;  // nsec
+  int min_batch_size_;
+  std::atomic<double> arrival_interval_;  // sec
+  std::atomic<int64_t> last_arrival_;     // nsec
+
+  // Pending evaluations by board key, striped to reduce contention.
+  InFlightStripe in_flight_[kNumStripes];
+  std::atomic<uint64_t> num_deduplicated_;
+
+  Histogram batch_size_hist_;
+  Histogram queue_wait_hist_;
+
+  /**
+   * Returns the number of request slots, which is enough for num_producers
+   * search threads to wait for evaluations at the same time.
+   */
+  static size_t RingCapacity(int num_producers) {
+    if (num_producers <= 0) num_producers = Options["num_threads"].get_int();
+    return 2 * std::max(num_producers, 2 * Options["batch_size"].get_int());
+  }
 
-  std::vector<std::shared_ptr<SyncedEntry>> PickupEntry() {
-    std::vector<std::shared_ptr<SyncedEntry>> entry_queue;
-    int num_entries = 0;
+  /**
+   * Returns the number of floats of input planes of a request.
+   */
+  static size_t RowSize() {
+    int num_features =
+        Options["use_full_features"].get_bool() ? kInputFeatures : 18;
+    return int{kNumRvts} * num_features *
+           Options["eval_symmetries"].get_int();
+  }
 
-    std::unique_lock<std::mutex> lk(mx_);
-    while (true) {
-      if (!running_) return std::move(entry_queue);
+  void Submit(EvalRequest* r, EvalPriority priority, ValueAndProb* vp) {
+    RequestRing& ring = rings_[priority];
+    if (priority == kNormalPriority) {
+      UpdateArrivalRate();
+      ring.Publish(r);
+    } else {
+      ring.Publish(r);
+      rings_[kNormalPriority].WakeConsumers();
+    }
+
+    ring.WaitDone(r);
+    *vp = r->vp;
+    ring.Release(r);
+  }
 
-      num_entries = synced_queue_.size();
-      if (num_entries >= batch_size_) {
-        num_entries = batch_size_;
-        break;
+  void InitScheduler() {
+    target_latency_ = Options["batch_latency_ms"].get_double() * 1e6;
+    double min_fill = Options["batch_min_fill"].get_double();
+    min_batch_size_ = std::max(
+        1, std::min(batch_size_,
+                    static_cast<int>(std::ceil(min_fill * batch_size_))));
+    arrival_interval_ = kMaxInterval;
+    last_arrival_ = RequestRing::NowNanoseconds();
+  }
+
+  /**
+   * Updates the moving average of arrival intervals. An idle period is
+   * capped so that the estimate recovers quickly. Races between threads
+   * only lose samples.
+   */
+  void UpdateArrivalRate() {
+    int64_t now = RequestRing::NowNanoseconds();
+    int64_t prev = last_arrival_.exchange(now, std::memory_order_relaxed);
+    double interval = (now - prev) * 1e-9;
+    if (interval > kMaxInterval) interval = kMaxInterval;
+    double avg = arrival_interval_.load(std::memory_order_relaxed);
+    arrival_interval_.store(avg + kArrivalDecay * (interval - avg),
+                            std::memory_order_relaxed);
+  }
+
+  /**
+   * Waits until a batch should be dispatched by the scheduler and takes it.
+   * infer_time is the average inference time of the backend in seconds, and
+   * num_preemptions counts high priority batches dispatched in a row while
+   * normal requests were waiting.
+   * Returns the ring of the batch, or nullptr if the worker is stopped.
+   */
+  RequestRing* PickupEntry(double infer_time, int* num_preemptions,
+                           std::vector<EvalRequest*>* batch) {
+    RequestRing& high = rings_[kHighPriority];
+    RequestRing& normal = rings_[kNormalPriority];
+    batch->clear();
+
+    while (running_) {
+      uint32_t arrivals = normal.arrivals();
+      int num_high = high.CountReady(batch_size_);
+      int num_entries = normal.CountReady(batch_size_);
+      if (num_high == 0 && num_entries == 0) {
+        normal.WaitArrival(arrivals);
+        continue;
       }
 
-      bool timeout = !cv_.wait_for(
-          lk, std::chrono::milliseconds(wait_time_millisec_), [this]() {
-            return !running_ ||
-                   static_cast<int>(synced_queue_.size()) >= batch_size_;
-          });
-
-      if (!synced_queue_.empty()) {
-        if (timeout && in_single_eval_.exchange(true) == false) {
-          if (wait_time_millisec_ > 1) {
-            wait_time_millisec_--;
-          }
-          num_entries = 1;
-          break;
-        }
+      // Normal requests are taken once after kMaxPreemptions high batches.
+      bool starving = num_entries > 0 && *num_preemptions >= kMaxPreemptions;
+      if (num_high > 0 && !starving) {
+        if (!high.Pop(num_high, batch)) continue;
+        if (num_entries > 0) ++*num_preemptions;
+        RecordBatch(*batch);
+        return &high;
       }
+
+      int64_t now = RequestRing::NowNanoseconds();
+      // Time left for queueing the oldest request.
+      int64_t deadline =
+          normal.head_enqueue_ns() +
+          std::max<int64_t>(0, target_latency_ - infer_time * 1e9);
+      bool dispatch = starving || now >= deadline || num_entries >= batch_size_;
+      int64_t next_arrival = now + arrival_interval_.load() * 1e9;
+      if (num_entries >= min_batch_size_ && next_arrival > deadline)
+        dispatch = true;
+
+      if (!dispatch) {
+        normal.WaitArrival(arrivals, deadline - now);
+        continue;
+      }
+      if (!normal.Pop(num_entries, batch)) continue;  // Taken by other worker.
+
+      *num_preemptions = 0;
+      RecordBatch(*batch);
+      return &normal;
     }
 
-    auto end = synced_queue_.begin();
-    std::advance(end, num_entries);
-    std::move(synced_queue_.begin(), end, std::back_inserter(entry_queue));
-    synced_queue_.erase(synced_queue_.begin(), end);
+    return nullptr;
+  }
 
-    return std::move(entry_queue);
+  void RecordBatch(const std::vector<EvalRequest*>& batch) {
+    int64_t now = RequestRing::NowNanoseconds();
+    bool use_stats = SearchStats::Get().enabled();
+    for (auto r : batch) {
+      int64_t wait_ns = now - r->enqueue_ns.load();
+      queue_wait_hist_.Add(wait_ns / 1000);
+      if (use_stats) SearchStats::Get().Add(kPhaseQueueWait, wait_ns);
+    }
+    batch_size_hist_.Add(batch.size());
   }
 
-  void BatchWorker(const int gpu_id, std::string model_path) {
-    TensorEngine engine(gpu_id, batch_size_);
+  /**
+   * Answers requests without inference with a draw value and a uniform
+   * policy, which are marked as failed so that they are not cached.
+   */
+  static void SetFailed(std::vector<EvalRequest*>* batch) {
+    for (auto r : *batch) {
+      r->vp.value = 0.0;
+      r->vp.prob.fill(1.0f / kNumRvts);
+      r->vp.generation = kFailedGeneration;
+    }
+  }
+
+  /**
+   * Builds engines of the next generation for all workers, and hands them
+   * over after all of them are ready.
+   */
+  void LoadModel(std::string model_path) {
+    int generation = generation_ + 1;
+    std::vector<std::unique_ptr<InferEngine>> engines;
+    for (auto& slot : slots_) {
+      engines.push_back(
+          CreateEngine(slot->gpu_id, batch_size_ * num_symmetries_));
+      std::lock_guard<std::mutex> lock(mx_);
+      engines.back()->Init(model_path, use_full_features_, value_from_black_);
+    }
+
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      std::lock_guard<std::mutex> lock(slots_[i]->mx);
+      slots_[i]->next = std::move(engines[i]);
+      slots_[i]->generation = generation;
+    }
+    generation_ = generation;
+    std::cerr << "model generation " << generation << " is loaded."
+              << std::endl;
+  }
+
+  void BatchWorker(EngineSlot* slot, std::string model_path) {
+    Tracer::Get().SetThreadName("eval");
+    auto engine = CreateEngine(slot->gpu_id, batch_size_ * num_symmetries_);
+    int generation = 0;
 
     {
       std::lock_guard<std::mutex> lock(mx_);
-      engine.Init(model_path, use_full_features_, value_from_black_);
+      engine->Init(model_path, use_full_features_, value_from_black_);
     }
 
+    // Average inference time of this backend.
+    double infer_time = 0.0;
+    int num_preemptions = 0;
+    std::vector<EvalRequest*> batch;
+    batch.reserve(batch_size_);
+
     while (true) {
-      auto entry_queue = PickupEntry();
-      int num_entries = entry_queue.size();
+      RequestRing* ring;
+      {
+        TraceScope trace("pickup");
+        ring = PickupEntry(infer_time, &num_preemptions, &batch);
+      }
+
+      if (ring == nullptr) return;
+      if (!running_) {
+        // Answers the popped requests so that their searchers do not wait
+        // forever.
+        SetFailed(&batch);
+        for (auto r : batch) ring->Complete(r);
+        return;
+      }
 
-      if (!running_) return;
-      engine.Infer(&entry_queue, kNumSymmetry);
+      // Switches to the new model after the previous batch is completed.
+      if (generation != generation_) {
+        std::lock_guard<std::mutex> lock(slot->mx);
+        if (slot->next) {
+          engine = std::move(slot->next);
+          generation = slot->generation;
+        }
+      }
 
-      for (auto& entry : entry_queue) {
-        std::lock_guard<std::mutex> lk(entry->mx);
-        entry->cv.notify_all();
+      auto t0 = std::chrono::steady_clock::now();
+      bool ok;
+      {
+        TraceScope trace("infer", batch.size());
+        SearchStats::Timer infer_timer(kPhaseInfer);
+        ok = engine->Infer(&batch, num_symmetries_);
+      }
+      if (ok) {
+        for (auto r : batch) r->vp.generation = generation;
+      } else {
+        std::cerr << "inference of " << batch.size()
+                  << " requests failed." << std::endl;
+        SetFailed(&batch);
       }
+      double elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - t0)
+                           .count();
+      infer_time += kInferDecay * (elapsed - infer_time);
 
-      if (num_entries == 1) in_single_eval_ = false;
+      for (auto r : batch) ring->Complete(r);
     }
   }
 };
@@ -20,27 +20,36 @@
 #include "./feature.h"
 #include "./board.h"
 
-void Feature::Update(const Board& b) {
-  // 1. Initializes features.
-  std::fill(ladder_esc_.begin(), ladder_esc_.end(), float{0.0});
-  std::fill(sensibleness_.begin(), sensibleness_.end(), float{0.0});
-  for (int i = 0; i < kFeatureSize; ++i) {
-    std::fill(liberty_[i].begin(), liberty_[i].end(), float{0.0});
-    std::fill(cap_size_[i].begin(), cap_size_[i].end(), float{0.0});
-    std::fill(self_atari_[i].begin(), self_atari_[i].end(), float{0.0});
-    std::fill(liberty_after_[i].begin(), liberty_after_[i].end(), float{0.0});
-  }
+namespace {
+
+// Offsets of the planes computed from a board.
+constexpr int kLibertyPlane = 0;
+constexpr int kCapSizePlane = kLibertyPlane + kFeatureSize;
+constexpr int kSelfAtariPlane = kCapSizePlane + kFeatureSize;
+constexpr int kLibertyAfterPlane = kSelfAtariPlane + kFeatureSize;
+constexpr int kLadderEscPlane = kLibertyAfterPlane + kFeatureSize;
+constexpr int kSensiblenessPlane = kLadderEscPlane + 1;
+constexpr int kNumBoardPlanes = kSensiblenessPlane + 1;
+
+/**
+ * Calls set_one(plane, rv) for each vertex whose value is 1 in the planes of
+ * liberty, capture size, self Atari size, liberty after the move, ladder
+ * escape and sensibleness. The other values are 0.
+ */
+template <typename SetOne>
+void ForEachBoardPlane(const Board& b, SetOne set_one) {
   Color c_us = b.side_to_move();
 
   for (RawVertex rv = kRvtZero; rv < kNumRvts; ++rv) {
     Vertex v = rv2v(rv);
 
     if (b.color_at(v) != kEmpty) {
-      liberty_[std::min(kFeatureSize - 1, b.sg_num_liberties_at(v) - 1)][rv] =
-          1.0;
+      set_one(kLibertyPlane +
+                  std::min(kFeatureSize - 1, b.sg_num_liberties_at(v) - 1),
+              rv);
     } else if (b.IsLegal(v)) {
       // 2. Updates sensibleness.
-      if (!b.IsEyeShape(v) && !b.IsSeki(v)) sensibleness_[rv] = 1.0;
+      if (!b.IsEyeShape(v) && !b.IsSeki(v)) set_one(kSensiblenessPlane, rv);
 
       // 3. Checks sg_id of surrounding stone groups.
       std::vector<int> our_sg_ids;
@@ -100,16 +109,21 @@ void Feature::Update(const Board& b) {
 
       // 5. Updates capture size.
       if (num_captured != 0)
-        cap_size_[std::min(kFeatureSize - 1, num_captured - 1)][rv] = 1.0;
+        set_one(kCapSizePlane + std::min(kFeatureSize - 1, num_captured - 1),
+                rv);
 
       libs.Remove(v);
       int num_liberties = libs.num_bits();
 
       // 6. Updates self-atari size.
       if (num_liberties == 1)
-        self_atari_[std::min(kFeatureSize - 1, num_our_stones - 1)][rv] = 1.0;
+        set_one(
+            kSelfAtariPlane + std::min(kFeatureSize - 1, num_our_stones - 1),
+            rv);
       // 7. Updates liberties after the move.
-      liberty_after_[std::min(kFeatureSize - 1, num_liberties - 1)][rv] = 1.0;
+      set_one(
+          kLibertyAfterPlane + std::min(kFeatureSize - 1, num_liberties - 1),
+          rv);
     }
   }
 
@@ -117,7 +131,34 @@ void Feature::Update(const Board& b) {
   constexpr int num_escapes = kBSize == 9 ? 3 : 4;
   Board b_cpy = b;
   auto escape_vertices = b_cpy.LadderEscapes(num_escapes);
-  for (auto& v_esc : escape_vertices) ladder_esc_[v2rv(v_esc)] = 1.0;
+  for (auto& v_esc : escape_vertices) set_one(kLadderEscPlane, v2rv(v_esc));
+}
+
+}  // namespace
+
+void Feature::Update(const Board& b) {
+  // 1. Initializes features.
+  std::fill(ladder_esc_.begin(), ladder_esc_.end(), float{0.0});
+  std::fill(sensibleness_.begin(), sensibleness_.end(), float{0.0});
+  for (int i = 0; i < kFeatureSize; ++i) {
+    std::fill(liberty_[i].begin(), liberty_[i].end(), float{0.0});
+    std::fill(cap_size_[i].begin(), cap_size_[i].end(), float{0.0});
+    std::fill(self_atari_[i].begin(), self_atari_[i].end(), float{0.0});
+    std::fill(liberty_after_[i].begin(), liberty_after_[i].end(), float{0.0});
+  }
+
+  std::vector<float>* planes[kNumBoardPlanes];
+  for (int i = 0; i < kFeatureSize; ++i) {
+    planes[kLibertyPlane + i] = &liberty_[i];
+    planes[kCapSizePlane + i] = &cap_size_[i];
+    planes[kSelfAtariPlane + i] = &self_atari_[i];
+    planes[kLibertyAfterPlane + i] = &liberty_after_[i];
+  }
+  planes[kLadderEscPlane] = &ladder_esc_;
+  planes[kSensiblenessPlane] = &sensibleness_;
+
+  ForEachBoardPlane(
+      b, [&planes](int plane, int rv) { (*planes[plane])[rv] = 1.0; });
 }
 
 float* Feature::Copy(float* oi, bool use_full, int symmetry_idx) const {
@@ -162,3 +203,49 @@ float* Feature::Copy(float* oi, bool use_full, int symmetry_idx) const {
 
   return oi;
 }
+
+float* Feature::Write(const Board& b, float* oi, bool use_full,
+                      int symmetry_idx, int num_symmetries) const {
+  float* first = oi;
+
+  // History and color planes.
+  auto copy_n_symmetry = [symmetry_idx](const std::vector<float>& input,
+                                        float* output) {
+    if (symmetry_idx == 0) return std::copy_n(input.begin(), kNumRvts, output);
+    const int* sym = kCoordTable.rv2sym_table[symmetry_idx];
+    for (int j = 0; j < kNumRvts; ++j) output[j] = input[sym[j]];
+    return output + kNumRvts;
+  };
+
+  for (int i = 0; i < kNumHistory; ++i)
+    oi = copy_n_symmetry(stones_[next_side_][i], oi);
+  for (int i = 0; i < kNumHistory; ++i)
+    oi = copy_n_symmetry(stones_[~next_side_][i], oi);
+  oi = std::fill_n(oi, kNumRvts, float{next_side_ == kBlack ? 1.0f : 0.0f});
+  oi = std::fill_n(oi, kNumRvts, float{next_side_ == kWhite ? 1.0f : 0.0f});
+
+  // Planes computed from the board, which are sparse.
+  const int* sym_inv = kCoordTable.rv2sym_inv_table[symmetry_idx];
+  if (use_full) {
+    std::fill_n(oi, kNumBoardPlanes * kNumRvts, float{0.0});
+    ForEachBoardPlane(b, [oi, sym_inv](int plane, int rv) {
+      oi[plane * kNumRvts + sym_inv[rv]] = 1.0;
+    });
+    oi += kNumBoardPlanes * kNumRvts;
+  }
+
+  // Other symmetries, where the value at rv is first[sym_inv[rv]].
+  int num_planes = (oi - first) / kNumRvts;
+  for (int i = 1; i < num_symmetries; ++i) {
+    const int* sym_inv_i =
+        kCoordTable.rv2sym_inv_table[(symmetry_idx + i) % 8];
+    for (int p = 0; p < num_planes; ++p) {
+      const float* input = first + p * kNumRvts;
+      for (int rv = 0; rv < kNumRvts; ++rv)
+        oi[sym_inv_i[rv]] = input[sym_inv[rv]];
+      oi += kNumRvts;
+    }
+  }
+
+  return oi;
+}
@@ -267,6 +267,16 @@ class Feature {
 
   float* Copy(float* oi, bool use_full = true, int symmetry_idx = 0) const;
 
+  /**
+   * Writes the same input planes as Copy() of the feature updated with b,
+   * computing the planes of b directly into oi. The feature itself must
+   * hold the history of b. If num_symmetries is more than 1, the planes of
+   * the following symmetries are written after them, which are permuted
+   * from the first ones without computing the board planes again.
+   */
+  float* Write(const Board& b, float* oi, bool use_full = true,
+               int symmetry_idx = 0, int num_symmetries = 1) const;
+
   /**
    * Outputs Feature information. (for debug)
    */
@@ -39,7 +39,12 @@ const std::vector<std::string> kListCommands = {"board_size",
                                                 "place_free_handicap",
                                                 "set_free_handicap",
                                                 "gogui-play_sequence",
-                                                "lz-analyze"};
+                                                "lz-analyze",
+                                                "kata-analyze",
+                                                "aq-save_tree",
+                                                "aq-load_tree",
+                                                "aq-stats",
+                                                "aq-trace"};
 
 std::string GTPConnector::OnClearBoardCommand() {
   StopLizzieAnalysis();
@@ -63,7 +68,7 @@ std::string GTPConnector::OnClearBoardCommand() {
 
   if (save_log_) {
     std::ifstream ifs(sgf_path_);
-    if (ifs.is_open()) {
+    if (ifs.is_open() || sgf_log_path_ == sgf_path_) {
       time_t t = time(NULL);
       char date[64];
       strftime(date, sizeof(date), "%Y%m%d_%H%M%S", localtime(&t));
@@ -72,7 +77,6 @@ std::string GTPConnector::OnClearBoardCommand() {
       log_path_ = JoinPath(Options["working_dir"], "log", date_str + ".txt");
       sgf_path_ = JoinPath(Options["working_dir"], "log", date_str + ".sgf");
 
-      if (tree_.log_file()) tree_.log_file()->close();
       tree_.SetLogFile(log_path_);
       ifs.close();
     }
@@ -126,7 +130,7 @@ std::string GTPConnector::OnGenmoveCommand() {
 
   // e. Updates logs.
   sgf_.Add(next_move);
-  if (save_log_) sgf_.Write(sgf_path_);
+  WriteSgfLog();
   tree_.PrintBoardLog(b_);
   if (b_.double_pass()) PrintFinalResult(b_);
 
@@ -198,7 +202,7 @@ std::string GTPConnector::OnPlayCommand() {
 
   // d. Updates logs.
   sgf_.Add(next_move);
-  if (save_log_) sgf_.Write(sgf_path_);
+  WriteSgfLog();
   tree_.PrintBoardLog(b_);
   if (b_.double_pass()) PrintFinalResult(b_);
 
@@ -219,7 +223,7 @@ std::string GTPConnector::OnUndoCommand() {
 
   // a. Initializes board.
   b_.Init();
-  tree_.InitRoot();
+  tree_.InitRoot(true);
   sgf_.Init();
 
   // b. Advances the board to the previous state.
@@ -234,17 +238,26 @@ std::string GTPConnector::OnUndoCommand() {
   b_.set_num_passes(kBlack, num_passes[kBlack]);
 
   // c. Updates logs.
-  if (save_log_) sgf_.Write(sgf_path_);
+  WriteSgfLog();
   tree_.PrintBoardLog(b_);
 
   return "";
 }
 
 /**
- * Returns Lizzie information.
+ * Starts analysis for Lizzie (lz-analyze) or KataGo-compatible GUIs
+ * (kata-analyze).
  */
-std::string GTPConnector::OnLzAnalyzeCommand() {
-  lizzie_interval_ = (args_.size() >= 1 ? stoi(args_[0]) * 10 : 100);  // millisec
+std::string GTPConnector::OnLzAnalyzeCommand(bool kata) {
+  AnalyzeOptions options;
+  std::string error;
+  if (!AnalyzeOptions::Parse(args_, kata, &options, &error)) {
+    success_handle_ = false;
+    fprintf(stderr, "? %s\n", error.c_str());
+    return error;
+  }
+  lizzie_interval_ = options.interval;  // millisec
+  tree_.set_analyze_options(options);
   if (!tree_.has_eval_worker()) {
     AllocateGPU();  // Allocates memory.
     b_.Init();
@@ -259,6 +272,32 @@ std::string GTPConnector::OnLzAnalyzeCommand() {
   return "";
 }
 
+/**
+ * Saves the search tree of the current position to a file, or loads it so
+ * that the next search resumes with its playouts.
+ *  e.g. "=aq-save_tree tree.aqt", "=aq-load_tree tree.aqt"
+ */
+std::string GTPConnector::OnTreeSnapshotCommand(bool load) {
+  StopLizzieAnalysis();
+  std::string error;
+  if (args_.empty()) {
+    error = "missing file name";
+  } else if (load) {
+    if (!tree_.has_eval_worker()) AllocateGPU();  // Allocates memory.
+    if (tree_.LoadTree(b_, args_[0], &error))
+      fprintf(stderr, "loaded %d nodes from %s.\n",
+              tree_.num_entries(), args_[0].c_str());
+  } else {
+    tree_.SaveTree(args_[0], &error);
+  }
+
+  if (!error.empty()) {
+    success_handle_ = false;
+    fprintf(stderr, "? %s\n", error.c_str());
+  }
+  return error;
+}
+
 /**
  * Sets main and byoyomi time.
  *  e.g. "=kgs-time_settings byoyomi 30 60 3", ...
@@ -413,7 +452,7 @@ std::string GTPConnector::OnGoguiPlaySequenceCommand() {
   }
 
   tree_.UpdateRoot(b_);
-  if (save_log_) sgf_.Write(sgf_path_);
+  WriteSgfLog();
 
   std::fprintf(stderr, "sequence loaded.\n");
   return "";
@@ -21,14 +21,22 @@
 #define GTP_H_
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "./board.h"
+#include "./log_service.h"
 #include "./search.h"
 #include "./sgf.h"
+#include "./stats.h"
 
 extern const char kVersion[];
 
@@ -51,12 +59,20 @@ extern const std::vector<std::string> kListCommands;
  */
 class GTPConnector {
  public:
+  struct ReceivedCommand {
+    std::string line;
+    std::chrono::steady_clock::time_point received;
+  };
+
   // Constructor.
   GTPConnector()
       : c_engine_(kEmpty),
         go_ponder_(false),
+        sgf_footer_offset_(0),
         success_handle_(true),
-        lizzie_interval_(-1) {
+        lizzie_interval_(-1),
+        input_closed_(false),
+        pondering_(false) {
     // Log settings.
     if(Options["lizzie"]) Options["save_log"] = false;
     save_log_ = Options["save_log"].get_bool();
@@ -82,32 +98,26 @@ class GTPConnector {
   }
 
   void Start() {
+    Tracer::Get().SetThreadName("gtp");
     // Starts communication with the GTP protocol.
+    input_closed_ = false;
+    pondering_ = false;
+    std::thread reader(&GTPConnector::ReadCommands, this);
+
     bool running = true;
     while (running) {
-      std::string command("");
       bool start_pondering = Options["use_ponder"].get_bool() && go_ponder_ &&
                              b_.move_before() != kPass &&
                              (tree_.left_time() > 10.0 || tree_.byoyomi() != 0);
       if (start_pondering) AllocateGPU();
 
-      // Thread that monitors GTP commands during pondering.
-      std::thread read_th([this, &command, start_pondering]() {
-        while (command == "") {
-          ReceiveGTPCommand(&command);
-          if (command != "" && start_pondering) {
-            tree_.StopToThink();
-            break;
-          }
-          // Interval of checking command strings.
-          std::this_thread::sleep_for(std::chrono::milliseconds(1));  // 1 msec
-        }
-        // Waits until SearchTree class stops thinking.
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));  // 10 msec
-      });
-
-      // Goes pondering until the next command is received.
-      if (start_pondering) {
+      // Goes pondering until the next command is received. The reader stops
+      // the search as soon as a command arrives.
+      {
+        std::lock_guard<std::mutex> lock(command_mx_);
+        pondering_ = start_pondering && commands_.empty() && !input_closed_;
+      }
+      if (pondering_) {
         double winning_rate = 0.5;
         double time_limit = 100.0;
         if (Options["lizzie"])
@@ -119,15 +129,31 @@ class GTPConnector {
         tree_.Search(b_, time_limit, &winning_rate, false, true, lizzie_interval_);
       }
 
-      read_th.join();
+      // Waits for the next command. The end of input is regarded as quit.
+      ReceivedCommand command{"quit", std::chrono::steady_clock::now()};
+      {
+        std::unique_lock<std::mutex> lock(command_mx_);
+        pondering_ = false;
+        command_cv_.wait(
+            lock, [this] { return !commands_.empty() || input_closed_; });
+        if (!commands_.empty()) {
+          command = std::move(commands_.front());
+          commands_.pop_front();
+        }
+      }
       tree_.PrepareToThink();
 
       // Processes GTP command.
-      if (command == "" || command == "\n") continue;
+      if (command.line == "" || command.line == "\n") continue;
       // Executes each command.
       // Stops when 'quit' command is send.
-      running = ExecuteCommand(command);
+      auto t_start = std::chrono::steady_clock::now();
+      running = ExecuteCommand(command.line);
+      RecordLatency(command, t_start);
     }
+
+    reader.join();
+    PrintLatency(std::cerr);
   }
 
   bool ExecuteCommand(std::string command) {
@@ -139,6 +165,8 @@ class GTPConnector {
     std::string type = ParseCommand(command, &command_id, &args_);
     std::string response = "";
     success_handle_ = true;
+    Tracer& tracer = Tracer::Get();
+    TraceScope trace(tracer.enabled() ? tracer.Intern("gtp " + type) : "");
 
     if (FindString(command, "protocol_version")) {
       response = "2";
@@ -171,7 +199,15 @@ class GTPConnector {
     } else if (type == "komi") {
       double komi = stod(args_[0]);
       Options["komi"] = komi;
-      tree_.set_komi(komi);
+      if (komi != tree_.komi()) {
+        // Drops trees whose rollout rates are of the previous komi.
+        StopLizzieAnalysis();
+        double left_time = tree_.left_time();
+        tree_.set_komi(komi);
+        tree_.InitRoot();
+        tree_.set_left_time(left_time);
+        if (tree_.has_eval_worker()) tree_.UpdateRoot(b_);
+      }
       fprintf(stderr, "set komi=%.1f.\n", komi);
     } else if (type == "time_left") {
       // Sets remaining time.
@@ -190,8 +226,27 @@ class GTPConnector {
       response = OnUndoCommand();
     } else if (type == "final_score") {
       response = PrintFinalResult(b_);
-    } else if (type == "lz-analyze") {
-      response = OnLzAnalyzeCommand();
+    } else if (type == "lz-analyze" || type == "kata-analyze") {
+      response = OnLzAnalyzeCommand(type == "kata-analyze");
+    } else if (type == "aq-stats") {
+      // Returns counters and durations of search phases since start or the
+      // last "aq-stats clear" in JSON. Measurement starts at the first call
+      // unless search_stats is on.
+      SearchStats::Get().set_enabled(true);
+      if (!args_.empty() && args_[0] == "clear")
+        SearchStats::Get().Reset();
+      else
+        response = SearchStats::Get().Collect().ToJson().Dump();
+    } else if (type == "aq-trace") {
+      // Writes traced events to the file or trace_file.
+      std::string path =
+          args_.empty() ? Options["trace_file"].get_string() : args_[0];
+      if (!tracer.Dump(path, &response)) {
+        success_handle_ = false;
+        fprintf(stderr, "? %s\n", response.c_str());
+      }
+    } else if (type == "aq-save_tree" || type == "aq-load_tree") {
+      response = OnTreeSnapshotCommand(type == "aq-load_tree");
     } else if (type == "kgs-time_settings") {
       response = OnKgsTimeSettingsCommand();
     } else if (type == "time_settings") {
@@ -207,6 +262,7 @@ class GTPConnector {
     } else if (type == "quit") {
       StopLizzieAnalysis();
       PrintFinalResult(b_);
+      tree_.SaveEvalStore();
     } else {
       success_handle_ = false;
       response = "unknown command.";
@@ -273,10 +329,78 @@ class GTPConnector {
   }
 
   /**
-   * Reads a line of the input GTP command.
+   * Reads a line of the input GTP command. Returns false at the end of input.
+   */
+  bool ReceiveGTPCommand(std::string* input_str) {
+    return static_cast<bool>(std::getline(std::cin, *input_str));
+  }
+
+  /**
+   * Reads GTP commands from standard input until quit or the end of input,
+   * and stops pondering as soon as a command is received.
+   * This runs on a single thread for the whole session, which blocks on
+   * reading instead of polling.
+   */
+  void ReadCommands() {
+    for (;;) {
+      std::string line;
+      bool eof = !ReceiveGTPCommand(&line);
+      auto received = std::chrono::steady_clock::now();
+
+      int command_id;
+      std::vector<std::string> args;
+      bool quit = eof || ParseCommand(line, &command_id, &args) == "quit";
+
+      std::lock_guard<std::mutex> lock(command_mx_);
+      if (eof)
+        input_closed_ = true;
+      else
+        commands_.push_back(ReceivedCommand{line, received});
+      if (pondering_) tree_.StopToThink();
+      command_cv_.notify_one();
+      if (quit) break;
+    }
+  }
+
+  /**
+   * Records the latency of a command from its arrival, or the response to the
+   * previous command if it arrived earlier, to its response.
+   * The wait includes the time to stop pondering.
+   */
+  void RecordLatency(const ReceivedCommand& command,
+                     std::chrono::steady_clock::time_point t_start) {
+    auto t_end = std::chrono::steady_clock::now();
+    auto usec = [](std::chrono::steady_clock::duration d) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    auto t_ready = std::max(command.received, last_response_);
+    int64_t wait = usec(t_start - t_ready);
+    int64_t total = usec(t_end - t_ready);
+    last_response_ = t_end;
+
+    int command_id;
+    std::vector<std::string> args;
+    std::string type = ParseCommand(command.line, &command_id, &args);
+    auto it = latency_hists_.find(type);
+    if (it == latency_hists_.end())
+      it = latency_hists_
+               .emplace(type, Histogram::Exponential(3600 * 1000000LL))
+               .first;
+    it->second.Add(total);
+
+    if (tree_.log_file())
+      *tree_.log_file() << "latency of " << type << ": " << total / 1000.0
+                        << "[msec] (wait " << wait / 1000.0 << "[msec])"
+                        << std::endl;
+  }
+
+  /**
+   * Prints latency of each type of commands.
    */
-  void ReceiveGTPCommand(std::string* input_str) {
-    std::getline(std::cin, *input_str);
+  void PrintLatency(std::ostream& os) const {
+    for (const auto& kv : latency_hists_)
+      os << "latency of " << kv.first << ": " << kv.second.ToString("us")
+         << std::endl;
   }
 
   /**
@@ -316,11 +440,55 @@ class GTPConnector {
     return ss.str();
   }
 
+  /**
+   * Writes the game record to sgf_path_ through LogService.
+   * New moves are written over the footer of the previous record, and the
+   * file is rewritten only when the header or earlier moves have changed,
+   * e.g. by undo or a new game.
+   */
+  void WriteSgfLog() {
+    if (!save_log_) return;
+
+    std::string header = sgf_.HeaderString();
+    int num_moves = sgf_.game_ply();
+    int num_logged = sgf_log_moves_.size();
+    bool appendable = sgf_log_path_ == sgf_path_ &&
+                      sgf_log_header_ == header && num_logged <= num_moves;
+    for (int i = 0; appendable && i < num_logged; ++i)
+      appendable = sgf_log_moves_[i] == sgf_.move_at(i);
+
+    if (!appendable) {
+      sgf_log_path_ = sgf_path_;
+      sgf_log_header_ = header;
+      sgf_log_moves_.clear();
+      num_logged = 0;
+    } else if (num_logged == num_moves) {
+      return;
+    }
+
+    std::string moves;
+    for (int i = num_logged; i < num_moves; ++i) {
+      moves += sgf_.MoveString(i);
+      sgf_log_moves_.push_back(sgf_.move_at(i));
+    }
+
+    if (appendable) {
+      LogService::Get().WriteAt(sgf_path_, sgf_footer_offset_,
+                                moves + SgfData::kFooter);
+      sgf_footer_offset_ += moves.size();
+    } else {
+      LogService::Get().Replace(sgf_path_,
+                                header + moves + SgfData::kFooter);
+      sgf_footer_offset_ = header.size() + moves.size();
+    }
+  }
+
   /**
    * Stops analysis for Lizzie.
    */
   void StopLizzieAnalysis() {
     tree_.StopToThink();
+    tree_.set_analyze_options(AnalyzeOptions());
     lizzie_interval_ = -1;
   }
 
@@ -328,7 +496,8 @@ class GTPConnector {
   std::string OnGenmoveCommand();
   std::string OnPlayCommand();
   std::string OnUndoCommand();
-  std::string OnLzAnalyzeCommand();
+  std::string OnLzAnalyzeCommand(bool kata = false);
+  std::string OnTreeSnapshotCommand(bool load);
   std::string OnKgsTimeSettingsCommand();
   std::string OnTimeSettingsCommand();
   std::string OnSetFreeHandicapCommand();
@@ -344,9 +513,23 @@ class GTPConnector {
   SgfData sgf_;
   std::string log_path_;
   std::string sgf_path_;
+  // Contents of the game record last written by WriteSgfLog().
+  std::string sgf_log_path_;
+  std::string sgf_log_header_;
+  std::vector<Vertex> sgf_log_moves_;
+  int64_t sgf_footer_offset_;
   std::vector<std::string> args_;
   bool success_handle_;
   int lizzie_interval_;
+
+  // Commands received by ReadCommands() and not executed yet.
+  std::deque<ReceivedCommand> commands_;
+  bool input_closed_;
+  bool pondering_;
+  std::mutex command_mx_;
+  std::condition_variable command_cv_;
+  std::map<std::string, Histogram> latency_hists_;  // usec
+  std::chrono::steady_clock::time_point last_response_;
 };
 
 #endif  // GTP_H_
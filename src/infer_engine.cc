@@ -0,0 +1,190 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./infer_engine.h"
+#include "./cpu_network.h"
+#include "./network.h"
+
+std::string InferEngine::DefaultModelPath(std::string model_path) const {
+  if (model_path != "") return model_path;
+
+  if (Options["model_path"].get_string() == "default" ||
+      Options["model_path"].get_string() == "update") {
+    std::string engine_name = Options["rule"].get_int() == kChinese
+                                  ? "model_cn.engine"
+                                  : "model_jp.engine";
+    return JoinPath(Options["working_dir"], "engine", engine_name);
+  }
+
+  return Options["model_path"].get_string();
+}
+
+void InferEngine::SetFeatureMode(bool use_full_features,
+                                 bool value_from_black) {
+  use_full_features_ = use_full_features;
+  value_from_black_ = value_from_black;
+  feature_size_ = use_full_features_ ? kInputFeatures : 18;
+  host_buf_.resize(max_batch_size_ * int{kNumRvts} * feature_size_);
+  policy_buf_.resize(max_batch_size_ * int{kNumRvts});
+  value_buf_.resize(max_batch_size_);
+}
+
+void InferEngine::Restore(const float* policy, int symmetry_idx,
+                          ValueAndProb* vp) const {
+  if (symmetry_idx == 0) {
+    std::copy_n(policy, kNumRvts, vp->prob.begin());
+  } else {
+    for (int j = 0; j < kNumRvts; ++j) {
+      vp->prob[rv2sym(j, symmetry_idx)] = *policy;
+      ++policy;
+    }
+  }
+}
+
+bool InferEngine::Infer(const Feature& ft, ValueAndProb* vp,
+                        int symmetry_idx) {
+  float* inputs_itr = host_buf_.data();
+
+  if (symmetry_idx == kNumSymmetry) symmetry_idx = RandSymmetry();
+  ft.Copy(inputs_itr, use_full_features_, symmetry_idx);
+
+  if (!Forward(host_buf_.data(), 1, policy_buf_.data(), value_buf_.data()))
+    return false;
+
+  Restore(policy_buf_.data(), symmetry_idx, vp);
+  float value = value_buf_[0];
+  if (value_from_black_ && ft.next_side() == kWhite) value *= -1;
+  vp->value = value;
+
+  return true;
+}
+
+template <typename EntryAt>
+bool InferEngine::InferBatch(int batch_size, int symmetry_idx,
+                             EntryAt entry_at) {
+  if (batch_size <= 0 || batch_size > max_batch_size_) return false;
+
+  float* inputs_itr = host_buf_.data();
+
+  std::vector<int> symmetries(batch_size);
+  if (symmetry_idx != kNumSymmetry) {
+    for (int i = 0; i < batch_size; ++i) symmetries[i] = symmetry_idx;
+  } else {  // symmetry_idx == kNumSymmetry
+    for (int i = 0; i < batch_size; ++i) symmetries[i] = RandSymmetry();
+  }
+
+  for (int i = 0; i < batch_size; ++i)
+    inputs_itr =
+        entry_at(i)->ft.Copy(inputs_itr, use_full_features_, symmetries[i]);
+
+  if (!Forward(host_buf_.data(), batch_size, policy_buf_.data(),
+               value_buf_.data()))
+    return false;
+
+  for (int i = 0; i < batch_size; ++i) {
+    auto entry = entry_at(i);
+    Restore(policy_buf_.data() + i * kNumRvts, symmetries[i], &entry->vp);
+
+    float value = value_buf_[i];
+    if (value_from_black_ && entry->ft.next_side() == kWhite) value *= -1;
+    entry->vp.value = value;
+  }
+
+  return true;
+}
+
+bool InferEngine::Infer(std::vector<std::shared_ptr<SyncedEntry>>* entries,
+                        int symmetry_idx) {
+  return InferBatch(entries->size(), symmetry_idx,
+                    [entries](int i) { return (*entries)[i].get(); });
+}
+
+bool InferEngine::Infer(std::vector<RouteEntry>* entries, int symmetry_idx) {
+  ASSERT_LV3(static_cast<int>(entries->size()) <= max_batch_size_);
+  return InferBatch(entries->size(), symmetry_idx,
+                    [entries](int i) { return &(*entries)[i]; });
+}
+
+bool InferEngine::Infer(std::vector<EvalRequest*>* entries,
+                        int num_symmetries) {
+  int batch_size = entries->size();
+  int num_rows = batch_size * num_symmetries;
+  if (batch_size <= 0 || num_rows > max_batch_size_) return false;
+
+  // Uses the staging rows as they are if they are contiguous.
+  const size_t slot_size = int{kNumRvts} * feature_size_ * num_symmetries;
+  const float* inputs = (*entries)[0]->inputs;
+  for (int i = 1; i < batch_size; ++i) {
+    if ((*entries)[i]->inputs != inputs + i * slot_size) {
+      for (int j = 0; j < batch_size; ++j)
+        std::copy_n((*entries)[j]->inputs, slot_size,
+                    host_buf_.data() + j * slot_size);
+      inputs = host_buf_.data();
+      break;
+    }
+  }
+
+  if (!Forward(inputs, num_rows, policy_buf_.data(), value_buf_.data()))
+    return false;
+
+  const float weight = 1.0f / num_symmetries;
+  for (int i = 0; i < batch_size; ++i) {
+    EvalRequest* entry = (*entries)[i];
+    const float* policy = policy_buf_.data() + i * num_symmetries * kNumRvts;
+    Restore(policy, entry->symmetry_idx, &entry->vp);
+
+    // Averages the other symmetries in the original orientation.
+    float value = value_buf_[i * num_symmetries];
+    for (int k = 1; k < num_symmetries; ++k) {
+      policy += kNumRvts;
+      const int* sym =
+          kCoordTable.rv2sym_table[(entry->symmetry_idx + k) % kNumSymmetry];
+      for (int j = 0; j < kNumRvts; ++j) entry->vp.prob[sym[j]] += policy[j];
+      value += value_buf_[i * num_symmetries + k];
+    }
+    if (num_symmetries > 1) {
+      for (auto& p : entry->vp.prob) p *= weight;
+      value *= weight;
+    }
+
+    if (value_from_black_ && entry->next_side == kWhite) value *= -1;
+    entry->vp.value = value;
+  }
+
+  return true;
+}
+
+bool UseCpuEngine() {
+#if defined(CPU_ONLY)
+  return true;
+#else
+  return Options["use_cpu"].get_bool();
+#endif
+}
+
+std::unique_ptr<InferEngine> CreateEngine(int gpu_id, int batch_size) {
+  if (Options["model_path"].get_string() == "stub")
+    return std::unique_ptr<InferEngine>(new StubEngine(batch_size));
+#if !defined(CPU_ONLY)
+  if (!UseCpuEngine())
+    return std::unique_ptr<InferEngine>(new TensorEngine(gpu_id, batch_size));
+#endif
+  (void)gpu_id;
+  return std::unique_ptr<InferEngine>(new CpuEngine(batch_size));
+}
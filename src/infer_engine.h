@@ -0,0 +1,157 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INFER_ENGINE_H_
+#define INFER_ENGINE_H_
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./eval_cache.h"
+#include "./option.h"
+#include "./request_ring.h"
+#include "./route_queue.h"
+
+constexpr int kInputFeatures = 52;
+constexpr int kNumSymmetry = 8;
+
+/**
+ * @class InferEngine
+ * Base class of the inference backends (TensorRT and CPU).
+ * Derived classes only implement Forward() for a batch of input planes, and
+ * this class handles copying features with symmetric operations and restoring
+ * the policy to the original orientation.
+ */
+class InferEngine {
+ public:
+  explicit InferEngine(int batch_size)
+      : max_batch_size_(batch_size),
+        feature_size_(kInputFeatures),
+        use_full_features_(true),
+        value_from_black_(false) {}
+
+  virtual ~InferEngine() {}
+
+  virtual void Init(std::string model_path = "", bool use_full_features = true,
+                    bool value_from_black = false) = 0;
+
+  int max_batch_size() const { return max_batch_size_; }
+
+  /**
+   * Infers a single board.
+   */
+  bool Infer(const Feature& ft, ValueAndProb* vp, int symmetry_idx = 0);
+
+  /**
+   * Infers boards from a list of SyncedEntries.
+   */
+  bool Infer(std::vector<std::shared_ptr<SyncedEntry>>* entries,
+             int symmetry_idx = 0);
+
+  /**
+   * Infers boards from a list of RouteEntires.
+   */
+  bool Infer(std::vector<RouteEntry>* entries, int symmetry_idx = 0);
+
+  /**
+   * Infers boards from slots of RequestRing, whose input planes are already
+   * written with their symmetric operations.
+   * Each slot has num_symmetries rows with symmetry_idx, symmetry_idx + 1,
+   * ... (mod kNumSymmetry), and their results are averaged. The engine must
+   * be created with batch_size * num_symmetries.
+   */
+  bool Infer(std::vector<EvalRequest*>* entries, int num_symmetries = 1);
+
+ protected:
+  /**
+   * Evaluates batch_size input planes in host memory, and writes
+   * (batch_size * kNumRvts) probabilities and batch_size values.
+   */
+  virtual bool Forward(const float* inputs, int batch_size, float* policy,
+                       float* value) = 0;
+
+  /**
+   * Returns the model path from Options if model_path is empty.
+   */
+  std::string DefaultModelPath(std::string model_path) const;
+
+  /**
+   * Allocates the host buffer for input features.
+   */
+  void SetFeatureMode(bool use_full_features, bool value_from_black);
+
+  int max_batch_size_;
+  int feature_size_;
+  bool use_full_features_;
+  bool value_from_black_;
+  std::vector<float> host_buf_;
+  std::vector<float> policy_buf_;
+  std::vector<float> value_buf_;
+
+ private:
+  void Restore(const float* policy, int symmetry_idx, ValueAndProb* vp) const;
+
+  /**
+   * Infers batch_size entries, where entry_at(i) returns a pointer to the
+   * i-th entry with members ft and vp.
+   */
+  template <typename EntryAt>
+  bool InferBatch(int batch_size, int symmetry_idx, EntryAt entry_at);
+};
+
+/**
+ * @class StubEngine
+ * StubEngine returns a uniform policy and a draw value without a model. It is
+ * used with '--model_path=stub' to measure the search without inference.
+ */
+class StubEngine : public InferEngine {
+ public:
+  explicit StubEngine(int batch_size) : InferEngine(batch_size) {}
+
+  void Init(std::string model_path = "", bool use_full_features = true,
+            bool value_from_black = false) override {
+    (void)model_path;
+    SetFeatureMode(use_full_features, value_from_black);
+  }
+
+ protected:
+  bool Forward(const float* inputs, int batch_size, float* policy,
+               float* value) override {
+    (void)inputs;
+    std::fill_n(policy, batch_size * int{kNumRvts}, 1.0f / kNumRvts);
+    std::fill_n(value, batch_size, 0.0f);
+    return true;
+  }
+};
+
+/**
+ * Returns true if inference runs on CPU instead of TensorRT.
+ */
+bool UseCpuEngine();
+
+/**
+ * Creates an inference engine according to Options.
+ * Returns a CPU engine when '--use_cpu=on' or built with CPU_ONLY, and a stub
+ * engine when '--model_path=stub'.
+ */
+std::unique_ptr<InferEngine> CreateEngine(int gpu_id, int batch_size);
+
+#endif  // INFER_ENGINE_H_
@@ -0,0 +1,415 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @class JsonValue
+ * JsonValue class holds a JSON value for the analysis mode and statistics.
+ * Objects keep the order of their members, and a missing member or element
+ * is returned as null, so queries can be read with defaults.
+ *
+ * @code
+ *  JsonValue q;
+ *  std::string error;
+ *  if (JsonValue::Parse("{\"id\":\"a\",\"moves\":[\"D4\"]}", &q, &error))
+ *    std::string id = q["id"].get_string();
+ *
+ *  JsonValue r = JsonValue::Object();
+ *  r.Set("visits", 800);
+ *  std::cout << r.Dump() << std::endl;  // {"visits":800}
+ * @endcode
+ */
+class JsonValue {
+ public:
+  enum Type { kNull, kBool, kNumber, kString, kArray, kObject };
+
+  JsonValue() : type_(kNull), number_(0.0) {}
+  JsonValue(bool val) : type_(kBool), number_(val ? 1.0 : 0.0) {}
+  JsonValue(int val) : type_(kNumber), number_(val) {}
+  JsonValue(int64_t val) : type_(kNumber), number_(val) {}
+  JsonValue(uint64_t val) : type_(kNumber), number_(val) {}
+  JsonValue(double val) : type_(kNumber), number_(val) {}
+  JsonValue(const char* val) : type_(kString), number_(0.0), string_(val) {}
+  JsonValue(std::string val)
+      : type_(kString), number_(0.0), string_(std::move(val)) {}
+
+  static JsonValue Array() {
+    JsonValue v;
+    v.type_ = kArray;
+    return v;
+  }
+
+  static JsonValue Object() {
+    JsonValue v;
+    v.type_ = kObject;
+    return v;
+  }
+
+  Type type() const { return type_; }
+
+  bool is_null() const { return type_ == kNull; }
+
+  bool get_bool(bool def = false) const {
+    return type_ == kBool ? number_ != 0.0 : def;
+  }
+
+  double get_double(double def = 0.0) const {
+    return type_ == kNumber ? number_ : def;
+  }
+
+  int get_int(int def = 0) const {
+    return type_ == kNumber ? static_cast<int>(number_) : def;
+  }
+
+  std::string get_string(std::string def = "") const {
+    return type_ == kString ? string_ : def;
+  }
+
+  // Number of elements of an array or members of an object.
+  size_t size() const { return values_.size(); }
+
+  const JsonValue& operator[](size_t i) const {
+    return i < values_.size() ? values_[i] : Null();
+  }
+
+  const JsonValue& operator[](const std::string& key) const {
+    for (size_t i = 0; i < keys_.size(); ++i)
+      if (keys_[i] == key) return values_[i];
+    return Null();
+  }
+
+  const JsonValue& operator[](const char* key) const {
+    return (*this)[std::string(key)];
+  }
+
+  const std::string& key(size_t i) const { return keys_[i]; }
+
+  void Push(JsonValue val) { values_.push_back(std::move(val)); }
+
+  /**
+   * Adds a member of an object. Keys are not checked for duplicates.
+   */
+  void Set(std::string key, JsonValue val) {
+    keys_.push_back(std::move(key));
+    values_.push_back(std::move(val));
+  }
+
+  /**
+   * Returns the compact JSON text.
+   */
+  std::string Dump() const {
+    std::string out;
+    Dump(&out);
+    return out;
+  }
+
+  void Dump(std::string* out) const {
+    switch (type_) {
+      case kNull:
+        *out += "null";
+        break;
+      case kBool:
+        *out += number_ != 0.0 ? "true" : "false";
+        break;
+      case kNumber:
+        DumpNumber(number_, out);
+        break;
+      case kString:
+        DumpString(string_, out);
+        break;
+      case kArray:
+        *out += '[';
+        for (size_t i = 0; i < values_.size(); ++i) {
+          if (i > 0) *out += ',';
+          values_[i].Dump(out);
+        }
+        *out += ']';
+        break;
+      case kObject:
+        *out += '{';
+        for (size_t i = 0; i < values_.size(); ++i) {
+          if (i > 0) *out += ',';
+          DumpString(keys_[i], out);
+          *out += ':';
+          values_[i].Dump(out);
+        }
+        *out += '}';
+        break;
+    }
+  }
+
+  /**
+   * Parses text into val. Returns false with a message if text is not a
+   * single JSON value.
+   */
+  static bool Parse(const std::string& text, JsonValue* val,
+                    std::string* error) {
+    Parser parser{text, 0, ""};
+    bool ok = parser.ParseValue(val, 0);
+    if (ok) {
+      parser.SkipSpaces();
+      if (parser.pos != text.size()) ok = parser.Fail("trailing characters");
+    }
+    if (!ok && error != nullptr) *error = parser.error;
+    return ok;
+  }
+
+ private:
+  static constexpr int kMaxDepth = 64;
+
+  Type type_;
+  double number_;
+  std::string string_;
+  std::vector<std::string> keys_;  // Only for objects.
+  std::vector<JsonValue> values_;
+
+  static const JsonValue& Null() {
+    static const JsonValue null_value;
+    return null_value;
+  }
+
+  static void DumpNumber(double d, std::string* out) {
+    if (!std::isfinite(d)) {
+      *out += "null";
+      return;
+    }
+    char buf[32];
+    if (d == std::floor(d) && std::fabs(d) < 1e15)
+      snprintf(buf, sizeof(buf), "%.0f", d);
+    else
+      snprintf(buf, sizeof(buf), "%.6g", d);
+    *out += buf;
+  }
+
+  static void DumpString(const std::string& s, std::string* out) {
+    *out += '"';
+    for (char c : s) {
+      switch (c) {
+        case '"':
+          *out += "\\\"";
+          break;
+        case '\\':
+          *out += "\\\\";
+          break;
+        case '\n':
+          *out += "\\n";
+          break;
+        case '\r':
+          *out += "\\r";
+          break;
+        case '\t':
+          *out += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            *out += buf;
+          } else {
+            *out += c;
+          }
+      }
+    }
+    *out += '"';
+  }
+
+  struct Parser {
+    const std::string& text;
+    size_t pos;
+    std::string error;
+
+    bool Fail(const std::string& message) {
+      std::stringstream ss;
+      ss << message << " at " << pos;
+      error = ss.str();
+      return false;
+    }
+
+    void SkipSpaces() {
+      while (pos < text.size() &&
+             (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' ||
+              text[pos] == '\r'))
+        ++pos;
+    }
+
+    bool Consume(const char* word) {
+      size_t len = std::char_traits<char>::length(word);
+      if (text.compare(pos, len, word) != 0) return false;
+      pos += len;
+      return true;
+    }
+
+    bool ParseValue(JsonValue* val, int depth) {
+      if (depth > kMaxDepth) return Fail("too deep");
+      SkipSpaces();
+      if (pos >= text.size()) return Fail("unexpected end");
+
+      char c = text[pos];
+      if (c == '{') return ParseObject(val, depth);
+      if (c == '[') return ParseArray(val, depth);
+      if (c == '"') {
+        *val = JsonValue("");
+        return ParseString(&val->string_);
+      }
+      if (Consume("true")) {
+        *val = JsonValue(true);
+        return true;
+      }
+      if (Consume("false")) {
+        *val = JsonValue(false);
+        return true;
+      }
+      if (Consume("null")) {
+        *val = JsonValue();
+        return true;
+      }
+
+      const char* begin = text.c_str() + pos;
+      char* end = nullptr;
+      double d = std::strtod(begin, &end);
+      if (end == begin) return Fail("unexpected character");
+      pos += end - begin;
+      *val = JsonValue(d);
+      return true;
+    }
+
+    bool ParseObject(JsonValue* val, int depth) {
+      *val = JsonValue::Object();
+      ++pos;  // '{'
+      SkipSpaces();
+      if (pos < text.size() && text[pos] == '}') {
+        ++pos;
+        return true;
+      }
+      for (;;) {
+        SkipSpaces();
+        std::string key;
+        if (pos >= text.size() || text[pos] != '"' || !ParseString(&key))
+          return Fail("expected key");
+        SkipSpaces();
+        if (pos >= text.size() || text[pos] != ':') return Fail("expected ':'");
+        ++pos;
+        JsonValue member;
+        if (!ParseValue(&member, depth + 1)) return false;
+        val->Set(std::move(key), std::move(member));
+
+        SkipSpaces();
+        if (pos < text.size() && text[pos] == ',') {
+          ++pos;
+        } else if (pos < text.size() && text[pos] == '}') {
+          ++pos;
+          return true;
+        } else {
+          return Fail("expected ',' or '}'");
+        }
+      }
+    }
+
+    bool ParseArray(JsonValue* val, int depth) {
+      *val = JsonValue::Array();
+      ++pos;  // '['
+      SkipSpaces();
+      if (pos < text.size() && text[pos] == ']') {
+        ++pos;
+        return true;
+      }
+      for (;;) {
+        JsonValue element;
+        if (!ParseValue(&element, depth + 1)) return false;
+        val->Push(std::move(element));
+
+        SkipSpaces();
+        if (pos < text.size() && text[pos] == ',') {
+          ++pos;
+        } else if (pos < text.size() && text[pos] == ']') {
+          ++pos;
+          return true;
+        } else {
+          return Fail("expected ',' or ']'");
+        }
+      }
+    }
+
+    // Parses a string from the opening quote. \u escapes are decoded to
+    // UTF-8 without combining surrogate pairs.
+    bool ParseString(std::string* s) {
+      ++pos;  // '"'
+      while (pos < text.size()) {
+        char c = text[pos++];
+        if (c == '"') return true;
+        if (c != '\\') {
+          *s += c;
+          continue;
+        }
+        if (pos >= text.size()) break;
+        char e = text[pos++];
+        switch (e) {
+          case 'b':
+            *s += '\b';
+            break;
+          case 'f':
+            *s += '\f';
+            break;
+          case 'n':
+            *s += '\n';
+            break;
+          case 'r':
+            *s += '\r';
+            break;
+          case 't':
+            *s += '\t';
+            break;
+          case 'u': {
+            if (pos + 4 > text.size()) return Fail("bad escape");
+            unsigned code = std::strtoul(text.substr(pos, 4).c_str(),
+                                         nullptr, 16);
+            pos += 4;
+            if (code < 0x80) {
+              *s += static_cast<char>(code);
+            } else if (code < 0x800) {
+              *s += static_cast<char>(0xc0 | (code >> 6));
+              *s += static_cast<char>(0x80 | (code & 0x3f));
+            } else {
+              *s += static_cast<char>(0xe0 | (code >> 12));
+              *s += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+              *s += static_cast<char>(0x80 | (code & 0x3f));
+            }
+            break;
+          }
+          default:
+            *s += e;  // '"', '\\' and '/'
+        }
+      }
+      return Fail("unterminated string");
+    }
+  };
+};
+
+#endif  // JSON_H_
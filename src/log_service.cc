@@ -0,0 +1,211 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./log_service.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "./option.h"
+#include "./request_ring.h"
+
+LogService& LogService::Get() {
+  static LogService service(Options["log_flush_ms"].get_int(), 4096);
+  return service;
+}
+
+LogService::LogService(int flush_ms, int capacity)
+    : flush_ms_(flush_ms),
+      head_(0),
+      tail_(0),
+      wake_(0),
+      sleeping_(0),
+      next_ticket_(0),
+      flushed_ticket_(0),
+      stop_(false),
+      num_full_waits_(0),
+      num_writes_(0) {
+  uint64_t size = 1;
+  while (size < static_cast<uint64_t>(capacity)) size <<= 1;
+  mask_ = size - 1;
+  cells_.reset(new Cell[size]);
+  for (uint64_t i = 0; i < size; ++i) cells_[i].seq.store(i);
+
+  writer_ = std::thread(&LogService::Run, this);
+}
+
+LogService::~LogService() {
+  stop_.store(true);
+  wake_.fetch_add(1);
+  FutexWakeAll(&wake_);
+  writer_.join();
+}
+
+void LogService::Flush() {
+  uint32_t ticket = next_ticket_.fetch_add(1) + 1;
+  Push(Record{kFlush, "", 0, "", ticket});
+  for (;;) {
+    uint32_t flushed = flushed_ticket_.load();
+    if (static_cast<int32_t>(flushed - ticket) >= 0) break;
+    FutexWait(&flushed_ticket_, flushed);
+  }
+}
+
+void LogService::Push(Record record) {
+  uint64_t pos = head_.load(std::memory_order_relaxed);
+  Cell* cell;
+  for (;;) {
+    cell = &cells_[pos & mask_];
+    uint64_t seq = cell->seq.load(std::memory_order_acquire);
+    int64_t diff = static_cast<int64_t>(seq - pos);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // The ring is full. Waits for the writer thread.
+      num_full_waits_.fetch_add(1, std::memory_order_relaxed);
+      std::this_thread::yield();
+      pos = head_.load(std::memory_order_relaxed);
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->record = std::move(record);
+  cell->seq.store(pos + 1, std::memory_order_seq_cst);
+
+  if (sleeping_.load(std::memory_order_seq_cst) != 0) {
+    wake_.fetch_add(1);
+    FutexWakeAll(&wake_);
+  }
+}
+
+bool LogService::Pop(Record* record) {
+  Cell* cell = &cells_[tail_ & mask_];
+  if (cell->seq.load(std::memory_order_seq_cst) != tail_ + 1) return false;
+
+  *record = std::move(cell->record);
+  cell->record.text.clear();
+  cell->seq.store(tail_ + mask_ + 1, std::memory_order_release);
+  ++tail_;
+  return true;
+}
+
+void LogService::Run() {
+  Record record;
+  auto last_flush = std::chrono::steady_clock::now();
+  const auto flush_interval = std::chrono::milliseconds(std::max(0, flush_ms_));
+
+  for (;;) {
+    bool popped = Pop(&record);
+    if (popped) Write(record);
+
+    auto now = std::chrono::steady_clock::now();
+    bool due = flush_ms_ == 0
+                   ? popped
+                   : flush_ms_ > 0 && now - last_flush >= flush_interval;
+    if (due) {
+      FlushFiles();
+      last_flush = now;
+    }
+    if (popped) continue;
+    if (stop_.load()) break;
+
+    // Sleeps until a record is pushed or the next flush.
+    uint32_t wake = wake_.load();
+    sleeping_.store(1, std::memory_order_seq_cst);
+    if (!stop_.load() &&
+        cells_[tail_ & mask_].seq.load(std::memory_order_seq_cst) !=
+            tail_ + 1)
+      FutexWait(&wake_, wake, flush_ms_ > 0 ? flush_ms_ * 1000000LL : -1);
+    sleeping_.store(0, std::memory_order_seq_cst);
+  }
+
+  FlushFiles();
+  for (auto& kv : files_) fclose(kv.second.fp);
+  files_.clear();
+}
+
+void LogService::Write(const Record& record) {
+  if (record.kind == kFlush) {
+    FlushFiles();
+    flushed_ticket_.store(record.ticket);
+    FutexWakeAll(&flushed_ticket_);
+    return;
+  }
+
+  if (record.path.empty()) {
+    fwrite(record.text.data(), 1, record.text.size(), stderr);
+    return;
+  }
+
+  OpenFile* file = OpenFileOf(record.path, record.kind == kReplace);
+  if (file == nullptr) return;
+
+  if (record.kind == kWriteAt)
+    fseek(file->fp, static_cast<long>(record.offset), SEEK_SET);
+  else
+    fseek(file->fp, 0, SEEK_END);
+  fwrite(record.text.data(), 1, record.text.size(), file->fp);
+  file->dirty = true;
+  file->last_used = ++num_writes_;
+}
+
+LogService::OpenFile* LogService::OpenFileOf(const std::string& path,
+                                             bool truncate) {
+  auto it = files_.find(path);
+  if (it != files_.end() && !truncate) return &it->second;
+  if (it != files_.end()) {
+    fclose(it->second.fp);
+    files_.erase(it);
+  }
+
+  if (files_.size() >= kMaxOpenFiles) {
+    auto lru = std::min_element(
+        files_.begin(), files_.end(),
+        [](const std::pair<const std::string, OpenFile>& lhs,
+           const std::pair<const std::string, OpenFile>& rhs) {
+          return lhs.second.last_used < rhs.second.last_used;
+        });
+    fclose(lru->second.fp);
+    files_.erase(lru);
+  }
+
+  FILE* fp = nullptr;
+  if (!truncate) fp = fopen(path.c_str(), "r+b");
+  if (fp == nullptr) fp = fopen(path.c_str(), "w+b");
+  if (fp == nullptr) {
+    if (failed_paths_.insert(path).second)
+      fprintf(stderr, "log: cannot open %s. its records are dropped.\n",
+              path.c_str());
+    return nullptr;
+  }
+  failed_paths_.erase(path);
+  return &files_.emplace(path, OpenFile{fp, false, 0}).first->second;
+}
+
+void LogService::FlushFiles() {
+  fflush(stderr);
+  for (auto& kv : files_) {
+    if (!kv.second.dirty) continue;
+    fflush(kv.second.fp);
+    kv.second.dirty = false;
+  }
+}
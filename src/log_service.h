@@ -0,0 +1,202 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_SERVICE_H_
+#define LOG_SERVICE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+/**
+ * @class LogService
+ * LogService class writes logs and game records on a background thread, so
+ * that the search and GTP responses do not wait for the disk or terminal.
+ *
+ * Producers put records into a bounded lock-free ring, where each cell has a
+ * sequence number telling which lap of the ring it is ready for (Vyukov's
+ * bounded queue). A producer waits only when the ring is full.
+ * Files are flushed every log_flush_ms milliseconds, after every record if
+ * it is 0, or only in Flush() and at exit if it is negative. At most
+ * kMaxOpenFiles files are kept open, and the least recently written one is
+ * closed to open another, e.g. the log of the next game.
+ *
+ * @code
+ *  LogService::Get().Append("log/a.txt", "total games=800\n");
+ *  LogService::Get().Append("", "to stderr\n");
+ *  LogService::Get().Flush();  // Waits until the records are on the disk.
+ * @endcode
+ */
+class LogService {
+ public:
+  /**
+   * Returns the service of the process, which is created at the first call
+   * after loading Options.
+   */
+  static LogService& Get();
+
+  LogService(int flush_ms, int capacity);
+
+  ~LogService();
+
+  /**
+   * Appends text to the file, or to stderr if path is empty.
+   */
+  void Append(std::string path, std::string text) {
+    Push(Record{kAppend, std::move(path), 0, std::move(text), 0});
+  }
+
+  /**
+   * Replaces the contents of the file with text.
+   */
+  void Replace(std::string path, std::string text) {
+    Push(Record{kReplace, std::move(path), 0, std::move(text), 0});
+  }
+
+  /**
+   * Writes text at offset of the file, overwriting the old contents there.
+   * The file is not truncated after the text.
+   */
+  void WriteAt(std::string path, int64_t offset, std::string text) {
+    Push(Record{kWriteAt, std::move(path), offset, std::move(text), 0});
+  }
+
+  /**
+   * Waits until all records pushed before are written and flushed.
+   */
+  void Flush();
+
+  // Number of times producers found the ring full.
+  uint64_t num_full_waits() const { return num_full_waits_.load(); }
+
+ private:
+  enum Kind { kAppend, kReplace, kWriteAt, kFlush };
+
+  struct Record {
+    Kind kind;
+    std::string path;
+    int64_t offset;
+    std::string text;
+    uint32_t ticket;  // Only for kFlush.
+  };
+
+  struct Cell {
+    std::atomic<uint64_t> seq;
+    Record record;
+  };
+
+  int flush_ms_;
+  uint64_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  // Padded to keep producers and the writer on separate cache lines.
+  char padding0_[64];
+  std::atomic<uint64_t> head_;
+  char padding1_[64];
+  uint64_t tail_;  // Only used by the writer thread.
+  char padding2_[64];
+
+  // Incremented by producers to wake the writer thread if it is sleeping.
+  std::atomic<uint32_t> wake_;
+  std::atomic<uint32_t> sleeping_;
+  std::atomic<uint32_t> next_ticket_;
+  std::atomic<uint32_t> flushed_ticket_;
+  std::atomic<bool> stop_;
+  std::atomic<uint64_t> num_full_waits_;
+
+  static constexpr size_t kMaxOpenFiles = 8;
+
+  struct OpenFile {
+    FILE* fp;
+    bool dirty;          // Whether it has unflushed records.
+    uint64_t last_used;  // Number of writes when it was written last.
+  };
+
+  std::unordered_map<std::string, OpenFile> files_;
+  uint64_t num_writes_;  // Only used by the writer thread.
+  // Paths which failed to open, which are reported once.
+  std::unordered_set<std::string> failed_paths_;
+  std::thread writer_;
+
+  void Push(Record record);
+
+  bool Pop(Record* record);
+
+  /**
+   * Writes records until the service is destroyed.
+   */
+  void Run();
+
+  void Write(const Record& record);
+
+  /**
+   * Returns the open file of path, opening it after closing the least
+   * recently written file if kMaxOpenFiles files are open. Returns nullptr
+   * if it cannot be opened.
+   */
+  OpenFile* OpenFileOf(const std::string& path, bool truncate);
+
+  void FlushFiles();
+};
+
+/**
+ * @class LogStream
+ * LogStream class is an output stream to a file through LogService.
+ * The file is truncated at construction, and text is sent to the service
+ * each time the stream is flushed, e.g. by std::endl.
+ */
+class LogStream : public std::ostream {
+ public:
+  explicit LogStream(std::string path) : std::ostream(nullptr), buf_(path) {
+    rdbuf(&buf_);
+    LogService::Get().Replace(path, "");
+  }
+
+  ~LogStream() { flush(); }
+
+ private:
+  class Buf : public std::stringbuf {
+   public:
+    explicit Buf(std::string path) : path_(std::move(path)) {}
+
+   protected:
+    int sync() override {
+      std::string text = str();
+      if (!text.empty()) {
+        LogService::Get().Append(path_, std::move(text));
+        str("");
+      }
+      return 0;
+    }
+
+   private:
+    std::string path_;
+  };
+
+  Buf buf_;
+};
+
+#endif  // LOG_SERVICE_H_
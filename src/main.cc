@@ -17,27 +17,53 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "./analysis.h"
+#include "./bench.h"
 #include "./board.h"
 #include "./gtp.h"
 #include "./option.h"
 #include "./test.h"
+#include "./trace.h"
 
 int main(int argc, char **argv) {
   std::string mode = ReadConfiguration(argc, argv);
+  std::string trace_file = Options["trace_file"];
+  if (!trace_file.empty())
+    Tracer::Get().Enable(Options["trace_buffer_size"].get_int());
 
+  int status = 0;
   if (mode == "--benchmark") {
     BenchMark();
     NetworkBench();
+  } else if (mode == "--benchmark_cache") {
+    EvalCacheBench();
+  } else if (mode == "--benchmark_suite") {
+    if (!MicroBenchmark()) status = 1;
+  } else if (mode == "--benchmark_compare") {
+    if (!CompareBenchmarks()) status = 1;
+  } else if (mode == "--build_eval_store") {
+    BuildEvalStore();
   } else if (mode == "--test") {
     TestBoard();
+  } else if (mode == "--test_cpu") {
+    TestCpuEngine();
   } else if (mode == "--self") {
     SelfMatch();
+  } else if (mode == "--parallel_self") {
+    ParallelSelfMatch();
   } else if (mode == "--policy_self") {
     PolicySelf();
+  } else if (mode == "--analysis") {
+    AnalysisEngine analysis_engine;
+    analysis_engine.Run(std::cin, std::cout);
   } else {
     GTPConnector gtp_connector;
     gtp_connector.Start();
   }
 
-  return 0;
+  std::string error;
+  if (!trace_file.empty() && !Tracer::Get().Dump(trace_file, &error))
+    std::cerr << error << std::endl;
+
+  return status;
 }
@@ -19,23 +19,13 @@
 
 #include "./network.h"
 
+#if !defined(CPU_ONLY)
+
 void TensorEngine::Init(std::string model_path, bool use_full_features,
                         bool value_from_black) {
   cudaSetDevice(gpu_id_);
 
-  if (model_path == "") {
-    if (Options["model_path"].get_string() == "default" ||
-        Options["model_path"].get_string() == "update") {
-      std::string engine_name = Options["rule"].get_int() == kChinese
-                                    ? "model_cn.engine"
-                                    : "model_jp.engine";
-      model_path = JoinPath(Options["working_dir"], "engine", engine_name);
-    } else {
-      model_path = Options["model_path"].get_string();
-    }
-  }
-
-  LoadEngine(model_path);
+  LoadEngine(DefaultModelPath(model_path));
   int max_batch_size = engine_->getMaxBatchSize();
   for (int i = 0; i < engine_->getNbBindings(); ++i) {
     auto dim = engine_->getBindingDimensions(i);
@@ -53,10 +43,7 @@ void TensorEngine::Init(std::string model_path, bool use_full_features,
     device_bufs_.push_back(buf);
   }
 
-  use_full_features_ = use_full_features;
-  value_from_black_ = value_from_black;
-  feature_size_ = use_full_features_ ? kInputFeatures : 18;
-  host_buf_.resize(max_batch_size_ * int{kNumRvts} * feature_size_);
+  SetFeatureMode(use_full_features, value_from_black);
 }
 
 void TensorEngine::BuildFromOnnx(std::string onnx_path, std::string save_path) {
@@ -87,7 +74,7 @@ void TensorEngine::BuildFromOnnx(std::string onnx_path, std::string save_path) {
     exit(1);
   }
 
-  int batch_size = Options["batch_size"].get_int();
+  int batch_size = BuildBatchSize();
   builder->setMaxBatchSize(batch_size);
   nvinfer1::IBuilderConfig *config = builder->createBuilderConfig();
   config->setMaxWorkspaceSize(uint32_t{1} << 28);
@@ -157,7 +144,7 @@ void TensorEngine::BuildFromUff(std::string uff_path, std::string save_path) {
     }
     exit(1);
   }
-  int batch_size = Options["batch_size"].get_int();
+  int batch_size = BuildBatchSize();
   builder->setMaxBatchSize(std::max(batch_size, 8));
   nvinfer1::IBuilderConfig *config = builder->createBuilderConfig();
   config->setMaxWorkspaceSize(uint32_t{1} << 28);
@@ -206,7 +193,7 @@ void TensorEngine::LoadEngine(std::string model_path) {
     engine_ = runtime_->deserializeCudaEngine(model_str.c_str(),
                                               model_str.size(), nullptr);
 
-    if (engine_->getMaxBatchSize() < Options["batch_size"].get_int()) {
+    if (engine_->getMaxBatchSize() < BuildBatchSize()) {
       std::cerr << "Max batch size of the sirialized model"
                    "is smaller than batch_size."
                 << std::endl;
@@ -221,7 +208,7 @@ void TensorEngine::LoadEngine(std::string model_path) {
 
     auto input_dims = engine_->getBindingDimensions(inputs_idx_);
     if (input_dims.d[0] < 0) {
-      input_dims.d[0] = Options["batch_size"].get_int();
+      input_dims.d[0] = BuildBatchSize();
       context_->setBindingDimensions(0, input_dims);
     }
   } else {
@@ -232,152 +219,25 @@ void TensorEngine::LoadEngine(std::string model_path) {
   }
 }
 
-bool TensorEngine::Infer(const Feature &ft, ValueAndProb *vp,
-                         int symmetry_idx) {
-  int inputs_size = kNumRvts * feature_size_;
-  float *inputs_itr = host_buf_.data();
-
-  if (symmetry_idx == kNumSymmetry) symmetry_idx = RandSymmetry();
-  ft.Copy(inputs_itr, use_full_features_, symmetry_idx);
-
-  cudaMemcpy(device_bufs_[inputs_idx_], host_buf_.data(),
-             inputs_size * sizeof(float), cudaMemcpyHostToDevice);
-
-  if (use_uff_)
-    context_->execute(max_batch_size_, device_bufs_.data());
-  else
-    context_->executeV2(device_bufs_.data());
-
-  std::vector<float> policy(kNumRvts);
-  std::vector<float> value(1);
-  cudaMemcpy(policy.data(), device_bufs_[policy_idx_],
-             policy.size() * sizeof(float), cudaMemcpyDeviceToHost);
-  cudaMemcpy(value.data(), device_bufs_[value_idx_],
-             value.size() * sizeof(float), cudaMemcpyDeviceToHost);
-
-  if (symmetry_idx == 0) {
-    std::copy_n(policy.begin(), kNumRvts, vp->prob.begin());
-  } else {
-    auto p_itr = policy.begin();
-    for (int j = 0; j < kNumRvts; ++j) {
-      vp->prob[rv2sym(j, symmetry_idx)] = *p_itr;
-      ++p_itr;
-    }
-  }
-  if (value_from_black_ && ft.next_side() == kWhite) value[0] *= -1;
-  vp->value = value[0];
-
-  return true;
-}
-
-bool TensorEngine::Infer(std::vector<std::shared_ptr<SyncedEntry>> *entries,
-                         int symmetry_idx) {
-  int batch_size = entries->size();
-
-  if (batch_size <= 0 || batch_size > max_batch_size_) return false;
-
+bool TensorEngine::Forward(const float *inputs, int batch_size, float *policy,
+                           float *value) {
   int inputs_size = batch_size * kNumRvts * feature_size_;
-  float *inputs_itr = host_buf_.data();
-
-  std::vector<int> symmetries(batch_size);
-  if (symmetry_idx != kNumSymmetry) {
-    for (int i = 0; i < batch_size; ++i) symmetries[i] = symmetry_idx;
-  } else {  // symmetry_idx == kNumSymmetry
-    for (int i = 0; i < batch_size; ++i) symmetries[i] = RandSymmetry();
-  }
-
-  for (int i = 0; i < batch_size; ++i)
-    inputs_itr =
-        (*entries)[i]->ft.Copy(inputs_itr, use_full_features_, symmetries[i]);
 
-  cudaMemcpy(device_bufs_[inputs_idx_], host_buf_.data(),
-             inputs_size * sizeof(float), cudaMemcpyHostToDevice);
+  cudaMemcpy(device_bufs_[inputs_idx_], inputs, inputs_size * sizeof(float),
+             cudaMemcpyHostToDevice);
 
   if (use_uff_)
     context_->execute(max_batch_size_, device_bufs_.data());
   else
     context_->executeV2(device_bufs_.data());
 
-  std::vector<float> policy(batch_size * kNumRvts);
-  std::vector<float> value(batch_size);
-  cudaMemcpy(policy.data(), device_bufs_[policy_idx_],
-             policy.size() * sizeof(float), cudaMemcpyDeviceToHost);
-  cudaMemcpy(value.data(), device_bufs_[value_idx_],
-             value.size() * sizeof(float), cudaMemcpyDeviceToHost);
-
-  auto p_itr = policy.begin();
-
-  for (int i = 0; i < batch_size; ++i) {
-    if (symmetry_idx == 0) {
-      std::copy_n(p_itr, kNumRvts, (*entries)[i]->vp.prob.begin());
-      std::advance(p_itr, kNumRvts);
-    } else {
-      for (int j = 0; j < kNumRvts; ++j) {
-        (*entries)[i]->vp.prob[rv2sym(j, symmetries[i])] = *p_itr;
-        ++p_itr;
-      }
-    }
-
-    if (value_from_black_ && (*entries)[i]->ft.next_side() == kWhite)
-      value[i] *= -1;
-    (*entries)[i]->vp.value = value[i];
-  }
+  cudaMemcpy(policy, device_bufs_[policy_idx_],
+             batch_size * int{kNumRvts} * sizeof(float),
+             cudaMemcpyDeviceToHost);
+  cudaMemcpy(value, device_bufs_[value_idx_], batch_size * sizeof(float),
+             cudaMemcpyDeviceToHost);
 
   return true;
 }
 
-bool TensorEngine::Infer(std::vector<RouteEntry> *entries, int symmetry_idx) {
-  int batch_size = entries->size();
-  if (batch_size <= 0) return false;
-
-  ASSERT_LV3(batch_size <= max_batch_size_);
-
-  int inputs_size = batch_size * kNumRvts * feature_size_;
-  float *inputs_itr = host_buf_.data();
-
-  std::vector<int> symmetries(batch_size);
-  if (symmetry_idx != kNumSymmetry) {
-    for (int i = 0; i < batch_size; ++i) symmetries[i] = symmetry_idx;
-  } else {  // symmetry_idx == 8
-    for (int i = 0; i < batch_size; ++i) symmetries[i] = RandSymmetry();
-  }
-
-  for (int i = 0; i < batch_size; ++i)
-    inputs_itr =
-        (*entries)[i].ft.Copy(inputs_itr, use_full_features_, symmetries[i]);
-
-  cudaMemcpy(device_bufs_[inputs_idx_], host_buf_.data(),
-             inputs_size * sizeof(float), cudaMemcpyHostToDevice);
-
-  if (use_uff_)
-    context_->execute(max_batch_size_, device_bufs_.data());
-  else
-    context_->executeV2(device_bufs_.data());
-
-  std::vector<float> policy(batch_size * kNumRvts);
-  std::vector<float> value(batch_size);
-  cudaMemcpy(policy.data(), device_bufs_[policy_idx_],
-             policy.size() * sizeof(float), cudaMemcpyDeviceToHost);
-  cudaMemcpy(value.data(), device_bufs_[value_idx_],
-             value.size() * sizeof(float), cudaMemcpyDeviceToHost);
-
-  auto p_itr = policy.begin();
-
-  for (int i = 0; i < batch_size; ++i) {
-    if (symmetry_idx == 0) {
-      std::copy_n(p_itr, kNumRvts, (*entries)[i].vp.prob.begin());
-      std::advance(p_itr, kNumRvts);
-    } else {
-      for (int j = 0; j < kNumRvts; ++j) {
-        (*entries)[i].vp.prob[rv2sym(j, symmetries[i])] = *p_itr;
-        ++p_itr;
-      }
-    }
-
-    if (value_from_black_ && (*entries)[i].ft.next_side() == kWhite)
-      value[i] *= -1;
-    (*entries)[i].vp.value = value[i];
-  }
-
-  return true;
-}
+#endif  // !defined(CPU_ONLY)
@@ -20,6 +20,8 @@
 #ifndef NETWORK_H_
 #define NETWORK_H_
 
+#if !defined(CPU_ONLY)
+
 #include <NvInfer.h>
 #include <NvOnnxParser.h>
 #include <NvUffParser.h>
@@ -32,12 +34,10 @@
 #include <vector>
 
 #include "./eval_cache.h"
+#include "./infer_engine.h"
 #include "./option.h"
 #include "./route_queue.h"
 
-constexpr int kInputFeatures = 52;
-constexpr int kNumSymmetry = 8;
-
 /**
  * @class Logger
  * Logger class of nvinfer.
@@ -67,15 +67,15 @@ class Logger : public nvinfer1::ILogger {
  * (18 * 19 * 19) inferences by setting use_full_feature = false.
  * NOTE: Don't call Init() in different programs or threads at the same time.
  */
-class TensorEngine {
+class TensorEngine : public InferEngine {
  public:
   TensorEngine(int gpu_id, int batch_size)
-      : engine_(nullptr),
+      : InferEngine(batch_size),
+        engine_(nullptr),
         runtime_(nullptr),
         context_(nullptr),
         gpu_id_(gpu_id),
-        use_uff_(true),
-        max_batch_size_(batch_size) {}
+        use_uff_(true) {}
 
   ~TensorEngine() {
     if (context_) context_->destroy();
@@ -116,6 +116,14 @@ class TensorEngine {
     }
   }
 
+  /**
+   * Returns the maximum batch size of built engines, which also fits the
+   * batches of ensemble evaluations.
+   */
+  int BuildBatchSize() const {
+    return std::max(max_batch_size_, Options["batch_size"].get_int());
+  }
+
   /**
    * Builds the TensorRT engine from an ONNX file.
    * This method is called when a serialized engine is not found or does not
@@ -137,39 +145,24 @@ class TensorEngine {
   void LoadEngine(std::string model_path);
 
   void Init(std::string model_path = "", bool use_full_features = true,
-            bool value_from_black = false);
+            bool value_from_black = false) override;
 
-  /**
-   * Infers a single board.
-   */
-  bool Infer(const Feature &ft, ValueAndProb *vp, int symmetry_idx = 0);
-
-  /**
-   * Infers boards from a list of SyncedEntries.
-   */
-  bool Infer(std::vector<std::shared_ptr<SyncedEntry>> *entries,
-             int symmetry_idx = 0);
-
-  /**
-   * Infers boards from a list of RouteEntires.
-   */
-  bool Infer(std::vector<RouteEntry> *entries, int symmetry_idx = 0);
+ protected:
+  bool Forward(const float *inputs, int batch_size, float *policy,
+               float *value) override;
 
  private:
   nvinfer1::ICudaEngine *engine_;
   nvinfer1::IRuntime *runtime_;
   nvinfer1::IExecutionContext *context_;
   std::vector<void *> device_bufs_;
-  std::vector<float> host_buf_;
   int gpu_id_;
-  int max_batch_size_;
-  int feature_size_;
-  bool use_full_features_;
-  bool value_from_black_;
   int inputs_idx_;
   int policy_idx_;
   int value_idx_;
   bool use_uff_;
 };
 
+#endif  // !defined(CPU_ONLY)
+
 #endif  // NETWORK_H_
@@ -22,6 +22,7 @@
 
 #include <algorithm>
 #include <atomic>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <thread>
@@ -29,6 +30,7 @@
 #include <vector>
 
 #include "./board.h"
+#include "./trace.h"
 
 /**
  * Function to perform arithmetic addition for atomic<float>, atomic<double>,
@@ -126,6 +128,8 @@ class RateStat {
     FetchAdd(&win_values_, win);
   }
 
+  friend class TreeSnapshot;
+
  protected:
   std::atomic<int> num_rollouts_;     // The number of rollout execution.
   std::atomic<int> num_values_;       // The number of board evaluation.
@@ -224,13 +228,23 @@ class ChildNode : public RateStat {
 
   void SetCompleteState() { create_state_.exchange(kComplete); }
 
-  void WaitForComplete() {
-    while (create_state_.load() == kCreating) {
+  /**
+   * Waits until the next node is created, and returns the number of spins.
+   * It yields between loads so as not to keep the line of the child busy
+   * while the creating thread writes to it.
+   */
+  int WaitForComplete() {
+    int num_spins = 0;
+    while (create_state_.load(std::memory_order_acquire) == kCreating) {
+      ++num_spins;
+      std::this_thread::yield();
     }
+    return num_spins;
   }
 
   friend class Node;
   friend class RootNode;
+  friend class TreeSnapshot;
 
  private:
   std::atomic<Vertex> move_;        // Move to the child board.
@@ -380,6 +394,9 @@ class Node : public RateStat {
     }
   }
 
+  friend class RootNode;
+  friend class TreeSnapshot;
+
  private:
   std::atomic<int> ply_;  // Number of moves in the game.
   // Sum of evaluation visits of all child nodes.
@@ -404,111 +421,361 @@ inline int ChildNode::num_entries() const {
  * @class RootNode
  * The RootNode class holds a pointer to the root node of the search tree. When
  * the board is advanced, it transitions to the corresponding child node.
+ *
+ * Nodes which leave the tree are retained up to max_num_retained_ nodes, so
+ * that the search is resumed after undo, setup or a jump to another position.
+ * The ancestors of the root are kept as a chain whose detached children lead
+ * to the root, and other subtrees are kept in the order of use. The new root
+ * is looked up by following the moves of the board from the top of each of
+ * them, and the least recently used ones are deleted first.
  */
 class RootNode {
  public:
-  RootNode() : max_num_entries_(0), num_entries_(0), pnd_(nullptr) {}
+  RootNode()
+      : max_num_entries_(0),
+        max_num_retained_(0),
+        num_retained_(0),
+        num_entries_(0),
+        pnd_(nullptr) {}
 
   RootNode(const RootNode& rhs) = delete;
 
   int num_entries() const { return num_entries_.load(); }
 
   double entry_rate() const {
-    return max_num_entries_ == 0 ? 0.0 : num_entries_.load() / max_num_entries_;
+    return max_num_entries_ == 0
+               ? 0.0
+               : static_cast<double>(num_entries_.load()) / max_num_entries_;
   }
 
   Node* node() const { return pnd_.get(); }
 
   void increment_entries() { ++num_entries_; }
 
-  void set_node(std::unique_ptr<Node>* pnd) { pnd_ = std::move(*pnd); }
+  int max_num_entries() const { return max_num_entries_; }
 
-  void Init() {
+  int num_retained() const { return num_retained_; }
+
+  void set_node(std::unique_ptr<Node>* pnd) { set_node(pnd, 1); }
+
+  /**
+   * Replaces the root node with a tree of num_entries nodes.
+   */
+  void set_node(std::unique_ptr<Node>* pnd, int num_entries) {
+    ReleaseAncestors();
+    DeleteInBackground(&pnd_);
+    pnd_ = std::move(*pnd);
+    num_entries_ = num_entries;
+  }
+
+  /**
+   * Clears the root node and retained trees. If retain is true, they are kept
+   * so that the next ShiftRootNode() looks up the new root in them.
+   */
+  void Init(bool retain = false) {
+    if (retain) return;
+    ReleaseAncestors();
+    ReleaseSubtrees();
     num_entries_ = 0;
     pnd_.reset();
   }
 
-  void Resize(int max_size) {
+  void Resize(int max_size, int max_retained = 0) {
     max_num_entries_ = max_size;
-    num_entries_ = 0;
-    pnd_.reset();
+    max_num_retained_ = max_retained;
+    Init();
   }
 
   bool ShiftRootNode(Vertex v, const Board& b, bool create_if_not_found = true);
 
+  /**
+   * Deletes subtrees under children whose visits are less than ratio of the
+   * most visited sibling, and returns the number of deleted nodes. Statistics
+   * of the children are kept, and their nodes are created again when they
+   * are searched. The tree must not be searched during pruning.
+   */
+  int PruneSubtrees(double ratio);
+
  private:
+  /**
+   * A retained node whose child at child_idx is detached and leads to the
+   * next ancestor or the root, with the number of nodes left under it.
+   */
+  struct Ancestor {
+    std::unique_ptr<Node> nd;
+    int child_idx;
+    int num_entries;
+  };
+
+  /**
+   * A retained subtree of another line with the number of its nodes.
+   */
+  struct Subtree {
+    std::unique_ptr<Node> nd;
+    int num_entries;
+  };
+
   int max_num_entries_;
+  int max_num_retained_;
+  int num_retained_;  // Number of nodes in ancestors_ and subtrees_.
   std::atomic<int> num_entries_;
   std::unique_ptr<Node> pnd_;
+  std::vector<Ancestor> ancestors_;  // From the oldest to the parent of root.
+  std::list<Subtree> subtrees_;      // From the most recently used.
+
+  /**
+   * Deletes a tree in another thread, which takes 400,000 nodes per sec.
+   */
+  static void DeleteInBackground(std::unique_ptr<Node>* pnd) {
+    Node* p = pnd->release();
+    if (p == nullptr) return;
+    auto th = std::thread([p]() {
+      TraceScope trace("free_tree");
+      delete p;
+    });
+    th.detach();
+  }
+
+  /**
+   * Detaches subtrees under nd as PruneSubtrees() into garbage, and returns
+   * the number of their nodes, which is subtracted from nd on the way back.
+   */
+  static int PruneUnder(Node* nd, double ratio, std::vector<Node*>* garbage);
+
+  /**
+   * Finds the node of b under top by following moves of b, and stores the
+   * indexes of the children on the way in path.
+   */
+  static bool FindPath(const Node& top, const Board& b, std::vector<int>* path);
+
+  /**
+   * Attaches the root and its ancestors into one tree, and returns its top
+   * with the number of nodes. The ancestors are copied to chain so that
+   * their numbers of nodes are reused.
+   */
+  std::unique_ptr<Node> Reassemble(int* num_entries,
+                                   std::vector<Ancestor>* chain);
+
+  /**
+   * Detaches the nodes on path from top, which has num_entries nodes, as
+   * ancestors and sets the last one to the root.
+   */
+  void Descend(std::unique_ptr<Node>* top, int num_entries,
+               const std::vector<int>& path,
+               const std::vector<Ancestor>& chain);
+
+  void Retain(std::unique_ptr<Node>* pnd, int num_entries) {
+    subtrees_.push_front({std::move(*pnd), num_entries});
+    num_retained_ += num_entries;
+  }
+
+  /**
+   * Deletes the least recently used subtrees and then the oldest ancestors
+   * until the retained nodes fit in max_num_retained_.
+   */
+  void EvictRetained() {
+    while (num_retained_ > max_num_retained_ && !subtrees_.empty()) {
+      num_retained_ -= subtrees_.back().num_entries;
+      DeleteInBackground(&subtrees_.back().nd);
+      subtrees_.pop_back();
+    }
+    int num_evicted = 0;
+    while (num_retained_ > max_num_retained_ &&
+           num_evicted < static_cast<int>(ancestors_.size())) {
+      num_retained_ -= ancestors_[num_evicted].num_entries;
+      DeleteInBackground(&ancestors_[num_evicted].nd);
+      ++num_evicted;
+    }
+    ancestors_.erase(ancestors_.begin(), ancestors_.begin() + num_evicted);
+  }
+
+  void ReleaseAncestors() {
+    for (auto& a : ancestors_) {
+      num_retained_ -= a.num_entries;
+      DeleteInBackground(&a.nd);
+    }
+    ancestors_.clear();
+  }
+
+  void ReleaseSubtrees() {
+    for (auto& t : subtrees_) {
+      num_retained_ -= t.num_entries;
+      DeleteInBackground(&t.nd);
+    }
+    subtrees_.clear();
+  }
 };
 
+inline int RootNode::PruneUnder(Node* nd, double ratio,
+                                std::vector<Node*>* garbage) {
+  int max_visits = 0;
+  for (const auto& child : nd->children)
+    max_visits = std::max(max_visits, child.num_values());
+
+  int num_pruned = 0;
+  for (auto& child : nd->children) {
+    if (!child.has_next()) continue;
+    if (child.num_values() < ratio * max_visits) {
+      num_pruned += std::max(1, child.num_entries());
+      garbage->push_back(child.next_ptr_.release());
+      child.create_state_.store(kInitial);
+    } else {
+      num_pruned += PruneUnder(child.next_ptr(), ratio, garbage);
+    }
+  }
+  nd->num_entries_ -= num_pruned;
+
+  return num_pruned;
+}
+
+inline int RootNode::PruneSubtrees(double ratio) {
+  if (!pnd_) return 0;
+
+  std::vector<Node*> garbage;
+  int num_pruned = PruneUnder(pnd_.get(), ratio, &garbage);
+
+  if (!garbage.empty()) {
+    auto th = std::thread([garbage]() {
+      TraceScope trace("free_tree", garbage.size());
+      for (Node* p : garbage) delete p;
+    });
+    th.detach();
+  }
+  num_entries_ -= num_pruned;
+
+  return num_pruned;
+}
+
+inline bool RootNode::FindPath(const Node& top, const Board& b,
+                               std::vector<int>* path) {
+  path->clear();
+  int ply = top.game_ply();
+  if (ply > b.game_ply()) return false;
+
+  std::vector<Vertex> moves = b.move_history();
+  const Node* nd = &top;
+  for (; ply < b.game_ply(); ++ply) {
+    int child_idx = -1;
+    for (int i = 0, n = nd->num_children(); i < n; ++i) {
+      if (nd->children[i].move() == moves[ply]) {
+        child_idx = i;
+        break;
+      }
+    }
+    if (child_idx < 0 || !nd->children[child_idx].has_next()) return false;
+    path->push_back(child_idx);
+    nd = nd->children[child_idx].next_ptr();
+  }
+
+  return nd->key() == b.key();
+}
+
+inline std::unique_ptr<Node> RootNode::Reassemble(
+    int* num_entries, std::vector<Ancestor>* chain) {
+  *num_entries = pnd_ ? num_entries_.load() : 0;
+  std::unique_ptr<Node> top = std::move(pnd_);
+
+  for (int i = static_cast<int>(ancestors_.size()) - 1; i >= 0; --i) {
+    Ancestor& a = ancestors_[i];
+    if (top) a.nd->children[a.child_idx].next_ptr_ = std::move(top);
+    top = std::move(a.nd);
+    *num_entries += a.num_entries;
+    num_retained_ -= a.num_entries;
+    chain->push_back({nullptr, a.child_idx, a.num_entries});
+  }
+  std::reverse(chain->begin(), chain->end());
+  ancestors_.clear();
+
+  return top;
+}
+
+inline void RootNode::Descend(std::unique_ptr<Node>* top, int num_entries,
+                              const std::vector<int>& path,
+                              const std::vector<Ancestor>& chain) {
+  std::unique_ptr<Node> nd = std::move(*top);
+  bool on_chain = true;
+
+  for (int i = 0, n = path.size(); i < n; ++i) {
+    ChildNode* child = &nd->children[path[i]];
+
+    // Reuses the number of nodes while following the previous line.
+    on_chain &= i < static_cast<int>(chain.size()) &&
+                chain[i].child_idx == path[i];
+    int num_parent =
+        on_chain ? chain[i].num_entries
+                 : num_entries - std::max(1, child->num_entries());
+    num_parent = std::max(1, num_parent);
+
+    std::unique_ptr<Node> next = std::move(child->next_ptr_);
+    ancestors_.push_back({std::move(nd), path[i], num_parent});
+    num_retained_ += num_parent;
+    num_entries = std::max(1, num_entries - num_parent);
+    nd = std::move(next);
+  }
+
+  pnd_ = std::move(nd);
+  num_entries_ = num_entries;
+}
+
 inline bool RootNode::ShiftRootNode(Vertex v, const Board& b,
                                     bool create_if_not_found) {
+  TraceScope trace("shift_root");
   // Already updated.
   if (static_cast<bool>(pnd_) && pnd_->game_ply() == b.game_ply() &&
       pnd_->key() == b.key())
     return true;
 
-  bool found_next = false;
+  // 1. Looks up the tree of the current line, whose ancestors are reattached
+  //    so that it can be followed in any direction.
+  Node* prev_root = pnd_.get();
+  std::vector<Ancestor> chain;
+  int num_entries = 0;
+  std::unique_ptr<Node> top = Reassemble(&num_entries, &chain);
+  std::vector<int> path;
+  bool found_next = top && FindPath(*top, b, &path);
+
+  // 2. Adds the node of the move from the previous root if it is not
+  //    expanded, so that the line is kept.
+  bool expanded = false;
+  if (!found_next && create_if_not_found && prev_root != nullptr &&
+      prev_root->game_ply() + 1 == b.game_ply()) {
+    for (int i = 0, n = prev_root->num_children(); i < n; ++i) {
+      ChildNode* cn = &prev_root->children[i];
+      if (cn->move() != v || cn->has_next()) continue;
+      std::unique_ptr<Node> next(new Node(b));
+      cn->set_next_ptr(&next);
+      cn->SetCompleteState();
+      ++prev_root->num_entries_;
+      ++num_entries;
+      path.clear();
+      for (const auto& a : chain) path.push_back(a.child_idx);
+      path.push_back(i);
+      expanded = true;
+      break;
+    }
+  }
 
-  if (static_cast<bool>(pnd_) && pnd_->game_ply() + 1 == b.game_ply()) {
-    for (int i = 0, n = pnd_->num_children(); i < n; ++i) {
-      ChildNode* cn = &pnd_->children[i];
-      if (cn->move() == v && cn->has_next()) {
+  // 3. Looks up the retained subtrees of other lines.
+  if (!found_next && !expanded) {
+    chain.clear();
+    for (auto it = subtrees_.begin(); it != subtrees_.end(); ++it) {
+      if (FindPath(*it->nd, b, &path)) {
         found_next = true;
-        num_entries_ = std::max(1, cn->num_entries());
-
-        auto prev_pnd = std::move(pnd_);
-        pnd_ = std::move(prev_pnd->children[i].next_ptr_);
-
-        // Deletes previous pnd_ in another thread, which
-        // takes 400,000 nodes per sec.
-        auto p = prev_pnd.release();
-        auto th = std::thread([p]() { delete p; });
-        th.detach();
-
+        if (top) Retain(&top, num_entries);
+        top = std::move(it->nd);
+        num_entries = it->num_entries;
+        num_retained_ -= it->num_entries;
+        subtrees_.erase(it);
         break;
       }
     }
-  } else if (static_cast<bool>(pnd_) && pnd_->game_ply() + 2 == b.game_ply()) {
-    Vertex v_prev = b.move_before_2();
-
-    for (size_t i = 0, n = pnd_->num_children(); i < n; ++i) {
-      ChildNode* cn = &pnd_->children[i];
-      if (cn->move() == v_prev && cn->has_next()) {
-        Node* nnd = cn->next_ptr();
-        for (size_t j = 0, n = nnd->num_children(); j < n; ++j) {
-          ChildNode* gcn = &nnd->children[j];
-          if (gcn->move() == v && gcn->has_next()) {
-            found_next = true;
-            num_entries_ = std::max(1, gcn->num_entries());
-
-            auto prev_pnd = std::move(pnd_);
-            gcn = &(prev_pnd->children[i].next_ptr()->children[j]);
-            pnd_ = std::move(gcn->next_ptr_);
-
-            // Deletes previous pnd_ in another thread, which
-            // takes 400,000 nodes per sec.
-            auto p = prev_pnd.release();
-            auto th = std::thread([p]() { delete p; });
-            th.detach();
-
-            break;
-          }
-        }
-      }
-
-      if (found_next) break;
-    }
   }
 
-  if (!found_next) {
-    if (static_cast<bool>(pnd_)) {
-      auto prev_pnd = std::move(pnd_);
-      auto p = prev_pnd.release();
-      auto th = std::thread([p]() { delete p; });
-      th.detach();
-    }
+  // 4. Detaches the new root, or creates it.
+  if (found_next || expanded) {
+    Descend(&top, num_entries, path, chain);
+  } else {
+    if (top) Retain(&top, num_entries);
 
     if (create_if_not_found) {
       pnd_ = std::move(std::unique_ptr<Node>(new Node(b)));
@@ -519,6 +786,8 @@ inline bool RootNode::ShiftRootNode(Vertex v, const Board& b,
     }
   }
 
+  EvictRetained();
+
   return found_next;
 }
 
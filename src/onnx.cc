@@ -0,0 +1,426 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./onnx.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "./types.h"
+
+namespace {
+
+/**
+ * @class ProtoReader
+ * Reader of the protobuf wire format.
+ * https://developers.google.com/protocol-buffers/docs/encoding
+ */
+class ProtoReader {
+ public:
+  ProtoReader(const char* begin, const char* end)
+      : ptr_(begin), end_(end), ok_(true) {}
+
+  bool ok() const { return ok_; }
+  bool eof() const { return !ok_ || ptr_ >= end_; }
+
+  uint64_t ReadVarint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (ptr_ >= end_) break;
+      uint8_t b = static_cast<uint8_t>(*ptr_++);
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) return v;
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  /**
+   * Reads a tag and returns the field number. The wire type is set to *wire.
+   */
+  int ReadTag(int* wire) {
+    uint64_t tag = ReadVarint();
+    *wire = static_cast<int>(tag & 7);
+    return static_cast<int>(tag >> 3);
+  }
+
+  ProtoReader ReadMessage() {
+    uint64_t len = ReadVarint();
+    if (len > static_cast<uint64_t>(end_ - ptr_)) {
+      ok_ = false;
+      return ProtoReader(end_, end_);
+    }
+    ProtoReader sub(ptr_, ptr_ + len);
+    ptr_ += len;
+    return sub;
+  }
+
+  std::string ReadString() {
+    ProtoReader sub = ReadMessage();
+    return std::string(sub.ptr_, sub.end_);
+  }
+
+  float ReadFixed32Float() {
+    float f = 0.0f;
+    if (end_ - ptr_ < 4) {
+      ok_ = false;
+      return f;
+    }
+    std::memcpy(&f, ptr_, 4);
+    ptr_ += 4;
+    return f;
+  }
+
+  double ReadFixed64Double() {
+    double d = 0.0;
+    if (end_ - ptr_ < 8) {
+      ok_ = false;
+      return d;
+    }
+    std::memcpy(&d, ptr_, 8);
+    ptr_ += 8;
+    return d;
+  }
+
+  void Skip(int wire) {
+    switch (wire) {
+      case 0:
+        ReadVarint();
+        break;
+      case 1:
+        ptr_ += 8;
+        break;
+      case 2:
+        ReadMessage();
+        break;
+      case 5:
+        ptr_ += 4;
+        break;
+      default:
+        ok_ = false;
+        break;
+    }
+    if (ptr_ > end_) ok_ = false;
+  }
+
+  /**
+   * Reads a repeated integer field, which may be packed or not.
+   */
+  void ReadInts(int wire, std::vector<int64_t>* v) {
+    if (wire == 2) {
+      ProtoReader sub = ReadMessage();
+      while (!sub.eof()) v->push_back(static_cast<int64_t>(sub.ReadVarint()));
+    } else {
+      v->push_back(static_cast<int64_t>(ReadVarint()));
+    }
+  }
+
+  /**
+   * Reads a repeated float field, which may be packed or not.
+   */
+  void ReadFloats(int wire, std::vector<float>* v) {
+    if (wire == 2) {
+      ProtoReader sub = ReadMessage();
+      while (!sub.eof()) v->push_back(sub.ReadFixed32Float());
+    } else {
+      v->push_back(ReadFixed32Float());
+    }
+  }
+
+  /**
+   * Reads a repeated double field, which may be packed or not.
+   */
+  void ReadDoubles(int wire, std::vector<float>* v) {
+    if (wire == 2) {
+      ProtoReader sub = ReadMessage();
+      while (!sub.eof()) v->push_back(sub.ReadFixed64Double());
+    } else {
+      v->push_back(ReadFixed64Double());
+    }
+  }
+
+ private:
+  const char* ptr_;
+  const char* end_;
+  bool ok_;
+};
+
+void ParseTensor(ProtoReader r, OnnxTensor* t) {
+  std::string raw_data;
+  while (!r.eof()) {
+    int wire;
+    int field = r.ReadTag(&wire);
+    switch (field) {
+      case 1:
+        r.ReadInts(wire, &t->dims);
+        break;
+      case 2:
+        t->data_type = static_cast<int>(r.ReadVarint());
+        break;
+      case 4:
+        r.ReadFloats(wire, &t->floats);
+        break;
+      case 5:  // int32_data, which also holds float16 values.
+        r.ReadInts(wire, &t->ints);
+        break;
+      case 7:
+        r.ReadInts(wire, &t->ints);
+        break;
+      case 8:
+        t->name = r.ReadString();
+        break;
+      case 9:
+        raw_data = r.ReadString();
+        break;
+      case 10:
+        r.ReadDoubles(wire, &t->floats);
+        break;
+      default:
+        r.Skip(wire);
+        break;
+    }
+  }
+
+  if (!raw_data.empty()) {
+    const char* p = raw_data.data();
+    size_t n = raw_data.size();
+    switch (t->data_type) {
+      case 1:  // FLOAT
+        t->floats.resize(n / 4);
+        std::memcpy(t->floats.data(), p, t->floats.size() * 4);
+        break;
+      case 10:  // FLOAT16
+        for (size_t i = 0; i + 2 <= n; i += 2) {
+          uint16_t h;
+          std::memcpy(&h, p + i, 2);
+          t->floats.push_back(HalfToFloat(h));
+        }
+        break;
+      case 11:  // DOUBLE
+        for (size_t i = 0; i + 8 <= n; i += 8) {
+          double d;
+          std::memcpy(&d, p + i, 8);
+          t->floats.push_back(static_cast<float>(d));
+        }
+        break;
+      case 6:  // INT32
+        for (size_t i = 0; i + 4 <= n; i += 4) {
+          int32_t v;
+          std::memcpy(&v, p + i, 4);
+          t->ints.push_back(v);
+        }
+        break;
+      case 7:  // INT64
+        t->ints.resize(n / 8);
+        std::memcpy(t->ints.data(), p, t->ints.size() * 8);
+        break;
+      case 9:  // BOOL
+        for (size_t i = 0; i < n; ++i) t->ints.push_back(p[i] != 0);
+        break;
+      default:
+        break;
+    }
+  } else if (t->data_type == 10 && t->floats.empty()) {
+    for (auto v : t->ints) t->floats.push_back(HalfToFloat(v & 0xffff));
+    t->ints.clear();
+  }
+}
+
+void ParseAttribute(ProtoReader r, OnnxAttribute* a) {
+  while (!r.eof()) {
+    int wire;
+    int field = r.ReadTag(&wire);
+    switch (field) {
+      case 1:
+        a->name = r.ReadString();
+        break;
+      case 2:
+        a->f = r.ReadFixed32Float();
+        break;
+      case 3:
+        a->i = static_cast<int64_t>(r.ReadVarint());
+        break;
+      case 4:
+        a->s = r.ReadString();
+        break;
+      case 5:
+        ParseTensor(r.ReadMessage(), &a->t);
+        break;
+      case 7:
+        r.ReadFloats(wire, &a->floats);
+        break;
+      case 8:
+        r.ReadInts(wire, &a->ints);
+        break;
+      default:
+        r.Skip(wire);
+        break;
+    }
+  }
+}
+
+void ParseNode(ProtoReader r, OnnxNode* node) {
+  while (!r.eof()) {
+    int wire;
+    int field = r.ReadTag(&wire);
+    switch (field) {
+      case 1:
+        node->inputs.push_back(r.ReadString());
+        break;
+      case 2:
+        node->outputs.push_back(r.ReadString());
+        break;
+      case 3:
+        node->name = r.ReadString();
+        break;
+      case 4:
+        node->op_type = r.ReadString();
+        break;
+      case 5: {
+        OnnxAttribute a;
+        ParseAttribute(r.ReadMessage(), &a);
+        node->attributes[a.name] = a;
+        break;
+      }
+      default:
+        r.Skip(wire);
+        break;
+    }
+  }
+}
+
+/**
+ * Reads ValueInfoProto.
+ * type (2) -> TypeProto.tensor_type (1) -> shape (2) -> dim (1)
+ *  -> dim_value (1)
+ */
+void ParseValueInfo(ProtoReader r, OnnxValueInfo* info) {
+  while (!r.eof()) {
+    int wire;
+    int field = r.ReadTag(&wire);
+    if (field == 1) {
+      info->name = r.ReadString();
+    } else if (field == 2) {
+      ProtoReader type = r.ReadMessage();
+      while (!type.eof()) {
+        int w_type;
+        if (type.ReadTag(&w_type) != 1) {
+          type.Skip(w_type);
+          continue;
+        }
+        ProtoReader tensor = type.ReadMessage();
+        while (!tensor.eof()) {
+          int w_tensor;
+          if (tensor.ReadTag(&w_tensor) != 2) {
+            tensor.Skip(w_tensor);
+            continue;
+          }
+          ProtoReader shape = tensor.ReadMessage();
+          while (!shape.eof()) {
+            int w_shape;
+            if (shape.ReadTag(&w_shape) != 1) {
+              shape.Skip(w_shape);
+              continue;
+            }
+            ProtoReader dim = shape.ReadMessage();
+            int64_t d = -1;
+            while (!dim.eof()) {
+              int w_dim;
+              if (dim.ReadTag(&w_dim) == 1)
+                d = static_cast<int64_t>(dim.ReadVarint());
+              else
+                dim.Skip(w_dim);
+            }
+            info->dims.push_back(d);
+          }
+        }
+      }
+    } else {
+      r.Skip(wire);
+    }
+  }
+}
+
+}  // namespace
+
+bool OnnxModel::Load(const std::string& path) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs.is_open()) return false;
+
+  std::ostringstream oss(std::ios::binary);
+  oss << ifs.rdbuf();
+  std::string buf = oss.str();
+
+  nodes_.clear();
+  initializers_.clear();
+  inputs_.clear();
+  outputs_.clear();
+
+  ProtoReader model(buf.data(), buf.data() + buf.size());
+  bool has_graph = false;
+
+  while (!model.eof()) {
+    int wire;
+    int field = model.ReadTag(&wire);
+    if (field == 8) {  // opset_import
+      ProtoReader opset = model.ReadMessage();
+      std::string domain;
+      int64_t version = 0;
+      while (!opset.eof()) {
+        int w;
+        int f = opset.ReadTag(&w);
+        if (f == 1)
+          domain = opset.ReadString();
+        else if (f == 2)
+          version = static_cast<int64_t>(opset.ReadVarint());
+        else
+          opset.Skip(w);
+      }
+      if (domain == "" || domain == "ai.onnx") opset_version_ = version;
+    } else if (field == 7) {  // graph
+      has_graph = true;
+      ProtoReader graph = model.ReadMessage();
+      while (!graph.eof()) {
+        int w;
+        int f = graph.ReadTag(&w);
+        if (f == 1) {
+          nodes_.emplace_back();
+          ParseNode(graph.ReadMessage(), &nodes_.back());
+        } else if (f == 5) {
+          initializers_.emplace_back();
+          ParseTensor(graph.ReadMessage(), &initializers_.back());
+        } else if (f == 11) {
+          inputs_.emplace_back();
+          ParseValueInfo(graph.ReadMessage(), &inputs_.back());
+        } else if (f == 12) {
+          outputs_.emplace_back();
+          ParseValueInfo(graph.ReadMessage(), &outputs_.back());
+        } else {
+          graph.Skip(w);
+        }
+      }
+      if (!graph.ok()) return false;
+    } else {
+      model.Skip(wire);
+    }
+  }
+
+  return model.ok() && has_graph;
+}
@@ -0,0 +1,131 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ONNX_H_
+#define ONNX_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @struct OnnxTensor
+ * Tensor stored in an ONNX file.
+ * Floating point data is converted to float and integer data to int64_t.
+ */
+struct OnnxTensor {
+  std::string name;
+  std::vector<int64_t> dims;
+  int data_type = 0;
+  std::vector<float> floats;
+  std::vector<int64_t> ints;
+
+  bool is_float() const {
+    return data_type == 1 || data_type == 10 || data_type == 11;
+  }
+
+  int64_t size() const {
+    int64_t n = 1;
+    for (auto d : dims) n *= d;
+    return n;
+  }
+};
+
+/**
+ * @struct OnnxAttribute
+ * Attribute of a node. Only the fields used by AQ are kept.
+ */
+struct OnnxAttribute {
+  std::string name;
+  float f = 0.0f;
+  int64_t i = 0;
+  std::string s;
+  OnnxTensor t;
+  std::vector<float> floats;
+  std::vector<int64_t> ints;
+};
+
+/**
+ * @struct OnnxNode
+ * Operator node of an ONNX graph.
+ */
+struct OnnxNode {
+  std::string name;
+  std::string op_type;
+  std::vector<std::string> inputs;
+  std::vector<std::string> outputs;
+  std::unordered_map<std::string, OnnxAttribute> attributes;
+
+  bool has(const std::string& key) const {
+    return attributes.find(key) != attributes.end();
+  }
+
+  int64_t get_int(const std::string& key, int64_t default_value) const {
+    auto itr = attributes.find(key);
+    return itr == attributes.end() ? default_value : itr->second.i;
+  }
+
+  float get_float(const std::string& key, float default_value) const {
+    auto itr = attributes.find(key);
+    return itr == attributes.end() ? default_value : itr->second.f;
+  }
+
+  std::vector<int64_t> get_ints(const std::string& key) const {
+    auto itr = attributes.find(key);
+    return itr == attributes.end() ? std::vector<int64_t>() : itr->second.ints;
+  }
+};
+
+/**
+ * @struct OnnxValueInfo
+ * Name and shape of a graph input or output. Unknown dimensions are -1.
+ */
+struct OnnxValueInfo {
+  std::string name;
+  std::vector<int64_t> dims;
+};
+
+/**
+ * @class OnnxModel
+ * Minimal reader of ONNX files, which decodes the protobuf wire format
+ * directly so that no protobuf library is needed.
+ */
+class OnnxModel {
+ public:
+  /**
+   * Reads an ONNX file. Returns false if the file is not found or broken.
+   */
+  bool Load(const std::string& path);
+
+  int64_t opset_version() const { return opset_version_; }
+  const std::vector<OnnxNode>& nodes() const { return nodes_; }
+  const std::vector<OnnxTensor>& initializers() const { return initializers_; }
+  const std::vector<OnnxValueInfo>& inputs() const { return inputs_; }
+  const std::vector<OnnxValueInfo>& outputs() const { return outputs_; }
+
+ private:
+  int64_t opset_version_ = 0;
+  std::vector<OnnxNode> nodes_;
+  std::vector<OnnxTensor> initializers_;
+  std::vector<OnnxValueInfo> inputs_;
+  std::vector<OnnxValueInfo> outputs_;
+};
+
+#endif  // ONNX_H_
@@ -59,6 +59,15 @@ void InitOptions(Option::OptionsMap* o) {
   (*o)["resign_value"] << Option(0.1);
   (*o)["use_ponder"] << Option(true);
   (*o)["allocate_gpu"] << Option(false);
+  (*o)["use_cpu"] << Option(false);
+  (*o)["num_cpu_threads"] << Option(0, 0, 512);
+  (*o)["cpu_precision"] << Option("fp32");
+  (*o)["eval_cache_mb"] << Option(512, 1, 1 << 20);
+  (*o)["eval_cache_format"] << Option("fp32");
+  (*o)["eval_cache_topk"] << Option(32, 1, 360);
+  (*o)["eval_store_path"] << Option("");
+  (*o)["eval_store_record"] << Option(false);
+  (*o)["eval_store_max_ply"] << Option(30, 0, kMaxPly);
 
   (*o)["main_time"] << Option(0.0);
   (*o)["byoyomi"] << Option(3.0);
@@ -72,8 +81,21 @@ void InitOptions(Option::OptionsMap* o) {
   (*o)["model_path"] << Option("default");
   (*o)["validate_model_path"] << Option("default");
   (*o)["node_size"] << Option(65536, 4096, 67108864);
+  (*o)["retained_node_size"] << Option(32768, 0, 67108864);
+  (*o)["prune_ratio"] << Option(0.05);
+  (*o)["search_stats"] << Option(false);
+  (*o)["trace_file"] << Option("");
+  (*o)["trace_buffer_size"] << Option(65536, 1, 16777216);
+  (*o)["bench_sgf_dir"] << Option("");
+  (*o)["bench_filter"] << Option("");
+  (*o)["bench_warmup"] << Option(3, 0, 10000);
+  (*o)["bench_reps"] << Option(30, 1, 100000);
+  (*o)["bench_output"] << Option("");
+  (*o)["bench_baseline"] << Option("");
+  (*o)["bench_threshold"] << Option(0.05);
 
   (*o)["save_log"] << Option(true);
+  (*o)["log_flush_ms"] << Option(100, -1, 60000);
   (*o)["resume_file_name"] << Option("");
   (*o)["send_list"] << Option(false);
 
@@ -81,6 +103,9 @@ void InitOptions(Option::OptionsMap* o) {
 
   // Seach parameters.
   (*o)["batch_size"] << Option(8, 1, 256);
+  (*o)["batch_latency_ms"] << Option(10.0);
+  (*o)["batch_min_fill"] << Option(0.0);
+  (*o)["eval_symmetries"] << Option(1, 1, 8);
   (*o)["lambda_init"] << Option(0.95);
   (*o)["lambda_delta"] << Option(0.2);
 
@@ -104,6 +129,8 @@ void InitOptions(Option::OptionsMap* o) {
   (*o)["ladder_reduction"] << Option(0.1);
 
   (*o)["num_games"] << Option(1, 1, 1000000);
+  (*o)["num_parallel_games"] << Option(4, 1, 1024);
+  (*o)["num_search_trees"] << Option(4, 1, 64);
   (*o)["use_full_features"] << Option(true);
   (*o)["value_from_black"] << Option(false);
 
@@ -182,8 +209,11 @@ std::string ReadConfiguration(int argc, char** argv) {
   }
 
   std::unordered_set<std::string> executable_modes{
-      "--benchmark",   "--test",  "--self",
-      "--policy_self", "--learn", "--rating"};
+      "--benchmark",         "--benchmark_cache", "--benchmark_suite",
+      "--benchmark_compare", "--test",            "--test_cpu",
+      "--self",              "--parallel_self",   "--policy_self",
+      "--learn",             "--rating",          "--analysis",
+      "--build_eval_store"};
 
   auto trim_str = [](const std::string& str,
                      const char* trim_chars = " \t\v\r\n") {
@@ -0,0 +1,322 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REQUEST_RING_H_
+#define REQUEST_RING_H_
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "./config.h"
+#include "./eval_cache.h"
+
+// -- Futex
+
+/**
+ * Blocks while *addr == expected, for at most timeout_ns nanoseconds if it is
+ * not negative. May return spuriously.
+ */
+inline void FutexWait(std::atomic<uint32_t>* addr, uint32_t expected,
+                      int64_t timeout_ns = -1) {
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "std::atomic<uint32_t> must be lock-free");
+#ifdef _WIN32
+  DWORD ms = timeout_ns < 0 ? INFINITE : (timeout_ns + 999999) / 1000000;
+  WaitOnAddress(addr, &expected, sizeof(expected), ms);
+#elif defined(__linux__)
+  struct timespec ts;
+  struct timespec* pts = nullptr;
+  if (timeout_ns >= 0) {
+    ts.tv_sec = timeout_ns / 1000000000;
+    ts.tv_nsec = timeout_ns % 1000000000;
+    pts = &ts;
+  }
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE,
+          expected, pts, nullptr, 0);
+#else
+  (void)timeout_ns;
+  if (addr->load(std::memory_order_relaxed) == expected)
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+}
+
+/**
+ * Wakes threads blocked in FutexWait on addr.
+ */
+inline void FutexWakeAll(std::atomic<uint32_t>* addr) {
+#ifdef _WIN32
+  WakeByAddressAll(addr);
+#elif defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE,
+          INT_MAX, nullptr, nullptr, 0);
+#else
+  (void)addr;
+#endif
+}
+
+/**
+ * @struct EvalRequest
+ * Slot of RequestRing. A search thread writes the input planes to its row of
+ * the staging buffer, and the batch worker writes the result.
+ */
+struct EvalRequest {
+  enum State : uint32_t { kPending, kSleeping, kDone };
+
+  // Position in the ring which the slot is ready for (see RequestRing).
+  std::atomic<uint64_t> seq;
+  std::atomic<uint32_t> state;
+  std::atomic<int64_t> enqueue_ns;  // steady_clock
+  uint64_t pos;
+  float* inputs;  // Row of the staging buffer.
+  int symmetry_idx;
+  Color next_side;
+  ValueAndProb vp;
+
+  EvalRequest()
+      : seq(0),
+        state(kPending),
+        enqueue_ns(0),
+        pos(0),
+        inputs(nullptr),
+        symmetry_idx(0),
+        next_side(kBlack) {}
+};
+
+/**
+ * @class RequestRing
+ * Bounded MPMC queue of preallocated EvalRequest slots, based on the queue
+ * of Dmitry Vyukov.
+ *
+ * The slots own consecutive rows of a staging buffer of input planes, so a
+ * batch of consecutive slots is a contiguous input of the network unless it
+ * wraps around the end. While a batch is evaluated, the following slots are
+ * filled by search threads, i.e. the ring is a multiple buffer of batches.
+ *
+ * The slot at position pos has seq == pos while free, pos + 1 while queued,
+ * and is handed to the next lap (pos + capacity) by the producer after it
+ * reads the result. So neither producers nor consumers allocate memory or
+ * take locks, and a blocked thread sleeps on a futex.
+ *
+ * @code
+ *  // Search thread:
+ *  EvalRequest* r = ring.Acquire();
+ *  b.WriteFeature(r->inputs);
+ *  ring.Publish(r);
+ *  ring.WaitDone(r);
+ *  vp = r->vp;
+ *  ring.Release(r);
+ *
+ *  // Batch worker:
+ *  size_t n = ring.CountReady(batch_size);
+ *  if (n > 0 && ring.Pop(n, &batch)) {
+ *    ...  // Evaluates the batch.
+ *    for (auto r : batch) ring.Complete(r);
+ *  }
+ * @endcode
+ */
+class RequestRing {
+ public:
+  /**
+   * Allocates at least capacity slots with rows of row_size floats.
+   */
+  RequestRing(size_t capacity, size_t row_size)
+      : row_size_(row_size), enqueue_pos_(0), dequeue_pos_(0) {
+    capacity_ = 1;
+    while (capacity_ < capacity) capacity_ *= 2;
+    mask_ = capacity_ - 1;
+    slots_.reset(new EvalRequest[capacity_]);
+    staging_.reset(new float[capacity_ * row_size_]);
+    for (size_t i = 0; i < capacity_; ++i) {
+      slots_[i].seq.store(i);
+      slots_[i].inputs = staging_.get() + i * row_size_;
+    }
+    arrivals_.store(0);
+    num_sleeping_.store(0);
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  size_t row_size() const { return row_size_; }
+
+  // -- Producer
+
+  /**
+   * Claims the next slot. Waits while it is used by the previous lap, which
+   * only happens if there are more waiting threads than slots.
+   */
+  EvalRequest* Acquire() {
+    uint64_t pos = enqueue_pos_.fetch_add(1, std::memory_order_relaxed);
+    EvalRequest* r = &slots_[pos & mask_];
+    while (r->seq.load(std::memory_order_acquire) != pos)
+      std::this_thread::yield();
+    r->pos = pos;
+    r->state.store(EvalRequest::kPending, std::memory_order_relaxed);
+    return r;
+  }
+
+  /**
+   * Makes the slot visible to consumers.
+   */
+  void Publish(EvalRequest* r) {
+    r->enqueue_ns.store(NowNanoseconds(), std::memory_order_relaxed);
+    r->seq.store(r->pos + 1, std::memory_order_release);
+    // Both sides of the handshake with Wait() are seq_cst, so that either
+    // the consumer sees the arrival or this sees the sleeping consumer.
+    arrivals_.fetch_add(1, std::memory_order_seq_cst);
+    if (num_sleeping_.load(std::memory_order_seq_cst) > 0)
+      FutexWakeAll(&arrivals_);
+  }
+
+  /**
+   * Blocks until a consumer calls Complete(r).
+   */
+  void WaitDone(EvalRequest* r) {
+    uint32_t s = EvalRequest::kPending;
+    if (r->state.compare_exchange_strong(s, EvalRequest::kSleeping,
+                                         std::memory_order_acquire)) {
+      while (r->state.load(std::memory_order_acquire) != EvalRequest::kDone)
+        FutexWait(&r->state, EvalRequest::kSleeping);
+    }
+  }
+
+  /**
+   * Returns the slot to the ring for the next lap.
+   */
+  void Release(EvalRequest* r) {
+    r->seq.store(r->pos + capacity_, std::memory_order_release);
+  }
+
+  // -- Consumer
+
+  /**
+   * Returns the number of consecutive queued requests from the head, up to
+   * max_count.
+   */
+  size_t CountReady(size_t max_count) const {
+    uint64_t head = dequeue_pos_.load(std::memory_order_acquire);
+    size_t n = 0;
+    while (n < max_count &&
+           slots_[(head + n) & mask_].seq.load(std::memory_order_acquire) ==
+               head + n + 1)
+      ++n;
+    return n;
+  }
+
+  /**
+   * Returns the enqueue time of the head request. It may be stale if another
+   * consumer is popping it.
+   */
+  int64_t head_enqueue_ns() const {
+    uint64_t head = dequeue_pos_.load(std::memory_order_acquire);
+    return slots_[head & mask_].enqueue_ns.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Takes n requests from the head. Returns false if another consumer took
+   * them first or they are not ready.
+   */
+  bool Pop(size_t n, std::vector<EvalRequest*>* batch) {
+    uint64_t head = dequeue_pos_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i)
+      if (slots_[(head + i) & mask_].seq.load(std::memory_order_acquire) !=
+          head + i + 1)
+        return false;
+    if (!dequeue_pos_.compare_exchange_strong(head, head + n,
+                                              std::memory_order_acq_rel))
+      return false;
+
+    batch->clear();
+    for (size_t i = 0; i < n; ++i)
+      batch->push_back(&slots_[(head + i) & mask_]);
+    return true;
+  }
+
+  /**
+   * Hands the result to the producer.
+   */
+  void Complete(EvalRequest* r) {
+    if (r->state.exchange(EvalRequest::kDone, std::memory_order_release) ==
+        EvalRequest::kSleeping)
+      FutexWakeAll(&r->state);
+  }
+
+  /**
+   * Returns the number of published requests, which is passed to
+   * WaitArrival() to detect new requests.
+   */
+  uint32_t arrivals() const {
+    return arrivals_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Blocks until a request is published after arrivals() returned seen, for
+   * at most timeout_ns nanoseconds if it is not negative.
+   */
+  void WaitArrival(uint32_t seen, int64_t timeout_ns = -1) {
+    num_sleeping_.fetch_add(1, std::memory_order_seq_cst);
+    if (arrivals_.load(std::memory_order_seq_cst) == seen)
+      FutexWait(&arrivals_, seen, timeout_ns);
+    num_sleeping_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Wakes all consumers, e.g. to stop them.
+   */
+  void WakeConsumers() {
+    arrivals_.fetch_add(1, std::memory_order_release);
+    FutexWakeAll(&arrivals_);
+  }
+
+  static int64_t NowNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+ private:
+  size_t capacity_;
+  size_t mask_;
+  size_t row_size_;
+  std::unique_ptr<EvalRequest[]> slots_;
+  std::unique_ptr<float[]> staging_;
+
+  // Producers and consumers are on separate cache lines. They are padded
+  // instead of aligned, because new does not align over 16 bytes in C++11.
+  char padding0_[64];
+  std::atomic<uint64_t> enqueue_pos_;
+  char padding1_[64];
+  std::atomic<uint64_t> dequeue_pos_;
+  char padding2_[64];
+  std::atomic<uint32_t> arrivals_;
+  std::atomic<int> num_sleeping_;
+  char padding3_[64];
+};
+
+#endif  // REQUEST_RING_H_
@@ -21,7 +21,10 @@
 #define ROUTE_QUEUE_H_
 
 #include <algorithm>
+#include <array>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -37,34 +40,56 @@ enum LeafType { kEvaluated, kWaitEval, kFailToPush, kReachEnd, kLeafNone };
 /**
  * @struct SearchRoute
  * Record of the paths taken in the search tree.
+ * The first kInlineDepth steps are stored inline, so that a route is built
+ * without allocations in most searches. hash is updated incrementally with
+ * each step and is compared before the steps themselves.
  */
 struct SearchRoute {
+  static constexpr int kInlineDepth = 32;
+
   int tree_id;
   int depth;
   int num_requests;
   LeafType leaf;
-  std::vector<Vertex> moves;
-  std::vector<int> child_ids;
-
-  SearchRoute() : depth(0), num_requests(1), tree_id(0), leaf(kLeafNone) {}
+  uint64_t hash;
 
-  SearchRoute(const SearchRoute& rhs)
-      : depth(rhs.depth),
-        num_requests(rhs.num_requests),
-        tree_id(rhs.tree_id),
-        leaf(rhs.leaf),
-        moves(rhs.moves),
-        child_ids(rhs.child_ids) {}
+  SearchRoute()
+      : tree_id(0), depth(0), num_requests(1), leaf(kLeafNone), hash(0) {}
 
   bool operator==(const SearchRoute& rhs) const {
-    return depth == rhs.depth && tree_id == rhs.tree_id && moves == rhs.moves &&
-           child_ids == rhs.child_ids;
+    if (hash != rhs.hash || depth != rhs.depth || tree_id != rhs.tree_id)
+      return false;
+    for (int i = 0; i < depth; ++i)
+      if (step(i) != rhs.step(i)) return false;
+    return true;
+  }
+
+  Vertex move(int i) const {
+    return static_cast<Vertex>(static_cast<int>(step(i) >> 32));
   }
 
+  int child_id(int i) const { return static_cast<int>(step(i)); }
+
   void Add(Vertex v, int child_id) {
-    moves.push_back(v);
-    child_ids.push_back(child_id);
+    uint64_t s = (static_cast<uint64_t>(static_cast<uint32_t>(v)) << 32) |
+                 static_cast<uint32_t>(child_id);
+    if (depth < kInlineDepth)
+      inline_steps_[depth] = s;
+    else
+      overflow_steps_.push_back(s);
     ++depth;
+    hash = (hash ^ s) * 0x100000001b3ULL;  // FNV-1a
+  }
+
+ private:
+  // A step packs the move in the upper 32 bits and the child index in the
+  // lower ones.
+  std::array<uint64_t, kInlineDepth> inline_steps_;
+  std::vector<uint64_t> overflow_steps_;
+
+  uint64_t step(int i) const {
+    return i < kInlineDepth ? inline_steps_[i]
+                            : overflow_steps_[i - kInlineDepth];
   }
 };
 
@@ -104,12 +129,17 @@ struct RouteEntry {
  * Queue class that exclusively stores a RouteEntry.
  * Used for managing common node information while searching in multiple search
  * trees during training.
+ * Entries are indexed by the board key. The index assumes that entries are
+ * not inserted or removed except by push() and clear().
  */
 class RouteQueue {
  public:
   RouteQueue() {}
 
-  void clear() { entries_.clear(); }
+  void clear() {
+    entries_.clear();
+    index_.clear();
+  }
 
   int size() const { return entries_.size(); }
 
@@ -117,14 +147,11 @@ class RouteQueue {
     Key key = b.key();
 
     std::lock_guard<std::mutex> lock(mx_);
-    auto itr =
-        find_if(entries_.begin(), entries_.end(), [key](const RouteEntry& e) {
-          return e.key == key && e.has_node_ptr();
-        });
-
-    if (itr != entries_.end()) {
-      itr->AddRoute(route);
+    auto itr = index_.find(key);
+    if (itr != index_.end() && entries_[itr->second].has_node_ptr()) {
+      entries_[itr->second].AddRoute(route);
     } else {
+      index_[key] = entries_.size();
       entries_.emplace_back(b, route);
     }
   }
@@ -134,6 +161,7 @@ class RouteQueue {
  private:
   std::mutex mx_;
   std::vector<RouteEntry> entries_;
+  std::unordered_map<Key, size_t> index_;  // Key -> index in entries_
 };
 
 #endif  // ROUTE_QUEUE_H_
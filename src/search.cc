@@ -73,10 +73,12 @@ void SearchTree::UpdateNodeVP(Node* nd, const ValueAndProb& vp) {
 template <bool NNSearch>
 double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
                                 RouteQueue* eq, EvalCache* cache) {
+  SearchStats& stats = SearchStats::Get();
+  SearchStats::Timer select_timer(kPhaseSelect);
   ChildNode* child;
 
   // 1. Chooses the move with the highest action value.
-  int selected_id = 0;
+  int selected_id = -1;
   double max_action_value = -128;
 
   double nd_rollout_rate = nd->rollout_rate();
@@ -131,17 +133,26 @@ double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
         rate + cp_nd * child->prob() * sqrt(num_nd_games) / (1 + num_cn_games);
 
     // d. Updates max_action_value.
-    if (action_value > max_action_value && b->IsLegal(child->move())) {
+    if (action_value > max_action_value && b->IsLegal(child->move()) &&
+        !analyze_snapshot_.options().Filters(b->side_to_move(), child->move(),
+                                             route->depth)) {
       max_action_value = action_value;
       selected_id = i;
     }
   }
 
+  // Passes if analysis filters exclude all legal moves. Pass is the last
+  // child and is always legal.
+  if (selected_id < 0) selected_id = nd->num_children() - 1;
+
   // 2. Searches for the move with the maximum action value.
   child = &nd->children[selected_id];
   nd->VirtualLoss<NNSearch>(selected_id, virtual_loss_);
 
-  child->WaitForComplete();
+  select_timer.Stop();
+
+  int num_spins = child->WaitForComplete();
+  if (num_spins > 0) stats.Count(kCounterWaitSpins, num_spins);
   Node* nnd = child->has_next() ? child->next_ptr() : nullptr;
 
   route->Add(child->move(), selected_id);
@@ -195,6 +206,7 @@ double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
       route->leaf = kReachEnd;
     } else {
       if (stop_think_ || !child->SetCreatingState()) {
+        stats.Count(kCounterFailToPush);
         route->leaf = kFailToPush;
         nd->VirtualLoss<true>(selected_id, -virtual_loss_);
         return 0.0;
@@ -202,18 +214,25 @@ double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
 
       ValueAndProb vp;
       bool found_cache = false;
-      if (cache == nullptr)
-        found_cache = eval_cache_.Probe(*b, &vp);
-      else
-        found_cache = cache->Probe(*b, &vp);
+      {
+        SearchStats::Timer t(kPhaseCacheProbe);
+        if (cache == nullptr)
+          found_cache = cache_->Probe(*b, &vp);
+        else
+          found_cache = cache->Probe(*b, &vp);
+      }
+      if (found_cache) stats.Count(kCounterCacheHits);
 
       if (!found_cache) {
         if (eq == nullptr) {
-          eval_worker_->Evaluate(b->get_feature(), &vp);
+          {
+            SearchStats::Timer t(kPhaseEvalWait);
+            eval_worker_->Evaluate(*b, &vp);
+          }
           if (cache == nullptr)
-            eval_cache_.Insert(b->key(), vp);
+            cache_->Insert(*b, vp);
           else
-            cache->Insert(b->key(), vp);
+            cache->Insert(*b, vp);
         } else {
           eq->push(*b, *route);
           route->leaf = kWaitEval;
@@ -221,8 +240,10 @@ double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
         }
       }
 
+      SearchStats::Timer expand_timer(kPhaseExpand);
       std::unique_ptr<Node> pnd =
           std::move(std::unique_ptr<Node>(new Node(*b)));
+      expand_timer.Stop();
       pnd->AddValueOnce(vp.value);
       SetNextNode(nd, selected_id, &pnd, vp);
       child->SetCompleteState();
@@ -237,10 +258,12 @@ double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
   if (nnd != nullptr) {  // Goes to next node.
     result = -SearchBranch<NNSearch>(child->next_ptr(), b, route, eq, cache);
   } else if (!NNSearch) {  // Rollout.
+    SearchStats::Timer t(kPhaseRollout);
     Color winner = b->Rollout(komi_);
     result = winner == kEmpty ? 0 : winner == c_nd ? 1 : -1;
   }
 
+  SearchStats::Timer backup_timer(kPhaseBackup);
   if (!NNSearch) {
     nd->VirtualWin<false>(selected_id, virtual_loss_, 1, result);
   } else if (route->leaf == kFailToPush) {
@@ -253,12 +276,23 @@ double SearchTree::SearchBranch(Node* nd, Board* b, SearchRoute* route,
   return result;
 }
 
+template double SearchTree::SearchBranch<true>(Node*, Board*, SearchRoute*,
+                                               RouteQueue*, EvalCache*);
+template double SearchTree::SearchBranch<false>(Node*, Board*, SearchRoute*,
+                                                RouteQueue*, EvalCache*);
+
 Vertex SearchTree::Search(const Board& b, double time_limit,
                           double* winning_rate, bool is_errout, bool ponder,
                           int lizzie_interval) {
+  TraceScope trace("search");
   const auto t0 = std::chrono::system_clock::now();
+  search_start_ = t0;
+  SearchStats::Snapshot stats0;
+  if (is_errout) stats0 = SearchStats::Get().Collect();
+  first_playout_time_ = -1.0;
 
-  // 1. Updates root node.
+  // 1. Updates root node. A search from the empty board starts a new tree,
+  //    because trees of a previous game may have another komi.
   if (b.game_ply() == 0 && !ponder) RootNode::Init();
 
   // 2. If the root node is not evaluated, evaluates the probability.
@@ -316,6 +350,8 @@ Vertex SearchTree::Search(const Board& b, double time_limit,
   } else {  // 7-2. Normal search
     {
       int num_prev_games = nd->num_total_values();
+      uint64_t num_prev_dedup =
+          eval_worker_ ? eval_worker_->num_deduplicated() : 0;
 
       double think_time = time_limit;
       bool extendable = false;
@@ -381,6 +417,22 @@ Vertex SearchTree::Search(const Board& b, double time_limit,
             (nd->num_total_values() - num_prev_games),
             (nd->num_total_values() - num_prev_games) / elapsed_time /
                 num_gpus_);
+        if (eval_worker_) {
+          PrintLog(
+              "batch size: %s\nqueue wait: %s\ndeduplicated: %d\n"
+              "first playout: %.1f[msec]\n",
+              eval_worker_->batch_size_histogram().ToString().c_str(),
+              eval_worker_->queue_wait_histogram().ToString("us").c_str(),
+              static_cast<int>(eval_worker_->num_deduplicated() -
+                               num_prev_dedup),
+              first_playout_time_ * 1000);
+        }
+        if (SearchStats::Get().enabled()) {
+          PrintLog("stats: %s\n", (SearchStats::Get().Collect() - stats0)
+                                      .ToJson()
+                                      .Dump()
+                                      .c_str());
+        }
       }
     }
   }
@@ -434,15 +486,25 @@ Vertex SearchTree::Search(const Board& b, double time_limit,
 
 void SearchTree::EvaluateWorker(const Board& b, double time_limit, bool ponder,
                                 int th_id) {
+  Tracer::Get().SetThreadName("search");
   const auto t0 = std::chrono::system_clock::now();
   auto nd = root_node();
   int num_initial_games = nd->num_total_values();
   Board b_;
 
-  while (!stop_think_) {
+  while (!stop_think_ && !prune_requested_) {
     b_ = b;
     SearchRoute route;
-    SearchBranch<true>(root_node(), &b_, &route);
+    {
+      TraceScope trace("playout");
+      SearchBranch<true>(root_node(), &b_, &route);
+    }
+    SearchStats::Get().Count(kCounterPlayouts);
+    if (first_playout_time_ < 0) {
+      double expected = -1.0;
+      first_playout_time_.compare_exchange_strong(expected,
+                                                  ElapsedTime(search_start_));
+    }
     double elapsed_time = th_id == 0 ? ElapsedTime(t0) : 0.0;
 
     bool reach_limit =
@@ -450,7 +512,12 @@ void SearchTree::EvaluateWorker(const Board& b, double time_limit, bool ponder,
     bool reach_ends =
         (num_reach_ends_ >= 10000 ||
          (search_limit_ > 0 && num_reach_ends_ >= 2 * search_limit_));
-    bool exceed_time = elapsed_time > time_limit || entry_rate() > 0.9;
+    bool is_full = entry_rate() > 0.9;
+    if (is_full && ponder && prune_ratio_ > 0) {
+      prune_requested_ = true;
+      break;
+    }
+    bool exceed_time = elapsed_time > time_limit || is_full;
 
     if (reach_limit || reach_ends || exceed_time) {
       stop_think_ = true;
@@ -484,7 +551,7 @@ void SearchTree::EvaluateWorker(const Board& b, double time_limit, bool ponder,
 
 double SearchTree::FinalScore(const Board& b, Vertex next_move,
                               int num_policy_moves, int num_playouts,
-                              Board::OwnerMap* owner, TensorEngine* engine,
+                              Board::OwnerMap* owner, InferEngine* engine,
                               EvalCache* cache) {
   Board b_policy = b;
   if (next_move <= kPass && b.IsLegal(next_move))
@@ -497,7 +564,7 @@ double SearchTree::FinalScore(const Board& b, Vertex next_move,
     if (validate_engine_)
       cache = &validate_cache_;
     else
-      cache = &eval_cache_;
+      cache = cache_;
   }
 
   auto DoesInduceNakade = [](const Board& b, Vertex v) {
@@ -564,9 +631,9 @@ double SearchTree::FinalScore(const Board& b, Vertex next_move,
       else if (validate_engine_)
         validate_engine_->Infer(ft, &vp);
       else
-        eval_worker_->Evaluate(ft, &vp);
+        eval_worker_->Evaluate(ft, &vp, kHighPriority);
 
-      cache->Insert(b_policy.key(), vp);
+      cache->Insert(b_policy, vp);
     }
 
     std::vector<std::pair<float, int>> sorted_candidates;
@@ -751,7 +818,7 @@ double SearchTree::FinalScore(const Board& b, Vertex next_move,
 
 Vertex SearchTree::ShouldPass(const Board& b, Vertex next_move,
                               int num_policy_moves, int num_playouts,
-                              TensorEngine* engine, EvalCache* cache) {
+                              InferEngine* engine, EvalCache* cache) {
   auto scores = b.RolloutScores(num_playouts, kPass, -1, true, false);
   double total_wins = 0.0;
   for (auto& score_and_games : scores) {
@@ -804,16 +871,16 @@ Vertex SearchTree::ShouldPass(const Board& b, Vertex next_move,
   if (nv >= kPass || !need_fills.empty()) {
     ValueAndProb vp;
     Board b_ = b;
-    if (cache == nullptr) cache = &eval_cache_;
+    if (cache == nullptr) cache = cache_;
 
     if (cache->Probe(b_, &vp) == false) {
       Feature ft(b_.get_feature());
       if (engine)
         engine->Infer(ft, &vp);
       else
-        eval_worker_->Evaluate(ft, &vp);
+        eval_worker_->Evaluate(ft, &vp, kHighPriority);
 
-      cache->Insert(b_.key(), vp);
+      cache->Insert(b_, vp);
     }
 
     std::vector<std::pair<float, int>> sorted_candidates;
@@ -994,42 +1061,3 @@ void SearchTree::PrintCandidates(const Node* nd, int next_move,
     if (pickup_next && i == 0) ost << "--" << std::endl;
   }
 }
-
-void SearchTree::LizzieInfo(const Node* nd, std::ostream& ost) const {
-  if (!nd) return;
-  std::vector<ChildNode*> candidates = SortChildren(*nd);
-  std::regex re(" ->|->");
-  bool need_space = false;
-  int cutoff = 0;
-
-  for (int i = 0, imax = nd->num_children(); i < imax; ++i) {
-    ChildNode* child = candidates[i];
-    int num_games = child->num_values();
-
-    if (i != 0 && num_games == 0) break;
-    if (!cutoff) cutoff = static_cast<int>(sqrt(num_games));
-    if (num_games < cutoff) break;
-
-    double rollout_rate = (child->rollout_rate() + 1) / 2;
-    double value_rate = (child->value_rate() + 1) / 2;
-    double rate = (1 - lambda_) * rollout_rate + lambda_ * value_rate;
-    int depth = 1;
-    std::string seq;
-    if (child->has_next()) {
-      depth = MaxDepth(*child->next_ptr(), kVtNull, 1);
-      seq = PV(child->next_ptr(), child->move(), depth);
-      seq = std::regex_replace(seq, re, " ");
-    }
-
-    if (need_space) ost << " ";
-    ost << "info move " << v2str(child->move());
-    ost << " visits " << num_games;
-    ost << " winrate " << static_cast<int>(rate * 10000);
-    ost << " prior " << static_cast<int>(child->prob() * 10000);
-    ost << " order " << i;
-    ost << " pv " << seq;
-    need_space = seq.back() != ' ';
-  }
-
-  ost << std::endl;
-}
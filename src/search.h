@@ -26,19 +26,23 @@
 #include <functional>
 #include <iomanip>
 #include <memory>
-#include <regex>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "./analyze_snapshot.h"
 #include "./board.h"
 #include "./eval_cache.h"
 #include "./eval_worker.h"
-#include "./network.h"
+#include "./infer_engine.h"
+#include "./log_service.h"
 #include "./node.h"
 #include "./option.h"
+#include "./search_stats.h"
 #include "./timer.h"
+#include "./trace.h"
+#include "./tree_snapshot.h"
 
 /**
  * @class SearchTree
@@ -72,7 +76,7 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
 
   bool consider_pass() const { return consider_pass_; }
 
-  std::ofstream* log_file() const { return log_file_.get(); }
+  std::ostream* log_file() const { return log_file_.get(); }
 
   bool has_eval_worker() const { return static_cast<bool>(eval_worker_); }
 
@@ -80,6 +84,15 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
 
   void set_komi(double val) { komi_ = val; }
 
+  void set_search_limit(int val) { search_limit_ = val; }
+
+  /**
+   * Sets the number of symmetries averaged in the evaluation of a new root.
+   */
+  void set_root_symmetries(int val) {
+    root_symmetries_ = std::max(1, std::min(val, kNumSymmetry));
+  }
+
   void set_num_reach_ends(int val) { num_reach_ends_.store(val); }
 
   void UpdateLambda(int ply) {
@@ -92,40 +105,115 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
                                   (lambda_move_end_ - lambda_move_start_)));
   }
 
+  /**
+   * Saves the search tree under the root node to path.
+   */
+  bool SaveTree(const std::string& path, std::string* error) const {
+    if (root_node() == nullptr) {
+      *error = "no search tree";
+      return false;
+    }
+    return TreeSnapshot::Save(*root_node(), path, error);
+  }
+
+  /**
+   * Replaces the search tree with the one saved for b in path, so that the
+   * next search of b resumes with its playouts.
+   */
+  bool LoadTree(const Board& b, const std::string& path, std::string* error) {
+    std::unique_ptr<Node> pnd;
+    int num_nodes = 0;
+    if (!TreeSnapshot::Load(path, b, max_num_entries(), &pnd, &num_nodes,
+                            error))
+      return false;
+    RootNode::set_node(&pnd, num_nodes);
+    return true;
+  }
+
   void StopToThink() { stop_think_.store(true); }
 
   void PrepareToThink() { stop_think_.store(false); }
 
   void SetLogFile(std::string log_path) {
-    if (log_file_) {
-      log_file_->close();
-      log_file_.reset();
-    }
-    log_file_ = std::move(std::unique_ptr<std::ofstream>(
-        new std::ofstream(log_path, std::ofstream::out)));
+    log_file_.reset();
+    log_file_.reset(new LogStream(log_path));
   }
 
   void PrintBoardLog(const Board& b) {
-    if (Options["save_log"]) std::cerr << b;
-    if (log_file_) *(log_file_.get()) << b;
+    std::stringstream ss;
+    ss << b;
+    if (Options["save_log"]) LogService::Get().Append("", ss.str());
+    if (log_file_) *(log_file_.get()) << ss.str() << std::flush;
+  }
+
+  void InitEvalCache() { cache_->Init(); }
+
+  /**
+   * Opens the persistent evaluation store, and starts recording evaluations
+   * of opening positions if '--eval_store_record=on'.
+   */
+  void InitEvalStore() {
+    std::string path = Options["eval_store_path"];
+    eval_cache_.set_store(nullptr);
+    eval_cache_.set_recorder(nullptr);
+    if (path.empty()) return;
+
+    if (eval_store_.Open(path)) {
+      eval_cache_.set_store(&eval_store_);
+      std::cerr << "eval store: " << eval_store_.num_entries()
+                << " positions in " << path << std::endl;
+    }
+    if (Options["eval_store_record"].get_bool()) {
+      eval_store_recorder_.reset(
+          new EvalStoreBuilder(Options["eval_store_max_ply"].get_int()));
+      eval_cache_.set_recorder(eval_store_recorder_.get());
+    }
   }
 
-  void InitEvalCache() { eval_cache_.Init(); }
+  /**
+   * Merges recorded evaluations into the persistent store.
+   */
+  void SaveEvalStore() {
+    if (!eval_store_recorder_ || eval_store_recorder_->size() == 0) return;
+    std::string path = Options["eval_store_path"];
+    eval_cache_.set_store(nullptr);
+    eval_cache_.set_recorder(nullptr);
+    eval_store_recorder_->Merge(eval_store_);
+    eval_store_.Close();
+
+    if (eval_store_recorder_->Write(path))
+      std::cerr << "eval store: saved " << eval_store_recorder_->size()
+                << " positions to " << path << std::endl;
+    eval_store_recorder_.reset();
+  }
 
-  void ReplaceModel(std::vector<int> gpu_ids, std::string model_path = "") {
-    eval_worker_->ReplaceModel(gpu_ids, model_path);
+  /**
+   * Loads a new model in the background. The evaluation cache stops serving
+   * evaluations of the current model once the new one is used.
+   */
+  void ReplaceModel(std::string model_path = "") {
+    eval_worker_->ReplaceModel(model_path);
   }
 
-  void InitEvalWorker(std::vector<int> list_gpus, std::string model_path = "") {
+  /**
+   * Starts the evaluation worker for num_trees trees, which share it by
+   * ShareEvaluator().
+   */
+  void InitEvalWorker(std::vector<int> list_gpus, std::string model_path = "",
+                      int num_trees = 1) {
     if (list_gpus.empty()) {
       for (int i = 0; i < num_gpus_; ++i) {
         list_gpus.push_back(i);
       }
     }
 
-    eval_worker_ = std::move(std::unique_ptr<EvalWorker>(new EvalWorker()));
+    eval_worker_ = std::move(std::unique_ptr<EvalWorker>(
+        new EvalWorker(num_trees * num_threads_)));
     eval_worker_->Init(list_gpus, model_path);
-    eval_cache_.Resize(300000);
+    eval_cache_.Resize(Options["eval_cache_mb"].get_int(),
+                       Options["eval_cache_format"].get_string(),
+                       Options["eval_cache_topk"].get_int());
+    InitEvalStore();
 
     if (Options["rule"].get_int() == kJapanese &&
         Options["validate_model_path"].get_string() != "") {
@@ -136,22 +224,42 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
         validate_model_path =
             JoinPath(Options["working_dir"], "engine", "model_cn.engine");
       }
-      validate_engine_ = std::move(std::unique_ptr<TensorEngine>(
-          new TensorEngine(list_gpus[0], Options["batch_size"].get_int())));
+      validate_engine_ =
+          CreateEngine(list_gpus[0], Options["batch_size"].get_int());
       validate_engine_->Init(validate_model_path);
     }
 
     stop_think_ = false;
   }
 
-  void SetGPUAndMemory() {
+  /**
+   * Allocates the evaluation worker and the node table. num_trees is the
+   * number of trees sharing the worker, including this one.
+   */
+  void SetGPUAndMemory(int num_trees = 1) {
     std::vector<int> list_gpus;
     for (int i = 0; i < num_gpus_; ++i) list_gpus.push_back(i);
 
-    InitEvalWorker(list_gpus);
-    RootNode::Resize(Options["node_size"].get_int());
+    InitEvalWorker(list_gpus, "", num_trees);
+    RootNode::Resize(Options["node_size"].get_int(),
+                     Options["retained_node_size"].get_int());
+  }
+
+  /**
+   * Uses the evaluation worker and cache of owner instead of its own ones,
+   * so that batches are filled by threads of multiple trees, and allocates
+   * the node table as SetGPUAndMemory(). owner must outlive this tree, and
+   * be set up with SetGPUAndMemory() for all trees.
+   */
+  void ShareEvaluator(SearchTree* owner) {
+    eval_worker_ = owner->eval_worker_;
+    cache_ = owner->cache_;
+    RootNode::Resize(Options["node_size"].get_int(),
+                     Options["retained_node_size"].get_int());
   }
 
+  EvalWorker* eval_worker() const { return eval_worker_.get(); }
+
   void Init() {
     num_gpus_ = Options["num_gpus"].get_int();
     num_threads_ = Options["num_threads"].get_int();
@@ -159,16 +267,28 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
     use_dirichlet_noise_ = Options["use_dirichlet_noise"].get_bool();
     reflesh_root_ = false;  // (bool)Options["use_dirichlet_noise"];
     consider_pass_ = Options["rule"].get_int() == kJapanese;
+    prune_ratio_ = Options["prune_ratio"].get_double();
+    // aq-stats may have enabled it during the session.
+    if (Options["search_stats"].get_bool())
+      SearchStats::Get().set_enabled(true);
     log_file_.reset();
     stop_think_ = false;
+    prune_requested_ = false;
+    cache_ = &eval_cache_;
+    root_symmetries_ = 1;
     InitRoot();
   }
 
-  void InitRoot() {
+  /**
+   * Initializes the root node. If retain_tree is true, the current tree is
+   * kept so that it is reused when its positions are searched again, which
+   * is only used by undo.
+   */
+  void InitRoot(bool retain_tree = false) {
     lambda_ = lambda_init_;
     num_evaluated_ = 0;
     num_reach_ends_ = 0;
-    RootNode::Init();
+    RootNode::Init(retain_tree);
     Timer::Init();
   }
 
@@ -226,10 +346,28 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
     if (reflesh_root_) nd->set_num_total_values(1);
   }
 
+  /**
+   * Evaluates ft with root_symmetries_ symmetries from a random one, and
+   * averages the results.
+   */
+  void EvaluateSymmetries(const Feature& ft, ValueAndProb* vp) {
+    int symmetry_idx = RandSymmetry();
+    ValueAndProb sum;
+    for (int i = 0; i < root_symmetries_; ++i) {
+      eval_worker_->Evaluate(ft, vp, kHighPriority,
+                             (symmetry_idx + i) % kNumSymmetry);
+      sum.value += vp->value;
+      for (int j = 0; j < kNumRvts; ++j) sum.prob[j] += vp->prob[j];
+    }
+    vp->value = sum.value / root_symmetries_;
+    for (int j = 0; j < kNumRvts; ++j)
+      vp->prob[j] = sum.prob[j] / root_symmetries_;
+  }
+
   /**
    * Updates the root node.
    */
-  void UpdateRoot(const Board& b, TensorEngine* engine = nullptr) {
+  void UpdateRoot(const Board& b, InferEngine* engine = nullptr) {
     Vertex v = b.move_before();
     bool has_child = RootNode::ShiftRootNode(v, b);
     if (!has_child) {
@@ -238,8 +376,10 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
 
       if (engine) {
         engine->Infer(ft, &vp);
+      } else if (root_symmetries_ == 1) {
+        eval_worker_->Evaluate(ft, &vp, kHighPriority);
       } else {
-        eval_worker_->Evaluate(ft, &vp);
+        EvaluateSymmetries(ft, &vp);
       }
 
       CreateNode(root_node(), b, vp);
@@ -262,17 +402,23 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
   /**
    * Writes out text to the log file.
    * Outputs to standard error output when save_log mode.
+   * Both are written by LogService in the background.
    */
   void PrintLog(const char* output_text, ...) {
     va_list args;
-    char buf[1024];
+    va_start(args, output_text);
+    int len = vsnprintf(nullptr, 0, output_text, args);
+    va_end(args);
+    if (len <= 0) return;
 
+    std::string buf(len + 1, '\0');
     va_start(args, output_text);
-    vsprintf(buf, output_text, args);
+    vsnprintf(&buf[0], buf.size(), output_text, args);
     va_end(args);
+    buf.resize(len);
 
-    if (Options["save_log"]) std::cerr << buf;
-    if (log_file_) *(log_file_.get()) << buf;
+    if (Options["save_log"]) LogService::Get().Append("", buf);
+    if (log_file_) *(log_file_.get()) << buf << std::flush;
   }
 
   /**
@@ -364,11 +510,16 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
    * Rollouts in a single thread.
    */
   void RolloutWorker(const Board& b) {
+    Tracer::Get().SetThreadName("rollout");
     Board b_;
-    while (!stop_think_) {
+    while (!stop_think_ && !prune_requested_) {
       b_ = b;
       SearchRoute route;
-      SearchBranch<false>(root_node(), &b_, &route);
+      {
+        TraceScope trace("rollout_playout");
+        SearchBranch<false>(root_node(), &b_, &route);
+      }
+      SearchStats::Get().Count(kCounterRollouts);
     }
   }
 
@@ -390,23 +541,57 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
         std::max(num_rollout_threads, num_threads_ - num_evaluate_threads);
     int num_total_threads = num_evaluate_threads + num_rollout_threads;
 
-    std::vector<std::thread> ths;
-    for (int i = 0; i < num_total_threads; ++i) {
-      if (i < num_evaluate_threads)
-        ths.push_back(std::thread(&SearchTree::EvaluateWorker, this, b,
-                                  time_limit, ponder, i));
-      else
-        ths.push_back(std::thread(&SearchTree::RolloutWorker, this, b));
+    const auto t0 = std::chrono::system_clock::now();
+    for (;;) {
+      double left_time = time_limit - ElapsedTime(t0);
+      std::vector<std::thread> ths;
+      for (int i = 0; i < num_total_threads; ++i) {
+        if (i < num_evaluate_threads)
+          ths.push_back(std::thread(&SearchTree::EvaluateWorker, this, b,
+                                    left_time, ponder, i));
+        else
+          ths.push_back(std::thread(&SearchTree::RolloutWorker, this, b));
+      }
+
+      if (ponder && lizzie_interval > 0) {
+        // Sleeps in short slices so that a new command stops it promptly.
+        do {
+          analyze_snapshot_.Write(*nd, b, lambda_, std::cout);
+          for (int t = 0;
+               t < lizzie_interval && !stop_think_ && !prune_requested_;
+               t += 5)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        } while (!stop_think_ && !prune_requested_);
+      }
+
+      for (std::thread& th : ths) th.join();
+
+      // Resumes pondering after pruning when the tree is full.
+      if (!prune_requested_ || stop_think_) break;
+      prune_requested_ = false;
+      if (!PruneTree()) break;
     }
+    prune_requested_ = false;
+  }
 
-    if (ponder && lizzie_interval > 0) {
-      do {
-        LizzieInfo(nd, std::cout);
-        std::this_thread::sleep_for(std::chrono::milliseconds(lizzie_interval));
-      } while (!stop_think_);
+  /**
+   * Prunes subtrees with few visits relative to their siblings until half of
+   * node_size is free. The ratio is doubled up to 1 if not enough nodes are
+   * pruned. Returns false if the tree is still full.
+   */
+  bool PruneTree() {
+    TraceScope trace("prune");
+    const auto t0 = std::chrono::system_clock::now();
+    int num_prev_entries = num_entries();
+    int target = max_num_entries() / 2;
+    for (double r = prune_ratio_; num_entries() > target; r *= 2) {
+      PruneSubtrees(std::min(r, 1.0));
+      if (r >= 1.0) break;
     }
 
-    for (std::thread& th : ths) th.join();
+    PrintLog("pruned %d[nodes] in %.3f[sec], %d[nodes] left\n",
+             num_prev_entries - num_entries(), ElapsedTime(t0), num_entries());
+    return entry_rate() <= 0.9;
   }
 
   /**
@@ -414,7 +599,7 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
    */
   double FinalScore(const Board& b, Vertex next_move, int num_policy_moves,
                     int num_playouts, Board::OwnerMap* owner,
-                    TensorEngine* engine = nullptr, EvalCache* cache = nullptr);
+                    InferEngine* engine = nullptr, EvalCache* cache = nullptr);
 
   /**
    * Returns whether or not a pass should be made.
@@ -422,7 +607,7 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
    * returns it.
    */
   Vertex ShouldPass(const Board& b, Vertex next_move, int num_policy_moves,
-                    int num_playouts, TensorEngine* engine = nullptr,
+                    int num_playouts, InferEngine* engine = nullptr,
                     EvalCache* cache = nullptr);
 
   /**
@@ -439,9 +624,12 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
                        bool flip_value = false) const;
 
   /**
-   * Outputs information on candidate moves for Lizzie.
+   * Sets the format and move filters of lz-analyze and kata-analyze.
+   * The filters restrict the search until they are reset.
    */
-  void LizzieInfo(const Node* nd, std::ostream& ost) const;
+  void set_analyze_options(const AnalyzeOptions& options) {
+    analyze_snapshot_.set_options(options);
+  }
 
  private:
   double lambda_;
@@ -451,16 +639,26 @@ class SearchTree : public RootNode, public Timer, public SearchParameter {
   bool use_dirichlet_noise_;
   bool reflesh_root_;
   bool consider_pass_;
+  int root_symmetries_;
+  double prune_ratio_;
   std::atomic<bool> stop_think_;
+  std::atomic<bool> prune_requested_;
   std::atomic<int> num_evaluated_;
   std::atomic<int> num_reach_ends_;
+  std::chrono::system_clock::time_point search_start_;
+  std::atomic<double> first_playout_time_;  // sec, negative until done
 
+  AnalyzeSnapshot analyze_snapshot_;
   EvalCache validate_cache_;
-  EvalCache eval_cache_;
-
-  std::unique_ptr<std::ofstream> log_file_;
-  std::unique_ptr<TensorEngine> validate_engine_;
-  std::unique_ptr<EvalWorker> eval_worker_;
+  // Sized by InitEvalWorker(), and left minimal if the evaluator is shared.
+  EvalCache eval_cache_{0};
+  EvalCache* cache_;  // eval_cache_ or that of the owner of eval_worker_.
+  EvalStore eval_store_;
+  std::unique_ptr<EvalStoreBuilder> eval_store_recorder_;
+
+  std::unique_ptr<LogStream> log_file_;
+  std::unique_ptr<InferEngine> validate_engine_;
+  std::shared_ptr<EvalWorker> eval_worker_;
 };
 
 #endif  // SEARCH_H_
@@ -0,0 +1,321 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SEARCH_STATS_H_
+#define SEARCH_STATS_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+
+#include "./json.h"
+
+/**
+ * @enum SearchPhase
+ * Phases of a search whose durations are measured.
+ */
+enum SearchPhase : int {
+  kPhaseSelect = 0,  // Choosing a child in SearchTree::SearchBranch().
+  kPhaseExpand,      // Creating a node from a board.
+  kPhaseCacheProbe,  // Probing the evaluation cache.
+  kPhaseEvalWait,    // Waiting for an evaluation in a search thread.
+  kPhaseQueueWait,   // From enqueueing a request to its pickup for a batch.
+  kPhaseInfer,       // Inference of a batch.
+  kPhaseBackup,      // Updating statistics of a node with a result.
+  kPhaseRollout,     // Rollout from a leaf.
+  kNumPhases,
+};
+
+/**
+ * @enum SearchCounter
+ * Events of a search which are counted.
+ */
+enum SearchCounter : int {
+  kCounterPlayouts = 0,  // Descents with evaluation.
+  kCounterRollouts,      // Descents with rollout.
+  kCounterCacheHits,     // Probes found in the evaluation cache.
+  kCounterWaitSpins,     // Spins in ChildNode::WaitForComplete().
+  kCounterFailToPush,    // Descents which found a child being created.
+  kNumCounters,
+};
+
+/**
+ * @class SearchStats
+ * SearchStats class collects counters and duration histograms of search
+ * phases from all search and evaluation threads.
+ *
+ * Each thread adds to its own slot with relaxed atomic operations, so that
+ * threads do not share cache lines, and the slots are summed up when read.
+ * The slot of an exited thread is reused by the next new thread.
+ * Durations are counted in buckets of a quarter octave in nanoseconds.
+ *
+ * @code
+ *  SearchStats::Snapshot s0 = SearchStats::Get().Collect();
+ *  {
+ *    SearchStats::Timer t(kPhaseSelect);
+ *    ...
+ *  }
+ *  std::cerr << (SearchStats::Get().Collect() - s0).ToJson().Dump();
+ * @endcode
+ */
+class SearchStats {
+ public:
+  static constexpr int kNumSlots = 64;
+  static constexpr int kNumBuckets = 160;  // Up to 2^40 ns.
+
+  /**
+   * Sums of all slots at a moment.
+   */
+  struct Snapshot {
+    std::array<uint64_t, kNumCounters> counters;
+    std::array<uint64_t, kNumPhases> counts;
+    std::array<uint64_t, kNumPhases> sums_ns;
+    std::array<std::array<uint64_t, kNumBuckets>, kNumPhases> buckets;
+
+    Snapshot() {
+      counters.fill(0);
+      counts.fill(0);
+      sums_ns.fill(0);
+      for (auto& b : buckets) b.fill(0);
+    }
+
+    /**
+     * Returns the events between rhs and this.
+     */
+    Snapshot operator-(const Snapshot& rhs) const {
+      Snapshot s;
+      for (int i = 0; i < kNumCounters; ++i)
+        s.counters[i] = counters[i] - rhs.counters[i];
+      for (int p = 0; p < kNumPhases; ++p) {
+        s.counts[p] = counts[p] - rhs.counts[p];
+        s.sums_ns[p] = sums_ns[p] - rhs.sums_ns[p];
+        for (int i = 0; i < kNumBuckets; ++i)
+          s.buckets[p][i] = buckets[p][i] - rhs.buckets[p][i];
+      }
+      return s;
+    }
+
+    /**
+     * Returns the upper bound in nanoseconds of the q-quantile of phase p.
+     */
+    double Percentile(SearchPhase p, double q) const {
+      uint64_t n = counts[p];
+      if (n == 0) return 0.0;
+      uint64_t rank = std::max<uint64_t>(1, q * n + 0.5);
+      uint64_t acc = 0;
+      for (int i = 0; i < kNumBuckets; ++i) {
+        acc += buckets[p][i];
+        if (acc >= rank) return UpperBound(i);
+      }
+      return UpperBound(kNumBuckets - 1);
+    }
+
+    /**
+     * Returns counters and phases in microseconds.
+     *  e.g. {"playouts":800,...,"phases":{"select":{"n":8000,"total_ms":2.1,
+     *        "mean_us":0.26,"p50_us":0.24,"p90_us":0.4,"p99_us":1.3},...}}
+     */
+    JsonValue ToJson() const {
+      static const char* kCounterNames[kNumCounters] = {
+          "playouts", "rollouts", "cache_hits", "wait_spins", "fail_to_push"};
+      static const char* kPhaseNames[kNumPhases] = {
+          "select",     "expand", "cache_probe", "eval_wait",
+          "queue_wait", "infer",  "backup",      "rollout"};
+
+      JsonValue json = JsonValue::Object();
+      for (int i = 0; i < kNumCounters; ++i)
+        json.Set(kCounterNames[i], counters[i]);
+
+      JsonValue phases = JsonValue::Object();
+      for (int p = 0; p < kNumPhases; ++p) {
+        SearchPhase phase = static_cast<SearchPhase>(p);
+        JsonValue ph = JsonValue::Object();
+        ph.Set("n", counts[p]);
+        ph.Set("total_ms", Round(sums_ns[p] * 1e-6));
+        double mean_ns = counts[p] == 0 ? 0.0 : sums_ns[p] / counts[p];
+        ph.Set("mean_us", Round(mean_ns * 1e-3));
+        ph.Set("p50_us", Round(Percentile(phase, 0.5) * 1e-3));
+        ph.Set("p90_us", Round(Percentile(phase, 0.9) * 1e-3));
+        ph.Set("p99_us", Round(Percentile(phase, 0.99) * 1e-3));
+        phases.Set(kPhaseNames[p], std::move(ph));
+      }
+      json.Set("phases", std::move(phases));
+      return json;
+    }
+
+   private:
+    static double Round(double val) { return std::round(val * 1000) / 1000; }
+  };
+
+  /**
+   * Measures the duration of phase from construction to Stop() or
+   * destruction.
+   */
+  class Timer {
+   public:
+    explicit Timer(SearchPhase phase)
+        : phase_(phase), t0_(Get().enabled() ? Now() : -1) {}
+
+    ~Timer() { Stop(); }
+
+    void Stop() {
+      if (t0_ < 0) return;
+      Get().Add(phase_, Now() - t0_);
+      t0_ = -1;
+    }
+
+   private:
+    SearchPhase phase_;
+    int64_t t0_;
+  };
+
+  static SearchStats& Get() {
+    static SearchStats stats;
+    return stats;
+  }
+
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  void set_enabled(bool val) { enabled_.store(val); }
+
+  void Add(SearchPhase phase, int64_t ns) {
+    if (!enabled()) return;
+    Slot& s = slot();
+    uint64_t val = std::max<int64_t>(0, ns);
+    s.counts[phase].fetch_add(1, std::memory_order_relaxed);
+    s.sums_ns[phase].fetch_add(val, std::memory_order_relaxed);
+    s.buckets[phase][BucketOf(val)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void Count(SearchCounter counter, uint64_t n = 1) {
+    if (!enabled()) return;
+    slot().counters[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  Snapshot Collect() const {
+    Snapshot snap;
+    for (const auto& s : slots_) {
+      for (int i = 0; i < kNumCounters; ++i)
+        snap.counters[i] += s.counters[i].load(std::memory_order_relaxed);
+      for (int p = 0; p < kNumPhases; ++p) {
+        snap.counts[p] += s.counts[p].load(std::memory_order_relaxed);
+        snap.sums_ns[p] += s.sums_ns[p].load(std::memory_order_relaxed);
+        for (int i = 0; i < kNumBuckets; ++i)
+          snap.buckets[p][i] += s.buckets[p][i].load(std::memory_order_relaxed);
+      }
+    }
+    return snap;
+  }
+
+  void Reset() {
+    for (auto& s : slots_) s.Reset();
+  }
+
+ private:
+  struct alignas(64) Slot {
+    std::array<std::atomic<uint64_t>, kNumCounters> counters;
+    std::array<std::atomic<uint64_t>, kNumPhases> counts;
+    std::array<std::atomic<uint64_t>, kNumPhases> sums_ns;
+    std::array<std::array<std::atomic<uint64_t>, kNumBuckets>, kNumPhases>
+        buckets;
+
+    void Reset() {
+      for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+      for (auto& c : counts) c.store(0, std::memory_order_relaxed);
+      for (auto& c : sums_ns) c.store(0, std::memory_order_relaxed);
+      for (auto& b : buckets)
+        for (auto& c : b) c.store(0, std::memory_order_relaxed);
+    }
+  };
+
+  std::atomic<bool> enabled_;
+  std::mutex mx_;
+  int num_threads_;                        // Guarded by mx_.
+  std::array<int, kNumSlots> num_owners_;  // Guarded by mx_.
+  std::array<Slot, kNumSlots> slots_;
+
+  SearchStats() : enabled_(false), num_threads_(0) {
+    num_owners_.fill(0);
+    Reset();
+  }
+
+  /**
+   * Returns the slot of this thread, which is released when the thread
+   * exits. Threads share slots if there are more than kNumSlots threads.
+   */
+  Slot& slot() {
+    struct Owner {
+      int idx = -1;
+      ~Owner() {
+        if (idx >= 0) Get().ReleaseSlot(idx);
+      }
+    };
+    static thread_local Owner owner;
+    if (owner.idx < 0) owner.idx = AcquireSlot();
+    return slots_[owner.idx];
+  }
+
+  int AcquireSlot() {
+    std::lock_guard<std::mutex> lock(mx_);
+    int idx = num_threads_++ % kNumSlots;
+    for (int i = 0; i < kNumSlots; ++i) {
+      if (num_owners_[i] == 0) {
+        idx = i;
+        break;
+      }
+    }
+    ++num_owners_[idx];
+    return idx;
+  }
+
+  void ReleaseSlot(int idx) {
+    std::lock_guard<std::mutex> lock(mx_);
+    --num_owners_[idx];
+  }
+
+  /**
+   * Returns the bucket of ns. Values less than 4 have their own buckets, and
+   * each octave above is divided into four.
+   */
+  static int BucketOf(uint64_t ns) {
+    if (ns < 4) return static_cast<int>(ns);
+    int msb = std::ilogb(static_cast<double>(ns));
+    int sub = static_cast<int>(ns >> (msb - 2)) & 3;
+    return std::min(4 * (msb - 1) + sub, kNumBuckets - 1);
+  }
+
+  static double UpperBound(int bucket) {
+    if (bucket < 4) return bucket;
+    int msb = bucket / 4 + 1;
+    int sub = bucket % 4;
+    return std::ldexp(5 + sub, msb - 2);
+  }
+};
+
+#endif  // SEARCH_STATS_H_
@@ -189,9 +189,7 @@ void SgfData::Read(std::string file_path) {
   }
 }
 
-void SgfData::Write(std::string file_path,
-                    std::vector<std::string>* comments) const {
-  // Opens file.
+std::string SgfData::HeaderString() const {
   std::stringstream ss;
   std::string rule_str =
       Options["rule"].get_int() == kJapanese ? "Japanese" : "Chinese";
@@ -215,19 +213,35 @@ void SgfData::Write(std::string file_path,
   }
   ss << std::endl;
 
+  return ss.str();
+}
+
+std::string SgfData::MoveString(int i, const std::string* comment) const {
   std::string str = "abcdefghijklmnopqrs";
+  Vertex v = move_history_[i];
+  int x = x_of(v) - 1;
+  int y = kBSize - y_of(v);
+
+  std::stringstream ss;
+  ss << (i % 2 == 0 ? ";B[" : ";W[");
+  ss << (v < kPass ? str.substr(x, 1) + str.substr(y, 1) : "") << "]";
+  if (comment != nullptr) ss << "C[" << *comment << "]";
+  if ((i + 1) % 8 == 0) ss << std::endl;
+
+  return ss.str();
+}
+
+void SgfData::Write(std::string file_path,
+                    std::vector<std::string>* comments) const {
+  // Opens file.
+  std::stringstream ss;
+  ss << HeaderString();
   for (int i = 0, n = move_history_.size(); i < n; ++i) {
-    Vertex v = move_history_[i];
-    int x = x_of(v) - 1;
-    int y = kBSize - y_of(v);
-
-    ss << (i % 2 == 0 ? ";B[" : ";W[");
-    ss << (v < kPass ? str.substr(x, 1) + str.substr(y, 1) : "") << "]";
-    if (comments != nullptr && static_cast<int>(comments->size()) > i)
-      ss << "C[" << (*comments)[i] << "]";
-    if ((i + 1) % 8 == 0) ss << std::endl;
+    bool has_comment =
+        comments != nullptr && static_cast<int>(comments->size()) > i;
+    ss << MoveString(i, has_comment ? &(*comments)[i] : nullptr);
   }
-  ss << ")" << std::endl;
+  ss << kFooter;
 
   std::ofstream ofs(file_path.c_str());
   ofs << ss.str();
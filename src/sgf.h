@@ -94,6 +94,20 @@ class SgfData {
 
   void Read(std::string file_path);
 
+  /**
+   * Returns the root node of the SGF, which ends with a line break.
+   */
+  std::string HeaderString() const;
+
+  /**
+   * Returns the i-th move node of the SGF with a comment.
+   */
+  std::string MoveString(int i, const std::string* comment = nullptr) const;
+
+  // Closes the game tree. An SGF file is HeaderString(), MoveString(i) for
+  // all moves and kFooter.
+  static constexpr const char* kFooter = ")\n";
+
   /**
    * Outputs the match information to an SGF file with comments.
    */
@@ -0,0 +1,147 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @class Histogram
+ * Histogram class counts non-negative integer samples in buckets of
+ * increasing upper bounds. Add() is lock-free and may be called from
+ * multiple threads.
+ *
+ * @code
+ *  Histogram h = Histogram::Exponential(1000000);  // [0, 1e6]
+ *  h.Add(120);
+ *  std::cerr << h.ToString("us") << std::endl;
+ * @endcode
+ */
+class Histogram {
+ public:
+  /**
+   * Buckets of width 1 for [0, max_value].
+   */
+  static std::vector<int64_t> LinearBounds(int64_t max_value) {
+    std::vector<int64_t> bounds;
+    for (int64_t v = 0; v <= max_value; ++v) bounds.push_back(v);
+    return bounds;
+  }
+
+  /**
+   * Buckets whose upper bounds grow by about 2^(1/4) up to max_value.
+   */
+  static std::vector<int64_t> ExponentialBounds(int64_t max_value) {
+    std::vector<int64_t> bounds{0};
+    for (double v = 1.0; bounds.back() < max_value; v *= 1.189207115) {
+      int64_t b = std::min(max_value, static_cast<int64_t>(v + 0.5));
+      if (b > bounds.back()) bounds.push_back(b);
+    }
+    return bounds;
+  }
+
+  static Histogram Linear(int64_t max_value) {
+    return Histogram(LinearBounds(max_value));
+  }
+
+  static Histogram Exponential(int64_t max_value) {
+    return Histogram(ExponentialBounds(max_value));
+  }
+
+  // Samples larger than the last bound are counted in the last bucket.
+  explicit Histogram(std::vector<int64_t> bounds)
+      : bounds_(std::move(bounds)),
+        counts_(new std::atomic<uint64_t>[bounds_.size()]) {
+    Reset();
+  }
+
+  Histogram(Histogram&& rhs)
+      : bounds_(std::move(rhs.bounds_)), counts_(std::move(rhs.counts_)) {
+    count_.store(rhs.count_.load());
+    sum_.store(rhs.sum_.load());
+  }
+
+  void Add(int64_t value) {
+    value = std::max<int64_t>(0, value);
+    size_t i = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+               bounds_.begin();
+    i = std::min(i, bounds_.size() - 1);
+    counts_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  void Reset() {
+    for (size_t i = 0; i < bounds_.size(); ++i)
+      counts_[i].store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  double mean() const {
+    uint64_t n = count();
+    return n == 0 ? 0.0
+                  : static_cast<double>(sum_.load(std::memory_order_relaxed)) /
+                        n;
+  }
+
+  /**
+   * Returns the upper bound of the bucket containing the q-quantile.
+   */
+  int64_t Percentile(double q) const {
+    uint64_t n = count();
+    if (n == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, q * n + 0.5);
+    uint64_t acc = 0;
+    for (size_t i = 0; i < bounds_.size(); ++i) {
+      acc += counts_[i].load(std::memory_order_relaxed);
+      if (acc >= rank) return bounds_[i];
+    }
+    return bounds_.back();
+  }
+
+  /**
+   * Returns a summary such as "n=100 mean=3.2 p50=3 p90=6 p99=8 [unit]".
+   */
+  std::string ToString(std::string unit = "") const {
+    std::stringstream ss;
+    ss.precision(3);
+    ss << "n=" << count() << " mean=" << mean() << " p50=" << Percentile(0.5)
+       << " p90=" << Percentile(0.9) << " p99=" << Percentile(0.99);
+    if (!unit.empty()) ss << " [" << unit << "]";
+    return ss.str();
+  }
+
+ private:
+  std::vector<int64_t> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+};
+
+#endif  // STATS_H_
@@ -18,10 +18,17 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <string>
+#include <thread>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -82,7 +89,9 @@ bool IdentifyBoards(const Board& b1, const Board& b2) {
   CheckEqual(b1, b2, "response_move_[3]", b1.response_move_[3],
              b2.response_move_[3]);
   CheckEqual(b1, b2, "prev_rsp_prob_", b1.prev_rsp_prob_, b2.prev_rsp_prob_);
-  CheckEqual(b1, b2, "hash_key_", b1.hash_key_, b2.hash_key_);
+  for (int i = 0; i < 8; ++i)
+    CheckEqual(b1, b2, "sym_hash_keys_[i]", b1.sym_hash_keys_[i],
+               b2.sym_hash_keys_[i], i);
   for (int i = 0; i < 8; ++i)
     CheckEqual(b1, b2, "key_history_[i]", b1.key_history_[i],
                b2.key_history_[i], i);
@@ -488,6 +497,268 @@ void PrintFinalResult() {
   }
 }
 
+/**
+ * Displays what failed and terminates abnormally unless ok.
+ */
+void CheckTrue(bool ok, const std::string& what) {
+  if (ok) return;
+  std::cout << "failed: " << what << std::endl;
+  exit(1);
+}
+
+/**
+ * Checks that every policy format of EvalCache returns inserted evaluations
+ * within its error, and that a probe never returns a torn entry while
+ * another thread overwrites it.
+ */
+void CheckEvalCache() {
+  Board b;
+  for (std::string s : {"C3", "Q5", "E17"}) b.MakeMove<kOneWay>(str2v(s));
+  Board b_other;
+
+  ValueAndProb vp;
+  std::mt19937 mt(1);
+  std::uniform_real_distribution<float> dist(0.1f, 1.0f);
+  float sum = 0.0f;
+  for (auto& p : vp.prob) sum += (p = dist(mt));
+  for (auto& p : vp.prob) p /= sum;
+  vp.value = 0.25;
+
+  std::vector<int> order(kNumRvts);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&](int i, int j) { return vp.prob[i] > vp.prob[j]; });
+
+  // Relative errors of the formats, and the number of moves kept by topk.
+  // Probabilities are above the subnormal range of fp16.
+  struct Format {
+    std::string name;
+    float max_error;
+    int num_checked;
+  };
+  constexpr int kTopK = 32;
+  for (const Format& f : {Format{"fp32", 0.0f, kNumRvts},
+                          Format{"fp16", 0.0005f, kNumRvts},
+                          Format{"u8", 0.032f, kNumRvts},
+                          Format{"topk", 0.0005f, kTopK}}) {
+    EvalCache cache(1);
+    cache.Resize(1, f.name, kTopK);
+    cache.Insert(b, vp);
+
+    ValueAndProb vp_out;
+    CheckTrue(cache.Probe(b, &vp_out), f.name + " probe");
+    CheckTrue(!cache.Probe(b_other, &vp_out), f.name + " probe of another");
+    cache.Probe(b, &vp_out);
+    CheckTrue(vp_out.value == vp.value, f.name + " value");
+    for (int i = 0; i < f.num_checked; ++i) {
+      int rv = order[i];
+      CheckTrue(std::abs(vp_out.prob[rv] - vp.prob[rv]) <=
+                    f.max_error * vp.prob[rv],
+                f.name + " prob of " + std::to_string(rv));
+    }
+    float sum_out =
+        std::accumulate(vp_out.prob.begin(), vp_out.prob.end(), 0.0f);
+    CheckTrue(std::abs(sum_out - 1.0f) < 0.05f, f.name + " sum of probs");
+  }
+
+  // Seqlock: every generation is written with the value and probabilities
+  // equal to it, so a torn read has a mismatch.
+  EvalCache cache(1);
+  constexpr Key kKey = 0x123456789abcdef0ULL;
+  constexpr int kNumWrites = 20000;
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    ValueAndProb vp_in;
+    for (int g = 1; g <= kNumWrites; ++g) {
+      vp_in.generation = g;
+      vp_in.value = g;
+      vp_in.prob.fill(static_cast<float>(g));
+      cache.Insert(kKey, vp_in);
+    }
+    done = true;
+  });
+
+  while (!done) {
+    ValueAndProb vp_out;
+    if (!cache.Probe(kKey, &vp_out)) continue;
+    bool consistent = vp_out.generation == static_cast<int>(vp_out.value);
+    for (float p : vp_out.prob)
+      consistent = consistent && p == static_cast<float>(vp_out.value);
+    CheckTrue(consistent, "seqlock");
+  }
+  writer.join();
+
+  ValueAndProb vp_last;
+  CheckTrue(cache.Probe(kKey, &vp_last) && vp_last.generation == kNumWrites,
+            "last write");
+}
+
+/**
+ * Returns true if the trees under nd1 and nd2 have the same statistics.
+ */
+bool SameTree(const Node& nd1, const Node& nd2) {
+  if (nd1.key() != nd2.key() || nd1.game_ply() != nd2.game_ply() ||
+      nd1.num_children() != nd2.num_children() ||
+      nd1.num_entries() != nd2.num_entries() ||
+      nd1.num_total_values() != nd2.num_total_values() ||
+      nd1.value() != nd2.value() || nd1.num_values() != nd2.num_values() ||
+      static_cast<float>(nd1.win_values()) !=
+          static_cast<float>(nd2.win_values()))
+    return false;
+
+  for (int i = 0; i < nd1.num_children(); ++i) {
+    const ChildNode& c1 = nd1.children[i];
+    const ChildNode& c2 = nd2.children[i];
+    if (c1.move() != c2.move() || c1.prob() != c2.prob() ||
+        c1.num_values() != c2.num_values() ||
+        static_cast<float>(c1.win_values()) !=
+            static_cast<float>(c2.win_values()) ||
+        c1.has_next() != c2.has_next())
+      return false;
+    if (c1.has_next() && !SameTree(*c1.next_ptr(), *c2.next_ptr()))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Checks that a tree saved by TreeSnapshot is loaded as it was, and only for
+ * the same position.
+ */
+void CheckTreeSnapshot() {
+  Board b;
+  b.MakeMove<kOneWay>(str2v("D4"));
+  std::unique_ptr<Node> root(new Node(b));
+  root->set_value(0.4f);
+  root->AddValueOnce(0.4f);
+  for (int i = 0; i < root->num_children(); ++i) {
+    ChildNode& child = root->children[i];
+    child.set_prob(1.0f / root->num_children());
+    if (i % 3 == 0) child.AddValueOnce(0.1f * (i % 10));
+  }
+
+  // Expands the first and the last children.
+  for (int i : {0, root->num_children() - 1}) {
+    Board b_next = b;
+    b_next.MakeMove<kOneWay>(root->children[i].move());
+    std::unique_ptr<Node> next(new Node(b_next));
+    next->set_value(0.6f);
+    next->children[0].AddValueOnce(0.3f);
+    root->children[i].set_next_ptr(&next);
+    root->increment_entries();
+  }
+
+  std::string path = "test_tree_snapshot.aqt";
+  std::string error;
+  CheckTrue(TreeSnapshot::Save(*root, path, &error), "save: " + error);
+
+  std::unique_ptr<Node> loaded;
+  int num_nodes = 0;
+  bool ok = TreeSnapshot::Load(path, b, 100, &loaded, &num_nodes, &error);
+  CheckTrue(ok, "load: " + error);
+  CheckTrue(num_nodes == 3, "number of loaded nodes");
+  CheckTrue(SameTree(*root, *loaded), "loaded tree");
+
+  Board b_other;
+  ok = TreeSnapshot::Load(path, b_other, 100, &loaded, &num_nodes, &error);
+  CheckTrue(!ok, "load for another position");
+  ok = TreeSnapshot::Load(path, b, 2, &loaded, &num_nodes, &error);
+  CheckTrue(!ok, "load over max_nodes");
+
+  std::remove(path.c_str());
+}
+
+/**
+ * Checks parsing of JSON values and of analysis queries.
+ */
+void CheckAnalysisQuery() {
+  JsonValue json;
+  std::string error;
+  std::string text =
+      "{\"a\": [1, -2.5e1, \"x\\\"y\\u00e9\"], \"b\": true, \"c\": null}";
+  CheckTrue(JsonValue::Parse(text, &json, &error), "json: " + error);
+  const JsonValue& a = json["a"];
+  CheckTrue(a.size() == 3 && a[static_cast<size_t>(0)].get_int() == 1 &&
+                a[1].get_double() == -25.0 &&
+                a[2].get_string() == "x\"y\xc3\xa9" &&
+                json["b"].get_bool() && json["c"].is_null() &&
+                json["d"].is_null(),
+            "json values");
+
+  JsonValue json_dumped;
+  CheckTrue(JsonValue::Parse(json.Dump(), &json_dumped, &error) &&
+                json_dumped.Dump() == json.Dump(),
+            "json dump");
+
+  std::vector<std::string> bad_texts = {
+      "", "{\"a\": 1,}", "[1 2]", "\"abc", "{} x", "{\"a\" 1}", "tru",
+      std::string(100, '[') + std::string(100, ']')};
+  for (const std::string& bad : bad_texts) {
+    CheckTrue(!JsonValue::Parse(bad, &json, &error), "invalid json " + bad);
+  }
+
+  AnalysisEngine::Query q;
+  JsonValue::Parse(
+      "{\"id\": \"q1\", \"moves\": [\"D4\", \"Q16\", \"pass\"], "
+      "\"komi\": 6.5, \"max_visits\": 100, \"include_ownership\": true}",
+      &json, &error);
+  CheckTrue(AnalysisEngine::ParseQuery(json, &q, &error), "query: " + error);
+  CheckTrue(q.id == "q1" && q.moves.size() == 3 &&
+                q.moves[0] == str2v("D4") && q.moves[2] == kPass &&
+                q.komi == 6.5 && q.max_visits == 100 &&
+                q.include_ownership && q.num_symmetries == 1,
+            "query values");
+
+  for (std::string bad :
+       {"[]", "{\"moves\": []}", "{\"id\": \"q\"}",
+        "{\"id\": \"q\", \"moves\": [\"D4\", \"D4\"]}",
+        "{\"id\": \"q\", \"moves\": [\"Z99\"]}",
+        "{\"id\": \"q\", \"moves\": [], \"max_visits\": 0}"}) {
+    JsonValue::Parse(bad, &json, &error);
+    CheckTrue(!AnalysisEngine::ParseQuery(json, &q, &error),
+              "invalid query " + bad);
+  }
+}
+
+/**
+ * Checks that RouteQueue merges routes to the same board.
+ */
+void CheckRouteQueue() {
+  Board b;
+  Board b_next = b;
+  b_next.MakeMove<kOneWay>(str2v("D4"));
+
+  SearchRoute route1;
+  route1.Add(str2v("D4"), 0);
+  SearchRoute route2;
+  route2.Add(str2v("Q16"), 1);
+  SearchRoute route3 = route1;
+  route3.tree_id = 1;
+
+  RouteQueue queue;
+  queue.push(b, route1);
+  queue.push(b, route1);
+  CheckTrue(queue.size() == 1, "same route");
+  CheckTrue((*queue.get_entries())[0].routes.size() == 1 &&
+                (*queue.get_entries())[0].routes[0].num_requests == 2,
+            "requests of the same route");
+
+  queue.push(b, route2);
+  queue.push(b, route3);
+  CheckTrue(queue.size() == 1 && (*queue.get_entries())[0].routes.size() == 3,
+            "other routes to the same board");
+
+  queue.push(b_next, route1);
+  CheckTrue(queue.size() == 2, "route to another board");
+  CheckTrue((*queue.get_entries())[1].key == b_next.key(), "key of entry");
+
+  queue.clear();
+  queue.push(b, route1);
+  CheckTrue(queue.size() == 1 &&
+                (*queue.get_entries())[0].routes[0].num_requests == 1,
+            "push after clear");
+}
+
 /**
  * Test structure and transitions of Board class.
  */
@@ -711,6 +982,16 @@ void TestBoard() {
   // Ladder
   CheckLadder();
   std::cout << "ladder: [OK]\n";
+
+  // Components of search
+  CheckEvalCache();
+  std::cout << "eval cache: [OK]\n";
+  CheckTreeSnapshot();
+  std::cout << "tree snapshot: [OK]\n";
+  CheckAnalysisQuery();
+  std::cout << "analysis query: [OK]\n";
+  CheckRouteQueue();
+  std::cout << "route queue: [OK]\n";
 }
 
 /**
@@ -825,14 +1106,14 @@ void TestSymmetry() {
 
   ValueAndProb vp;
   Feature ft = b.get_feature();
-  TensorEngine engine(0, 1);
-  engine.Init();
+  auto engine = CreateEngine(0, 1);
+  engine->Init();
   EvalCache eval_cache;
 
   for (int j = 0; j < 8; ++j) {
-    engine.Infer(ft, &vp, j);
+    engine->Infer(ft, &vp, j);
     PrintProb(b, vp);
-    if (j == 0) eval_cache.Insert(b.key(), vp);
+    if (j == 0) eval_cache.Insert(b, vp);
   }
 
   for (int i = 0; i < 8; ++i) {
@@ -861,14 +1142,14 @@ void TestSymmetry() {
 void PolicySelf() {
   Board b;
   ValueAndProb vp;
-  TensorEngine engine(0, 8);
-  engine.Init();
+  auto engine = CreateEngine(0, 8);
+  engine->Init();
 
   for (int j = 0; j < 1; ++j) {
     b.Init();
 
     for (int i = 0; i < kMaxPly; ++i) {
-      engine.Infer(b.get_feature(), &vp);
+      engine->Infer(b.get_feature(), &vp);
       PrintProb(b, vp);
 
       std::cerr << "[Press Enter]" << std::endl;
@@ -936,6 +1217,97 @@ void SelfMatch() {
   }
 }
 
+/**
+ * Plays num_games self matches, num_parallel_games of them at the same time.
+ * Each game has its own tree and board, and the trees share the EvalWorker
+ * and EvalCache of the first one. A game slot starts the next game as soon
+ * as its game ends, so that all trees keep filling the batches until the
+ * last games.
+ */
+void ParallelSelfMatch() {
+  const int num_games = Options["num_games"].get_int();
+  const int num_slots =
+      std::min(num_games, Options["num_parallel_games"].get_int());
+
+  std::vector<SearchTree> trees(num_slots);
+  trees[0].SetGPUAndMemory(num_slots);
+  for (int i = 1; i < num_slots; ++i) trees[i].ShareEvaluator(&trees[0]);
+
+  std::atomic<int> next_game(0);
+  std::atomic<int> num_moves(0);
+  std::mutex mx;
+  const auto t0 = std::chrono::steady_clock::now();
+
+  auto play_games = [&](SearchTree* tree) {
+    Board b;
+    double winning_rate = 0.5;
+    for (int j = next_game++; j < num_games; j = next_game++) {
+      b.Init();
+      tree->InitRoot();
+      for (int i = 0; i < kMaxPly; ++i) {
+        Vertex v = tree->Search(b, 0.0, &winning_rate, false, false);
+        b.MakeMove<kOneWay>(v);
+        if (b.double_pass()) break;
+      }
+      num_moves += b.game_ply();
+
+      std::array<std::array<double, kNumVts>, kNumPlayers> owner = {0};
+      double s = tree->FinalScore(b, kVtNull, -1, 1024, &owner);
+      std::lock_guard<std::mutex> lock(mx);
+      std::cerr << "game " << j + 1 << ": " << b.game_ply() << " moves, "
+                << (s > 0 ? "B+" : "W+") << std::fabs(s) << std::endl;
+    }
+  };
+
+  std::vector<std::thread> ths;
+  for (auto& tree : trees) ths.emplace_back(play_games, &tree);
+  for (auto& th : ths) th.join();
+
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - t0)
+                       .count();
+  const Histogram& h = trees[0].eval_worker()->batch_size_histogram();
+  std::cerr << num_games << " games, " << num_moves << " moves in " << elapsed
+            << " sec: " << num_games * 3600.0 / elapsed << " games/hour"
+            << std::endl;
+  std::cerr << "batch fill: "
+            << 100.0 * h.mean() / Options["batch_size"].get_int() << "% ("
+            << h.ToString() << ")" << std::endl;
+}
+
+/**
+ * Returns evaluations per second of the engine with full batches of ft.
+ * Stops after 20000 evaluations or 10 seconds.
+ */
+double MeasureEvalSpeed(InferEngine* engine, const Feature& ft) {
+  std::vector<std::shared_ptr<SyncedEntry>> entries;
+  int num_entries = engine->max_batch_size();
+  for (int i = 0; i < num_entries; ++i) {
+    entries.emplace_back(std::make_shared<SyncedEntry>(ft));
+  }
+
+  auto start = std::chrono::system_clock::now();
+  const int max_evaluation = 20000;
+  const double max_time = 10.0;
+  int num_evaluation = 0;
+  double elapsed_time = 0.0;
+
+  while (num_evaluation < max_evaluation && elapsed_time < max_time) {
+    for (int i = 0; i < num_entries; ++i) {
+      entries[i]->ft = ft;
+    }
+    engine->Infer(&entries);
+    num_evaluation += num_entries;
+
+    elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now() - start)
+                       .count() /
+                   1000.0;
+  }
+
+  return num_evaluation / std::max(elapsed_time, 1e-3);
+}
+
 /**
  * Benchmark the inference speed of a neural network.
  */
@@ -953,35 +1325,114 @@ void NetworkBench() {
 
   int batch_size = Options["batch_size"].get_int();
 
-  TensorEngine engine(0, batch_size);
-  engine.Init();
+  auto engine = CreateEngine(0, batch_size);
+  engine->Init();
+
+  std::cout << "evaluates per seconds = "
+            << MeasureEvalSpeed(engine.get(), b.get_feature()) << " [eps]"
+            << std::endl;
+
+  // Compares reduced precision CPU inference with fp32.
+  std::string precision = Options["cpu_precision"];
+  if (!UseCpuEngine() || precision == "fp32") return;
+
+  CpuEngine ref_engine(batch_size);
+  ref_engine.set_precision("fp32");
+  ref_engine.Init();
+  std::cout << "evaluates per seconds (fp32) = "
+            << MeasureEvalSpeed(&ref_engine, b.get_feature()) << " [eps]"
+            << std::endl;
+
+  const int num_positions = 256;
+  std::vector<Feature> features = CpuEngine::SampleFeatures(num_positions);
+  int num_top_match = 0;
+  double sum_value_diff = 0.0;
+  double max_value_diff = 0.0;
+  for (const auto& ft : features) {
+    ValueAndProb vp, ref_vp;
+    engine->Infer(ft, &vp);
+    ref_engine.Infer(ft, &ref_vp);
+
+    auto top = std::max_element(vp.prob.begin(), vp.prob.end()) -
+               vp.prob.begin();
+    auto ref_top = std::max_element(ref_vp.prob.begin(), ref_vp.prob.end()) -
+                   ref_vp.prob.begin();
+    if (top == ref_top) ++num_top_match;
+
+    double value_diff = std::abs(vp.value - ref_vp.value);
+    sum_value_diff += value_diff;
+    max_value_diff = std::max(max_value_diff, value_diff);
+  }
+
+  std::cout << precision << " vs fp32: top-1 policy agreement = "
+            << 100.0 * num_top_match / num_positions
+            << "%, mean value diff = " << sum_value_diff / num_positions
+            << ", max value diff = " << max_value_diff << std::endl;
+}
+
+/**
+ * Compares the CPU engine with TensorRT (or, in CPU_ONLY builds, batched
+ * inference with single inference) on positions of random games.
+ */
+void TestCpuEngine() {
+  const int num_positions = 8;
+  const double policy_tolerance = 1e-2;
+  const double value_tolerance = 2e-2;
 
   std::vector<std::shared_ptr<SyncedEntry>> entries;
-  int num_entries = batch_size;
-  for (int i = 0; i < num_entries; ++i) {
+  Board b;
+  for (int i = 0; i < num_positions; ++i) {
+    b.Init();
+    for (int j = 0; j < 24 * i; ++j) {
+      Vertex v = b.SelectMoveRandom();
+      b.MakeMove<kOneWay>(v);
+      if (b.double_pass()) break;
+    }
     entries.emplace_back(std::make_shared<SyncedEntry>(b.get_feature()));
   }
 
-  auto start = std::chrono::system_clock::now();
-  const int max_evaluation = 20000;
-  int num_evaluation = 0;
+  CpuEngine cpu_engine(num_positions);
+  cpu_engine.Init();
+  cpu_engine.Infer(&entries);
 
-  for (int j = 0; j < max_evaluation && num_evaluation < max_evaluation; ++j) {
-    for (int i = 0; i < num_entries; ++i) {
-      entries[i]->ft = b.get_feature();
-    }
-    engine.Infer(&entries);
-    num_evaluation += num_entries;
+#if defined(CPU_ONLY)
+  CpuEngine ref_engine(1);
+  std::string ref_name = "single";
+#else
+  TensorEngine ref_engine(0, num_positions);
+  std::string ref_name = "TensorRT";
+#endif
+  ref_engine.Init();
+
+  double max_policy_diff = 0.0;
+  double max_value_diff = 0.0;
+  int num_top_match = 0;
+  for (auto& entry : entries) {
+    ValueAndProb vp;
+    ref_engine.Infer(entry->ft, &vp);
+
+    const auto& prob = entry->vp.prob;
+    auto cpu_top = std::max_element(prob.begin(), prob.end()) - prob.begin();
+    auto ref_top = std::max_element(vp.prob.begin(), vp.prob.end()) -
+                   vp.prob.begin();
+    if (cpu_top == ref_top) ++num_top_match;
+
+    for (int j = 0; j < kNumRvts; ++j)
+      max_policy_diff = std::max(
+          max_policy_diff, std::abs(double{entry->vp.prob[j]} - vp.prob[j]));
+    max_value_diff =
+        std::max(max_value_diff, std::abs(entry->vp.value - vp.value));
   }
 
-  const auto end = std::chrono::system_clock::now();
-  double elapsed_time =
-      std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
-          .count() /
-      1000.0;
+  std::cout << "cpu vs " << ref_name
+            << ": max policy diff = " << max_policy_diff
+            << ", max value diff = " << max_value_diff
+            << ", top-1 match = " << num_top_match << "/" << num_positions
+            << std::endl;
 
-  std::cout << "evaluates per seconds = " << num_evaluation / elapsed_time
-            << " [eps]" << std::endl;
+  bool ok = max_policy_diff < policy_tolerance &&
+            max_value_diff < value_tolerance;
+  std::cout << "cpu engine: " << (ok ? "[OK]" : "[NG]") << std::endl;
 }
 
 /**
@@ -1022,6 +1473,192 @@ void BenchMark() {
             << std::endl;
 }
 
+/**
+ * Measures the hit rate and probe latency of EvalCache shared by 64 threads.
+ * Keys are drawn from a skewed distribution over 4x more positions than the
+ * cache can hold, and a miss is followed by an insertion.
+ */
+void EvalCacheBench() {
+  const int num_threads = 64;
+  const int num_probes = 200000;  // Per thread.
+  const int sampling_interval = 16;
+
+  std::cout << "*** EvalCache Benchmark ***" << std::endl;
+
+  // Accuracy of policy formats on softmax distributions of random logits.
+  std::mt19937 mt(0);
+  std::normal_distribution<float> normal(0.0f, 3.0f);
+  for (std::string format : {"fp32", "fp16", "u8", "topk"}) {
+    EvalCache cache;
+    cache.Resize(1, format, Options["eval_cache_topk"].get_int());
+    const int num_samples = 1000;
+    double sum_l1 = 0.0;
+    int num_top_match = 0;
+    for (int i = 0; i < num_samples; ++i) {
+      ValueAndProb vp, vp_cache;
+      float sum = 0.0f;
+      for (auto& p : vp.prob) sum += (p = std::exp(normal(mt)));
+      for (auto& p : vp.prob) p /= sum;
+      cache.Insert(i + 1, vp);
+      if (!cache.Probe(i + 1, &vp_cache)) continue;
+
+      for (int j = 0; j < kNumRvts; ++j)
+        sum_l1 += std::abs(vp.prob[j] - vp_cache.prob[j]);
+      if (std::max_element(vp.prob.begin(), vp.prob.end()) -
+              vp.prob.begin() ==
+          std::max_element(vp_cache.prob.begin(), vp_cache.prob.end()) -
+              vp_cache.prob.begin())
+        ++num_top_match;
+    }
+    std::cout << format << ": " << cache.slot_bytes()
+              << " bytes/entry, mean L1 error = "
+              << sum_l1 / cache.num_probes()
+              << ", top-1 match = " << num_top_match << "/"
+              << cache.num_probes() << std::endl;
+  }
+
+  EvalCache cache;
+  cache.Resize(Options["eval_cache_mb"].get_int(),
+               Options["eval_cache_format"].get_string(),
+               Options["eval_cache_topk"].get_int());
+  const double working_set = 4.0 * cache.num_slots();
+  std::cout << "slots = " << cache.num_slots() << " ("
+            << (cache.size_bytes() >> 20) << " MB, "
+            << Options["eval_cache_format"].get_string() << ")" << std::endl;
+
+  std::vector<std::vector<double>> latencies(num_threads);
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      std::mt19937_64 mt(t + 1);
+      std::uniform_real_distribution<double> uniform(0.0, 1.0);
+      ValueAndProb vp;
+
+      for (int i = 0; i < num_probes; ++i) {
+        double u = uniform(mt);
+        uint64_t idx = static_cast<uint64_t>(working_set * u * u * u);
+        // splitmix64 of idx as a Zobrist-like key.
+        Key key = idx + 0x9e3779b97f4a7c15ULL;
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+        key ^= key >> 31;
+
+        bool found;
+        if (i % sampling_interval == 0) {
+          auto t0 = std::chrono::steady_clock::now();
+          found = cache.Probe(key, &vp);
+          auto t1 = std::chrono::steady_clock::now();
+          latencies[t].push_back(
+              std::chrono::duration<double, std::nano>(t1 - t0).count());
+        } else {
+          found = cache.Probe(key, &vp);
+        }
+        if (!found) {
+          vp.value = static_cast<double>(idx);
+          cache.Insert(key, vp);
+        }
+      }
+    });
+  }
+  for (auto& th : threads) th.join();
+
+  double elapsed_time =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  std::vector<double> all;
+  for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+  std::sort(all.begin(), all.end());
+  double mean = std::accumulate(all.begin(), all.end(), 0.0) / all.size();
+
+  std::cout << "threads = " << num_threads
+            << ", probes = " << cache.num_probes()
+            << ", hit rate = " << 100.0 * cache.hit_rate() << "%"
+            << std::endl;
+  std::cout << "probe latency: mean = " << mean
+            << " ns, p50 = " << all[all.size() / 2]
+            << " ns, p99 = " << all[all.size() * 99 / 100] << " ns"
+            << std::endl;
+  std::cout << "throughput = " << cache.num_probes() / elapsed_time / 1e6
+            << " [M probes/s]" << std::endl;
+}
+
+/**
+ * Evaluates the opening positions of the games in sgf_dir and writes them to
+ * the persistent evaluation store at eval_store_path. Positions already in
+ * the store are kept and not evaluated again.
+ */
+void BuildEvalStore() {
+  std::string sgf_dir = Options["sgf_dir"];
+  std::string store_path = Options["eval_store_path"];
+  if (sgf_dir.empty() || store_path.empty()) {
+    std::cerr << "set --sgf_dir and --eval_store_path." << std::endl;
+    return;
+  }
+
+  EvalStoreBuilder builder(Options["eval_store_max_ply"].get_int());
+  {
+    EvalStore store;
+    if (store.Open(store_path)) builder.Merge(store);
+  }
+  size_t num_existing = builder.size();
+
+  auto engine = CreateEngine(0, Options["batch_size"].get_int());
+  engine->Init();
+
+  std::vector<std::string> files;
+  SgfData::GetSgfFiles(sgf_dir, &files);
+
+  std::vector<std::shared_ptr<SyncedEntry>> entries;
+  std::vector<Board> boards;
+  auto flush = [&]() {
+    if (entries.empty()) return;
+    engine->Infer(&entries);
+    for (size_t i = 0; i < entries.size(); ++i)
+      builder.Add(boards[i], entries[i]->vp);
+    entries.clear();
+    boards.clear();
+  };
+
+  auto t0 = std::chrono::system_clock::now();
+  Board b;
+  std::unordered_set<Key> queued;
+  for (auto file_path : files) {
+    if (file_path.find_first_of("/\\") == std::string::npos)
+      file_path = JoinPath(sgf_dir, file_path);
+
+    SgfData sgf;
+    sgf.Read(file_path);
+    int max_ply = std::min(sgf.game_ply(), builder.max_ply());
+    for (int i = 0; i <= max_ply; ++i) {
+      if (!sgf.ReconstructBoard(&b, i)) break;
+      if (builder.Contains(b)) continue;
+      if (!queued.insert(b.canonical_key()).second) continue;
+
+      entries.emplace_back(std::make_shared<SyncedEntry>(b.get_feature()));
+      boards.push_back(b);
+      if (static_cast<int>(entries.size()) == engine->max_batch_size())
+        flush();
+    }
+  }
+  flush();
+
+  auto t1 = std::chrono::system_clock::now();
+  double elapsed =
+      std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() /
+      1000.0;
+  std::cerr << files.size() << " files, " << builder.size() - num_existing
+            << " positions added in " << elapsed << " sec." << std::endl;
+
+  if (!builder.Write(store_path))
+    std::cerr << "failed to write " << store_path << std::endl;
+  else
+    std::cerr << builder.size() << " positions saved to " << store_path
+              << std::endl;
+}
+
 /**
  * Measures the speed at which a tree node is freed from memory.
  */
@@ -1158,8 +1795,8 @@ void TestPassMove() {
   if (ifs.fail())
     std::cerr << "file could not be opened: sgf_list.txt" << std::endl;
 
-  TensorEngine engine(0, 1);
-  engine.Init();
+  auto engine = CreateEngine(0, 1);
+  engine->Init();
   SearchTree tree;
   std::vector<std::ostream*> os_list;
   os_list.push_back(&std::cout);
@@ -1225,9 +1862,9 @@ void TestPassMove() {
       const int num_playouts = 1024;
       const int num_policy_moves = -1;
       Vertex best_move_32 =
-          tree.ShouldPass(b, next_move, 32, num_playouts, &engine);
+          tree.ShouldPass(b, next_move, 32, num_playouts, engine.get());
       Vertex best_move = tree.ShouldPass(b, next_move, num_policy_moves,
-                                         num_playouts, &engine);
+                                         num_playouts, engine.get());
 
       if (best_move != best_move_32) {
         std::cout << "ply=" << b.game_ply() << " next_move:" << next_move
@@ -1280,7 +1917,7 @@ void TestPassMove() {
 
       std::array<std::array<double, kNumVts>, kNumPlayers> owner = {0};
       // double s = tree.final_score(b, kVtNull, -1, 1024, owner);
-      double s = tree.FinalScore(b, kVtNull, -1, 1024, &owner, &engine);
+      double s = tree.FinalScore(b, kVtNull, -1, 1024, &owner, engine.get());
       b.PrintOwnerMap(s, 1024, owner, os_list);
       std::cout << "sgf   : " << (sgf_data.winner() == kBlack ? "B+" : "W+");
       std::cout << std::fixed << std::setprecision(1)
@@ -20,9 +20,12 @@
 #ifndef TEST_H_
 #define TEST_H_
 
+#include "./analysis.h"
 #include "./board.h"
+#include "./cpu_network.h"
 #include "./network.h"
 #include "./option.h"
+#include "./route_queue.h"
 #include "./search.h"
 #include "./sgf.h"
 
@@ -46,16 +49,36 @@ void PolicySelf();
  */
 void SelfMatch();
 
+/**
+ * Plays self matches concurrently with a shared evaluation worker.
+ */
+void ParallelSelfMatch();
+
 /**
  * Benchmark the inference speed of a neural network.
  */
 void NetworkBench();
 
+/**
+ * Compares outputs of the CPU engine with TensorRT.
+ */
+void TestCpuEngine();
+
 /**
  * Measures the execution speed of the rollout.
  */
 void BenchMark();
 
+/**
+ * Measures the hit rate and probe latency of EvalCache with 64 threads.
+ */
+void EvalCacheBench();
+
+/**
+ * Builds the persistent evaluation store from opening positions in sgf_dir.
+ */
+void BuildEvalStore();
+
 /**
  * Measures the speed at which a tree node is freed from memory.
  */
@@ -0,0 +1,180 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "./json.h"
+
+namespace {
+
+/**
+ * Appends "ns" in microseconds with three decimals.
+ */
+void AppendMicroseconds(int64_t ns, std::string* out) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3f", ns / 1000.0);
+  *out += buf;
+}
+
+}  // namespace
+
+int64_t Tracer::NowNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Tracer::Ring* Tracer::ring() {
+  // Returns the ring to the tracer when the thread exits.
+  struct Owner {
+    Ring* r = nullptr;
+    ~Owner() {
+      if (r != nullptr) Tracer::Get().ReleaseRing(r);
+    }
+  };
+  static thread_local Owner owner;
+
+  if (owner.r == nullptr) {
+    std::lock_guard<std::mutex> lock(mx_);
+    if (!free_rings_.empty()) {
+      // Keeps the events of the exited thread, which have its tid, until
+      // they are overwritten.
+      owner.r = free_rings_.back();
+      free_rings_.pop_back();
+    } else {
+      std::unique_ptr<Ring> new_ring(new Ring);
+      new_ring->events.reset(new Event[capacity_]);
+      new_ring->num_written = 0;
+      owner.r = new_ring.get();
+      rings_.push_back(std::move(new_ring));
+    }
+    owner.r->tid = ++num_tids_;
+    thread_names_[owner.r->tid] = "thread " + std::to_string(owner.r->tid);
+  }
+  return owner.r;
+}
+
+void Tracer::SetThreadName(const std::string& name) {
+  if (!enabled()) return;
+  Ring* r = ring();
+  std::lock_guard<std::mutex> lock(mx_);
+  thread_names_[r->tid] = name;
+}
+
+const char* Tracer::Intern(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mx_);
+  return names_.insert(name).first->c_str();
+}
+
+void Tracer::Record(const char* name, int64_t t0, int64_t arg) {
+  Ring* r = ring();
+  uint64_t n = r->num_written.load(std::memory_order_relaxed);
+  // Orders the previous count before overwriting the slot.
+  std::atomic_thread_fence(std::memory_order_release);
+  Event& e = r->events[n % capacity_];
+  e.name.store(name, std::memory_order_relaxed);
+  e.ts.store(t0 - start_ns_, std::memory_order_relaxed);
+  e.dur.store(NowNanoseconds() - t0, std::memory_order_relaxed);
+  e.arg.store(arg, std::memory_order_relaxed);
+  e.tid.store(r->tid, std::memory_order_relaxed);
+  r->num_written.store(n + 1, std::memory_order_release);
+}
+
+bool Tracer::Dump(const std::string& path, std::string* error) {
+  if (!enabled()) {
+    *error = "tracing is disabled. set --trace_file to enable it";
+    return false;
+  }
+
+  std::string events;
+  std::set<int> tids;  // Threads with events or rings.
+
+  std::lock_guard<std::mutex> lock(mx_);
+  for (const auto& r : rings_) {
+    if (std::find(free_rings_.begin(), free_rings_.end(), r.get()) ==
+        free_rings_.end())
+      tids.insert(r->tid);
+
+    // Copies events which are not overwritten during the copy.
+    uint64_t end = r->num_written.load(std::memory_order_acquire);
+    uint64_t begin = end > static_cast<uint64_t>(capacity_) ? end - capacity_
+                                                            : 0;
+    std::string buf;
+    for (uint64_t i = begin; i < end; ++i) {
+      const Event& e = r->events[i % capacity_];
+      const char* name = e.name.load(std::memory_order_relaxed);
+      int64_t ts = e.ts.load(std::memory_order_relaxed);
+      int64_t dur = e.dur.load(std::memory_order_relaxed);
+      int64_t arg = e.arg.load(std::memory_order_relaxed);
+      int tid = e.tid.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t written = r->num_written.load(std::memory_order_relaxed);
+      if (written >= i + capacity_) continue;  // Overwritten.
+
+      buf = ",\n{\"name\":";
+      JsonValue(name).Dump(&buf);
+      buf += ",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(tid) +
+             ",\"ts\":";
+      AppendMicroseconds(ts, &buf);
+      buf += ",\"dur\":";
+      AppendMicroseconds(dur, &buf);
+      if (arg >= 0) buf += ",\"args\":{\"n\":" + std::to_string(arg) + "}";
+      buf += "}";
+      events += buf;
+      tids.insert(tid);
+    }
+  }
+
+  // Names threads, forgetting those which have neither events nor rings.
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for (auto it = thread_names_.begin(); it != thread_names_.end();) {
+    if (tids.count(it->first) == 0) {
+      it = thread_names_.erase(it);
+      continue;
+    }
+    JsonValue meta = JsonValue::Object();
+    meta.Set("name", "thread_name");
+    meta.Set("ph", "M");
+    meta.Set("pid", 1);
+    meta.Set("tid", it->first);
+    JsonValue args = JsonValue::Object();
+    args.Set("name", it->second);
+    meta.Set("args", std::move(args));
+    if (it != thread_names_.begin()) out += ",\n";
+    out += meta.Dump();
+    ++it;
+  }
+  if (thread_names_.empty() && !events.empty()) events.erase(0, 2);
+  out += events;
+  out += "]}\n";
+
+  FILE* fp = fopen(path.c_str(), "w");
+  if (fp == nullptr) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+  ok &= fclose(fp) == 0;
+  if (!ok) *error = "failed to write " + path;
+  return ok;
+}
@@ -0,0 +1,165 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * @class Tracer
+ * Tracer class records timestamped events of search, evaluation and GTP
+ * threads, and writes them as a Chrome trace (JSON Array/Object Format),
+ * which can be viewed in chrome://tracing or Perfetto.
+ *
+ * Each thread writes complete events with their durations to its own ring
+ * buffer of trace_buffer_size events without locks, overwriting the oldest
+ * ones. The ring of an exited thread is reused by the next new thread with
+ * a new thread id, so that short-lived threads do not add rings forever.
+ * Events keep the id of the thread which recorded them. Tracing is enabled
+ * with '--trace_file', which is written at exit, and the GTP command
+ * "aq-trace {file}" writes the events on demand.
+ *
+ * @code
+ *  void Search() {
+ *    TraceScope trace("search");
+ *    ...
+ *  }
+ *  Tracer::Get().Dump("trace.json", &error);
+ * @endcode
+ */
+class Tracer {
+ public:
+  static Tracer& Get() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  /**
+   * Starts recording with buffers of capacity events per thread.
+   */
+  void Enable(int capacity) {
+    if (enabled()) return;
+    capacity_ = std::max(1, capacity);
+    start_ns_ = NowNanoseconds();
+    enabled_ = true;
+  }
+
+  /**
+   * Names the current thread in the trace. e.g. "search", "eval"
+   */
+  void SetThreadName(const std::string& name);
+
+  /**
+   * Returns a pointer to a copy of name which lives until exit, so that
+   * event names can be built at runtime.
+   */
+  const char* Intern(const std::string& name);
+
+  /**
+   * Records an event from t0 to now in nanoseconds of NowNanoseconds().
+   * arg is shown in the event if it is non-negative.
+   */
+  void Record(const char* name, int64_t t0, int64_t arg = -1);
+
+  /**
+   * Writes recorded events of all threads to path.
+   */
+  bool Dump(const std::string& path, std::string* error);
+
+  static int64_t NowNanoseconds();
+
+ private:
+  struct Event {
+    std::atomic<const char*> name;
+    std::atomic<int64_t> ts;   // ns from start_ns_
+    std::atomic<int64_t> dur;  // ns
+    std::atomic<int64_t> arg;
+    std::atomic<int> tid;  // Thread which recorded the event.
+  };
+
+  /**
+   * Events of a thread. Only the owner thread writes them, and readers
+   * discard events which might have been overwritten while reading.
+   */
+  struct Ring {
+    int tid;  // Thread which owns the ring now.
+    std::unique_ptr<Event[]> events;
+    std::atomic<uint64_t> num_written;
+  };
+
+  std::atomic<bool> enabled_;
+  int capacity_;
+  int64_t start_ns_;
+  std::mutex mx_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::vector<Ring*> free_rings_;  // Rings of exited threads.
+  int num_tids_;
+  // Names of threads which own rings or whose events may remain in rings.
+  std::map<int, std::string> thread_names_;
+  std::set<std::string> names_;
+
+  Tracer() : enabled_(false), capacity_(1), start_ns_(0), num_tids_(0) {}
+
+  /**
+   * Returns the ring of this thread, which is returned to free_rings_ when
+   * the thread exits.
+   */
+  Ring* ring();
+
+  void ReleaseRing(Ring* r) {
+    std::lock_guard<std::mutex> lock(mx_);
+    free_rings_.push_back(r);
+  }
+};
+
+/**
+ * @class TraceScope
+ * Records an event from construction to destruction if tracing is enabled.
+ */
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name, int64_t arg = -1)
+      : name_(name),
+        arg_(arg),
+        t0_(Tracer::Get().enabled() ? Tracer::NowNanoseconds() : -1) {}
+
+  ~TraceScope() {
+    if (t0_ >= 0) Tracer::Get().Record(name_, t0_, arg_);
+  }
+
+  void set_arg(int64_t arg) { arg_ = arg; }
+
+ private:
+  const char* name_;
+  int64_t arg_;
+  int64_t t0_;
+};
+
+#endif  // TRACE_H_
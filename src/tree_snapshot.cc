@@ -0,0 +1,258 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "./tree_snapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr char kMagic[8] = {'A', 'Q', 'T', 'R', 'E', 'E', '\0', '\0'};
+constexpr size_t kFileBufferSize = 1 << 20;
+
+/**
+ * Closes the file when it goes out of scope.
+ */
+struct FileCloser {
+  void operator()(FILE* fp) const {
+    if (fp != nullptr) fclose(fp);
+  }
+};
+
+typedef std::unique_ptr<FILE, FileCloser> FilePtr;
+
+template <typename T>
+bool WriteRecord(FILE* fp, const T& rec) {
+  return fwrite(&rec, sizeof(T), 1, fp) == 1;
+}
+
+template <typename T>
+bool ReadRecord(FILE* fp, T* rec) {
+  return fread(rec, sizeof(T), 1, fp) == 1;
+}
+
+/**
+ * A node in the middle of traversal and the index of its next child.
+ */
+template <typename NodeT>
+struct Frame {
+  NodeT* nd;
+  int child_idx;
+};
+
+}  // namespace
+
+void TreeSnapshot::ToRecord(const Node& nd, NodeRecord* rec) {
+  std::memset(rec, 0, sizeof(*rec));
+  rec->key = nd.key();
+  rec->ply = nd.game_ply();
+  rec->num_children = nd.num_children();
+  rec->num_total_values = nd.num_total_values();
+  rec->num_total_rollouts = nd.num_total_rollouts();
+  rec->num_rollouts = nd.num_rollouts();
+  rec->num_values = nd.num_values();
+  rec->win_rollouts = nd.win_rollouts_.load();
+  rec->win_values = nd.win_values_.load();
+  rec->value = nd.value();
+  rec->num_entries = nd.num_entries();
+}
+
+void TreeSnapshot::ToRecord(const ChildNode& child, ChildRecord* rec) {
+  std::memset(rec, 0, sizeof(*rec));
+  rec->move = static_cast<uint16_t>(child.move());
+  rec->has_next = child.has_next() ? 1 : 0;
+  rec->prob = child.prob();
+  rec->num_rollouts = child.num_rollouts();
+  rec->num_values = child.num_values();
+  rec->win_rollouts = child.win_rollouts_.load();
+  rec->win_values = child.win_values_.load();
+}
+
+void TreeSnapshot::FromRecord(const NodeRecord& rec, Node* nd) {
+  nd->key_.store(rec.key);
+  nd->ply_.store(rec.ply);
+  nd->num_total_values_.store(rec.num_total_values);
+  nd->num_total_rollouts_.store(rec.num_total_rollouts);
+  nd->num_rollouts_.store(rec.num_rollouts);
+  nd->num_values_.store(rec.num_values);
+  nd->win_rollouts_.store(rec.win_rollouts);
+  nd->win_values_.store(rec.win_values);
+  nd->value_.store(rec.value);
+  nd->num_entries_.store(rec.num_entries);
+}
+
+void TreeSnapshot::FromRecord(const ChildRecord& rec, ChildNode* child) {
+  child->move_.store(static_cast<Vertex>(rec.move));
+  child->prob_.store(rec.prob);
+  child->num_rollouts_.store(rec.num_rollouts);
+  child->num_values_.store(rec.num_values);
+  child->win_rollouts_.store(rec.win_rollouts);
+  child->win_values_.store(rec.win_values);
+  // Children with next nodes are marked as created after their subtrees are
+  // read, so that searches do not create them again.
+  child->create_state_.store(kInitial);
+}
+
+bool TreeSnapshot::Save(const Node& root, const std::string& path,
+                        std::string* error) {
+  FilePtr fp(fopen(path.c_str(), "wb"));
+  if (!fp) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  setvbuf(fp.get(), nullptr, _IOFBF, kFileBufferSize);
+
+  // The header is rewritten with the numbers of records at the end.
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.board_size = kBSize;
+  header.root_key = root.key();
+  header.root_ply = root.game_ply();
+  bool ok = WriteRecord(fp.get(), header);
+
+  // Writes nodes in pre-order. Only the path from the root is on the stack.
+  NodeRecord node_rec;
+  ChildRecord child_rec;
+  std::vector<Frame<const Node>> stack;
+  stack.push_back({&root, -1});
+  while (ok && !stack.empty()) {
+    Frame<const Node>& f = stack.back();
+    if (f.child_idx < 0) {
+      ToRecord(*f.nd, &node_rec);
+      ok &= WriteRecord(fp.get(), node_rec);
+      for (const auto& child : f.nd->children) {
+        ToRecord(child, &child_rec);
+        ok &= WriteRecord(fp.get(), child_rec);
+      }
+      ++header.num_nodes;
+      header.num_children += f.nd->num_children();
+      f.child_idx = 0;
+    }
+
+    int n = f.nd->num_children();
+    while (f.child_idx < n && !f.nd->children[f.child_idx].has_next())
+      ++f.child_idx;
+    if (f.child_idx == n) {
+      stack.pop_back();
+    } else {
+      const Node* next = f.nd->children[f.child_idx++].next_ptr();
+      stack.push_back({next, -1});
+    }
+  }
+
+  ok = ok && fseek(fp.get(), 0, SEEK_SET) == 0 &&
+       WriteRecord(fp.get(), header) && fflush(fp.get()) == 0;
+  if (!ok) *error = "failed to write " + path;
+  return ok;
+}
+
+bool TreeSnapshot::Load(const std::string& path, const Board& b, int max_nodes,
+                        std::unique_ptr<Node>* root, int* num_nodes,
+                        std::string* error) {
+  FilePtr fp(fopen(path.c_str(), "rb"));
+  if (!fp) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  setvbuf(fp.get(), nullptr, _IOFBF, kFileBufferSize);
+
+  Header header;
+  if (!ReadRecord(fp.get(), &header) ||
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    *error = path + " is not a tree snapshot";
+    return false;
+  }
+  if (header.version != kVersion) {
+    *error = "unsupported version " + std::to_string(header.version);
+    return false;
+  }
+  if (header.board_size != kBSize) {
+    *error = "board size " + std::to_string(header.board_size) +
+             " differs from " + std::to_string(kBSize);
+    return false;
+  }
+  if (header.root_key != b.key() || header.root_ply != b.game_ply()) {
+    *error = "snapshot is for another position";
+    return false;
+  }
+  if (header.num_nodes == 0 ||
+      header.num_nodes > static_cast<uint64_t>(max_nodes)) {
+    *error = "snapshot has " + std::to_string(header.num_nodes) +
+             " nodes, more than node_size " + std::to_string(max_nodes);
+    return false;
+  }
+
+  // Reads nodes in the same order as Save().
+  std::unique_ptr<Node> top(new Node);
+  NodeRecord node_rec;
+  ChildRecord child_rec;
+  uint64_t num_read = 0;
+  std::vector<Frame<Node>> stack;
+  stack.push_back({top.get(), -1});
+  while (!stack.empty()) {
+    Frame<Node>& f = stack.back();
+    if (f.child_idx < 0) {
+      if (++num_read > header.num_nodes ||
+          !ReadRecord(fp.get(), &node_rec) || node_rec.num_children <= 0 ||
+          node_rec.num_children > kNumVts + 1) {
+        *error = "corrupted node record";
+        return false;
+      }
+      FromRecord(node_rec, f.nd);
+      f.nd->children.resize(node_rec.num_children);
+      for (auto& child : f.nd->children) {
+        if (!ReadRecord(fp.get(), &child_rec) || child_rec.move > kPass) {
+          *error = "corrupted child record";
+          return false;
+        }
+        FromRecord(child_rec, &child);
+        if (child_rec.has_next) {
+          std::unique_ptr<Node> next(new Node);
+          child.set_next_ptr(&next);
+        }
+      }
+      f.child_idx = 0;
+    }
+
+    int n = f.nd->num_children();
+    while (f.child_idx < n && !f.nd->children[f.child_idx].has_next())
+      ++f.child_idx;
+    if (f.child_idx == n) {
+      stack.pop_back();
+    } else {
+      ChildNode& child = f.nd->children[f.child_idx++];
+      child.SetCompleteState();
+      stack.push_back({child.next_ptr(), -1});
+    }
+  }
+
+  if (num_read != header.num_nodes || fgetc(fp.get()) != EOF) {
+    *error = "unexpected number of nodes";
+    return false;
+  }
+
+  *root = std::move(top);
+  *num_nodes = static_cast<int>(num_read);
+  return true;
+}
@@ -0,0 +1,124 @@
+/*
+ * AQ, a Go playing engine.
+ * Copyright (C) 2017-2020 Yu Yamaguchi
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TREE_SNAPSHOT_H_
+#define TREE_SNAPSHOT_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "./board.h"
+#include "./node.h"
+
+/**
+ * @class TreeSnapshot
+ * TreeSnapshot class saves a search tree to a binary file and restores it,
+ * so that a search can be resumed with all playouts of a previous session.
+ *
+ * The file consists of a 64-byte Header followed by the nodes in pre-order.
+ * Each node is a NodeRecord followed by a ChildRecord for each child, and
+ * then the subtrees of the children which have next nodes in the order of
+ * the children. All records are little-endian with fixed sizes and natural
+ * alignment without pointers, so the file can also be read through mmap.
+ *
+ * Both saving and loading walk the tree with an explicit stack through a
+ * file buffer, so they need memory only for the depth of the tree in
+ * addition to the tree itself.
+ *
+ * @code
+ *  std::string error;
+ *  TreeSnapshot::Save(*tree.root_node(), "tree.aqt", &error);
+ *
+ *  std::unique_ptr<Node> root;
+ *  int num_nodes;
+ *  TreeSnapshot::Load("tree.aqt", b, 1000000, &root, &num_nodes, &error);
+ * @endcode
+ */
+class TreeSnapshot {
+ public:
+  static constexpr uint32_t kVersion = 1;
+
+  struct Header {
+    char magic[8];  // "AQTREE\0\0"
+    uint32_t version;
+    uint32_t board_size;
+    uint64_t num_nodes;
+    uint64_t num_children;
+    uint64_t root_key;
+    int32_t root_ply;
+    uint32_t reserved[5];
+  };
+
+  struct NodeRecord {
+    uint64_t key;
+    int32_t ply;
+    int32_t num_children;
+    int32_t num_total_values;
+    int32_t num_total_rollouts;
+    int32_t num_rollouts;
+    int32_t num_values;
+    float win_rollouts;
+    float win_values;
+    float value;
+    int32_t num_entries;
+  };
+
+  struct ChildRecord {
+    uint16_t move;
+    uint8_t has_next;
+    uint8_t reserved;
+    float prob;
+    int32_t num_rollouts;
+    int32_t num_values;
+    float win_rollouts;
+    float win_values;
+  };
+
+  static_assert(sizeof(Header) == 64, "unexpected padding in Header");
+  static_assert(sizeof(NodeRecord) == 48, "unexpected padding in NodeRecord");
+  static_assert(sizeof(ChildRecord) == 24,
+                "unexpected padding in ChildRecord");
+
+  /**
+   * Writes the tree under root to path. Returns false with a message on
+   * failure. The tree must not be searched during saving.
+   */
+  static bool Save(const Node& root, const std::string& path,
+                   std::string* error);
+
+  /**
+   * Reads a tree saved for b from path into root. Fails if it is for another
+   * position or has more than max_nodes nodes.
+   */
+  static bool Load(const std::string& path, const Board& b, int max_nodes,
+                   std::unique_ptr<Node>* root, int* num_nodes,
+                   std::string* error);
+
+ private:
+  static void ToRecord(const Node& nd, NodeRecord* rec);
+
+  static void ToRecord(const ChildNode& child, ChildRecord* rec);
+
+  static void FromRecord(const NodeRecord& rec, Node* nd);
+
+  static void FromRecord(const ChildRecord& rec, ChildNode* child);
+};
+
+#endif  // TREE_SNAPSHOT_H_
@@ -116,6 +116,10 @@ CoordinateTable::CoordinateTable() {
             rv2sym_table[i - 1][xy2rv_table[y][x]];  // Rotates.
     }
     v2sym_table[i][kNumVts] = kPass;
+    for (Vertex v = kVtZero; v < kNumVtsPlus1; ++v)
+      v2sym_inv_table[i][v2sym_table[i][v]] = v;
+    for (int rv = 0; rv < kNumRvts; ++rv)
+      rv2sym_inv_table[i][rv2sym_table[i][rv]] = rv;
   }
 
   // Distance
@@ -20,6 +20,8 @@
 #ifndef TYPES_H_
 #define TYPES_H_
 
+#include <cctype>
+#include <cstring>
 #include <iostream>
 #include <random>
 #include <string>
@@ -154,6 +156,7 @@ struct CoordinateTable {
   int dist_table[kNumVtsPlus1][kNumVtsPlus1];
   int dist_edge_table[kNumVtsPlus1];
   Vertex v2sym_table[8][kNumVtsPlus1];
+  Vertex v2sym_inv_table[8][kNumVtsPlus1];
 
   // --- RawVertex
   int rv2x_table[kNumRvts];
@@ -162,6 +165,7 @@ struct CoordinateTable {
   Vertex rv2v_table[kNumRvts];
   RawVertex v2rv_table[kNumVtsPlus1];
   int rv2sym_table[8][kNumRvts];
+  int rv2sym_inv_table[8][kNumRvts];
 
   // --- Bitboard
   int v2bb_idx_table[kNumVtsPlus1];
@@ -236,6 +240,29 @@ inline Vertex xy2v(int x, int y) {
   return v;
 }
 
+/**
+ * Returns a vertex from a GTP-style string. e.g. "D4" -> (4,4)
+ * Returns kVtNull if str is neither a vertex on the board nor a pass.
+ */
+inline Vertex str2v(std::string str) {
+  for (auto& c : str) c = std::toupper(c);
+  if (str == "PASS") return kPass;
+  if (str.size() < 2 || str.size() > 3) return kVtNull;
+
+  std::string x_list = std::string("ABCDEFGHJKLMNOPQRST").substr(0, kBSize);
+  auto x = x_list.find(str[0]);
+  if (x == std::string::npos) return kVtNull;
+
+  int y = 0;
+  for (size_t i = 1; i < str.size(); ++i) {
+    if (!std::isdigit(str[i])) return kVtNull;
+    y = y * 10 + (str[i] - '0');
+  }
+  if (y < 1 || y > kBSize) return kVtNull;
+
+  return xy2v(x + 1, y);
+}
+
 /**
  * Returns a vertex that has been symmetrically manipulated by a symmetric
  * index.
@@ -245,6 +272,15 @@ inline Vertex v2sym(Vertex v, int symmetry_idx) {
   return kCoordTable.v2sym_table[symmetry_idx][v];
 }
 
+/**
+ * Returns the vertex which is moved to v by the symmetric operation, i.e.
+ * v2sym(v2sym_inv(v, i), i) == v.
+ */
+inline Vertex v2sym_inv(Vertex v, int symmetry_idx) {
+  ASSERT_LV2(is_ok(v) && symmetry_idx >= 0 && symmetry_idx < 8);
+  return kCoordTable.v2sym_inv_table[symmetry_idx][v];
+}
+
 /**
  * Returns whether v is in expansion area.
  */
@@ -362,6 +398,13 @@ inline int rv2sym(int rv, int symmetry_idx) {
   return kCoordTable.rv2sym_table[symmetry_idx][rv];
 }
 
+/**
+ * Returns j such that rv2sym(j, symmetry_idx) == rv.
+ */
+inline int rv2sym_inv(int rv, int symmetry_idx) {
+  return kCoordTable.rv2sym_inv_table[symmetry_idx][rv];
+}
+
 // --------------------
 //      Direction
 // --------------------
@@ -554,6 +597,71 @@ inline bool IsBentFourHash(uint64_t hash_key) {
   return kCoordTable.bent4_set.find(hash_key) != kCoordTable.bent4_set.end();
 }
 
+// --------------------
+//    Half Precision
+// --------------------
+
+/**
+ * Converts IEEE 754 binary16 to float.
+ */
+inline float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+
+  if (exp == 0) {
+    if (mant == 0) {
+      bits = sign;
+    } else {  // Subnormal number.
+      exp = 127 - 15 + 1;
+      while ((mant & 0x400) == 0) {
+        mant <<= 1;
+        --exp;
+      }
+      bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+  } else if (exp == 31) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else {
+    bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  }
+
+  float f;
+  std::memcpy(&f, &bits, 4);
+  return f;
+}
+
+/**
+ * Converts float to IEEE 754 binary16, rounding to nearest even.
+ */
+inline uint16_t FloatToHalf(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, 4);
+  uint16_t sign = (bits >> 16) & 0x8000;
+  int exp = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = bits & 0x7fffff;
+
+  if (((bits >> 23) & 0xff) == 0xff)  // Inf or NaN.
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if (exp >= 31) return sign | 0x7c00;  // Overflow.
+  if (exp <= 0) {                       // Subnormal number or zero.
+    if (exp < -10) return sign;
+    mant |= 0x800000;
+    int shift = 14 - exp;
+    uint32_t half_mant = mant >> shift;
+    uint32_t rest = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half_mant & 1))) ++half_mant;
+    return sign | half_mant;
+  }
+
+  uint16_t h = sign | (exp << 10) | (mant >> 13);
+  uint32_t rest = mant & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) ++h;  // May carry to exp.
+  return h;
+}
+
 // --------------------
 //    Operator Macro
 // --------------------